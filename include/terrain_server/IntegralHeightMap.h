@@ -0,0 +1,159 @@
+#ifndef TERRAIN_SERVER__INTEGRAL_HEIGHT_MAP__H
+#define TERRAIN_SERVER__INTEGRAL_HEIGHT_MAP__H
+
+#include <terrain_server/TerrainGrid.h>
+#include <vector>
+
+
+namespace terrain_server
+{
+
+/**
+ * @class IntegralHeightMap
+ * @brief Dense height image of the terrain grid (unrolled from its origin) with
+ * the summed-area tables of the known heights and of the number of known cells.
+ * So, the sum and count of the heights inside any box are computed in O(1)
+ */
+class IntegralHeightMap
+{
+	public:
+		/** @brief Constructor function */
+		IntegralHeightMap();
+
+		/** @brief Destructor function */
+		~IntegralHeightMap();
+
+		/**
+		 * @brief Computes the height image and its summed-area tables
+		 * @param const TerrainGrid& Terrain grid
+		 */
+		void compute(const TerrainGrid& grid);
+
+		/**
+		 * @brief Updates the height image and its summed-area tables after a
+		 * set of cells changed. The tables are recomputed only from the first
+		 * row and column of these cells, and fully if the grid moved
+		 * @param const TerrainGrid& Terrain grid
+		 * @param const std::vector<unsigned int>& Indexes of the changed cells
+		 */
+		void update(const TerrainGrid& grid,
+					const std::vector<unsigned int>& indexes);
+
+		/**
+		 * @brief Gets the first column and row of the tables that changed in
+		 * the last computation (the size of the image if none changed)
+		 * @param int& Coordinate along the x-axis
+		 * @param int& Coordinate along the y-axis
+		 */
+		void getChangedCorner(int& x, int& y) const;
+
+		/**
+		 * @brief Gets the coordinates of a cell in the height image
+		 * @param int& Coordinate along the x-axis
+		 * @param int& Coordinate along the y-axis
+		 * @param unsigned short Key of the cell along the x-axis
+		 * @param unsigned short Key of the cell along the y-axis
+		 */
+		void getCoordinates(int& x, int& y,
+							unsigned short key_x,
+							unsigned short key_y) const;
+
+		/**
+		 * @brief Gets the height of a cell of the height image
+		 * @param double& Height of the cell
+		 * @param int Coordinate along the x-axis
+		 * @param int Coordinate along the y-axis
+		 * @return Returns false if the height is unknown or the cell is outside
+		 * the image
+		 */
+		bool getHeight(double& height,
+					   int x, int y) const;
+
+		/**
+		 * @brief Gets the sum of the known heights, and the number of known
+		 * cells, inside a box. The box is clipped to the image
+		 * @param double& Sum of the heights
+		 * @param unsigned int& Number of known cells
+		 * @param int Minimum coordinate (inclusive) along the x-axis
+		 * @param int Minimum coordinate (inclusive) along the y-axis
+		 * @param int Maximum coordinate (inclusive) along the x-axis
+		 * @param int Maximum coordinate (inclusive) along the y-axis
+		 */
+		void getBoxSum(double& height_sum,
+					   unsigned int& num_cells,
+					   int min_x, int min_y,
+					   int max_x, int max_y) const;
+
+		/** @brief Gets the number of cells along the x-axis */
+		int getSizeX() const;
+
+		/** @brief Gets the number of cells along the y-axis */
+		int getSizeY() const;
+
+		/** @brief Gets the minimum key (corner) of the image along the x-axis */
+		int getOriginKeyX() const;
+
+		/** @brief Gets the minimum key (corner) of the image along the y-axis */
+		int getOriginKeyY() const;
+
+
+	private:
+		/**
+		 * @brief Computes the summed-area tables from a corner of the image
+		 * @param int First column
+		 * @param int First row
+		 */
+		void computeTables(int first_x, int first_y);
+
+		/** @brief Minimum key (corner) of the image */
+		int origin_key_x_, origin_key_y_;
+
+		/** @brief Number of cells along the x and y axes */
+		int size_x_, size_y_;
+
+		/** @brief Height image and known cells */
+		std::vector<float> height_;
+		std::vector<unsigned char> is_height_;
+
+		/** @brief Summed-area tables, with an extra row and column of zeros */
+		std::vector<double> height_sum_;
+		std::vector<unsigned int> count_sum_;
+
+		/** @brief First column and row changed in the last computation */
+		int changed_x_, changed_y_;
+};
+
+
+inline void IntegralHeightMap::getChangedCorner(int& x, int& y) const
+{
+	x = changed_x_;
+	y = changed_y_;
+}
+
+
+inline int IntegralHeightMap::getSizeX() const
+{
+	return size_x_;
+}
+
+
+inline int IntegralHeightMap::getSizeY() const
+{
+	return size_y_;
+}
+
+
+inline int IntegralHeightMap::getOriginKeyX() const
+{
+	return origin_key_x_;
+}
+
+
+inline int IntegralHeightMap::getOriginKeyY() const
+{
+	return origin_key_y_;
+}
+
+} //@namespace terrain_server
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef TERRAIN_SERVER__INTEGRAL_MOMENT_MAP__H
+#define TERRAIN_SERVER__INTEGRAL_MOMENT_MAP__H
+
+#include <terrain_server/IntegralHeightMap.h>
+#include <Eigen/Dense>
+#include <vector>
+
+
+namespace terrain_server
+{
+
+/**
+ * @class IntegralMomentMap
+ * @brief Summed-area tables of the first and second moments of the surface
+ * points of an integral height map. The mean and covariance of the surface
+ * points inside any box are computed in O(1), and the plane is fitted with a
+ * closed-form 3x3 eigen solve. The points are expressed with respect to the
+ * centre of the corner (origin) cell of the height map
+ */
+class IntegralMomentMap
+{
+	public:
+		/** @brief Moments of a set of points */
+		struct Moments
+		{
+			Moments() : num_points(0.), x(0.), y(0.), z(0.),
+					xx(0.), xy(0.), xz(0.), yy(0.), yz(0.), zz(0.) {}
+
+			double num_points;
+			double x, y, z;
+			double xx, xy, xz, yy, yz, zz;
+		};
+
+		/** @brief Constructor function */
+		IntegralMomentMap();
+
+		/** @brief Destructor function */
+		~IntegralMomentMap();
+
+		/**
+		 * @brief Computes the summed-area tables of the moments. If the height
+		 * map didn't move, only the part of the tables after its changed
+		 * corner is recomputed
+		 * @param const IntegralHeightMap& Integral height map
+		 * @param double Resolution of the cells
+		 */
+		void compute(const IntegralHeightMap& height_map,
+					 double resolution);
+
+		/**
+		 * @brief Gets the moments of the points inside a box. The box is
+		 * clipped to the map
+		 * @param Moments& Moments of the points
+		 * @param int Minimum coordinate (inclusive) along the x-axis
+		 * @param int Minimum coordinate (inclusive) along the y-axis
+		 * @param int Maximum coordinate (inclusive) along the x-axis
+		 * @param int Maximum coordinate (inclusive) along the y-axis
+		 */
+		void getBoxMoments(Moments& moments,
+						   int min_x, int min_y,
+						   int max_x, int max_y) const;
+
+		/**
+		 * @brief Fits a plane to the points of a square around a cell
+		 * @param Eigen::Vector3d& Mean of the points
+		 * @param Eigen::Vector3d& Normal of the plane (pointing upwards)
+		 * @param double& Curvature, i.e. the surface variation
+		 * @param int Coordinate of the cell along the x-axis
+		 * @param int Coordinate of the cell along the y-axis
+		 * @param int Radius of the square (in cells)
+		 * @return The number of points of the square
+		 */
+		unsigned int computePlane(Eigen::Vector3d& mean,
+								  Eigen::Vector3d& normal,
+								  double& curvature,
+								  int x, int y,
+								  int radius) const;
+
+
+	private:
+		/** @brief Number of cells along the x and y axes */
+		int size_x_, size_y_;
+
+		/** @brief Origin of the height map and resolution of the tables */
+		int origin_key_x_, origin_key_y_;
+		double resolution_;
+
+		/** @brief Summed-area table, with an extra row and column of zeros */
+		std::vector<Moments> moments_;
+};
+
+} //@namespace terrain_server
+
+#endif
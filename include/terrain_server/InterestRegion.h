@@ -0,0 +1,92 @@
+#ifndef TERRAIN_SERVER__INTEREST_REGION__H
+#define TERRAIN_SERVER__INTEREST_REGION__H
+
+#include <dwl/environment/SpaceDiscretization.h>
+
+
+namespace terrain_server
+{
+
+/**
+ * @class InterestRegion
+ * @brief Interest region around the robot, i.e. a half ellipse in front of the
+ * robot and a half circle behind it. An unbounded radius is clamped, so the
+ * region is a convex set whose intersection with a row of a grid is a range of
+ * keys. The grids are cropped row by row to these ranges, so only the cells
+ * that leave the region are visited
+ */
+class InterestRegion
+{
+	public:
+		/**
+		 * @brief Constructor function
+		 * @param double Radius along the x-axis of the robot (lateral and back)
+		 * @param double Radius along the y-axis of the robot (front)
+		 * @param double Position of the robot along the x-axis
+		 * @param double Position of the robot along the y-axis
+		 * @param double Yaw angle of the robot
+		 */
+		InterestRegion(double radius_x,
+					   double radius_y,
+					   double robot_x,
+					   double robot_y,
+					   double yaw);
+
+		/** @brief Destructor function */
+		~InterestRegion();
+
+		/** @brief Indicates if the region is bounded, i.e. something is removed */
+		bool isBounded() const;
+
+		/**
+		 * @brief Gets the range of keys of a row whose cells are inside the
+		 * region. The first key is bigger than the last one if there isn't a
+		 * cell inside it
+		 * @param int& First key along the x-axis
+		 * @param int& Last key along the x-axis
+		 * @param const dwl::environment::SpaceDiscretization& Discretization of the grid
+		 * @param unsigned short Key of the row along the y-axis
+		 * @param int First key of the grid along the x-axis
+		 * @param int Last key of the grid along the x-axis
+		 */
+		void getRowKeys(int& first_key,
+						int& last_key,
+						const dwl::environment::SpaceDiscretization& discretization,
+						unsigned short key_y,
+						int first_grid_key,
+						int last_grid_key) const;
+
+
+	private:
+		/**
+		 * @brief Adds to a range (relative to the robot) the part of a range
+		 * of a row that is in the front or back half plane of the robot
+		 * @param double& Minimum of the range
+		 * @param double& Maximum of the range
+		 * @param double First value of the range of the row
+		 * @param double Last value of the range of the row
+		 * @param double Distance of the row to the robot along the y-axis
+		 * @param bool Indicates if it's the front half plane
+		 */
+		void clipToHalfPlane(double& min_dx,
+							 double& max_dx,
+							 double first_dx,
+							 double last_dx,
+							 double dy,
+							 bool is_front) const;
+
+		/** @brief Radius of the region (clamped) */
+		double radius_x_, radius_y_;
+
+		/** @brief Position and orientation of the robot */
+		double robot_x_, robot_y_;
+		double cos_yaw_, sin_yaw_;
+
+		/** @brief Coefficients of the ellipse that don't depend on the row */
+		double inv_sq_x_, inv_sq_y_;
+		double ellipse_a_;
+};
+
+} //@namespace terrain_server
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef TERRAIN_SERVER__LATEST_MAILBOX__H
+#define TERRAIN_SERVER__LATEST_MAILBOX__H
+
+#include <atomic>
+#include <cstddef>
+
+
+namespace terrain_server
+{
+
+/**
+ * @class LatestMailbox
+ * @brief Lock-free mailbox that keeps only the latest item. Posting an item
+ * replaces (and returns) the stale one, so the consumer always takes the newest
+ * item and the producer never waits. The items are owned by the mailbox while
+ * they are posted
+ */
+template<typename T>
+class LatestMailbox
+{
+	public:
+		/** @brief Constructor function */
+		LatestMailbox() : slot_(NULL) {}
+
+		/** @brief Destructor function */
+		~LatestMailbox()
+		{
+			delete slot_.exchange(NULL);
+		}
+
+		/**
+		 * @brief Posts an item
+		 * @param T* Item
+		 * @return The stale item that was replaced (NULL if there wasn't)
+		 */
+		T* post(T* item)
+		{
+			return slot_.exchange(item, std::memory_order_acq_rel);
+		}
+
+		/**
+		 * @brief Takes the latest item
+		 * @return The item, or NULL if the mailbox is empty
+		 */
+		T* take()
+		{
+			return slot_.exchange(NULL, std::memory_order_acq_rel);
+		}
+
+		/** @brief Indicates if there is an item */
+		bool isFull() const
+		{
+			return slot_.load(std::memory_order_acquire) != NULL;
+		}
+
+
+	private:
+		/** @brief Slot of the latest item */
+		std::atomic<T*> slot_;
+};
+
+} //@namespace terrain_server
+
+#endif
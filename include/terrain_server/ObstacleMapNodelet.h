@@ -0,0 +1,49 @@
+#ifndef TERRAIN_SERVER__OBSTACLE_MAP_NODELET__H
+#define TERRAIN_SERVER__OBSTACLE_MAP_NODELET__H
+
+#include <nodelet/nodelet.h>
+#include <terrain_server/ObstacleMapServer.h>
+#include <memory>
+
+
+namespace terrain_server
+{
+
+/**
+ * @class ObstacleMapNodelet
+ * @brief Nodelet of the obstacle map server. In a shared manager, the octomaps
+ * are delivered without serialization only if the publisher publishes them by
+ * shared pointer (publish(boost::shared_ptr)). The octomap server publishes its
+ * messages by value (publishFullOctoMap), so they are still serialized and
+ * deserialized inside the manager, only the loopback socket is saved
+ */
+class ObstacleMapNodelet : public nodelet::Nodelet
+{
+	public:
+		/** @brief Constructor function */
+		ObstacleMapNodelet();
+
+		/** @brief Destructor function */
+		~ObstacleMapNodelet();
+
+
+	private:
+		/** @brief Initialization of the obstacle map server */
+		virtual void onInit();
+
+		/**
+		 * @brief Publishes the obstacle map, as the loop of the standalone server
+		 * @param const ros::TimerEvent& Timer event
+		 */
+		void publishCallback(const ros::TimerEvent& event);
+
+		/** @brief Obstacle map server */
+		std::unique_ptr<ObstacleMapServer> server_;
+
+		/** @brief Timer of the obstacle map publication */
+		ros::Timer publish_timer_;
+};
+
+} //@namespace terrain_server
+
+#endif
@@ -7,7 +7,9 @@
 #include <octomap_msgs/conversions.h>
 #include <octomap/math/Utils.h>
 
-#include <dwl/environment/ObstacleMap.h>
+#include <terrain_server/ObstacleMapping.h>
+#include <terrain_server/OctomapReader.h>
+#include <terrain_server/Statistics.h>
 #include <dwl/utils/Orientation.h>
 
 #include <Eigen/Dense>
@@ -15,6 +17,7 @@
 #include <geometry_msgs/PoseArray.h>
 #include <terrain_server/ObstacleMap.h>
 #include <terrain_server/TerrainCell.h>
+#include <terrain_server/ServerStatistics.h>
 #include <std_srvs/Empty.h>
 
 #include <tf/transform_datatypes.h>
@@ -33,8 +36,11 @@ namespace terrain_server
 class ObstacleMapServer
 {
 	public:
-		/** @brief Constructor function */
-		ObstacleMapServer();
+		/**
+		 * @brief Constructor function
+		 * @param ros::NodeHandle Node handle of the topics, services and parameters
+		 */
+		ObstacleMapServer(ros::NodeHandle node = ros::NodeHandle());
 
 		/** @brief Destructor function */
 		~ObstacleMapServer();
@@ -56,11 +62,18 @@ class ObstacleMapServer
 
 
 	private:
+		/**
+		 * @brief Publishes the statistics of the hot paths, and starts a new
+		 * window of them
+		 * @param const ros::TimerEvent& Timer event
+		 */
+		void publishStatistics(const ros::TimerEvent& event);
+
 		/** @brief ROS node handle */
 		ros::NodeHandle node_;
 
-		/** @brief Pointer to the ObstacleMap class */
-		dwl::environment::ObstacleMap obstacle_map_;
+		/** @brief Obstacle mapping */
+		ObstacleMapping obstacle_map_;
 
 		/** @brief Obstacle map publisher */
 		ros::Publisher obstacle_pub_;
@@ -71,6 +84,9 @@ class ObstacleMapServer
 		/** @brief TF and octomap subscriber */
 		tf::MessageFilter<octomap_msgs::Octomap>* tf_octomap_sub_;
 
+		/** @brief Reader of the octomap messages into a reused octree */
+		OctomapReader octomap_reader_;
+
 		/** @brief Reset service */
 		ros::ServiceServer reset_srv_;
 
@@ -88,6 +104,19 @@ class ObstacleMapServer
 
 		/** @brief Indicates if it was computed new information of the reward map */
 		bool new_information_;
+
+		/** @brief Indicates if the obstacle map is updated from the changes of the octree */
+		bool incremental_update_;
+
+		/** @brief Statistics of the hot paths, and its periodic publisher */
+		Statistics statistics_;
+		ros::Publisher statistics_pub_;
+		ros::Timer statistics_timer_;
+		terrain_server::ServerStatistics statistics_msg_;
+
+		/** @brief Timers and counters of the statistics */
+		unsigned int deserialize_timer_, tf_timer_, compute_timer_, publish_timer_;
+		unsigned int octomap_bytes_counter_, map_bytes_counter_, obstacle_counter_;
 };
 
 } //@namespace terrain_server
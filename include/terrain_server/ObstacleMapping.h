@@ -0,0 +1,302 @@
+#ifndef TERRAIN_SERVER__OBSTACLE_MAPPING__H
+#define TERRAIN_SERVER__OBSTACLE_MAPPING__H
+
+#include <dwl/environment/SpaceDiscretization.h>
+#include <dwl/utils/utils.h>
+
+#include <octomap/octomap.h>
+#include <terrain_server/InterestRegion.h>
+#include <terrain_server/OccupancyPatch.h>
+#include <terrain_server/ThreadPool.h>
+#include <terrain_server/Statistics.h>
+#include <Eigen/Dense>
+#include <stdint.h>
+#include <vector>
+
+
+namespace terrain_server
+{
+
+/**
+ * @class ObstacleMapping
+ * @brief Builds the obstacle map, i.e. the occupied voxels inside the search
+ * areas around the robot. The voxels of every column are stored as a bitset in
+ * a robot-centric rolling grid (indexed as the terrain grid), so the obstacles
+ * are kept while they are inside the interest region. The columns are
+ * extracted in parallel tiles from a bit-packed patch of the octree, and a
+ * column is only rewritten if its voxels changed. In the incremental update,
+ * only the new columns and the ones inside the changed regions of the octree
+ * are extracted. The obstacles are read as runs of free and occupied voxels of
+ * a grid with an origin
+ */
+class ObstacleMapping
+{
+	public:
+		/** @brief Constructor function */
+		ObstacleMapping();
+
+		/** @brief Destructor function */
+		~ObstacleMapping();
+
+		/**
+		 * @brief Computes the obstacle map according the robot position and
+		 * the model of the environment
+		 * @param octomap::OcTree* The model of the environment
+		 * @param const Eigen::Vector4d& The position of the robot and the yaw angle
+		 * @return Returns true if the obstacles changed
+		 */
+		bool compute(octomap::OcTree* octomap,
+					 const Eigen::Vector4d& robot_state);
+
+		/**
+		 * @brief Gets the obstacles as runs of free and occupied voxels. The
+		 * grid is centred in the robot, and its voxels are ordered by columns,
+		 * i.e. the index of a voxel is (y * size_x + x) * size_z + z
+		 * @param std::vector<uint16_t>& Lengths of the alternating runs,
+		 * starting with a free run. The runs longer than the maximum length
+		 * are split by empty runs
+		 * @param dwl::Key& Key of the first voxel of the grid
+		 * @param dwl::Key& Number of voxels along every axis
+		 * @return The number of occupied voxels
+		 */
+		unsigned int getObstacleRuns(std::vector<uint16_t>& runs,
+									 dwl::Key& origin_key,
+									 dwl::Key& size);
+
+		/**
+		 * @brief Gets the horizontal reach of the octree data read around the
+		 * robot, i.e. the reach of the search areas
+		 * @return The radius around the robot
+		 */
+		double getOctomapReach() const;
+
+		/** @brief Removes all the obstacles */
+		void reset();
+
+		/**
+		 * @brief Sets the number of threads used for computing the obstacle map
+		 * @param unsigned int Number of threads
+		 */
+		void setNumberOfThreads(unsigned int num_threads);
+
+		/**
+		 * @brief Sets the statistics of the hot paths, the timers and counters
+		 * of the obstacle mapping are added to them
+		 * @param Statistics* Statistics (NULL for disabling them)
+		 * @param const std::string& Prefix of the names of the metrics
+		 */
+		void setStatistics(Statistics* statistics,
+						   const std::string& name = "obstacle_mapping");
+
+		/**
+		 * @brief Enables the incremental update of the obstacle map. In this
+		 * mode only the new columns (or the ones whose vertical window moved),
+		 * and the columns inside the changed regions of the octree (see
+		 * addChangedRegion()) are extracted
+		 * @param bool Incremental update status
+		 */
+		void setIncrementalUpdate(bool incremental);
+
+		/**
+		 * @brief Adds a region of the octree whose voxels changed since the
+		 * last computation. The regions are used by the next computation
+		 * @param double Minimum Cartesian position along the x-axis
+		 * @param double Maximum Cartesian position along the x-axis
+		 * @param double Minimum Cartesian position along the y-axis
+		 * @param double Maximum Cartesian position along the y-axis
+		 */
+		void addChangedRegion(double min_x, double max_x,
+							  double min_y, double max_y);
+
+		/**
+		 * @brief Sets a interest region
+		 * @param double Radius along the x-axis
+		 * @param double Radius along the y-axis
+		 */
+		void setInterestRegion(double radius_x,
+							   double radius_y);
+
+		/**
+		 * @brief Adds a search area around the robot. The resolution of the
+		 * grid is the finest resolution of the search areas, and a coarse area
+		 * takes one column per its resolution
+		 * @param double Minimum Cartesian position along the x-axis
+		 * @param double Maximum Cartesian position along the x-axis
+		 * @param double Minimum Cartesian position along the y-axis
+		 * @param double Maximum Cartesian position along the y-axis
+		 * @param double Minimum Cartesian position along the z-axis
+		 * @param double Maximum Cartesian position along the z-axis
+		 * @param double Resolution of the search area
+		 */
+		void addSearchArea(double min_x, double max_x,
+						   double min_y, double max_y,
+						   double min_z, double max_z,
+						   double resolution);
+
+		/**
+		 * @brief Gets the resolution of the obstacle map
+		 * @param bool Indicates if it's the plane (true) or height (false) resolution
+		 */
+		double getResolution(bool plane) const;
+
+
+	private:
+		/** @brief Column of the grid */
+		struct Column
+		{
+			Column() : key_x(0), key_y(0), key_z(0), area(0), scan(0),
+					is_changed(false), is_column(false) {}
+
+			unsigned short key_x;
+			unsigned short key_y;
+			unsigned short key_z; // Key of the first voxel of the bitset
+			unsigned int area; // Search area of the bitset
+			unsigned int scan; // Last computation that scanned the column
+			bool is_changed; // Its voxels changed since it was extracted
+			bool is_column;
+		};
+
+		/** @brief Column that is extracted from the octree */
+		struct ScanColumn
+		{
+			ScanColumn(unsigned int _index, unsigned short _key_x,
+					   unsigned short _key_y, unsigned short _key_z,
+					   octomap::key_type _octree_key_x,
+					   octomap::key_type _octree_key_y, unsigned int _area) :
+						   index(_index), key_x(_key_x), key_y(_key_y),
+						   key_z(_key_z), octree_key_x(_octree_key_x),
+						   octree_key_y(_octree_key_y), area(_area) {}
+
+			unsigned int index;
+			unsigned short key_x;
+			unsigned short key_y;
+			unsigned short key_z;
+			octomap::key_type octree_key_x;
+			octomap::key_type octree_key_y;
+			unsigned int area;
+		};
+
+		/** @brief Allocates the grid for the interest region */
+		void resizeGrid();
+
+		/**
+		 * @brief Removes the columns outside the interest region
+		 * @param const Eigen::Vector4d& The position of the robot and the yaw angle
+		 * @return The number of removed columns with obstacles
+		 */
+		unsigned int removeObstacleOutsideInterestRegion(const Eigen::Vector4d& robot_state);
+
+		/**
+		 * @brief Removes the columns of a row outside a range of keys, only
+		 * the columns between the range of the row and this range are visited
+		 * @param unsigned int Slot of the row in the grid
+		 * @param int First kept key along the x-axis
+		 * @param int Last kept key along the x-axis
+		 * @return The number of removed columns with obstacles
+		 */
+		unsigned int cropRow(unsigned int slot_y,
+							 int first_key_x,
+							 int last_key_x);
+
+		/**
+		 * @brief Marks the columns of the grid inside the changed regions of
+		 * the octree
+		 * @param double Size of the octree voxels of the queries, a column
+		 * changes if the voxel around its centre changed
+		 */
+		void markChangedColumns(double voxel_size);
+
+		/**
+		 * @brief Gets the columns of the search areas, every column belongs
+		 * to the first area that contains it
+		 * @param octomap::OcTreeKey& Minimum octree key of the columns
+		 * @param octomap::OcTreeKey& Maximum octree key of the columns
+		 * @param octomap::OcTree* The model of the environment
+		 * @param const Eigen::Vector4d& The position of the robot and the yaw angle
+		 * @param bool Indicates if all the columns are extracted, otherwise
+		 * only the new and changed ones
+		 */
+		void getScanColumns(octomap::OcTreeKey& min_key,
+							octomap::OcTreeKey& max_key,
+							octomap::OcTree* octomap,
+							const Eigen::Vector4d& robot_state,
+							bool is_full_scan);
+
+		/**
+		 * @brief Extracts the voxels of a column, and updates the column if
+		 * they changed
+		 * @param octomap::OcTree* The model of the environment
+		 * @param const ScanColumn& Column
+		 * @param uint64_t* Buffer of the bitset of the column
+		 * @param bool Indicates if the occupancy patch has the column
+		 * @return Returns true if the column changed
+		 */
+		bool computeColumn(octomap::OcTree* octomap,
+						   const ScanColumn& scan_column,
+						   uint64_t* bits,
+						   bool is_patch);
+
+		/** @brief Space discretization of the obstacle map */
+		dwl::environment::SpaceDiscretization space_discretization_;
+
+		/** @brief Search areas and their number of voxels per column */
+		std::vector<dwl::SearchArea> search_areas_;
+		std::vector<unsigned int> area_voxels_;
+
+		/** @brief Interest region */
+		double interest_radius_x_;
+		double interest_radius_y_;
+
+		/** @brief Columns of the grid, and their bitsets (column_words_ per column) */
+		std::vector<Column> columns_;
+		std::vector<uint64_t> bits_;
+		unsigned int size_x_, size_y_;
+		unsigned int column_words_;
+
+		/**
+		 * @brief Key and range of keys of the columns of every row of the
+		 * grid (the first key is bigger than the last one if the row is empty)
+		 */
+		std::vector<int> row_key_y_;
+		std::vector<int> row_first_key_;
+		std::vector<int> row_last_key_;
+
+		/** @brief Key of the robot in the last computation */
+		unsigned short centre_key_x_, centre_key_y_;
+
+		/** @brief Counter of the computations */
+		unsigned int scan_;
+
+		/** @brief Indicates if the obstacle map is updated incrementally */
+		bool incremental_update_;
+
+		/**
+		 * @brief Regions of the octree that changed since the last
+		 * computation (min_x, max_x, min_y and max_y)
+		 */
+		std::vector<Eigen::Vector4d> changed_regions_;
+
+		/** @brief Columns that are extracted in the current computation */
+		std::vector<ScanColumn> scan_columns_;
+
+		/** @brief Occupancy of the octree inside the search areas */
+		OccupancyPatch patch_;
+
+		/** @brief Depth of the octree queries */
+		int depth_;
+
+		/** @brief Bitsets of the columns computed by every thread */
+		std::vector<std::vector<uint64_t> > thread_bits_;
+
+		/** @brief Pool of threads that computes the tiles of columns */
+		ThreadPool pool_;
+
+		/** @brief Statistics of the hot paths, and the identifiers of its metrics */
+		Statistics* statistics_;
+		unsigned int eviction_timer_, patch_timer_, column_scan_timer_;
+		unsigned int scanned_counter_, changed_counter_;
+};
+
+} //@namespace terrain_server
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef TERRAIN_SERVER__OCCUPANCY_PATCH__H
+#define TERRAIN_SERVER__OCCUPANCY_PATCH__H
+
+#include <octomap/octomap.h>
+#include <terrain_server/ThreadPool.h>
+#include <stdint.h>
+#include <vector>
+
+
+namespace terrain_server
+{
+
+/**
+ * @class OccupancyPatch
+ * @brief Dense bit-packed block of the occupied voxels of an octree inside a
+ * bounding box. It's extracted in one walk through the leafs (split in tiles of
+ * rows as the surface extraction), so the neighbors of many cells are queried
+ * from a contiguous block instead of descending the octree per neighbor. The
+ * bits are packed along the x-axis
+ */
+class OccupancyPatch
+{
+	public:
+		/** @brief Constructor function */
+		OccupancyPatch();
+
+		/** @brief Destructor function */
+		~OccupancyPatch();
+
+		/**
+		 * @brief Extracts the occupied voxels inside a bounding box
+		 * @param octomap::OcTree* Pointer to the octomap model of the environment
+		 * @param const octomap::OcTreeKey& Minimum key of the bounding box
+		 * @param const octomap::OcTreeKey& Maximum key of the bounding box
+		 * @param int Depth of the octomap
+		 * @param ThreadPool& Pool of threads that computes the tiles
+		 * @return Returns false if the bounding box has more voxels than the
+		 * maximum size of the patch, in this case the patch is empty
+		 */
+		bool compute(octomap::OcTree* octomap,
+					 const octomap::OcTreeKey& min_key,
+					 const octomap::OcTreeKey& max_key,
+					 int depth,
+					 ThreadPool& pool);
+
+		/** @brief Removes the voxels of the patch */
+		void clear();
+
+		/**
+		 * @brief Gets the occupancy of a voxel
+		 * @param bool& Indicates if the voxel is occupied
+		 * @param const octomap::OcTreeKey& Key of the voxel
+		 * @return Returns false if the voxel is outside the patch
+		 */
+		bool getOccupancy(bool& is_occupied,
+						  const octomap::OcTreeKey& key) const;
+
+
+	private:
+		/**
+		 * @brief Extracts the occupied voxels of a tile
+		 * @param octomap::OcTree* Pointer to the octomap model of the environment
+		 * @param const octomap::OcTreeKey& Minimum key of the tile
+		 * @param const octomap::OcTreeKey& Maximum key of the tile
+		 * @param int Depth of the octomap
+		 */
+		void computeTile(octomap::OcTree* octomap,
+						 const octomap::OcTreeKey& min_key,
+						 const octomap::OcTreeKey& max_key,
+						 int depth);
+
+		/** @brief Bounding box of the patch */
+		octomap::OcTreeKey min_key_, max_key_;
+
+		/** @brief Number of voxels along the y and z axes */
+		unsigned int size_y_, size_z_;
+
+		/** @brief Number of words per row (along the x-axis) */
+		unsigned int row_words_;
+
+		/** @brief Occupancy bits, stored by (z, y) rows of words along x */
+		std::vector<uint64_t> bits_;
+
+		/** @brief Indicates if the patch has voxels */
+		bool is_patch_;
+};
+
+} //@namespace terrain_server
+
+#endif
@@ -0,0 +1,222 @@
+#ifndef TERRAIN_SERVER__OCTOMAP_READER__H
+#define TERRAIN_SERVER__OCTOMAP_READER__H
+
+#include <octomap/octomap.h>
+#include <octomap_msgs/Octomap.h>
+#include <streambuf>
+#include <vector>
+
+
+namespace terrain_server
+{
+
+/**
+ * @class OctomapReader
+ * @brief Deserializes octomap messages into one reused octree. The octree is
+ * owned by the reader, and a new message is read into the nodes of the previous
+ * one, i.e. only the new branches are allocated and only the leftover branches
+ * are freed. So, there is only one tree alive (bounded memory), and reading
+ * similar messages barely allocates. The message data is read in place, i.e.
+ * without copying it into a string stream. The reading can be restricted to a
+ * bounding box, then the node stream is parsed but only the branches that
+ * intersect the box are kept. Since the nodes are reused, the reader can track
+ * the regions whose leafs changed, so the users recompute only these regions
+ */
+class OctomapReader
+{
+	public:
+		/** @brief Region of the octree, i.e. a cube of keys */
+		struct OctreeRegion
+		{
+			OctreeRegion(const octomap::OcTreeKey& _key, int _size) :
+				key(_key), size(_size) {}
+
+			octomap::OcTreeKey key; // Minimum key (corner) of the region
+			int size; // Number of keys along every axis
+		};
+
+		/** @brief Constructor function */
+		OctomapReader();
+
+		/** @brief Destructor function */
+		~OctomapReader();
+
+		/**
+		 * @brief Reads an octomap message into the reused octree
+		 * @param const octomap_msgs::Octomap& Octomap message
+		 * @return The octree, or NULL if the message couldn't be read
+		 */
+		octomap::OcTree* read(const octomap_msgs::Octomap& msg);
+
+		/** @brief Gets the octree (NULL if a message wasn't read) */
+		octomap::OcTree* getOctree() const;
+
+		/** @brief Removes the octree */
+		void clear();
+
+		/**
+		 * @brief Restricts the reading of the next messages to a bounding box
+		 * @param const octomap::point3d& Minimum corner of the bounding box
+		 * @param const octomap::point3d& Maximum corner of the bounding box
+		 */
+		void setBoundingBox(const octomap::point3d& min,
+							const octomap::point3d& max);
+
+		/** @brief Reads the whole octree of the next messages (default) */
+		void clearBoundingBox();
+
+		/**
+		 * @brief Enables the tracking of the regions whose leafs changed in
+		 * every read (disabled by default)
+		 * @param bool Change tracking status
+		 */
+		void setChangeTracking(bool tracking);
+
+		/**
+		 * @brief Gets the regions whose leafs changed (or were added or
+		 * removed) in the last read. It's the whole octree if the previous
+		 * tree wasn't reused, e.g. in the first read
+		 * @return The changed regions
+		 */
+		const std::vector<OctreeRegion>& getChangedRegions() const;
+
+
+	private:
+		/** @brief Stream buffer over the data of a message */
+		struct MessageBuffer : public std::streambuf
+		{
+			MessageBuffer(const octomap_msgs::Octomap& msg);
+		};
+
+		/**
+		 * @brief Octree that reads only the branches inside a bounding box
+		 * (all the keys for the whole tree). The nodes of the current tree are
+		 * reused, the skipped branches are parsed without nodes, and the
+		 * occupancy of the inner nodes is the maximum of the read children
+		 */
+		class CroppedOcTree : public octomap::OcTree
+		{
+			public:
+				CroppedOcTree(double resolution);
+
+				/**
+				 * @brief Reads the binary (occupied/free) data of the tree
+				 * @param std::istream& Stream of the data
+				 * @param const octomap::OcTreeKey& Minimum key of the bounding box
+				 * @param const octomap::OcTreeKey& Maximum key of the bounding box
+				 */
+				std::istream& readCroppedBinaryData(std::istream& stream,
+													const octomap::OcTreeKey& min_key,
+													const octomap::OcTreeKey& max_key);
+
+				/**
+				 * @brief Reads the full (log-odds) data of the tree
+				 * @param std::istream& Stream of the data
+				 * @param const octomap::OcTreeKey& Minimum key of the bounding box
+				 * @param const octomap::OcTreeKey& Maximum key of the bounding box
+				 */
+				std::istream& readCroppedData(std::istream& stream,
+											  const octomap::OcTreeKey& min_key,
+											  const octomap::OcTreeKey& max_key);
+
+				/**
+				 * @brief Sets the regions where the changes of the next reads
+				 * are added
+				 * @param std::vector<OctreeRegion>* Changed regions (NULL for
+				 * not tracking the changes)
+				 */
+				void setChangedRegions(std::vector<OctreeRegion>* changed_regions);
+
+
+			private:
+				/**
+				 * @brief Reads the binary data of a node and its children
+				 * @param std::istream& Stream of the data
+				 * @param octomap::OcTreeNode* Node (NULL if it's skipped)
+				 * @param const octomap::OcTreeKey& Minimum key (corner) of the node
+				 * @param int Size of the node in keys
+				 * @param bool Indicates if the node is inside a changed region
+				 * @return Returns false if the node doesn't have read children
+				 */
+				bool readBinaryNode(std::istream& stream,
+									octomap::OcTreeNode* node,
+									const octomap::OcTreeKey& node_key,
+									int node_size,
+									bool is_changed);
+
+				/**
+				 * @brief Reads the full data of a node and its children
+				 * @param std::istream& Stream of the data
+				 * @param octomap::OcTreeNode* Node (NULL if it's skipped)
+				 * @param const octomap::OcTreeKey& Minimum key (corner) of the node
+				 * @param int Size of the node in keys
+				 * @param bool Indicates if the node is inside a changed region
+				 * @return Returns false if the node is an inner node without
+				 * read children
+				 */
+				bool readNode(std::istream& stream,
+							  octomap::OcTreeNode* node,
+							  const octomap::OcTreeKey& node_key,
+							  int node_size,
+							  bool is_changed);
+
+				/**
+				 * @brief Removes a child of a node and its branch
+				 * @param octomap::OcTreeNode* Node
+				 * @param unsigned int Index of the child
+				 */
+				void deleteChild(octomap::OcTreeNode* node,
+								 unsigned int child);
+
+				/**
+				 * @brief Removes the children of a node, so it's a leaf. Note
+				 * that the nodes don't free the array of children when they
+				 * are deleted, so the children are pruned instead
+				 * @param octomap::OcTreeNode* Node
+				 */
+				void pruneChildren(octomap::OcTreeNode* node);
+
+				/**
+				 * @brief Adds a changed region if the changes are tracked
+				 * @param const octomap::OcTreeKey& Minimum key (corner) of the region
+				 * @param int Size of the region in keys
+				 */
+				void addChangedRegion(const octomap::OcTreeKey& key,
+									  int size);
+
+				/** @brief Gets the minimum key (corner) of a child of a node */
+				static octomap::OcTreeKey getChildKey(const octomap::OcTreeKey& node_key,
+													  int child_size,
+													  unsigned int child);
+
+				/** @brief Indicates if a child intersects the bounding box */
+				bool isChildInside(const octomap::OcTreeKey& child_key,
+								   int child_size) const;
+
+				/** @brief Bounding box of the read nodes */
+				octomap::OcTreeKey min_key_;
+				octomap::OcTreeKey max_key_;
+
+				/** @brief Changed regions of the read (NULL if they aren't tracked) */
+				std::vector<OctreeRegion>* changed_regions_;
+		};
+
+		/** @brief Reused octree */
+		CroppedOcTree* octree_;
+
+		/** @brief Indicates if the octree has the data of a message */
+		bool is_octree_;
+
+		/** @brief Bounding box of the read octree */
+		octomap::point3d bbx_min_;
+		octomap::point3d bbx_max_;
+		bool is_bounding_box_;
+
+		/** @brief Regions that changed in the last read, if they are tracked */
+		std::vector<OctreeRegion> changed_regions_;
+		bool is_change_tracking_;
+};
+
+} //@namespace terrain_server
+
+#endif
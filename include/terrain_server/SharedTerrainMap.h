@@ -0,0 +1,164 @@
+#ifndef TERRAIN_SERVER__SHARED_TERRAIN_MAP__H
+#define TERRAIN_SERVER__SHARED_TERRAIN_MAP__H
+
+#include <terrain_server/TerrainGrid.h>
+#include <atomic>
+#include <string>
+#include <stdint.h>
+
+
+namespace terrain_server
+{
+
+/**
+ * @class SharedTerrainMap
+ * @brief Terrain map in a POSIX shared-memory segment, for the clients in the
+ * same host. The segment has two slots with the unrolled grid: the writer fills
+ * the inactive slot and then activates it, and every slot is versioned by a
+ * sequence lock. So, the readers access the cells in place (without copying the
+ * map) and retry only if the writer reused the slot during the read. When the
+ * grid doesn't fit, the writer retires the segment and creates a new one. The
+ * segment has only the finest resolution level of the terrain map
+ */
+class SharedTerrainMap
+{
+	public:
+		/** @brief Constructor function */
+		SharedTerrainMap();
+
+		/** @brief Destructor function */
+		~SharedTerrainMap();
+
+		/**
+		 * @brief Creates the segment (writer)
+		 * @param const std::string& Name of the segment
+		 * @param unsigned int Maximum number of cells of the grid
+		 * @return Returns false if the segment couldn't be created
+		 */
+		bool create(const std::string& name,
+					unsigned int capacity);
+
+		/**
+		 * @brief Opens an existing segment as read-only (reader)
+		 * @param const std::string& Name of the segment
+		 * @return Returns false if the segment isn't available
+		 */
+		bool open(const std::string& name);
+
+		/** @brief Unmaps the segment, and removes it if it was created */
+		void close();
+
+		/** @brief Indicates if the segment is mapped */
+		bool isOpen() const;
+
+		/** @brief Indicates if the writer replaced the segment (reader) */
+		bool isRetired() const;
+
+		/** @brief Gets the maximum number of cells of the grid */
+		unsigned int getCapacity() const;
+
+		/**
+		 * @brief Writes the terrain cells of a grid into the inactive slot,
+		 * and activates it (writer)
+		 * @param const TerrainGrid& Terrain grid
+		 * @param double Resolution of the plane
+		 * @param double Resolution of the height
+		 * @return Returns false if the grid doesn't fit in the segment
+		 */
+		bool write(const TerrainGrid& grid,
+				   double plane_size,
+				   double height_size);
+
+		/**
+		 * @brief Gets the resolutions of the active slot (reader)
+		 * @param double& Resolution of the plane
+		 * @param double& Resolution of the height
+		 * @return Returns false if there isn't a terrain map
+		 */
+		bool getResolution(double& plane_size,
+						   double& height_size) const;
+
+		/**
+		 * @brief Gets a terrain cell of the active slot in place (reader)
+		 * @param float& Height of the cell
+		 * @param float& Cost of the cell
+		 * @param Eigen::Vector3f& Normal of the cell
+		 * @param unsigned short& Key of the cell along the z-axis
+		 * @param unsigned short Key of the cell along the x-axis
+		 * @param unsigned short Key of the cell along the y-axis
+		 * @return Returns false if there isn't terrain data
+		 */
+		bool getCell(float& height,
+					 float& cost,
+					 Eigen::Vector3f& normal,
+					 unsigned short& key_z,
+					 unsigned short key_x,
+					 unsigned short key_y) const;
+
+		/**
+		 * @brief Copies the active slot into a grid (reader)
+		 * @param TerrainGrid& Terrain grid
+		 * @param double& Resolution of the plane
+		 * @param double& Resolution of the height
+		 * @return Returns false if there isn't a terrain map
+		 */
+		bool getGrid(TerrainGrid& grid,
+					 double& plane_size,
+					 double& height_size) const;
+
+
+	private:
+		/** @brief Terrain cell of a slot */
+		struct Cell
+		{
+			float height;
+			float cost;
+			float normal[3];
+			uint16_t key_z;
+			uint8_t is_terrain;
+			uint8_t padding;
+		};
+
+		/** @brief Header of a slot, i.e. the grid geometry and its version
+		 * (odd while it's written) */
+		struct Slot
+		{
+			std::atomic<uint64_t> sequence;
+			double plane_size;
+			double height_size;
+			int32_t origin_key_x;
+			int32_t origin_key_y;
+			uint32_t size_x;
+			uint32_t size_y;
+		};
+
+		/** @brief Header of the segment */
+		struct Segment
+		{
+			uint32_t magic;
+			uint32_t capacity;
+			std::atomic<uint32_t> active_slot;
+			std::atomic<uint32_t> is_retired;
+			Slot slot[2];
+		};
+
+		/** @brief Gets the cells of a slot */
+		Cell* getCells(unsigned int slot) const;
+
+		/** @brief Gets the size of a segment given its capacity */
+		static size_t getSegmentSize(unsigned int capacity);
+
+		/** @brief Mapped segment */
+		Segment* segment_;
+		size_t segment_size_;
+
+		/** @brief Name of the segment */
+		std::string name_;
+
+		/** @brief Indicates if the segment was created by this object */
+		bool is_writer_;
+};
+
+} //@namespace terrain_server
+
+#endif
@@ -0,0 +1,166 @@
+#ifndef TERRAIN_SERVER__STATISTICS__H
+#define TERRAIN_SERVER__STATISTICS__H
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <time.h>
+
+
+namespace terrain_server
+{
+
+/**
+ * @class Statistics
+ * @brief Timers and counters of the hot paths. Every metric aggregates its
+ * samples in a log-scale histogram (8 bins per decade) that is rolled, i.e.
+ * summarized and cleared, when the statistics are read. The metrics are added
+ * before the samples are recorded, and recording a sample is thread-safe. When
+ * the statistics are disabled, the samples aren't recorded and the scoped
+ * timers don't read the clock
+ */
+class Statistics
+{
+	public:
+		/** @brief Summary of a metric in the rolling window */
+		struct Summary
+		{
+			std::string name;
+			std::string unit;
+			unsigned long samples;
+			double total;
+			double mean;
+			double min;
+			double max;
+			double p50;
+			double p90;
+			double p99;
+		};
+
+		/** @brief Constructor function */
+		Statistics();
+
+		/** @brief Destructor function */
+		~Statistics();
+
+		/**
+		 * @brief Enables the recording of the samples
+		 * @param bool Enable status
+		 */
+		void setEnabled(bool enable);
+
+		/** @brief Indicates if the samples are recorded */
+		bool isEnabled() const
+		{
+			return is_enabled_.load(std::memory_order_relaxed);
+		}
+
+		/**
+		 * @brief Adds a timer, its samples are durations in seconds
+		 * @param const std::string& Name of the timer
+		 * @return The identifier of the timer
+		 */
+		unsigned int addTimer(const std::string& name);
+
+		/**
+		 * @brief Adds a counter
+		 * @param const std::string& Name of the counter
+		 * @param const std::string& Unit of the counter
+		 * @return The identifier of the counter
+		 */
+		unsigned int addCounter(const std::string& name,
+								const std::string& unit = "count");
+
+		/**
+		 * @brief Records a sample of a metric (if the statistics are enabled)
+		 * @param unsigned int Identifier of the metric
+		 * @param double Value of the sample
+		 */
+		void addSample(unsigned int metric,
+					   double value);
+
+		/**
+		 * @brief Gets the summaries of the metrics, and starts a new window
+		 * @param std::vector<Summary>& Summaries of the metrics
+		 * @return The duration of the window in seconds
+		 */
+		double rollWindow(std::vector<Summary>& summaries);
+
+		/** @brief Gets the monotonic time in seconds */
+		static double getTime()
+		{
+			timespec time;
+			clock_gettime(CLOCK_MONOTONIC, &time);
+			return time.tv_sec + 1e-9 * time.tv_nsec;
+		}
+
+
+	private:
+		/** @brief Metric and its histogram of the rolling window */
+		struct Metric
+		{
+			std::string name;
+			std::string unit;
+			std::vector<unsigned long> histogram;
+			unsigned long samples;
+			double total;
+			double min;
+			double max;
+		};
+
+		/** @brief Clears the samples of a metric */
+		static void clearMetric(Metric& metric);
+
+		/** @brief Metrics */
+		std::vector<Metric> metrics_;
+		std::mutex mutex_;
+
+		/** @brief Start time of the window */
+		double window_start_;
+
+		/** @brief Indicates if the samples are recorded */
+		std::atomic<bool> is_enabled_;
+};
+
+
+/**
+ * @class ScopedTimer
+ * @brief Records the duration of a scope in a timer of the statistics, the
+ * clock is read only when the statistics are enabled
+ */
+class ScopedTimer
+{
+	public:
+		/**
+		 * @brief Constructor function
+		 * @param Statistics* Statistics (NULL for disabling the timer)
+		 * @param unsigned int Identifier of the timer
+		 */
+		ScopedTimer(Statistics* statistics,
+					unsigned int timer) :
+				statistics_(statistics && statistics->isEnabled() ? statistics : NULL),
+				timer_(timer), start_time_(statistics_ ? Statistics::getTime() : 0.) {}
+
+		/** @brief Destructor function */
+		~ScopedTimer()
+		{
+			if (statistics_)
+				statistics_->addSample(timer_, Statistics::getTime() - start_time_);
+		}
+
+
+	private:
+		/** @brief Statistics of the timer */
+		Statistics* statistics_;
+
+		/** @brief Identifier of the timer */
+		unsigned int timer_;
+
+		/** @brief Start time of the scope */
+		double start_time_;
+};
+
+} //@namespace terrain_server
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef TERRAIN_SERVER__SURFACE_EXTRACTION__H
+#define TERRAIN_SERVER__SURFACE_EXTRACTION__H
+
+#include <octomap/octomap.h>
+#include <terrain_server/ThreadPool.h>
+#include <vector>
+
+
+namespace terrain_server
+{
+
+/**
+ * @class SurfaceExtraction
+ * @brief Extracts the topmost occupied voxel of every octree column inside a
+ * bounding box. The octree is descended from the root, and the free or unknown
+ * nodes are skipped with their whole span since the occupancy of an inner node
+ * is the maximum of its children. The occupied nodes of the query depth (and
+ * the pruned ones) update all the columns that they cover. The bounding box is
+ * split in tiles of rows that are walked in parallel, and every tile writes
+ * only its own rows
+ */
+class SurfaceExtraction
+{
+	public:
+		/** @brief Constructor function */
+		SurfaceExtraction();
+
+		/** @brief Destructor function */
+		~SurfaceExtraction();
+
+		/**
+		 * @brief Computes the surface of the columns inside a bounding box
+		 * @param octomap::OcTree* Pointer to the octomap model of the environment
+		 * @param const octomap::OcTreeKey& Minimum key of the bounding box
+		 * @param const octomap::OcTreeKey& Maximum key of the bounding box
+		 * @param int Depth of the octomap
+		 * @param ThreadPool& Pool of threads that computes the tiles
+		 */
+		void compute(octomap::OcTree* octomap,
+					 const octomap::OcTreeKey& min_key,
+					 const octomap::OcTreeKey& max_key,
+					 int depth,
+					 ThreadPool& pool);
+
+		/**
+		 * @brief Gets the key of the topmost occupied voxel of a column
+		 * @param octomap::key_type& Key of the surface along the z-axis
+		 * @param octomap::key_type Key of the column along the x-axis
+		 * @param octomap::key_type Key of the column along the y-axis
+		 * @return Returns false if the column is outside the bounding box or
+		 * there isn't an occupied voxel in it
+		 */
+		bool getSurfaceKey(octomap::key_type& key_z,
+						   octomap::key_type key_x,
+						   octomap::key_type key_y) const;
+
+
+	private:
+		/**
+		 * @brief Computes the surface of the columns of a tile
+		 * @param octomap::OcTree* Pointer to the octomap model of the environment
+		 * @param const octomap::OcTreeKey& Minimum key of the tile
+		 * @param const octomap::OcTreeKey& Maximum key of the tile
+		 * @param int Depth of the octomap
+		 */
+		void computeTile(octomap::OcTree* octomap,
+						 const octomap::OcTreeKey& min_key,
+						 const octomap::OcTreeKey& max_key,
+						 int depth);
+
+		/**
+		 * @brief Searches the occupied nodes of a subtree inside a bounding box
+		 * @param octomap::OcTree* Pointer to the octomap model of the environment
+		 * @param octomap::OcTreeNode* Root of the subtree
+		 * @param const octomap::OcTreeKey& Minimum key (corner) of the node
+		 * @param int Depth of the node
+		 * @param const octomap::OcTreeKey& Minimum key of the bounding box
+		 * @param const octomap::OcTreeKey& Maximum key of the bounding box
+		 * @param int Depth of the octomap
+		 */
+		void searchNode(octomap::OcTree* octomap,
+						octomap::OcTreeNode* node,
+						const octomap::OcTreeKey& node_key,
+						int node_depth,
+						const octomap::OcTreeKey& min_key,
+						const octomap::OcTreeKey& max_key,
+						int depth);
+
+		/** @brief Bounding box of the computed columns */
+		octomap::OcTreeKey min_key_, max_key_;
+
+		/** @brief Number of columns along the x and y axes */
+		unsigned int size_x_, size_y_;
+
+		/** @brief Key of the surface per column (-1 if there isn't surface) */
+		std::vector<int> surface_key_;
+};
+
+} //@namespace terrain_server
+
+#endif
@@ -0,0 +1,395 @@
+#ifndef TERRAIN_SERVER__TERRAIN_GRID__H
+#define TERRAIN_SERVER__TERRAIN_GRID__H
+
+#include <Eigen/Dense>
+#include <vector>
+#include <atomic>
+
+
+namespace terrain_server
+{
+
+/**
+ * @class TerrainGrid
+ * @brief Robot-centric rolling grid of terrain cells. The cells are stored in
+ * contiguous per-layer arrays indexed by the (x,y) keys of the terrain
+ * discretization modulo the grid size. Therefore a cell keeps its slot while the
+ * grid scrolls, and moving the grid only clears the slots that leave it. Every
+ * row keeps the range of keys of its cells, so the cells outside a region are
+ * removed without visiting the whole grid. The terrain data of different cells
+ * can be set concurrently. Optionally, the grid records the cells whose terrain
+ * data changed or that were removed, e.g. for publishing its updates
+ */
+class TerrainGrid
+{
+	public:
+		/** @brief Status flags of a cell */
+		enum CellStatus {
+			EMPTY = 0,
+			HEIGHT = 1,  // The surface height is known
+			TERRAIN = 2, // The cost and normal are computed
+			SCANNED = 4, // The surface was searched in the current octomap
+			MOMENT_NORMAL = 8, // The normal is estimated from the moment images
+			UPDATED = 16 // The cell is recorded as updated
+		};
+
+		/** @brief Constructor function */
+		TerrainGrid();
+
+		/**
+		 * @brief Copy constructor, e.g. for taking a snapshot of the grid. The
+		 * grid shouldn't be modified while it's copied
+		 * @param const TerrainGrid& Terrain grid
+		 */
+		TerrainGrid(const TerrainGrid& grid);
+
+		/** @brief Destructor function */
+		~TerrainGrid();
+
+		/**
+		 * @brief Copies a terrain grid, reusing the memory of the layers
+		 * @param const TerrainGrid& Terrain grid
+		 */
+		TerrainGrid& operator=(const TerrainGrid& grid);
+
+		/**
+		 * @brief Allocates the layers of the grid and removes all the cells
+		 * @param unsigned int Number of cells along the x-axis
+		 * @param unsigned int Number of cells along the y-axis
+		 */
+		void resize(unsigned int size_x,
+					unsigned int size_y);
+
+		/**
+		 * @brief Moves the grid to a new centre. Only the rows and columns
+		 * that leave the grid are cleared
+		 * @param unsigned short Key of the centre along the x-axis
+		 * @param unsigned short Key of the centre along the y-axis
+		 */
+		void move(unsigned short centre_key_x,
+				  unsigned short centre_key_y);
+
+		/** @brief Removes all the cells of the grid */
+		void clear();
+
+		/**
+		 * @brief Gets the index of the cell given its keys
+		 * @param unsigned int& Index of the cell
+		 * @param unsigned short Key of the cell along the x-axis
+		 * @param unsigned short Key of the cell along the y-axis
+		 * @return Returns false if the cell is outside the grid
+		 */
+		bool getIndex(unsigned int& index,
+					  unsigned short key_x,
+					  unsigned short key_y) const;
+
+		/**
+		 * @brief Gets the keys of the cell given its index
+		 * @param unsigned short& Key of the cell along the x-axis
+		 * @param unsigned short& Key of the cell along the y-axis
+		 * @param unsigned int Index of the cell
+		 */
+		void getKey(unsigned short& key_x,
+					unsigned short& key_y,
+					unsigned int index) const;
+
+		/**
+		 * @brief Sets the surface height of a cell, the terrain data of this
+		 * cell is invalidated
+		 * @param unsigned int Index of the cell
+		 * @param float Height of the surface
+		 * @param unsigned short Key of the surface along the z-axis
+		 */
+		void setHeight(unsigned int index,
+					   float height,
+					   unsigned short key_z);
+
+		/**
+		 * @brief Sets the terrain data of a cell with a known height
+		 * @param unsigned int Index of the cell
+		 * @param float Cost of the cell
+		 * @param const Eigen::Vector3f& Surface normal of the cell
+		 */
+		void setTerrain(unsigned int index,
+						float cost,
+						const Eigen::Vector3f& normal);
+
+		/**
+		 * @brief Sets if the surface of a cell was searched in the octomap
+		 * @param unsigned int Index of the cell
+		 * @param bool Scanned status
+		 */
+		void setScanned(unsigned int index,
+						bool scanned);
+
+		/**
+		 * @brief Sets if the normal of a cell is estimated from the integral
+		 * moment images (or from the neighbors in the octomap)
+		 * @param unsigned int Index of the cell
+		 * @param bool Moment estimation status
+		 */
+		void setMomentNormal(unsigned int index,
+							 bool moment_normal);
+
+		/** @brief Sets all the cells as not scanned */
+		void resetScanned();
+
+		/**
+		 * @brief Sets a set of cells as not scanned
+		 * @param const std::vector<unsigned int>& Indexes of the cells
+		 */
+		void resetScanned(const std::vector<unsigned int>& indexes);
+
+		/**
+		 * @brief Invalidates the terrain data of the cells around a set of
+		 * cells, e.g. the cells that changed their surface. The neighborhood is
+		 * a square, and it's computed with a separable dilation of the
+		 * bounding box of the cells
+		 * @param std::vector<unsigned int>& Indexes of the cells of the
+		 * neighborhood that have height and no terrain data
+		 * @param const std::vector<unsigned int>& Indexes of the cells
+		 * @param unsigned int Radius of the neighborhood (in cells)
+		 */
+		void invalidateTerrain(std::vector<unsigned int>& dirty_indexes,
+							   const std::vector<unsigned int>& indexes,
+							   unsigned int radius);
+
+		/**
+		 * @brief Removes a cell of the grid
+		 * @param unsigned int Index of the cell
+		 */
+		void removeCell(unsigned int index);
+
+		/**
+		 * @brief Removes the cells of a row outside a range of keys. Only the
+		 * slots between the range of the row cells and the kept range are
+		 * visited
+		 * @param unsigned short Key of the row along the y-axis
+		 * @param int First key of the kept range along the x-axis
+		 * @param int Last key of the kept range along the x-axis (a range
+		 * with the last key before the first one removes the whole row)
+		 * @return The number of removed cells
+		 */
+		unsigned int cropRow(unsigned short key_y,
+							 int first_key_x,
+							 int last_key_x);
+
+		/**
+		 * @brief Sets if the grid records the updated cells, i.e. the cells
+		 * whose terrain data changed or that were removed (see
+		 * takeUpdatedCells()). Note that the cells that leave the grid when it
+		 * moves aren't recorded
+		 * @param bool Tracking status
+		 */
+		void setUpdateTracking(bool tracking);
+
+		/**
+		 * @brief Takes the cells updated since the previous call, each cell is
+		 * taken once
+		 * @param std::vector<unsigned int>& Indexes of the updated cells
+		 * @return Returns false if the grid was resized or cleared since the
+		 * previous call, i.e. every cell could have changed
+		 */
+		bool takeUpdatedCells(std::vector<unsigned int>& indexes);
+
+		/** @brief Gets the number of cells along the x-axis */
+		unsigned int getSizeX() const;
+
+		/** @brief Gets the number of cells along the y-axis */
+		unsigned int getSizeY() const;
+
+		/** @brief Gets the total number of cells (slots) of the grid */
+		unsigned int getNumberOfCells() const;
+
+		/** @brief Gets the number of cells with a known height */
+		unsigned int getNumberOfHeightCells() const;
+
+		/** @brief Gets the number of cells with computed terrain data */
+		unsigned int getNumberOfTerrainCells() const;
+
+		/** @brief Gets the minimum key (corner) of the grid along the x-axis */
+		int getOriginKeyX() const;
+
+		/** @brief Gets the minimum key (corner) of the grid along the y-axis */
+		int getOriginKeyY() const;
+
+		/** @brief Indicates if a cell has a known height */
+		bool isHeight(unsigned int index) const;
+
+		/** @brief Indicates if a cell has computed terrain data */
+		bool isTerrain(unsigned int index) const;
+
+		/** @brief Indicates if the surface of a cell was searched */
+		bool isScanned(unsigned int index) const;
+
+		/** @brief Indicates if the normal of a cell is estimated from moments */
+		bool isMomentNormal(unsigned int index) const;
+
+		/** @brief Gets the layers of the grid */
+		float getHeight(unsigned int index) const;
+		float getCost(unsigned int index) const;
+		const Eigen::Vector3f& getNormal(unsigned int index) const;
+		unsigned short getKeyZ(unsigned int index) const;
+		unsigned char getStatus(unsigned int index) const;
+
+
+	private:
+		/**
+		 * @brief Records a cell as updated if the grid tracks them
+		 * @param unsigned int Index of the cell
+		 */
+		void markUpdated(unsigned int index);
+
+		/**
+		 * @brief Clears the slot of a cell without recording it
+		 * @param unsigned int Index of the cell
+		 */
+		void clearCell(unsigned int index);
+
+		/**
+		 * @brief Clears the slots of a range of keys along one axis
+		 * @param int First key of the range
+		 * @param int Number of keys of the range
+		 * @param bool Indicates if the range is along the x-axis
+		 */
+		void clearRange(int first_key,
+						int num_keys,
+						bool along_x);
+
+		/** @brief Number of cells along the x and y axes */
+		unsigned int size_x_, size_y_;
+
+		/** @brief Minimum key (corner) of the grid */
+		int origin_key_x_, origin_key_y_;
+
+		/** @brief Indicates if the grid was centred at least once */
+		bool is_centred_;
+
+		/** @brief Layers of the grid */
+		std::vector<float> height_;
+		std::vector<float> cost_;
+		std::vector<Eigen::Vector3f> normal_;
+		std::vector<unsigned short> key_z_;
+		std::vector<unsigned char> status_;
+
+		/** @brief Range of keys along the x-axis of the cells of each row. It
+		 * contains the cells of the row, although it could be wider */
+		std::vector<int> row_first_key_;
+		std::vector<int> row_last_key_;
+
+		/** @brief Dilation buffers used for invalidating the terrain data */
+		std::vector<unsigned char> dilation_mask_;
+		std::vector<unsigned short> dilation_count_;
+
+		/** @brief Number of cells with a known height */
+		unsigned int num_height_cells_;
+
+		/** @brief Number of cells with terrain data */
+		std::atomic<unsigned int> num_terrain_cells_;
+
+		/** @brief Indicates if the updated cells are recorded, the recorded
+		 * cells, and if the grid was cleared since they were taken */
+		bool is_update_tracking_;
+		std::vector<unsigned int> updated_cells_;
+		bool is_cleared_;
+};
+
+
+inline unsigned int TerrainGrid::getSizeX() const
+{
+	return size_x_;
+}
+
+
+inline unsigned int TerrainGrid::getSizeY() const
+{
+	return size_y_;
+}
+
+
+inline unsigned int TerrainGrid::getNumberOfCells() const
+{
+	return size_x_ * size_y_;
+}
+
+
+inline unsigned int TerrainGrid::getNumberOfHeightCells() const
+{
+	return num_height_cells_;
+}
+
+
+inline unsigned int TerrainGrid::getNumberOfTerrainCells() const
+{
+	return num_terrain_cells_;
+}
+
+
+inline int TerrainGrid::getOriginKeyX() const
+{
+	return origin_key_x_;
+}
+
+
+inline int TerrainGrid::getOriginKeyY() const
+{
+	return origin_key_y_;
+}
+
+
+inline bool TerrainGrid::isHeight(unsigned int index) const
+{
+	return status_[index] & HEIGHT;
+}
+
+
+inline bool TerrainGrid::isTerrain(unsigned int index) const
+{
+	return status_[index] & TERRAIN;
+}
+
+
+inline bool TerrainGrid::isScanned(unsigned int index) const
+{
+	return status_[index] & SCANNED;
+}
+
+
+inline bool TerrainGrid::isMomentNormal(unsigned int index) const
+{
+	return status_[index] & MOMENT_NORMAL;
+}
+
+
+inline float TerrainGrid::getHeight(unsigned int index) const
+{
+	return height_[index];
+}
+
+
+inline float TerrainGrid::getCost(unsigned int index) const
+{
+	return cost_[index];
+}
+
+
+inline const Eigen::Vector3f& TerrainGrid::getNormal(unsigned int index) const
+{
+	return normal_[index];
+}
+
+
+inline unsigned short TerrainGrid::getKeyZ(unsigned int index) const
+{
+	return key_z_[index];
+}
+
+
+inline unsigned char TerrainGrid::getStatus(unsigned int index) const
+{
+	return status_[index];
+}
+
+} //@namespace terrain_server
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef TERRAIN_SERVER__TERRAIN_MAP_CODEC__H
+#define TERRAIN_SERVER__TERRAIN_MAP_CODEC__H
+
+#include <Eigen/Dense>
+#include <cmath>
+
+
+namespace terrain_server
+{
+
+/**
+ * @class TerrainMapCodec
+ * @brief Quantization of the layers of the dense terrain map message. The cost
+ * is mapped into 8 bits, and the normal is mapped into two 8-bit components of
+ * its octahedral projection (angular error below 1 deg)
+ */
+class TerrainMapCodec
+{
+	public:
+		/**
+		 * @brief Encodes a cost
+		 * @param double Cost
+		 * @param double Maximum cost of the map
+		 * @return The quantized cost
+		 */
+		static unsigned char encodeCost(double cost,
+										double max_cost);
+
+		/**
+		 * @brief Decodes a cost
+		 * @param unsigned char Quantized cost
+		 * @param double Maximum cost of the map
+		 * @return The cost
+		 */
+		static double decodeCost(unsigned char cost,
+								 double max_cost);
+
+		/**
+		 * @brief Encodes a normal with the octahedral projection
+		 * @param signed char& First component
+		 * @param signed char& Second component
+		 * @param const Eigen::Vector3f& Unit normal
+		 */
+		static void encodeNormal(signed char& u,
+								 signed char& v,
+								 const Eigen::Vector3f& normal);
+
+		/**
+		 * @brief Decodes a normal from its octahedral projection
+		 * @param Eigen::Vector3d& Unit normal
+		 * @param signed char First component
+		 * @param signed char Second component
+		 */
+		static void decodeNormal(Eigen::Vector3d& normal,
+								 signed char u,
+								 signed char v);
+
+
+	private:
+		/** @brief Maximum values of the quantized cost and normal components */
+		static const int COST_LEVELS = 255;
+		static const int NORMAL_LEVELS = 127;
+
+		/** @brief Folds the lower hemisphere of the octahedron */
+		static void fold(double& x, double& y);
+};
+
+
+inline unsigned char TerrainMapCodec::encodeCost(double cost,
+												 double max_cost)
+{
+	if (max_cost <= 0. || cost <= 0.)
+		return 0;
+	else if (cost >= max_cost)
+		return COST_LEVELS;
+	else
+		return (unsigned char) std::lround(cost / max_cost * COST_LEVELS);
+}
+
+
+inline double TerrainMapCodec::decodeCost(unsigned char cost,
+										  double max_cost)
+{
+	return cost * max_cost / COST_LEVELS;
+}
+
+
+inline void TerrainMapCodec::encodeNormal(signed char& u,
+										  signed char& v,
+										  const Eigen::Vector3f& normal)
+{
+	double norm_1 = fabs(normal(0)) + fabs(normal(1)) + fabs(normal(2));
+	if (norm_1 == 0.) {
+		u = v = 0;
+		return;
+	}
+
+	double x = normal(0) / norm_1;
+	double y = normal(1) / norm_1;
+	if (normal(2) < 0.)
+		fold(x, y);
+
+	u = (signed char) std::lround(x * NORMAL_LEVELS);
+	v = (signed char) std::lround(y * NORMAL_LEVELS);
+}
+
+
+inline void TerrainMapCodec::decodeNormal(Eigen::Vector3d& normal,
+										  signed char u,
+										  signed char v)
+{
+	double x = (double) u / NORMAL_LEVELS;
+	double y = (double) v / NORMAL_LEVELS;
+	double z = 1. - fabs(x) - fabs(y);
+	if (z < 0.)
+		fold(x, y);
+
+	normal = Eigen::Vector3d(x, y, z).normalized();
+}
+
+
+inline void TerrainMapCodec::fold(double& x, double& y)
+{
+	double folded_x = (1. - fabs(y)) * (x >= 0. ? 1. : -1.);
+	double folded_y = (1. - fabs(x)) * (y >= 0. ? 1. : -1.);
+	x = folded_x;
+	y = folded_y;
+}
+
+} //@namespace terrain_server
+
+#endif
@@ -2,23 +2,42 @@
 #define TERRAIN_SERVER__TERRAIN_MAP_INTERFACE__H
 
 #include <ros/ros.h>
-#include <realtime_tools/realtime_buffer.h>
 
 #include <dwl/environment/TerrainMap.h>
 #include <dwl/environment/SpaceDiscretization.h>
 #include <dwl/utils/RigidBodyDynamics.h>
 #include <dwl/utils/EnvironmentRepresentation.h>
 #include <terrain_server/TerrainMap.h>
+#include <terrain_server/DenseTerrainMap.h>
+#include <terrain_server/TerrainMapUpdate.h>
+#include <terrain_server/TerrainMapCodec.h>
+#include <terrain_server/TerrainGrid.h>
+#include <terrain_server/SharedTerrainMap.h>
 #include <terrain_server/TerrainData.h>
+#include <terrain_server/TerrainDataBatch.h>
+#include <terrain_server/TerrainRegion.h>
 #include <std_srvs/Empty.h>
 
+#include <atomic>
+#include <deque>
+
 
 namespace terrain_server
 {
 
+/**
+ * @class TerrainMapInterface
+ * @brief Client of the terrain map. The messages are converted by the subscriber
+ * thread into a dense grid, which is published to the real-time thread through
+ * a lock-free triple buffer. So, updating the terrain map only swaps the buffers
+ * and the lookups of the terrain data are O(1) and allocation-free
+ */
 class TerrainMapInterface
 {
 	public:
+		/** @brief Format of the received terrain map */
+		enum MapFormat {FULL_MAP, DENSE_MAP, MAP_UPDATES, SHARED_MAP};
+
 		/** @brief Constructor function */
 		TerrainMapInterface();
 
@@ -27,16 +46,30 @@ class TerrainMapInterface
 
 		/**
 		 * @brief Creates a real-time subscriber of terrain map.
-		 * The name of the topic is defined as node_ns/terrain_map
+		 * The name of the topic is defined as node_ns/terrain_map,
+		 * node_ns/terrain_map_dense for the dense terrain map, or
+		 * node_ns/terrain_map_update for the terrain map updates. The shared
+		 * map is read from the shared memory of the server (same host), and
+		 * it falls back to the dense terrain map when it isn't available.
+		 * Only the full terrain map has the coarse resolution levels, the
+		 * other formats have the finest level
 		 * @param ros::NodeHandle ROS node handle used by the subscription
+		 * @param MapFormat Format of the received terrain map
+		 * @param const std::string& Name of the shared memory
 		 */
-		void init(ros::NodeHandle node);
+		void init(ros::NodeHandle node,
+				  MapFormat format = FULL_MAP,
+				  const std::string& shared_memory = "/terrain_map");
 
+		/** @brief Takes the latest converted terrain map (real-time safe) */
 		void updateTerrainMap();
+
+		/** @brief Calls the reset service of the terrain map */
 		bool resetTerrainMap();
 
 		/**
-		 * @brief Gets the vector of terrain cells
+		 * @brief Gets the vector of terrain cells of the finest level. Note
+		 * that it allocates the cells, so it isn't real-time safe
 		 * @param dwl::TerrainData& Vector of terrain cells
 		 */
 		bool getTerrainMap(dwl::TerrainData& map);
@@ -50,10 +83,37 @@ class TerrainMapInterface
 		const double& requestTerrainHeight(const Eigen::Vector2d& position);
 		const Eigen::Vector3d& requestTerrainNormal(const Eigen::Vector2d& position);
 
+		/**
+		 * @brief Calls the batch service of the terrain map, i.e. the terrain
+		 * data of all the positions in one call. The cells without data have
+		 * the default values
+		 * @param std::vector<dwl::TerrainCell>& Terrain cells
+		 * @param const std::vector<Eigen::Vector2d>& Positions of the cells
+		 * @return Returns false if the service failed
+		 */
+		bool requestTerrainData(std::vector<dwl::TerrainCell>& cells,
+								const std::vector<Eigen::Vector2d>& positions);
+
+		/**
+		 * @brief Calls the region service of the terrain map, i.e. the grid
+		 * of a (oriented) rectangle sampled at the plane resolution
+		 * @param terrain_server::TerrainRegion::Response& Grid of the region
+		 * @param const Eigen::Vector2d& Centre of the rectangle
+		 * @param double Size of the rectangle along its x-axis
+		 * @param double Size of the rectangle along its y-axis
+		 * @param double Yaw angle of the rectangle
+		 * @return Returns false if the service failed
+		 */
+		bool requestTerrainRegion(terrain_server::TerrainRegion::Response& region,
+								  const Eigen::Vector2d& centre,
+								  double size_x,
+								  double size_y,
+								  double yaw = 0.);
+
 		/** @brief These methods allows us to get the data from the updated
 		 * terrain map and get the desired terrain data. Note that returns false
 		 * if there is not available data, and in that case a default value is
-		 * assigned */
+		 * assigned. They are O(1) and real-time safe */
 		bool getTerrainData(dwl::TerrainCell& cell,
 							const Eigen::Vector2d& position) const;
 		const dwl::TerrainCell& getTerrainData(const Eigen::Vector2d& position) const;
@@ -69,35 +129,183 @@ class TerrainMapInterface
 
 
 	private:
+		/** @brief Resolution level of the converted terrain map */
+		struct MapLevel
+		{
+			TerrainGrid grid;
+			dwl::environment::SpaceDiscretization discretization;
+		};
+
+		/** @brief Terrain map converted into dense grids, its levels go from
+		 * the finest to the coarsest resolution. The sequence is the version
+		 * of the converted terrain map that the buffer has */
+		struct MapBuffer
+		{
+			MapBuffer() : level(1), is_map(false), sequence(0) {}
+
+			std::vector<MapLevel> level;
+			bool is_map;
+			uint64_t sequence;
+		};
+
+		/** @brief Subscribes to the terrain map topic of the format */
+		void subscribe();
+
+		/**
+		 * @brief Maps the shared memory if it isn't mapped or it was replaced,
+		 * otherwise it subscribes to the terrain map topic
+		 * @param const ros::TimerEvent& Timer event
+		 */
+		void checkSharedMap(const ros::TimerEvent& event);
+
 		/**
 		 * @brief Callback method when the terrain map message arrives
 		 * @param const terrain_server::TerrainMapConstPtr& Terrain map message
 		 */
 		void callback(const terrain_server::TerrainMapConstPtr& msg);
 
+		/**
+		 * @brief Callback method when the dense terrain map message arrives
+		 * @param const terrain_server::DenseTerrainMapConstPtr& Dense terrain map message
+		 */
+		void denseCallback(const terrain_server::DenseTerrainMapConstPtr& msg);
+
+		/**
+		 * @brief Callback method when the terrain map update arrives. The
+		 * deltas are applied in place, and a keyframe is requested when there
+		 * is a gap in the sequence
+		 * @param const terrain_server::TerrainMapUpdateConstPtr& Terrain map update
+		 */
+		void updateCallback(const terrain_server::TerrainMapUpdateConstPtr& msg);
+
+		/**
+		 * @brief Applies the update (not a keyframe) of the terrain map to the
+		 * grid of the finest level, i.e. it moves the grid and sets the
+		 * evicted and the inserted cells
+		 * @param MapLevel& Converted level
+		 * @param const terrain_server::TerrainMapUpdate& Terrain map update
+		 */
+		void applyUpdate(MapLevel& level,
+						 const terrain_server::TerrainMapUpdate& update);
+
+		/**
+		 * @brief Converts the cells of a resolution level into its grid. The
+		 * grid is only grown
+		 * @param MapLevel& Converted level
+		 * @param const std::vector<terrain_server::TerrainCell>& Terrain cells
+		 * @param double Resolution of the plane
+		 * @param double Resolution of the height
+		 */
+		void setLevel(MapLevel& level,
+					  const std::vector<terrain_server::TerrainCell>& cells,
+					  double plane_size,
+					  double height_size);
+
+		/**
+		 * @brief Sets the resolutions and the geometry of the grid of a level
+		 * @param MapLevel& Converted level
+		 * @param double Resolution of the plane
+		 * @param double Resolution of the height
+		 * @param int Minimum key (corner) of the grid along the x-axis
+		 * @param int Minimum key (corner) of the grid along the y-axis
+		 * @param unsigned int Number of cells along the x-axis
+		 * @param unsigned int Number of cells along the y-axis
+		 */
+		void setGrid(MapLevel& level,
+					 double plane_size,
+					 double height_size,
+					 int origin_key_x,
+					 int origin_key_y,
+					 unsigned int size_x,
+					 unsigned int size_y);
+
+		/**
+		 * @brief Sets a cell of the grid of a level
+		 * @param MapLevel& Converted level
+		 * @param const terrain_server::TerrainCell& Terrain cell message
+		 */
+		void setCell(MapLevel& level,
+					 const terrain_server::TerrainCell& cell);
+
+		/**
+		 * @brief Publishes the converted grid to the real-time thread. The
+		 * written buffer replays the updates that it missed, or it copies the
+		 * grids if they aren't recorded (e.g. after a keyframe)
+		 */
+		void publishGrid();
+
+		/**
+		 * @brief Looks up the cell of a position in the shared memory, or in
+		 * the finest level of the updated grids that has it
+		 * @param float& Height of the cell
+		 * @param float& Cost of the cell
+		 * @param Eigen::Vector3f& Normal of the cell
+		 * @param dwl::Key& Key of the cell
+		 * @param const Eigen::Vector2d& Position of the cell
+		 * @return Returns false if there isn't terrain data
+		 */
+		bool lookupCell(float& height,
+						float& cost,
+						Eigen::Vector3f& normal,
+						dwl::Key& key,
+						const Eigen::Vector2d& position) const;
+
+		/** @brief ROS node handle used by the subscription */
+		ros::NodeHandle node_;
+
 		/** @brief Terrain map subscriber */
 		ros::Subscriber sub_;
 
-		/** @brief Realtime buffer for the terrain map message */
-		realtime_tools::RealtimeBuffer<terrain_server::TerrainMap> map_buffer_;
+		/** @brief Timer for checking the shared memory */
+		ros::Timer shared_timer_;
 
 		/** @brief The terrain map clients */
 		ros::ServiceClient terrain_clt_;
+		ros::ServiceClient batch_clt_;
+		ros::ServiceClient region_clt_;
 		ros::ServiceClient reset_clt_;
+		ros::ServiceClient resync_clt_;
 
-		/** @brief Terrain map message */
-		terrain_server::TerrainMap map_msg_;
+		/** @brief Grids converted by the subscriber thread */
+		MapBuffer map_;
 
-		/** @brief Terrain map (or cells) */
-		std::shared_ptr<dwl::environment::TerrainMap> terrain_map_;
+		/** @brief Updates applied to the converted grids since the latest
+		 * keyframe (at most MAX_RECORDED_UPDATES), the last one has the
+		 * sequence of the converted grids */
+		std::deque<terrain_server::TerrainMapUpdateConstPtr> recorded_updates_;
+		static const unsigned int MAX_RECORDED_UPDATES = 16;
+
+		/** @brief Triple buffer of the converted grids, i.e. the buffer that is
+		 * written, the buffer that is read, and the latest written one */
+		MapBuffer buffers_[3];
+		unsigned int back_buffer_;
+		unsigned int front_buffer_;
+		std::atomic<unsigned int> ready_buffer_;
+
+		/** @brief Mappings of the shared memory, i.e. the active one (-1 if
+		 * there isn't) and the previous one */
+		SharedTerrainMap shared_maps_[2];
+		std::atomic<int> shared_map_;
+		std::string shared_memory_;
+		mutable dwl::environment::SpaceDiscretization shared_discretization_;
+
+		/** @brief Grid copied from the shared memory */
+		TerrainGrid shared_grid_;
+
+		/** @brief Terrain cells returned by the services and the lookups */
 		dwl::TerrainCell terrain_cell_;
-		dwl::TerrainData terrain_data_;
+		mutable dwl::TerrainCell lookup_cell_;
+
+		/** @brief Format of the received terrain map */
+		MapFormat format_;
 
-		/** @brief Indicates if there is a new terrain map available */
-		bool new_msg_;
+		/** @brief Sequence of the latest applied update, and if it follows a
+		 * keyframe without gaps */
+		uint64_t update_sequence_;
+		bool is_update_synced_;
 
-		/** @brief Indicates if there is a terrain map available */
-		bool is_terrain_data_;
+		/** @brief Time of the latest keyframe request */
+		ros::Time resync_time_;
 };
 
 } //@namespace terrain_server
@@ -0,0 +1,40 @@
+#ifndef TERRAIN_SERVER__TERRAIN_MAP_NODELET__H
+#define TERRAIN_SERVER__TERRAIN_MAP_NODELET__H
+
+#include <nodelet/nodelet.h>
+#include <terrain_server/TerrainMapServer.h>
+#include <memory>
+
+
+namespace terrain_server
+{
+
+/**
+ * @class TerrainMapNodelet
+ * @brief Nodelet of the terrain map server. In a shared manager, the octomaps
+ * are delivered without serialization only if the publisher publishes them by
+ * shared pointer (publish(boost::shared_ptr)). The octomap server publishes its
+ * messages by value (publishFullOctoMap), so they are still serialized and
+ * deserialized inside the manager, only the loopback socket is saved
+ */
+class TerrainMapNodelet : public nodelet::Nodelet
+{
+	public:
+		/** @brief Constructor function */
+		TerrainMapNodelet();
+
+		/** @brief Destructor function */
+		~TerrainMapNodelet();
+
+
+	private:
+		/** @brief Initialization of the terrain map server */
+		virtual void onInit();
+
+		/** @brief Terrain map server */
+		std::unique_ptr<TerrainMapServer> server_;
+};
+
+} //@namespace terrain_server
+
+#endif
@@ -7,6 +7,11 @@
 #include <dwl/utils/Orientation.h>
 
 #include <terrain_server/TerrainMapping.h>
+#include <terrain_server/OctomapReader.h>
+#include <terrain_server/LatestMailbox.h>
+#include <terrain_server/TerrainMapCodec.h>
+#include <terrain_server/SharedTerrainMap.h>
+#include <terrain_server/Statistics.h>
 #include <terrain_server/feature/SlopeFeature.h>
 #include <terrain_server/feature/HeightDeviationFeature.h>
 #include <terrain_server/feature/CurvatureFeature.h>
@@ -16,14 +21,27 @@
 #include <octomap_msgs/Octomap.h>
 #include <terrain_server/TerrainMap.h>
 #include <terrain_server/TerrainCell.h>
+#include <terrain_server/DenseTerrainMap.h>
+#include <terrain_server/TerrainMapUpdate.h>
+#include <terrain_server/ServerStatistics.h>
 #include <std_srvs/Empty.h>
 #include <terrain_server/TerrainData.h>
+#include <terrain_server/TerrainDataBatch.h>
+#include <terrain_server/TerrainRegion.h>
+#include <sensor_msgs/PointCloud2.h>
+#include <pcl_ros/point_cloud.h>
+#include <pcl/point_types.h>
 
 #include <tf/transform_datatypes.h>
 #include <tf/transform_listener.h>
 #include <tf/message_filter.h>
 #include <message_filters/subscriber.h>
 
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+
 
 
 namespace terrain_server
@@ -31,13 +49,28 @@ namespace terrain_server
 
 /**
  * @class TerrainMapServer
- * @brief Class for building terrain map
+ * @brief Class for building terrain map. The octomaps are processed by a
+ * pipeline of threads, decoupled from the ROS callbacks: the callback posts the
+ * message in a latest-only mailbox, a deserialization stage reads it into one of
+ * the recycled octrees, a compute stage builds the terrain map and takes a
+ * snapshot of it, and a publish stage sends the snapshot. So, the stale octomaps
+ * are dropped, the next octomap is deserialized while the current one is
+ * computed, and the services answer from the latest snapshot. Alternatively,
+ * the terrain map is computed directly from a point cloud (without octree),
+ * the callback posts the cloud to the compute stage. The search areas are
+ * grouped by resolution in levels of detail, and every level has its own
+ * terrain grid and octree depth
  */
 class TerrainMapServer
 {
 	public:
-		/** @brief Constructor function */
-		TerrainMapServer(ros::NodeHandle node = ros::NodeHandle("~"));
+		/**
+		 * @brief Constructor function
+		 * @param ros::NodeHandle Private node handle (parameters and services)
+		 * @param ros::NodeHandle Node handle of the topics
+		 */
+		TerrainMapServer(ros::NodeHandle private_node = ros::NodeHandle("~"),
+						 ros::NodeHandle node = ros::NodeHandle());
 
 		/** @brief Destructor function */
 		~TerrainMapServer();
@@ -51,6 +84,20 @@ class TerrainMapServer
 		 */
 		void octomapCallback(const octomap_msgs::Octomap::ConstPtr& msg);
 
+		/**
+		 * @brief Callback function when it arrives the changes of the octomap,
+		 * i.e. a cloud of changed voxels with its log-odds update as intensity
+		 * @param const sensor_msgs::PointCloud2::ConstPtr& Octomap changes message
+		 */
+		void changesCallback(const sensor_msgs::PointCloud2::ConstPtr& msg);
+
+		/**
+		 * @brief Callback function when it arrives a point cloud, it's used
+		 * when the terrain map is computed without octree
+		 * @param const sensor_msgs::PointCloud2::ConstPtr& Point cloud message
+		 */
+		void cloudCallback(const sensor_msgs::PointCloud2::ConstPtr& msg);
+
 		/** @brief Resets the terrain map */
 		bool reset(std_srvs::Empty::Request& req,
 				   std_srvs::Empty::Response& resp);
@@ -59,27 +106,220 @@ class TerrainMapServer
 		bool getTerrainData(terrain_server::TerrainData::Request& req,
 							terrain_server::TerrainData::Response& res);
 
-		/** @brief Publishes a terrain map */
-		void publishTerrainMap();
+		/** @brief Gets the terrain data of a batch of positions */
+		bool getTerrainDataBatch(terrain_server::TerrainDataBatch::Request& req,
+								 terrain_server::TerrainDataBatch::Response& res);
+
+		/** @brief Gets the terrain data of a (oriented) rectangular region */
+		bool getTerrainRegion(terrain_server::TerrainRegion::Request& req,
+							  terrain_server::TerrainRegion::Response& res);
+
+		/** @brief Requests a keyframe of the terrain map updates */
+		bool resync(std_srvs::Empty::Request& req,
+					std_srvs::Empty::Response& resp);
+
+		/** @brief Gets the number of octomap frames that were computed */
+		unsigned long getNumberOfProcessedFrames() const;
+
+		/** @brief Gets the number of stale octomap frames that were dropped */
+		unsigned long getNumberOfDroppedFrames() const;
 
 
 	private:
+		/** @brief Octree deserialized from an octomap message */
+		struct OctreeFrame
+		{
+			OctreeFrame() : octree(NULL) {}
+
+			OctomapReader reader;
+			octomap::OcTree* octree;
+			ros::Time stamp;
+		};
+
+		/** @brief Resolution level of a snapshot of the terrain map */
+		struct SnapshotLevel
+		{
+			TerrainGrid grid;
+			dwl::environment::SpaceDiscretization discretization;
+			double plane_resolution;
+			double height_resolution;
+		};
+
+		/** @brief Snapshot of the terrain map computed at a certain time, its
+		 * levels go from the finest to the coarsest resolution */
+		struct TerrainSnapshot
+		{
+			std::vector<SnapshotLevel> level;
+			ros::Time stamp;
+
+			/** @brief Cells (keys) of the finest level whose terrain data
+			 * changed or that were removed since the previous snapshot, and if
+			 * every cell could have changed (e.g. after a reset) */
+			std::vector<std::pair<unsigned short, unsigned short> > updated_cells;
+			bool is_full_update;
+		};
+		typedef std::shared_ptr<TerrainSnapshot> TerrainSnapshotPtr;
+
+		/**
+		 * @brief Gets the latest snapshot of the terrain map, without waiting
+		 * for the computation of the terrain map
+		 * @return The snapshot, or NULL if there isn't a terrain map
+		 */
+		TerrainSnapshotPtr getLatestSnapshot() const;
+
+		/**
+		 * @brief Gets the cell index of a position in a snapshot, from the
+		 * finest level that has terrain data in this position
+		 * @param unsigned int& Index of the cell
+		 * @param const TerrainGrid*& Grid of the level of the cell
+		 * @param const TerrainSnapshot& Snapshot of the terrain map
+		 * @param double Position along the x-axis
+		 * @param double Position along the y-axis
+		 * @return Returns false if there isn't terrain data
+		 */
+		bool getCellIndex(unsigned int& index,
+						  const TerrainGrid*& grid,
+						  const TerrainSnapshot& snapshot,
+						  double x, double y) const;
+
+		/**
+		 * @brief Adds the enabled features to the terrain mapping of a level
+		 * @param TerrainMapping& Terrain mapping of the level
+		 */
+		void addFeatures(TerrainMapping& terrain_map);
+
+		/** @brief Deserializes the latest octomap message (pipeline stage) */
+		void deserializeLoop();
+
+		/** @brief Computes the terrain map of the latest octree (pipeline stage) */
+		void computeLoop();
+
+		/**
+		 * @brief Indicates if the octomap is older than the last reset
+		 * @param const ros::Time& Time of the octomap
+		 */
+		bool isBeforeReset(const ros::Time& stamp);
+
+		/** @brief Publishes the latest terrain map snapshot (pipeline stage) */
+		void publishLoop();
+
+		/** @brief Stops and joins the threads of the pipeline */
+		void stopPipeline();
+
+		/**
+		 * @brief Computes the terrain map given the robot state at a certain
+		 * time, and posts its snapshot to the publish stage
+		 * @param octomap::OcTree* The model of the environment
+		 * @param const ros::Time& Time of the robot state
+		 */
+		void computeTerrainMap(octomap::OcTree* octomap,
+							   const ros::Time& stamp);
+
+		/**
+		 * @brief Computes the terrain map from a point cloud given the robot
+		 * state at its time, and posts its snapshot to the publish stage
+		 * @param const sensor_msgs::PointCloud2& Point cloud message
+		 */
+		void computeTerrainMap(const sensor_msgs::PointCloud2& msg);
+
+		/**
+		 * @brief Gets the robot state (3D position and yaw angle) at a certain time
+		 * @param Eigen::Vector4d& Robot state
+		 * @param const ros::Time& Time of the robot state
+		 * @return Returns false if the transformation isn't available
+		 */
+		bool getRobotState(Eigen::Vector4d& robot_state,
+						   const ros::Time& stamp);
+
+		/**
+		 * @brief Takes a snapshot of the terrain map, and posts it to the
+		 * publish stage
+		 * @param const ros::Time& Time of the terrain map
+		 */
+		void postSnapshot(const ros::Time& stamp);
+
+		/**
+		 * @brief Applies the pending changes of the octomap to the octree
+		 * @param octomap::OcTree* The persistent octree
+		 * @return The time of the latest change
+		 */
+		ros::Time applyChanges(octomap::OcTree* octree);
+
+		/**
+		 * @brief Publishes a terrain map
+		 * @param const TerrainSnapshot& Snapshot of the terrain map
+		 */
+		void publishTerrainMap(const TerrainSnapshot& snapshot);
+
+		/**
+		 * @brief Publishes a dense terrain map, i.e. the grid with quantized layers
+		 * @param const TerrainSnapshot& Snapshot of the terrain map
+		 */
+		void publishDenseTerrainMap(const TerrainSnapshot& snapshot);
+
+		/**
+		 * @brief Publishes the update of the terrain map, i.e. the inserted,
+		 * modified and evicted cells since the previous update, or a keyframe
+		 * @param const TerrainSnapshot& Snapshot of the terrain map
+		 */
+		void publishTerrainMapUpdate(const TerrainSnapshot& snapshot);
+
+		/**
+		 * @brief Writes the terrain map into the shared memory
+		 * @param const TerrainSnapshot& Snapshot of the terrain map
+		 */
+		void writeSharedTerrainMap(const TerrainSnapshot& snapshot);
+
+		/** @brief Publishes a keyframe of the latest terrain map */
+		void publishKeyframe();
+
+		/**
+		 * @brief Publishes the statistics of the hot paths, and starts a new
+		 * window of them
+		 * @param const ros::TimerEvent& Timer event
+		 */
+		void publishStatistics(const ros::TimerEvent& event);
+
+		/**
+		 * @brief Converts a grid cell into a terrain cell message
+		 * @param terrain_server::TerrainCell& Terrain cell message
+		 * @param const TerrainGrid& Terrain grid
+		 * @param unsigned int Index of the cell
+		 */
+		void convertTerrainCell(terrain_server::TerrainCell& cell,
+								const TerrainGrid& grid,
+								unsigned int index) const;
+
+		/** @brief Returns an octree frame to the free frames */
+		void releaseFrame(OctreeFrame* frame);
+
+		/**
+		 * @brief Wakes up a stage of the pipeline
+		 * @param std::mutex& Mutex of the stage
+		 * @param std::condition_variable& Condition of the stage
+		 */
+		void notifyStage(std::mutex& mutex,
+						 std::condition_variable& condition);
+
 		/** @brief ROS node handle */
 		ros::NodeHandle node_;
 
 		/** @brief Private ROS node handle */
 		ros::NodeHandle private_node_;
 
-		/** @brief Pointer to the terrain mapping class */
-		terrain_server::TerrainMapping terrain_map_;
+		/** @brief Terrain mapping per level of detail, from the finest to the
+		 * coarsest resolution */
+		std::vector<std::unique_ptr<TerrainMapping> > terrain_levels_;
 
 		/**
 		 *  @brief Object of the SpaceDiscretization class for defining the
 		 *  conversion routines for the terrain cost-map */
 		dwl::environment::SpaceDiscretization terrain_discretization_;
 
-		/** @brief Terrain map publisher */
+		/** @brief Terrain map publishers */
 		ros::Publisher map_pub_;
+		ros::Publisher dense_map_pub_;
+		ros::Publisher update_pub_;
 
 		/** @brief Octomap subscriber */
 		message_filters::Subscriber<octomap_msgs::Octomap>* octomap_sub_;
@@ -87,14 +327,33 @@ class TerrainMapServer
 		/** @brief TF and octomap subscriber */
 		tf::MessageFilter<octomap_msgs::Octomap>* tf_octomap_sub_;
 
+		/** @brief Octomap changes subscriber */
+		message_filters::Subscriber<sensor_msgs::PointCloud2>* changes_sub_;
+
+		/** @brief TF and octomap changes subscriber */
+		tf::MessageFilter<sensor_msgs::PointCloud2>* tf_changes_sub_;
+
+		/** @brief Point cloud subscriber */
+		message_filters::Subscriber<sensor_msgs::PointCloud2>* cloud_sub_;
+
+		/** @brief TF and point cloud subscriber */
+		tf::MessageFilter<sensor_msgs::PointCloud2>* tf_cloud_sub_;
+
 		/** @brief Reset service */
 		ros::ServiceServer reset_srv_;
 
-		/** @bief Get the terrain data service */
+		/** @bief Get the terrain data services */
 		ros::ServiceServer terrain_data_srv_;
+		ros::ServiceServer terrain_batch_srv_;
+		ros::ServiceServer terrain_region_srv_;
 
-		/** @brief Terrain map message */
+		/** @brief Resync service of the terrain map updates */
+		ros::ServiceServer resync_srv_;
+
+		/** @brief Terrain map messages */
 		terrain_server::TerrainMap map_msg_;
+		terrain_server::DenseTerrainMap dense_map_msg_;
+		terrain_server::TerrainMapUpdate update_msg_;
 
 		/** @brief TF listener */
 		tf::TransformListener tf_listener_;
@@ -106,7 +365,101 @@ class TerrainMapServer
 		std::string world_frame_;
 
 		/** @brief Indicates if it was computed an initial terrain map */
-		bool initial_map_;
+		std::atomic<bool> initial_map_;
+
+		/** @brief Indicates if the octomap is updated from its changes */
+		bool incremental_update_;
+
+		/** @brief Indicates if the terrain map is computed from point clouds */
+		bool is_point_cloud_;
+
+		/** @brief Point cloud in the sensor frame and in the world frame */
+		pcl::PointCloud<pcl::PointXYZ> cloud_;
+		TerrainMapping::PointCloud points_;
+
+		/** @brief Number of recycled octrees (computing, waiting and reading) */
+		static const unsigned int NUM_OCTREE_FRAMES = 3;
+
+		/** @brief Octrees of the pipeline and the free ones */
+		OctreeFrame octree_frames_[NUM_OCTREE_FRAMES];
+		std::vector<OctreeFrame*> free_frames_;
+		std::mutex frames_mutex_;
+
+		/** @brief Persistent octree used in the incremental mode (compute stage) */
+		OctreeFrame* persistent_frame_;
+
+		/** @brief Time of the last reset (the older octomaps are dropped) and
+		 * indicates if the initial octomap of the incremental mode was read
+		 * since then. The mutex also serializes the (un)subscriptions */
+		ros::Time reset_stamp_;
+		bool is_initial_octree_;
+		std::mutex reset_mutex_;
+
+		/** @brief Horizontal reach of the octree data read by the terrain map
+		 * (0 until it's known), the octomaps are read only inside this reach */
+		std::atomic<double> octomap_reach_;
+
+		/** @brief Pending changes of the octomap (incremental mode) */
+		std::vector<sensor_msgs::PointCloud2::ConstPtr> pending_changes_;
+
+		/** @brief Latest-only mailboxes between the stages */
+		LatestMailbox<octomap_msgs::Octomap::ConstPtr> octomap_mailbox_;
+		LatestMailbox<sensor_msgs::PointCloud2::ConstPtr> cloud_mailbox_;
+		LatestMailbox<OctreeFrame> octree_mailbox_;
+		LatestMailbox<TerrainSnapshotPtr> snapshot_mailbox_;
+
+		/** @brief Threads, mutexes and conditions of the stages */
+		std::thread deserialize_thread_, compute_thread_, publish_thread_;
+		std::mutex deserialize_mutex_, compute_mutex_, publish_mutex_;
+		std::condition_variable deserialize_cond_, compute_cond_, publish_cond_;
+
+		/** @brief Latest snapshot (read by the services) and the recycled one */
+		TerrainSnapshotPtr latest_snapshot_;
+		TerrainSnapshotPtr spare_snapshot_;
+
+		/** @brief Indicates if the pipeline is stopped */
+		std::atomic<bool> is_stopped_;
+
+		/** @brief Indicates if a reset of the terrain map was requested */
+		std::atomic<bool> reset_request_;
+
+		/** @brief Indicates if the updates are published since there are
+		 * subscribers, otherwise the next update is a keyframe */
+		bool is_update_published_;
+
+		/** @brief Updated cells taken from the finest level (compute stage) */
+		std::vector<unsigned int> updated_indexes_;
+
+		/** @brief Sequence number of the latest update */
+		uint64_t update_sequence_;
+
+		/** @brief Number of updates between keyframes */
+		int keyframe_period_;
+
+		/** @brief Indicates if a keyframe was requested */
+		std::atomic<bool> keyframe_request_;
+
+		/** @brief Terrain map in the shared memory (same-host clients) */
+		SharedTerrainMap shared_map_;
+		std::string shared_memory_;
+		bool is_shared_memory_;
+
+		/** @brief Number of processed and dropped frames (octomaps or point clouds) */
+		std::atomic<unsigned long> processed_frames_;
+		std::atomic<unsigned long> dropped_frames_;
+
+		/** @brief Statistics of the hot paths, and its periodic publisher */
+		Statistics statistics_;
+		ros::Publisher statistics_pub_;
+		ros::Timer statistics_timer_;
+		terrain_server::ServerStatistics statistics_msg_;
+
+		/** @brief Timers and counters of the statistics */
+		unsigned int deserialize_timer_, tf_timer_, compute_timer_, snapshot_timer_;
+		unsigned int publish_map_timer_, publish_dense_timer_, publish_update_timer_;
+		unsigned int shared_map_timer_;
+		unsigned int octomap_bytes_counter_, map_bytes_counter_, dense_bytes_counter_;
+		unsigned int update_bytes_counter_, cloud_points_counter_, octree_nodes_counter_;
 };
 
 } //@namespace terrain_server
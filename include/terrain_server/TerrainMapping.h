@@ -6,6 +6,16 @@
 #include <dwl/utils/utils.h>
 
 #include <octomap/octomap.h>
+#include <mutex>
+#include <terrain_server/TerrainGrid.h>
+#include <terrain_server/InterestRegion.h>
+#include <terrain_server/IntegralHeightMap.h>
+#include <terrain_server/IntegralMomentMap.h>
+#include <terrain_server/SurfaceExtraction.h>
+#include <terrain_server/OccupancyPatch.h>
+#include <terrain_server/ThreadPool.h>
+#include <terrain_server/Statistics.h>
+#include <terrain_server/feature/BatchFeature.h>
 
 
 namespace terrain_server
@@ -18,6 +28,24 @@ namespace terrain_server
 class TerrainMapping : public dwl::environment::TerrainMap
 {
 	public:
+		/** @brief Methods for estimating the normal and curvature of the cells */
+		enum NormalEstimation {
+			OCTREE_NEIGHBORS, // Plane fitted to the occupied neighbors in the octomap
+			INTEGRAL_MOMENTS  // Plane fitted to the surface points from moment images
+		};
+
+		/**
+		 * @brief Methods for fusing the points of the clouds into a cell. The
+		 * points are fused over the frames until the cell is removed
+		 */
+		enum HeightFusion {
+			MAX_HEIGHT, // Highest point of the cell within the decay time
+			MEAN_HEIGHT // Running mean height of the points of the cell
+		};
+
+		/** @brief Point cloud in the world frame */
+		typedef std::vector<Eigen::Vector3f> PointCloud;
+
 		/** @brief Constructor function */
 		TerrainMapping();
 
@@ -25,7 +53,10 @@ class TerrainMapping : public dwl::environment::TerrainMap
 		~TerrainMapping();
 
 		/**
-		 * @brief Adds a feature of the terrain map
+		 * @brief Adds a feature of the terrain map. A feature without the
+		 * batch interface (see feature::BatchFeature) computes the cost per
+		 * cell. It isn't called concurrently, and it reads the heights of the
+		 * grid from the height map of the terrain information
 		 * @param Feature* the pointer of the feature to add
 		 */
 		void addFeature(dwl::environment::Feature* feature);
@@ -38,7 +69,9 @@ class TerrainMapping : public dwl::environment::TerrainMap
 
 		/**
 		 * @brief Abstract method for computing the terrain map according
-		 * the robot position and model of the terrain
+		 * the robot position and model of the terrain. The octree is queried
+		 * at the depth whose voxels match the resolution of the grid, so a
+		 * coarse grid reads the inner nodes instead of the leafs
 		 * @param octomap::OcTree* The model of the environment
 		 * @param const Eigen::Vector4d& The position of the robot and the yaw angle
 		 */
@@ -46,22 +79,123 @@ class TerrainMapping : public dwl::environment::TerrainMap
 					 const Eigen::Vector4d& robot_state);
 
 		/**
-		 * @brief Computes the terrain data given the voxel map
-		 * and the key of the topmost cell of a certain position of the grid
+		 * @brief Computes the terrain map from a point cloud, without an
+		 * octree. The points inside the search areas are fused into the
+		 * heights of the cells, and the normals are estimated from the moment
+		 * images
+		 * @param const PointCloud& Points in the world frame
+		 * @param const Eigen::Vector4d& The position of the robot and the yaw angle
+		 * @param double Time of the point cloud in seconds
+		 */
+		void compute(const PointCloud& cloud,
+					 const Eigen::Vector4d& robot_state,
+					 double time);
+
+		/**
+		 * @brief Computes the terrain data (position, normal and curvature)
+		 * given the voxel map and the key of the topmost cell of a certain
+		 * position of the grid
 		 * @param octomap::OcTree* Pointer to the octomap model of the environment
 		 * @param const octomap::OcTreeKey& The key of the topmost cell of a
 		 * certain position of the grid
+		 * @param dwl::Terrain& Terrain information used by the calling thread
+		 * @return Returns false if the surface couldn't be fitted
+		 */
+		bool computeTerrainData(octomap::OcTree* octomap,
+								const octomap::OcTreeKey& heightmap_key,
+								dwl::Terrain& terrain_info);
+
+		/**
+		 * @brief Computes the terrain data (position, normal and curvature)
+		 * from the integral moment images of the surface points
+		 * @param const Eigen::Vector3d& Position of the topmost cell of a certain
+		 * position of the grid
+		 * @param dwl::Terrain& Terrain information used by the calling thread
+		 * @return Returns false if the surface couldn't be fitted
+		 */
+		bool computeTerrainDataFromMoments(const Eigen::Vector3d& heightmap_position,
+										   dwl::Terrain& terrain_info);
+
+		/**
+		 * @brief Computes the total (weighted) cost of the features for a
+		 * batch of cells
+		 * @param feature::TerrainBatch& Batch of cells
 		 */
-		void computeTerrainData(octomap::OcTree* octomap,
-								const octomap::OcTreeKey& heightmap_key);
+		void computeTerrainCost(feature::TerrainBatch& batch);
 
 		/**
-		 * @brief Removes terrain values outside the interest region
+		 * @brief Removes terrain values outside the interest region. Every row
+		 * of the grid is cropped to its range inside the region, so only the
+		 * cells that leave it are visited
 		 * @param const Eigen::Vector3d& State of the robot, i.e. 3D position
 		 * and yaw orientation
 		 */
 		void removeTerrainOutsideInterestRegion(const Eigen::Vector3d& robot_state);
 
+		/**
+		 * @brief Gets the horizontal reach of the octree data read around the
+		 * robot, i.e. the reach of the search areas plus the neighbors of the
+		 * cells whose terrain data is recomputed
+		 * @param double Resolution of the octomap
+		 * @return The radius around the robot
+		 */
+		double getOctomapReach(double octomap_resolution);
+
+		/**
+		 * @brief Enables the incremental update of the terrain map. In this
+		 * mode the octomap is persistent between calls to compute(), so the
+		 * surface is searched only on the columns that weren't scanned before
+		 * or that changed (see addChangedColumn())
+		 * @param bool Incremental update status
+		 */
+		void setIncrementalUpdate(bool incremental);
+
+		/**
+		 * @brief Adds a column that changed in the persistent octomap, it's
+		 * used in the next computation of the terrain map
+		 * @param double Cartesian position along the x-axis
+		 * @param double Cartesian position along the y-axis
+		 */
+		void addChangedColumn(double x,
+							  double y);
+
+		/**
+		 * @brief Sets the radius of the area used by the features. The terrain
+		 * data is recomputed inside this radius (or the neighboring area) around
+		 * the cells that changed
+		 * @param double Radius of the features
+		 */
+		void setFeatureRadius(double radius);
+
+		/**
+		 * @brief Sets the method for fusing the points of a cloud into a cell
+		 * @param HeightFusion Method of fusion
+		 */
+		void setHeightFusion(HeightFusion fusion);
+
+		/**
+		 * @brief Sets the time after which a cell that isn't observed in the
+		 * point clouds is removed
+		 * @param double Decay time in seconds (0 for keeping the cells)
+		 */
+		void setHeightDecay(double decay_time);
+
+		/**
+		 * @brief Sets the number of threads used for computing the terrain map
+		 * @param unsigned int Number of threads
+		 */
+		void setNumberOfThreads(unsigned int num_threads);
+
+		/**
+		 * @brief Sets the statistics of the hot paths, the timers and counters
+		 * of the terrain mapping are added to them. The terrain data and
+		 * features timers are the time summed over the threads
+		 * @param Statistics* Statistics (NULL for disabling them)
+		 * @param const std::string& Prefix of the names of the metrics
+		 */
+		void setStatistics(Statistics* statistics,
+						   const std::string& name = "terrain_mapping");
+
 		/**
 		 * @brief Sets a interest region
 		 * @param double Radius along the x-axis
@@ -79,11 +213,13 @@ class TerrainMapping : public dwl::environment::TerrainMap
 		 * @param double Minimum Cartesian position along the z-axis
 		 * @param double Maximum Cartesian position along the z-axis
 		 * @param double Resolution of the grid
+		 * @param NormalEstimation Method for estimating the normal of the cells
 		 */
 		void addSearchArea(double min_x, double max_x,
 						   double min_y, double max_y,
 						   double min_z, double max_z,
-						   double grid_size);
+						   double grid_size,
+						   NormalEstimation normal_estimation = OCTREE_NEIGHBORS);
 
 		/**
 		 * @brief Sets the neighboring area for computing physical properties
@@ -99,11 +235,172 @@ class TerrainMapping : public dwl::environment::TerrainMap
 								int left_neighbors, int right_neighbors,
 								int bottom_neighbors, int top_neighbors);
 
+		/** @brief Resets the terrain map */
+		void reset();
+
+		/**
+		 * @brief Gets the terrain data of a certain position
+		 * @param dwl::TerrainCell& Terrain cell
+		 * @param const Eigen::Vector2d& Cartesian position
+		 * @return Returns false if there isn't terrain data in this position
+		 */
+		bool getTerrainData(dwl::TerrainCell& cell,
+							const Eigen::Vector2d& position) const;
+
+		/** @brief Gets the robot-centric terrain grid */
+		const TerrainGrid& getTerrainGrid() const;
+
+		/**
+		 * @brief Sets if the terrain grid records the cells whose terrain
+		 * data changed or that were removed
+		 * @param bool Tracking status
+		 */
+		void setUpdateTracking(bool tracking);
+
+		/**
+		 * @brief Takes the updated cells of the terrain grid since the
+		 * previous call (see TerrainGrid::takeUpdatedCells())
+		 * @param std::vector<unsigned int>& Indexes of the updated cells
+		 * @return Returns false if every cell could have changed
+		 */
+		bool takeUpdatedCells(std::vector<unsigned int>& indexes);
+
+		/**
+		 * @brief Gets the integral height map of the terrain grid. It's
+		 * computed before the terrain data of the cells, so features can read it
+		 */
+		const IntegralHeightMap& getIntegralHeightMap() const;
+
+		/** @brief Gets the number of cells whose terrain data was computed in
+		 * the last computation */
+		unsigned int getNumberOfComputedCells() const;
+
 
 	private:
+		/**
+		 * @brief Allocates the terrain grid, it covers the interest region
+		 * (or the search areas when the interest region is unbounded)
+		 */
+		void resizeGrid();
+
+		/**
+		 * @brief Adds the default search area if there isn't one, and moves the
+		 * terrain grid with the robot
+		 * @param const Eigen::Vector4d& The position of the robot and the yaw angle
+		 */
+		void prepareGrid(const Eigen::Vector4d& robot_state);
+
+		/**
+		 * @brief Rasterizes the search areas into the cells of the grid,
+		 * relative to the cell of the robot. The raster of the previous yaw
+		 * is reused while its farthest cell moves less than half a cell
+		 * @param double Yaw angle of the robot
+		 */
+		void rasterizeSearchAreas(double yaw);
+
+		/**
+		 * @brief Fuses the points of a cloud into the heights of the cells
+		 * @param const PointCloud& Points in the world frame
+		 * @param const Eigen::Vector4d& The position of the robot and the yaw angle
+		 * @param double Time of the point cloud in seconds
+		 */
+		void fuseCloud(const PointCloud& cloud,
+					   const Eigen::Vector4d& robot_state,
+					   double time);
+
+		/**
+		 * @brief Computes the terrain data and features of the cells around the
+		 * cells that changed
+		 * @param octomap::OcTree* The model of the environment (NULL if there
+		 * isn't an octree)
+		 * @param double Size of the voxels of the environment
+		 */
+		void computeTerrain(octomap::OcTree* octomap,
+							double voxel_size);
+
+		/** @brief Column of the octomap that has to be scanned */
+		struct ScanColumn
+		{
+			ScanColumn(octomap::key_type x, octomap::key_type y,
+					   unsigned int i) : key_x(x), key_y(y), index(i) {}
+
+			octomap::key_type key_x;
+			octomap::key_type key_y;
+			unsigned int index;
+		};
+
+		/** @brief Cell of the rasterized search areas (offsets with respect to
+		 * the cell of the robot) */
+		struct RasterCell
+		{
+			RasterCell(int x, int y) : offset_x(x), offset_y(y) {}
+
+			int offset_x;
+			int offset_y;
+		};
+
+		/** @brief Bounding box of the raster of a search area */
+		struct RasterBox
+		{
+			int min_x, min_y;
+			int max_x, max_y;
+		};
+
+		/** @brief Cell of the grid whose terrain data has to be computed */
+		struct DirtyCell
+		{
+			DirtyCell(unsigned int i, const octomap::OcTreeKey& key,
+					  const octomap::point3d& point) :
+				index(i), heightmap_key(key), position(point) {}
+
+			unsigned int index;
+			octomap::OcTreeKey heightmap_key;
+			octomap::point3d position;
+		};
+
+		/** @brief Robot-centric grid that stores the terrain cells */
+		TerrainGrid grid_;
+
+		/** @brief Indicates if the terrain grid has the current dimensions */
+		bool is_resized_grid_;
+
+		/** @brief Integral height map of the terrain grid, and if it has to be
+		 * fully recomputed, i.e. if cells were removed without changing */
+		IntegralHeightMap height_map_;
+		bool is_height_map_stale_;
+
+		/** @brief Integral moment images of the surface points */
+		IntegralMomentMap moment_map_;
+
+		/** @brief Radius (in cells) of the square used by the moment images */
+		int moment_radius_;
+
+		/** @brief Surface (topmost occupied voxels) of the search area */
+		SurfaceExtraction surface_;
+
+		/** @brief Occupancy of the octree neighbors of the dirty cells */
+		OccupancyPatch patch_;
+
+		/** @brief Cells whose terrain data has to be computed, and their
+		 * indexes in the grid */
+		std::vector<DirtyCell> terrain_cells_;
+		std::vector<unsigned int> dirty_cells_;
+
+		/** @brief Pool of threads that computes the tiles of the terrain map */
+		ThreadPool pool_;
+
 		/** @brief Vector of pointers to the Feature class */
 		std::vector<dwl::environment::Feature*> features_;
 
+		/** @brief Batch interface of the features (NULL if they don't have it) */
+		std::vector<feature::BatchFeature*> batch_features_;
+
+		/** @brief Serializes the per-cell features, they aren't known to be thread-safe */
+		std::mutex cell_feature_mutex_;
+
+		/** @brief Batch of cells per thread */
+		std::vector<feature::TerrainBatch> thread_batch_;
+
 		/** @brief Terrain information */
 		dwl::Terrain terrain_info_;
 
@@ -119,6 +416,9 @@ class TerrainMapping : public dwl::environment::TerrainMap
 		/** @brief Vector of search areas */
 		std::vector<dwl::SearchArea> search_areas_;
 
+		/** @brief Method for estimating the normal of the cells of each search area */
+		std::vector<NormalEstimation> normal_estimation_;
+
 		/** @brief Object of the NeighboringArea struct that defines the
 		 *  neighboring area */
 		dwl::NeighboringArea neighboring_area_;
@@ -126,8 +426,88 @@ class TerrainMapping : public dwl::environment::TerrainMap
 		/** @brief Defines if it is using the mean of the cloud */
 		bool using_cloud_mean_;
 
-		/** @brief Depth of the octomap */
+		/** @brief Depth of the octomap queries, it's the depth whose voxels
+		 * have the resolution of the grid */
 		int depth_;
+
+		/** @brief Number of keys (of the leafs) per voxel of the query depth */
+		int key_step_;
+
+		/** @brief Indicates if the octomap is updated incrementally */
+		bool incremental_update_;
+
+		/** @brief Height of the robot when the columns were scanned */
+		double scan_height_;
+
+		/** @brief Radius of the area used by the features */
+		double feature_radius_;
+
+		/** @brief Columns (terrain keys) that changed in the octomap */
+		std::vector<std::pair<unsigned short, unsigned short> > changed_columns_;
+
+		/** @brief Columns that are scanned in the current search area */
+		std::vector<ScanColumn> scan_columns_;
+
+		/** @brief Cells scanned in the last computation of the full-octomap
+		 * mode, they are scanned again in the next one */
+		std::vector<unsigned int> scanned_cells_;
+
+		/** @brief Cells and bounding box of the raster of every search area */
+		std::vector<std::vector<RasterCell> > raster_cells_;
+		std::vector<RasterBox> raster_boxes_;
+
+		/** @brief Marks of the rasterized cells (deduplication of the areas) */
+		std::vector<unsigned char> raster_mask_;
+
+		/** @brief Indicates if the raster is valid, and its yaw, resolution
+		 * and reach */
+		bool is_rasterized_;
+		double raster_yaw_;
+		double raster_resolution_;
+		double raster_reach_;
+
+		/** @brief Cells whose surface changed in the current computation */
+		std::vector<unsigned int> changed_cells_;
+
+		/** @brief Method for fusing the points of a cloud into a cell */
+		HeightFusion height_fusion_;
+
+		/** @brief Time after which a cell that isn't observed is removed */
+		double decay_time_;
+
+		/** @brief Fused height and number of points per cell of the cloud */
+		std::vector<float> column_height_;
+		std::vector<unsigned int> column_count_;
+
+		/**
+		 * @brief Height fused over the frames per cell, its number of points
+		 * (mean) and the time it was reached (max)
+		 */
+		std::vector<float> cell_height_;
+		std::vector<unsigned int> cell_count_;
+		std::vector<double> cell_height_time_;
+
+		/** @brief Cells observed in the current point cloud */
+		std::vector<unsigned int> fused_cells_;
+
+		/** @brief Time of the last observation per cell */
+		std::vector<double> cell_time_;
+
+		/** @brief Statistics of the hot paths (NULL if they aren't recorded) */
+		Statistics* statistics_;
+
+		/** @brief Timers and counters of the statistics */
+		unsigned int eviction_timer_, column_scan_timer_, height_map_timer_;
+		unsigned int patch_timer_, terrain_data_timer_, features_timer_;
+		unsigned int scanned_counter_, search_counter_, recomputed_counter_;
+		unsigned int evicted_counter_, height_fusion_timer_, fused_counter_;
+
+		/** @brief Number of octree searches of the neighbors outside the patch */
+		std::atomic<unsigned long> octree_searches_;
+
+		/** @brief Time of the terrain data and features per thread */
+		std::vector<double> thread_data_time_;
+		std::vector<double> thread_feature_time_;
 };
 
 } //@namespace terrain_server
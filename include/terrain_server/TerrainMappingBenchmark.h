@@ -0,0 +1,116 @@
+#ifndef TERRAIN_SERVER__TERRAIN_MAPPING_BENCHMARK__H
+#define TERRAIN_SERVER__TERRAIN_MAPPING_BENCHMARK__H
+
+#include <terrain_server/TerrainMapping.h>
+#include <terrain_server/Statistics.h>
+#include <string>
+#include <vector>
+
+
+namespace terrain_server
+{
+
+/**
+ * @class TerrainMappingBenchmark
+ * @brief Offline replay of the terrain mapping, it doesn't need a ROS master.
+ * The octree is loaded from a binary octomap (.bt) or it's generated from the
+ * rectangles of a flat terrain scene (the launch files of default_flat_terrain).
+ * Then, the terrain map is computed along a trajectory of the robot, and the
+ * latency percentiles, the computed cells per second and the peak memory are
+ * reported
+ */
+class TerrainMappingBenchmark
+{
+	public:
+		/** @brief Constructor function */
+		TerrainMappingBenchmark();
+
+		/** @brief Destructor function */
+		~TerrainMappingBenchmark();
+
+		/**
+		 * @brief Loads the octree of a scene, i.e. a binary octomap (.bt) or
+		 * a launch file of a flat terrain
+		 * @param const std::string& File of the scene
+		 * @param double Resolution of the generated octree
+		 * @return Returns false if the scene couldn't be loaded
+		 */
+		bool loadScene(const std::string& filename,
+					   double resolution);
+
+		/**
+		 * @brief Loads a trajectory of the robot, one pose (x y z yaw) per line
+		 * @param const std::string& File of the trajectory
+		 * @return Returns false if the trajectory couldn't be loaded
+		 */
+		bool loadTrajectory(const std::string& filename);
+
+		/**
+		 * @brief Generates a trajectory along the x-axis of the scene, the
+		 * robot keeps a nominal height above the surface
+		 * @param double Distance between consecutive poses
+		 * @param double Nominal height of the robot
+		 */
+		void generateTrajectory(double step,
+								double nominal_height);
+
+		/**
+		 * @brief Computes the terrain map for every pose of the trajectory,
+		 * and prints the report
+		 * @param TerrainMapping& Terrain mapping to benchmark
+		 * @param unsigned int Number of poses that aren't measured
+		 * @param Statistics& Statistics of the stages of the terrain mapping
+		 * @return Returns false if there isn't a scene or a trajectory
+		 */
+		bool run(TerrainMapping& terrain_mapping,
+				 unsigned int warmup,
+				 Statistics& statistics);
+
+
+	private:
+		/** @brief Rectangle of a flat terrain scene */
+		struct Rectangle
+		{
+			Rectangle() : center_x(0.), center_y(0.), width(0.), length(0.),
+					yaw(0.), resolution(0.), height(0.) {}
+
+			double center_x;
+			double center_y;
+			double width;
+			double length;
+			double yaw;
+			double resolution;
+			double height;
+		};
+
+		/**
+		 * @brief Generates the octree from the rectangles of a launch file
+		 * @param const std::string& Launch file of the scene
+		 * @param double Resolution of the octree
+		 * @return Returns false if there aren't rectangles
+		 */
+		bool generateScene(const std::string& filename,
+						   double resolution);
+
+		/**
+		 * @brief Gets the height of the topmost occupied voxel of a column
+		 * @param double& Height of the surface
+		 * @param double Cartesian position along the x-axis
+		 * @param double Cartesian position along the y-axis
+		 * @return Returns false if the column is empty
+		 */
+		bool getSurfaceHeight(double& height,
+							  double x,
+							  double y) const;
+
+		/** @brief Octree of the scene */
+		octomap::OcTree* octree_;
+
+		/** @brief Poses of the robot (position and yaw angle) */
+		std::vector<Eigen::Vector4d,
+				Eigen::aligned_allocator<Eigen::Vector4d> > trajectory_;
+};
+
+} //@namespace terrain_server
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef TERRAIN_SERVER__THREAD_POOL__H
+#define TERRAIN_SERVER__THREAD_POOL__H
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+
+namespace terrain_server
+{
+
+/**
+ * @class ThreadPool
+ * @brief Persistent pool of threads that runs sets of indexed tasks. Every
+ * thread owns a queue of tasks, and it steals tasks from the back of the other
+ * queues when its own queue is empty. The calling thread also runs tasks
+ */
+class ThreadPool
+{
+	public:
+		/** @brief Function of a task, it receives the task and thread indexes */
+		typedef std::function<void(unsigned int, unsigned int)> Task;
+
+		/** @brief Constructor function */
+		ThreadPool();
+
+		/** @brief Destructor function */
+		~ThreadPool();
+
+		/**
+		 * @brief Sets the number of threads, including the calling thread
+		 * @param unsigned int Number of threads
+		 */
+		void setNumberOfThreads(unsigned int num_threads);
+
+		/** @brief Gets the number of threads, including the calling thread */
+		unsigned int getNumberOfThreads() const;
+
+		/**
+		 * @brief Runs a set of tasks and waits until all of them are finished
+		 * @param unsigned int Number of tasks
+		 * @param const Task& Function of the tasks
+		 */
+		void run(unsigned int num_tasks,
+				 const Task& task);
+
+
+	private:
+		/** @brief Queue of tasks of a thread */
+		struct TaskQueue
+		{
+			std::mutex mutex;
+			std::deque<unsigned int> tasks;
+		};
+
+		/** @brief Stops and joins the worker threads */
+		void stop();
+
+		/**
+		 * @brief Loop of a worker thread
+		 * @param unsigned int Index of the thread
+		 */
+		void work(unsigned int thread);
+
+		/**
+		 * @brief Runs the available tasks from the own queue, and then the ones
+		 * stolen from the other queues
+		 * @param unsigned int Index of the thread
+		 */
+		void runTasks(unsigned int thread);
+
+		/**
+		 * @brief Pops a task from the own queue, or steals it from another queue
+		 * @param unsigned int& Index of the task
+		 * @param unsigned int Index of the thread
+		 * @return Returns false if all the queues are empty
+		 */
+		bool popTask(unsigned int& task,
+					 unsigned int thread);
+
+		/** @brief Worker threads */
+		std::vector<std::thread> threads_;
+
+		/** @brief Queues of tasks, one per thread */
+		std::vector<std::unique_ptr<TaskQueue> > queues_;
+
+		/** @brief Function of the current tasks */
+		Task task_;
+
+		/** @brief Number of tasks that aren't finished */
+		std::atomic<unsigned int> pending_tasks_;
+
+		/** @brief Synchronization of the start and end of a set of tasks */
+		std::mutex mutex_;
+		std::condition_variable start_cond_;
+		std::condition_variable done_cond_;
+
+		/** @brief Counter of the sets of tasks */
+		unsigned long generation_;
+
+		/** @brief Indicates if the worker threads have to stop */
+		bool is_stopped_;
+};
+
+} //@namespace terrain_server
+
+#endif
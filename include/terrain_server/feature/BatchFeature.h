@@ -0,0 +1,117 @@
+#ifndef TERRAIN_SERVER__FEATURE__BATCH_FEATURE__H
+#define TERRAIN_SERVER__FEATURE__BATCH_FEATURE__H
+
+#include <dwl/environment/Feature.h>
+#include <vector>
+
+
+namespace terrain_server
+{
+
+namespace feature
+{
+
+/**
+ * @struct TerrainBatch
+ * @brief Terrain information of a set of cells (e.g. a tile of the terrain grid)
+ * stored as structure of arrays, i.e. one contiguous span per quantity
+ */
+struct TerrainBatch
+{
+	TerrainBatch() : resolution(0.), min_height(0.) {}
+
+	/** @brief Removes all the cells of the batch */
+	void clear();
+
+	/**
+	 * @brief Adds a cell to the batch
+	 * @param unsigned int Index of the cell in the terrain grid
+	 * @param const dwl::Terrain& Terrain information of the cell
+	 */
+	void addCell(unsigned int index,
+				 const dwl::Terrain& terrain_info);
+
+	/** @brief Gets the number of cells of the batch */
+	unsigned int size() const;
+
+	/** @brief Index of the cells in the terrain grid */
+	std::vector<unsigned int> index;
+
+	/** @brief Position, surface normal and curvature of the cells */
+	std::vector<float> position_x, position_y, position_z;
+	std::vector<float> normal_x, normal_y, normal_z;
+	std::vector<float> curvature;
+
+	/** @brief Total (weighted) cost of the cells */
+	std::vector<float> cost;
+
+	/**
+	 * @brief Workspace of the features. It isn't cleared with the cells, so
+	 * its memory is reused by the next tiles of the thread
+	 */
+	std::vector<float> workspace;
+
+	/** @brief Resolution of the terrain and minimum height of the map */
+	double resolution;
+	double min_height;
+};
+
+
+/**
+ * @class BatchFeature
+ * @brief Abstract class of the features that compute the cost of a whole batch
+ * of cells in one pass. The cost is weighted and added to the total cost of the
+ * batch, so there isn't a virtual call per cell and feature
+ */
+class BatchFeature : public dwl::environment::Feature
+{
+	public:
+		/** @brief Destructor function */
+		virtual ~BatchFeature() {}
+
+		/**
+		 * @brief Adds the weighted cost of a batch of cells to its total cost
+		 * @param TerrainBatch& Batch of cells
+		 */
+		virtual void addWeightedCost(TerrainBatch& batch) = 0;
+};
+
+
+inline void TerrainBatch::clear()
+{
+	index.clear();
+	position_x.clear();
+	position_y.clear();
+	position_z.clear();
+	normal_x.clear();
+	normal_y.clear();
+	normal_z.clear();
+	curvature.clear();
+	cost.clear();
+}
+
+
+inline void TerrainBatch::addCell(unsigned int cell_index,
+								  const dwl::Terrain& terrain_info)
+{
+	index.push_back(cell_index);
+	position_x.push_back(terrain_info.position(0));
+	position_y.push_back(terrain_info.position(1));
+	position_z.push_back(terrain_info.position(2));
+	normal_x.push_back(terrain_info.surface_normal(0));
+	normal_y.push_back(terrain_info.surface_normal(1));
+	normal_z.push_back(terrain_info.surface_normal(2));
+	curvature.push_back(terrain_info.curvature);
+	cost.push_back(0.);
+}
+
+
+inline unsigned int TerrainBatch::size() const
+{
+	return index.size();
+}
+
+} //@namespace feature
+} //@namespace terrain_server
+
+#endif
@@ -1,7 +1,7 @@
 #ifndef TERRAIN_SERVER__FEATURE__CURVATURE_FEATURE__H
 #define TERRAIN_SERVER__FEATURE__CURVATURE_FEATURE__H
 
-#include <dwl/environment/Feature.h>
+#include <terrain_server/feature/BatchFeature.h>
 
 
 namespace terrain_server
@@ -14,7 +14,7 @@ namespace feature
  * @class CurvatureFeature
  * @brief Class for computing the cost value of the curvature feature
  */
-class CurvatureFeature : public dwl::environment::Feature
+class CurvatureFeature : public BatchFeature
 {
 	public:
 		/** @brief Constructor function */
@@ -31,6 +31,12 @@ class CurvatureFeature : public dwl::environment::Feature
 		void computeCost(double& cost_value,
 						 const dwl::Terrain& terrain_info);
 
+		/**
+		 * @brief Adds the weighted cost of a batch of cells to its total cost
+		 * @param TerrainBatch& Batch of cells
+		 */
+		void addWeightedCost(TerrainBatch& batch);
+
 	private:
 		/** @brief Threshold that specify the positive condition */
 		double positive_threshold_;
@@ -1,7 +1,8 @@
 #ifndef TERRAIN_SERVER__FEATURE__HEIGHT_DEVIATION_FEATURE__H
 #define TERRAIN_SERVER__FEATURE__HEIGHT_DEVIATION_FEATURE__H
 
-#include <dwl/environment/Feature.h>
+#include <terrain_server/feature/BatchFeature.h>
+#include <terrain_server/IntegralHeightMap.h>
 
 
 namespace terrain_server
@@ -12,9 +13,11 @@ namespace feature
 
 /**
  * @class HeightDeviationFeature
- * @brief Class for solving the reward value of a height deviation feature
+ * @brief Class for solving the reward value of a height deviation feature. The
+ * heights of the neighboring area are read from an integral height map, so the
+ * box sums of the average and estimated heights are computed in O(1)
  */
-class HeightDeviationFeature : public dwl::environment::Feature
+class HeightDeviationFeature : public BatchFeature
 {
 	public:
 		/** @brief Constructor function */
@@ -24,6 +27,13 @@ class HeightDeviationFeature : public dwl::environment::Feature
 		/** @brief Destructor function */
 		~HeightDeviationFeature();
 
+		/**
+		 * @brief Sets the integral height map used for computing the cost.
+		 * It has to be computed before the cost of the cells
+		 * @param const IntegralHeightMap* Integral height map
+		 */
+		void setIntegralHeightMap(const IntegralHeightMap* height_map);
+
 		/**
 		 * @brief Compute the cost value given a terrain information
 		 * @param double& Cost value
@@ -32,8 +42,38 @@ class HeightDeviationFeature : public dwl::environment::Feature
 		void computeCost(double& cost_value,
 						 const dwl::Terrain& terrain_info);
 
+		/**
+		 * @brief Adds the weighted cost of a batch of cells to its total cost
+		 * @param TerrainBatch& Batch of cells
+		 */
+		void addWeightedCost(TerrainBatch& batch);
+
 
 	private:
+		/**
+		 * @brief Computes the cell offsets of the samples of the neighboring area
+		 * @param std::vector<int>& Offsets along the x-axis
+		 * @param std::vector<int>& Offsets along the y-axis
+		 * @param double Resolution of the terrain
+		 */
+		void computeSampleOffsets(std::vector<int>& offset_x,
+								  std::vector<int>& offset_y,
+								  double terrain_resolution) const;
+
+		/**
+		 * @brief Computes the cost of a cell of the integral height map
+		 * @param int Coordinate of the cell along the x-axis
+		 * @param int Coordinate of the cell along the y-axis
+		 * @param double Minimum height of the terrain
+		 * @param const std::vector<int>& Sample offsets along the x-axis
+		 * @param const std::vector<int>& Sample offsets along the y-axis
+		 * @return The cost value of the cell
+		 */
+		double computeCellCost(int cell_x, int cell_y,
+							   double min_height,
+							   const std::vector<int>& offset_x,
+							   const std::vector<int>& offset_y) const;
+
 		/** @brief Flat height deviation */
 		double flat_height_deviation_;
 
@@ -42,6 +82,9 @@ class HeightDeviationFeature : public dwl::environment::Feature
 
 		/** @brief Minimum allowed height */
 		double min_allowed_height_;
+
+		/** @brief Integral height map of the terrain */
+		const IntegralHeightMap* height_map_;
 };
 
 } //@namespace feature
@@ -0,0 +1,168 @@
+#include <terrain_server/IntegralHeightMap.h>
+#include <algorithm>
+
+
+namespace terrain_server
+{
+
+IntegralHeightMap::IntegralHeightMap() : origin_key_x_(0), origin_key_y_(0),
+		size_x_(0), size_y_(0), changed_x_(0), changed_y_(0)
+{
+
+}
+
+
+IntegralHeightMap::~IntegralHeightMap()
+{
+
+}
+
+
+void IntegralHeightMap::compute(const TerrainGrid& grid)
+{
+	origin_key_x_ = grid.getOriginKeyX();
+	origin_key_y_ = grid.getOriginKeyY();
+	size_x_ = grid.getSizeX();
+	size_y_ = grid.getSizeY();
+
+	unsigned int num_cells = size_x_ * size_y_;
+	height_.resize(num_cells);
+	is_height_.resize(num_cells);
+	height_sum_.assign((size_x_ + 1) * (size_y_ + 1), 0.);
+	count_sum_.assign((size_x_ + 1) * (size_y_ + 1), 0);
+
+	// Unrolling the circular grid from its origin
+	int first_slot_x = origin_key_x_ % size_x_;
+	for (int y = 0; y < size_y_; y++) {
+		unsigned int slot_offset = ((origin_key_y_ + y) % size_y_) * size_x_;
+		int slot_x = first_slot_x;
+		for (int x = 0; x < size_x_; x++) {
+			unsigned int index = slot_offset + slot_x;
+			unsigned int cell = y * size_x_ + x;
+			if (grid.isHeight(index)) {
+				height_[cell] = grid.getHeight(index);
+				is_height_[cell] = 1;
+			} else
+				is_height_[cell] = 0;
+
+			if (++slot_x == size_x_)
+				slot_x = 0;
+		}
+	}
+
+	computeTables(0, 0);
+}
+
+
+void IntegralHeightMap::update(const TerrainGrid& grid,
+							   const std::vector<unsigned int>& indexes)
+{
+	if (height_sum_.empty() ||
+			grid.getOriginKeyX() != origin_key_x_ || grid.getOriginKeyY() != origin_key_y_ ||
+			(int) grid.getSizeX() != size_x_ || (int) grid.getSizeY() != size_y_) {
+		compute(grid);
+		return;
+	}
+
+	// Updating the changed cells of the height image. Note that the sums of
+	// the tables before their first row and column don't change
+	int first_x = size_x_, first_y = size_y_;
+	for (unsigned int i = 0; i < indexes.size(); i++) {
+		unsigned int index = indexes[i];
+		unsigned short key_x, key_y;
+		grid.getKey(key_x, key_y, index);
+		int x = (int) key_x - origin_key_x_;
+		int y = (int) key_y - origin_key_y_;
+		unsigned int cell = y * size_x_ + x;
+		if (grid.isHeight(index)) {
+			height_[cell] = grid.getHeight(index);
+			is_height_[cell] = 1;
+		} else
+			is_height_[cell] = 0;
+
+		first_x = std::min(first_x, x);
+		first_y = std::min(first_y, y);
+	}
+
+	computeTables(first_x, first_y);
+}
+
+
+void IntegralHeightMap::computeTables(int first_x, int first_y)
+{
+	changed_x_ = first_x;
+	changed_y_ = first_y;
+
+	// Computing the summed-area tables row by row. The sums of a row before
+	// the first column are read from the tables
+	int stride = size_x_ + 1;
+	for (int y = first_y; y < size_y_; y++) {
+		double* height_sum = &height_sum_[(y + 1) * stride + 1];
+		unsigned int* count_sum = &count_sum_[(y + 1) * stride + 1];
+		double row_height = height_sum[first_x - 1] - height_sum[first_x - 1 - stride];
+		unsigned int row_count = count_sum[first_x - 1] - count_sum[first_x - 1 - stride];
+		for (int x = first_x; x < size_x_; x++) {
+			unsigned int cell = y * size_x_ + x;
+			if (is_height_[cell]) {
+				row_height += height_[cell];
+				row_count++;
+			}
+
+			height_sum[x] = height_sum[x - stride] + row_height;
+			count_sum[x] = count_sum[x - stride] + row_count;
+		}
+	}
+}
+
+
+void IntegralHeightMap::getCoordinates(int& x, int& y,
+									   unsigned short key_x,
+									   unsigned short key_y) const
+{
+	x = (int) key_x - origin_key_x_;
+	y = (int) key_y - origin_key_y_;
+}
+
+
+bool IntegralHeightMap::getHeight(double& height,
+								  int x, int y) const
+{
+	if (x < 0 || x >= size_x_ || y < 0 || y >= size_y_)
+		return false;
+
+	unsigned int cell = y * size_x_ + x;
+	if (!is_height_[cell])
+		return false;
+
+	height = height_[cell];
+	return true;
+}
+
+
+void IntegralHeightMap::getBoxSum(double& height_sum,
+								  unsigned int& num_cells,
+								  int min_x, int min_y,
+								  int max_x, int max_y) const
+{
+	min_x = std::max(min_x, 0);
+	min_y = std::max(min_y, 0);
+	max_x = std::min(max_x, size_x_ - 1);
+	max_y = std::min(max_y, size_y_ - 1);
+	if (min_x > max_x || min_y > max_y) {
+		height_sum = 0.;
+		num_cells = 0;
+		return;
+	}
+
+	// Corners of the box in the summed-area tables
+	unsigned int stride = size_x_ + 1;
+	unsigned int a = min_y * stride + min_x;
+	unsigned int b = min_y * stride + max_x + 1;
+	unsigned int c = (max_y + 1) * stride + min_x;
+	unsigned int d = (max_y + 1) * stride + max_x + 1;
+
+	height_sum = height_sum_[d] - height_sum_[b] - height_sum_[c] + height_sum_[a];
+	num_cells = count_sum_[d] - count_sum_[b] - count_sum_[c] + count_sum_[a];
+}
+
+} //@namespace terrain_server
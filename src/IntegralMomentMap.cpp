@@ -0,0 +1,160 @@
+#include <terrain_server/IntegralMomentMap.h>
+#include <algorithm>
+
+
+namespace terrain_server
+{
+
+/** @brief Adds (or subtracts) the moments of a set of points */
+static inline void accumulateMoments(IntegralMomentMap::Moments& result,
+									 const IntegralMomentMap::Moments& moments,
+									 double sign)
+{
+	result.num_points += sign * moments.num_points;
+	result.x += sign * moments.x;
+	result.y += sign * moments.y;
+	result.z += sign * moments.z;
+	result.xx += sign * moments.xx;
+	result.xy += sign * moments.xy;
+	result.xz += sign * moments.xz;
+	result.yy += sign * moments.yy;
+	result.yz += sign * moments.yz;
+	result.zz += sign * moments.zz;
+}
+
+
+IntegralMomentMap::IntegralMomentMap() : size_x_(0), size_y_(0),
+		origin_key_x_(0), origin_key_y_(0), resolution_(0.)
+{
+
+}
+
+
+IntegralMomentMap::~IntegralMomentMap()
+{
+
+}
+
+
+void IntegralMomentMap::compute(const IntegralHeightMap& height_map,
+								double resolution)
+{
+	// Recomputing the tables after the changed corner of the height map, or
+	// all of them if the height map moved
+	int first_x, first_y;
+	height_map.getChangedCorner(first_x, first_y);
+	if (moments_.empty() || height_map.getSizeX() != size_x_ ||
+			height_map.getSizeY() != size_y_ ||
+			height_map.getOriginKeyX() != origin_key_x_ ||
+			height_map.getOriginKeyY() != origin_key_y_ ||
+			resolution != resolution_) {
+		size_x_ = height_map.getSizeX();
+		size_y_ = height_map.getSizeY();
+		origin_key_x_ = height_map.getOriginKeyX();
+		origin_key_y_ = height_map.getOriginKeyY();
+		resolution_ = resolution;
+		moments_.assign((size_x_ + 1) * (size_y_ + 1), Moments());
+		first_x = first_y = 0;
+	}
+
+	// The moments of a row before the first column are read from the table
+	int stride = size_x_ + 1;
+	for (int y = first_y; y < size_y_; y++) {
+		Moments* moments = &moments_[(y + 1) * stride + 1];
+		Moments row = moments[first_x - 1];
+		accumulateMoments(row, moments[first_x - 1 - stride], -1.);
+		double point_y = y * resolution;
+		for (int x = first_x; x < size_x_; x++) {
+			double point_z;
+			if (height_map.getHeight(point_z, x, y)) {
+				double point_x = x * resolution;
+				row.num_points += 1.;
+				row.x += point_x;
+				row.y += point_y;
+				row.z += point_z;
+				row.xx += point_x * point_x;
+				row.xy += point_x * point_y;
+				row.xz += point_x * point_z;
+				row.yy += point_y * point_y;
+				row.yz += point_y * point_z;
+				row.zz += point_z * point_z;
+			}
+
+			moments[x] = moments[x - stride];
+			accumulateMoments(moments[x], row, 1.);
+		}
+	}
+}
+
+
+void IntegralMomentMap::getBoxMoments(Moments& moments,
+									  int min_x, int min_y,
+									  int max_x, int max_y) const
+{
+	moments = Moments();
+	min_x = std::max(min_x, 0);
+	min_y = std::max(min_y, 0);
+	max_x = std::min(max_x, size_x_ - 1);
+	max_y = std::min(max_y, size_y_ - 1);
+	if (min_x > max_x || min_y > max_y)
+		return;
+
+	// Corners of the box in the summed-area table
+	unsigned int stride = size_x_ + 1;
+	accumulateMoments(moments, moments_[(max_y + 1) * stride + max_x + 1], 1.);
+	accumulateMoments(moments, moments_[min_y * stride + max_x + 1], -1.);
+	accumulateMoments(moments, moments_[(max_y + 1) * stride + min_x], -1.);
+	accumulateMoments(moments, moments_[min_y * stride + min_x], 1.);
+}
+
+
+unsigned int IntegralMomentMap::computePlane(Eigen::Vector3d& mean,
+											 Eigen::Vector3d& normal,
+											 double& curvature,
+											 int x, int y,
+											 int radius) const
+{
+	Moments moments;
+	getBoxMoments(moments, x - radius, y - radius, x + radius, y + radius);
+
+	// Note that the number of points is an integer stored as double
+	unsigned int num_points = moments.num_points + 0.5;
+	if (num_points == 0)
+		return 0;
+
+	// Computing the mean and covariance from the raw moments
+	double inv_num_points = 1. / moments.num_points;
+	mean << moments.x * inv_num_points,
+			moments.y * inv_num_points,
+			moments.z * inv_num_points;
+
+	Eigen::Matrix3d covariance;
+	covariance(0,0) = moments.xx * inv_num_points - mean(0) * mean(0);
+	covariance(0,1) = moments.xy * inv_num_points - mean(0) * mean(1);
+	covariance(0,2) = moments.xz * inv_num_points - mean(0) * mean(2);
+	covariance(1,1) = moments.yy * inv_num_points - mean(1) * mean(1);
+	covariance(1,2) = moments.yz * inv_num_points - mean(1) * mean(2);
+	covariance(2,2) = moments.zz * inv_num_points - mean(2) * mean(2);
+	covariance(1,0) = covariance(0,1);
+	covariance(2,0) = covariance(0,2);
+	covariance(2,1) = covariance(1,2);
+
+	// The normal is the eigenvector of the smallest eigenvalue, and the
+	// curvature is the surface variation (smallest eigenvalue over their sum)
+	Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver;
+	solver.computeDirect(covariance);
+	const Eigen::Vector3d& eigenvalues = solver.eigenvalues();
+	normal = solver.eigenvectors().col(0);
+	if (normal(2) < 0.)
+		normal = -normal;
+
+	double eigenvalues_sum = eigenvalues.sum();
+	if (eigenvalues_sum > 0.)
+		curvature = fabs(eigenvalues(0) / eigenvalues_sum);
+	else
+		curvature = 0.;
+
+	return num_points;
+}
+
+} //@namespace terrain_server
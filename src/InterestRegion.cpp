@@ -0,0 +1,124 @@
+#include <terrain_server/InterestRegion.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+
+namespace terrain_server
+{
+
+/** @brief Radius of an unbounded region */
+static const double MAX_RADIUS = 1e6;
+
+
+InterestRegion::InterestRegion(double radius_x,
+							   double radius_y,
+							   double robot_x,
+							   double robot_y,
+							   double yaw) :
+		radius_x_(std::min(radius_x, MAX_RADIUS)),
+		radius_y_(std::min(radius_y, MAX_RADIUS)), robot_x_(robot_x),
+		robot_y_(robot_y), cos_yaw_(cos(yaw)), sin_yaw_(sin(yaw))
+{
+	inv_sq_x_ = 1. / (radius_x_ * radius_x_);
+	inv_sq_y_ = 1. / (radius_y_ * radius_y_);
+	ellipse_a_ = cos_yaw_ * cos_yaw_ * inv_sq_y_ + sin_yaw_ * sin_yaw_ * inv_sq_x_;
+}
+
+
+InterestRegion::~InterestRegion()
+{
+
+}
+
+
+bool InterestRegion::isBounded() const
+{
+	return radius_x_ < MAX_RADIUS || radius_y_ < MAX_RADIUS;
+}
+
+
+void InterestRegion::getRowKeys(int& first_key,
+								int& last_key,
+								const dwl::environment::SpaceDiscretization& discretization,
+								unsigned short key_y,
+								int first_grid_key,
+								int last_grid_key) const
+{
+	double y;
+	discretization.keyToCoord(y, key_y, true);
+	double dy = y - robot_y_;
+
+	// Getting the range of the row (relative to the robot) inside the front
+	// half ellipse, and inside the back half circle
+	double min_dx = std::numeric_limits<double>::max();
+	double max_dx = -std::numeric_limits<double>::max();
+	double ellipse_b = 2. * dy * sin_yaw_ * cos_yaw_ * (inv_sq_y_ - inv_sq_x_);
+	double ellipse_c = dy * dy * (sin_yaw_ * sin_yaw_ * inv_sq_y_ +
+								  cos_yaw_ * cos_yaw_ * inv_sq_x_) - 1.;
+	double discriminant = ellipse_b * ellipse_b - 4. * ellipse_a_ * ellipse_c;
+	if (discriminant >= 0.) {
+		double root = sqrt(discriminant);
+		clipToHalfPlane(min_dx, max_dx,
+						(-ellipse_b - root) / (2. * ellipse_a_),
+						(-ellipse_b + root) / (2. * ellipse_a_),
+						dy, true);
+	}
+	if (dy * dy <= radius_x_ * radius_x_) {
+		double root = sqrt(radius_x_ * radius_x_ - dy * dy);
+		clipToHalfPlane(min_dx, max_dx, -root, root, dy, false);
+	}
+
+	// Getting the range of keys whose cells are inside the region. The range
+	// is clipped to the grid before the conversion, so the keys don't overflow
+	first_key = last_grid_key + 1;
+	last_key = first_grid_key - 1;
+	if (min_dx > max_dx)
+		return;
+
+	double grid_min_x, grid_max_x;
+	discretization.keyToCoord(grid_min_x, first_grid_key, true);
+	discretization.keyToCoord(grid_max_x, last_grid_key, true);
+	double min_x = std::max(robot_x_ + min_dx, grid_min_x);
+	double max_x = std::min(robot_x_ + max_dx, grid_max_x);
+	if (min_x > max_x)
+		return;
+
+	unsigned short key;
+	double coord;
+	discretization.coordToKey(key, min_x, true);
+	discretization.keyToCoord(coord, key, true);
+	first_key = coord < min_x ? key + 1 : key;
+	discretization.coordToKey(key, max_x, true);
+	discretization.keyToCoord(coord, key, true);
+	last_key = coord > max_x ? key - 1 : key;
+}
+
+
+void InterestRegion::clipToHalfPlane(double& min_dx,
+									 double& max_dx,
+									 double first_dx,
+									 double last_dx,
+									 double dy,
+									 bool is_front) const
+{
+	// The front half plane is dx * cos(yaw) + dy * sin(yaw) >= 0
+	double sign = is_front ? 1. : -1.;
+	double a = sign * cos_yaw_;
+	double b = sign * dy * sin_yaw_;
+	if (fabs(a) < 1e-9) {
+		if (b < 0.)
+			return;
+	} else if (a > 0.)
+		first_dx = std::max(first_dx, -b / a);
+	else
+		last_dx = std::min(last_dx, -b / a);
+
+	if (first_dx > last_dx)
+		return;
+
+	min_dx = std::min(min_dx, first_dx);
+	max_dx = std::max(max_dx, last_dx);
+}
+
+} //@namespace terrain_server
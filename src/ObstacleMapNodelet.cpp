@@ -0,0 +1,45 @@
+#include <terrain_server/ObstacleMapNodelet.h>
+#include <pluginlib/class_list_macros.h>
+
+
+namespace terrain_server
+{
+
+ObstacleMapNodelet::ObstacleMapNodelet()
+{
+
+}
+
+
+ObstacleMapNodelet::~ObstacleMapNodelet()
+{
+
+}
+
+
+void ObstacleMapNodelet::onInit()
+{
+	// The obstacle map parameters are in the namespace of the node (see
+	// obstacle_map.yaml), so the server uses the public node handle
+	server_.reset(new ObstacleMapServer(getNodeHandle()));
+	if (!server_->init()) {
+		NODELET_ERROR("Could not initialize the obstacle map server");
+		return;
+	}
+
+	// Publishing the obstacle map at the rate of the standalone server. The
+	// timer shares the queue with the octomap callback
+	publish_timer_ = getNodeHandle().createTimer(ros::Duration(0.01),
+												 &ObstacleMapNodelet::publishCallback,
+												 this);
+}
+
+
+void ObstacleMapNodelet::publishCallback(const ros::TimerEvent& event)
+{
+	server_->publishObstacleMap();
+}
+
+} //@namespace terrain_server
+
+PLUGINLIB_EXPORT_CLASS(terrain_server::ObstacleMapNodelet, nodelet::Nodelet)
@@ -1,10 +1,13 @@
 #include <terrain_server/ObstacleMapServer.h>
+#include <limits>
 
 
 namespace terrain_server
 {
 
-ObstacleMapServer::ObstacleMapServer() : base_frame_("base_link"), world_frame_("world"), new_information_(false)
+ObstacleMapServer::ObstacleMapServer(ros::NodeHandle node) : node_(node),
+		base_frame_("base_link"), world_frame_("world"), new_information_(false),
+		incremental_update_(true)
 {
 	// Declaring the subscriber to octomap and tf messages
 	octomap_sub_ = new message_filters::Subscriber<octomap_msgs::Octomap> (node_, "octomap_binary", 5);
@@ -52,12 +55,48 @@ bool ObstacleMapServer::init()
 		}
 	}
 
-	// Getting the interest region, i.e. the information outside this region will be deleted
-	double radius_x, radius_y;
-	node_.getParam("reward_map/interest_region/radius_x", radius_x);
-	node_.getParam("reward_map/interest_region/radius_y", radius_y);
+	// Getting the interest region, i.e. the information outside this region will
+	// be deleted. The obstacles are kept everywhere if it isn't given
+	double radius_x = std::numeric_limits<double>::max();
+	double radius_y = std::numeric_limits<double>::max();
+	node_.param("obstacle_map/interest_region/radius_x", radius_x, radius_x);
+	node_.param("obstacle_map/interest_region/radius_y", radius_y, radius_y);
 	obstacle_map_.setInterestRegion(radius_x, radius_y);
 
+	// Getting the number of threads used for computing the obstacle map
+	int num_threads = 1;
+	node_.param("obstacle_map/num_threads", num_threads, num_threads);
+	obstacle_map_.setNumberOfThreads(num_threads);
+
+	// Getting the incremental update, the obstacle map extracts only the
+	// columns inside the regions of the octree that changed in every read
+	node_.param("obstacle_map/incremental_update", incremental_update_, incremental_update_);
+	octomap_reader_.setChangeTracking(incremental_update_);
+	obstacle_map_.setIncrementalUpdate(incremental_update_);
+
+	// Getting the statistics of the hot paths, they are published periodically
+	// if they are enabled
+	bool enable_statistics = false;
+	double statistics_period = 1.;
+	node_.param("obstacle_map/statistics/enable", enable_statistics, enable_statistics);
+	node_.param("obstacle_map/statistics/period", statistics_period, statistics_period);
+	deserialize_timer_ = statistics_.addTimer("obstacle_server/deserialize");
+	tf_timer_ = statistics_.addTimer("obstacle_server/tf_lookup");
+	compute_timer_ = statistics_.addTimer("obstacle_server/compute");
+	publish_timer_ = statistics_.addTimer("obstacle_server/publish_map");
+	octomap_bytes_counter_ = statistics_.addCounter("obstacle_server/octomap_bytes", "bytes");
+	map_bytes_counter_ = statistics_.addCounter("obstacle_server/map_bytes", "bytes");
+	obstacle_counter_ = statistics_.addCounter("obstacle_server/obstacle_voxels");
+	obstacle_map_.setStatistics(&statistics_);
+	if (enable_statistics) {
+		statistics_.setEnabled(true);
+		statistics_pub_ =
+				node_.advertise<terrain_server::ServerStatistics>("obstacle_map/statistics", 1);
+		statistics_timer_ =
+				node_.createTimer(ros::Duration(statistics_period),
+								  &ObstacleMapServer::publishStatistics, this);
+	}
+
 	return true;
 }
 
@@ -78,28 +117,52 @@ ObstacleMapServer::~ObstacleMapServer()
 
 void ObstacleMapServer::octomapCallback(const octomap_msgs::Octomap::ConstPtr& msg)
 {
-	// Creating a octree
-	octomap::OcTree* octomap = NULL;
-	octomap::AbstractOcTree* tree = octomap_msgs::msgToMap(*msg);
-
-	if (tree) {
-		octomap = dynamic_cast<octomap::OcTree*>(tree);
-	}
-
-	if (!octomap) {
-		ROS_WARN("Failed to create octree structure");
-		return;
-	}
-
 	// Getting the transformation between the world to robot frame
 	tf::StampedTransform tf_transform;
 	try {
+		ScopedTimer timer(&statistics_, tf_timer_);
 		tf_listener_.lookupTransform(world_frame_, base_frame_, msg->header.stamp, tf_transform);
 	} catch (tf::TransformException& ex) {
 		ROS_ERROR_STREAM("Transform error of sensor data: " << ex.what() << ", quitting callback");
 		return;
 	}
 
+	// Reading the octomap into the reused octree, only the branches inside
+	// the reach of the search areas around the robot
+	octomap::OcTree* octomap;
+	{
+		ScopedTimer timer(&statistics_, deserialize_timer_);
+		const tf::Vector3& position = tf_transform.getOrigin();
+		double reach = obstacle_map_.getOctomapReach();
+		octomap_reader_.setBoundingBox(
+				octomap::point3d(position.x() - reach, position.y() - reach, -1e6),
+				octomap::point3d(position.x() + reach, position.y() + reach, 1e6));
+		octomap = octomap_reader_.read(*msg);
+	}
+	statistics_.addSample(octomap_bytes_counter_, msg->data.size());
+	if (!octomap) {
+		ROS_WARN("Failed to create octree structure");
+		return;
+	}
+
+	// Adding the regions of the octree that changed (or entered the bounding
+	// box) in this read
+	if (incremental_update_) {
+		double half_size = 0.5 * octomap->getResolution();
+		const std::vector<OctomapReader::OctreeRegion>& regions =
+				octomap_reader_.getChangedRegions();
+		for (unsigned int i = 0; i < regions.size(); i++) {
+			const OctomapReader::OctreeRegion& region = regions[i];
+			octomap::OcTreeKey max_key(region.key[0] + region.size - 1,
+									   region.key[1] + region.size - 1,
+									   region.key[2] + region.size - 1);
+			octomap::point3d min = octomap->keyToCoord(region.key);
+			octomap::point3d max = octomap->keyToCoord(max_key);
+			obstacle_map_.addChangedRegion(min.x() - half_size, max.x() + half_size,
+										   min.y() - half_size, max.y() + half_size);
+		}
+	}
+
 	// Getting the robot state (3D position and yaw angle)
 	Eigen::Vector4d robot_position = Eigen::Vector4d::Zero();
 	robot_position(0) = tf_transform.getOrigin()[0];
@@ -111,21 +174,22 @@ void ObstacleMapServer::octomapCallback(const octomap_msgs::Octomap::ConstPtr& m
 	double yaw = dwl::math::getYaw(dwl::math::getRPY(Eigen::Quaterniond(q.getW(), q.getX(), q.getY(), q.getZ())));
 	robot_position(3) = yaw;
 
-	// Computing the reward map
+	// Computing the obstacle map, it's published only if the obstacles changed
 	timespec start_rt, end_rt;
 	clock_gettime(CLOCK_REALTIME, &start_rt);
-	obstacle_map_.compute(octomap, robot_position);
+	if (obstacle_map_.compute(octomap, robot_position))
+		new_information_ = true;
 	clock_gettime(CLOCK_REALTIME, &end_rt);
 	double duration = (end_rt.tv_sec - start_rt.tv_sec) + 1e-9*(end_rt.tv_nsec - start_rt.tv_nsec);
+	statistics_.addSample(compute_timer_, duration);
 	ROS_INFO("The duration of computation of optimization problem is %f seg.", duration);
-
-	new_information_ = true;
 }
 
 
 bool ObstacleMapServer::reset(std_srvs::Empty::Request& req, std_srvs::Empty::Response& resp)
 {
 	obstacle_map_.reset();
+	new_information_ = true;
 
 	ROS_INFO("Reset obstacle map");
 
@@ -138,62 +202,57 @@ void ObstacleMapServer::publishObstacleMap()
 	if (new_information_) {
 		// Publishing the reward map if there is at least one subscriber
 		if (obstacle_pub_.getNumSubscribers() > 0) {
+			ScopedTimer timer(&statistics_, publish_timer_);
 			obstacle_map_msg_.header.stamp = ros::Time::now();
 
-			std::map<dwl::Vertex, dwl::Cell> obstacle_gridmap;
-			obstacle_gridmap = obstacle_map_.getObstacleMap();
-
-			terrain_server::Cell cell;
 			obstacle_map_msg_.plane_size = obstacle_map_.getResolution(true);
 			obstacle_map_msg_.height_size = obstacle_map_.getResolution(false);
 
-			// Converting the vertexs into a cell message
-			for (std::map<dwl::Vertex, dwl::Cell>::iterator vertex_iter = obstacle_gridmap.begin();
-					vertex_iter != obstacle_gridmap.end();
-					vertex_iter++)
-			{
-				dwl::Cell obstacle_cell = vertex_iter->second;
-
-				cell.key_x = obstacle_cell.key.x;
-				cell.key_y = obstacle_cell.key.y;
-				cell.key_z = obstacle_cell.key.z;
-				obstacle_map_msg_.cell.push_back(cell);
-			}
-
+			// Encoding the obstacles as runs of free and occupied voxels
+			dwl::Key origin_key, size;
+			unsigned int num_obstacles =
+					obstacle_map_.getObstacleRuns(obstacle_map_msg_.runs, origin_key, size);
+			obstacle_map_msg_.origin_key_x = origin_key.x;
+			obstacle_map_msg_.origin_key_y = origin_key.y;
+			obstacle_map_msg_.origin_key_z = origin_key.z;
+			obstacle_map_msg_.size_x = size.x;
+			obstacle_map_msg_.size_y = size.y;
+			obstacle_map_msg_.size_z = size.z;
 
 			obstacle_pub_.publish(obstacle_map_msg_);
+			if (statistics_.isEnabled()) {
+				statistics_.addSample(obstacle_counter_, num_obstacles);
+				statistics_.addSample(map_bytes_counter_,
+									  ros::serialization::serializationLength(obstacle_map_msg_));
+			}
 
-			// Deleting old information
-			obstacle_map_msg_.cell.clear();
 			new_information_ = false;
 		}
 	}
 }
 
-} //@namespace terrain_server
-
-
-int main(int argc, char **argv)
+void ObstacleMapServer::publishStatistics(const ros::TimerEvent& event)
 {
-	ros::init(argc, argv, "obstacle_map_server");
-
-	terrain_server::ObstacleMapServer obstacle_server;
-	if (!obstacle_server.init())
-			return -1;
-
-	ros::spinOnce();
-
-	try {
-		ros::Rate loop_rate(100);
-		while(ros::ok()) {
-			obstacle_server.publishObstacleMap();
-			ros::spinOnce();
-			loop_rate.sleep();
-		}
-	} catch(std::runtime_error& e) {
-		ROS_ERROR("obstacle_map_server exception: %s", e.what());
-		return -1;
+	std::vector<Statistics::Summary> summaries;
+	statistics_msg_.window = statistics_.rollWindow(summaries);
+	statistics_msg_.header.stamp = ros::Time::now();
+	statistics_msg_.metric.resize(summaries.size());
+	for (unsigned int i = 0; i < summaries.size(); i++) {
+		const Statistics::Summary& summary = summaries[i];
+		terrain_server::MetricSummary& metric = statistics_msg_.metric[i];
+		metric.name = summary.name;
+		metric.unit = summary.unit;
+		metric.samples = summary.samples;
+		metric.total = summary.total;
+		metric.mean = summary.mean;
+		metric.min = summary.min;
+		metric.max = summary.max;
+		metric.p50 = summary.p50;
+		metric.p90 = summary.p90;
+		metric.p99 = summary.p99;
 	}
 
-	return 0;
+	statistics_pub_.publish(statistics_msg_);
 }
+
+} //@namespace terrain_server
@@ -0,0 +1,27 @@
+#include <terrain_server/ObstacleMapServer.h>
+
+
+int main(int argc, char **argv)
+{
+	ros::init(argc, argv, "obstacle_map_server");
+
+	terrain_server::ObstacleMapServer obstacle_server;
+	if (!obstacle_server.init())
+			return -1;
+
+	ros::spinOnce();
+
+	try {
+		ros::Rate loop_rate(100);
+		while(ros::ok()) {
+			obstacle_server.publishObstacleMap();
+			ros::spinOnce();
+			loop_rate.sleep();
+		}
+	} catch(std::runtime_error& e) {
+		ROS_ERROR("obstacle_map_server exception: %s", e.what());
+		return -1;
+	}
+
+	return 0;
+}
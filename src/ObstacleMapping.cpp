@@ -0,0 +1,661 @@
+#include <terrain_server/ObstacleMapping.h>
+#include <algorithm>
+#include <limits>
+
+
+namespace terrain_server
+{
+
+/** @brief Number of columns per tile */
+static const unsigned int TILE_COLUMNS = 256;
+
+/** @brief Number of bits per word */
+static const unsigned int WORD_BITS = 64;
+
+/** @brief Maximum length of a run of voxels */
+static const unsigned long MAX_RUN = std::numeric_limits<uint16_t>::max();
+
+
+/** @brief Indicates if a bitset doesn't have occupied voxels */
+static bool isEmpty(const uint64_t* bits,
+					unsigned int words)
+{
+	for (unsigned int i = 0; i < words; i++) {
+		if (bits[i] != 0)
+			return false;
+	}
+
+	return true;
+}
+
+
+/** @brief Adds a run of voxels, it's split if it's longer than the maximum */
+static void addRun(std::vector<uint16_t>& runs,
+				   unsigned long length)
+{
+	while (length > MAX_RUN) {
+		runs.push_back(MAX_RUN);
+		runs.push_back(0);
+		length -= MAX_RUN;
+	}
+	runs.push_back(length);
+}
+
+
+/**
+ * @brief Appends voxels to the current run, or starts a new run if their
+ * occupancy is different
+ * @param std::vector<uint16_t>& Lengths of the runs
+ * @param bool& Occupancy of the current run
+ * @param unsigned long& Length of the current run
+ * @param bool Occupancy of the voxels
+ * @param unsigned long Number of voxels
+ */
+static void appendVoxels(std::vector<uint16_t>& runs,
+						 bool& is_occupied_run,
+						 unsigned long& length,
+						 bool is_occupied,
+						 unsigned long num_voxels)
+{
+	if (is_occupied != is_occupied_run) {
+		addRun(runs, length);
+		is_occupied_run = is_occupied;
+		length = 0;
+	}
+	length += num_voxels;
+}
+
+
+ObstacleMapping::ObstacleMapping() : space_discretization_(0.04, 0.04, M_PI / 200),
+		interest_radius_x_(std::numeric_limits<double>::max()),
+		interest_radius_y_(std::numeric_limits<double>::max()), size_x_(0),
+		size_y_(0), column_words_(0), centre_key_x_(0), centre_key_y_(0), scan_(0),
+		incremental_update_(false), depth_(16), statistics_(NULL), eviction_timer_(0), patch_timer_(0),
+		column_scan_timer_(0), scanned_counter_(0), changed_counter_(0)
+{
+
+}
+
+
+ObstacleMapping::~ObstacleMapping()
+{
+
+}
+
+
+bool ObstacleMapping::compute(octomap::OcTree* octomap,
+							  const Eigen::Vector4d& robot_state)
+{
+	if (search_areas_.empty()) {
+		printf(YELLOW "Could not computed the obstacle map because there"
+				" isn't a search area\n" COLOR_RESET);
+		changed_regions_.clear();
+		return false;
+	}
+
+	if (columns_.empty())
+		resizeGrid();
+	scan_++;
+
+	// Getting the depth of the octree queries, the voxels of this depth are
+	// (at most) as big as the columns of the grid
+	int tree_depth = octomap->getTreeDepth();
+	double size_ratio =
+			space_discretization_.getEnvironmentResolution(true) / octomap->getResolution();
+	int coarse_levels = std::max(0, (int) floor(log2(size_ratio) + 1e-6));
+	int depth = std::max(1, tree_depth - coarse_levels);
+	bool is_full_scan = !incremental_update_ || depth != depth_;
+	depth_ = depth;
+
+	// Removing the obstacles outside the interest region
+	space_discretization_.coordToKey(centre_key_x_, robot_state(0), true);
+	space_discretization_.coordToKey(centre_key_y_, robot_state(1), true);
+	unsigned int num_changed_columns;
+	{
+		ScopedTimer timer(statistics_, eviction_timer_);
+		num_changed_columns = removeObstacleOutsideInterestRegion(robot_state);
+	}
+
+	// Marking the columns inside the changed regions of the octree, the other
+	// ones are kept in the incremental update
+	if (!is_full_scan)
+		markChangedColumns(octomap->getResolution() * (1 << (tree_depth - depth_)));
+	changed_regions_.clear();
+
+	// Getting the columns of the search areas
+	octomap::OcTreeKey min_key, max_key;
+	getScanColumns(min_key, max_key, octomap, robot_state, is_full_scan);
+	unsigned int num_columns = scan_columns_.size();
+	if (statistics_)
+		statistics_->addSample(scanned_counter_, num_columns);
+	if (num_columns == 0)
+		return num_changed_columns > 0;
+
+	// Extracting the occupancy of the columns in one pass. If the patch is
+	// too large, the voxels are searched in the octree
+	bool is_patch;
+	{
+		ScopedTimer timer(statistics_, patch_timer_);
+		is_patch = patch_.compute(octomap, min_key, max_key, depth_, pool_);
+	}
+
+	// Computing the columns in tiles, every tile writes only its own columns
+	{
+		ScopedTimer timer(statistics_, column_scan_timer_);
+		unsigned int num_threads = pool_.getNumberOfThreads();
+		thread_bits_.resize(num_threads);
+		for (unsigned int i = 0; i < num_threads; i++)
+			thread_bits_[i].resize(column_words_);
+		std::vector<unsigned int> thread_changed_columns(num_threads, 0);
+		unsigned int num_tiles = (num_columns + TILE_COLUMNS - 1) / TILE_COLUMNS;
+		pool_.run(num_tiles, [&](unsigned int tile, unsigned int thread) {
+			unsigned int first_column = tile * TILE_COLUMNS;
+			unsigned int last_column = std::min(first_column + TILE_COLUMNS, num_columns);
+			for (unsigned int i = first_column; i < last_column; i++) {
+				if (computeColumn(octomap, scan_columns_[i],
+								  thread_bits_[thread].data(), is_patch))
+					thread_changed_columns[thread]++;
+			}
+		});
+		for (unsigned int i = 0; i < num_threads; i++)
+			num_changed_columns += thread_changed_columns[i];
+	}
+	patch_.clear();
+
+	if (statistics_)
+		statistics_->addSample(changed_counter_, num_changed_columns);
+
+	return num_changed_columns > 0;
+}
+
+
+unsigned int ObstacleMapping::getObstacleRuns(std::vector<uint16_t>& runs,
+											  dwl::Key& origin_key,
+											  dwl::Key& size)
+{
+	runs.clear();
+	origin_key.x = centre_key_x_ - size_x_ / 2;
+	origin_key.y = centre_key_y_ - size_y_ / 2;
+	origin_key.z = 0;
+	size.x = size_x_;
+	size.y = size_y_;
+	size.z = 0;
+
+	// Getting the vertical range of the obstacles
+	int min_key_z = std::numeric_limits<int>::max();
+	int max_key_z = std::numeric_limits<int>::min();
+	unsigned int num_grid_columns = columns_.size();
+	for (unsigned int index = 0; index < num_grid_columns; index++) {
+		const Column& column = columns_[index];
+		if (!column.is_column)
+			continue;
+
+		const uint64_t* bits = &bits_[index * column_words_];
+		for (unsigned int i = 0; i < column_words_; i++) {
+			if (bits[i] == 0)
+				continue;
+
+			int first_bit = i * WORD_BITS + __builtin_ctzll(bits[i]);
+			min_key_z = std::min(min_key_z, column.key_z + first_bit);
+			break;
+		}
+		for (int i = column_words_ - 1; i >= 0; i--) {
+			if (bits[i] == 0)
+				continue;
+
+			int last_bit = i * WORD_BITS + WORD_BITS - 1 - __builtin_clzll(bits[i]);
+			max_key_z = std::max(max_key_z, column.key_z + last_bit);
+			break;
+		}
+	}
+	if (min_key_z > max_key_z)
+		return 0;
+
+	origin_key.z = min_key_z;
+	size.z = max_key_z - min_key_z + 1;
+
+	// Encoding the voxels column by column. The columns without obstacles
+	// are appended as one free run
+	bool is_occupied_run = false;
+	unsigned long length = 0;
+	unsigned int num_occupied = 0;
+	for (unsigned int y = 0; y < size.y; y++) {
+		unsigned short key_y = origin_key.y + y;
+		for (unsigned int x = 0; x < size.x; x++) {
+			unsigned short key_x = origin_key.x + x;
+			unsigned int index = (key_y % size_y_) * size_x_ + key_x % size_x_;
+			const Column& column = columns_[index];
+			const uint64_t* bits = &bits_[index * column_words_];
+			if (!column.is_column || column.key_x != key_x || column.key_y != key_y ||
+					isEmpty(bits, column_words_)) {
+				appendVoxels(runs, is_occupied_run, length, false, size.z);
+				continue;
+			}
+
+			for (unsigned int z = 0; z < size.z; z++) {
+				int bit = origin_key.z + z - column.key_z;
+				bool is_occupied = bit >= 0 && bit < (int) (column_words_ * WORD_BITS) &&
+						((bits[bit / WORD_BITS] >> (bit % WORD_BITS)) & 1);
+				appendVoxels(runs, is_occupied_run, length, is_occupied, 1);
+				if (is_occupied)
+					num_occupied++;
+			}
+		}
+	}
+	addRun(runs, length);
+
+	return num_occupied;
+}
+
+
+double ObstacleMapping::getOctomapReach() const
+{
+	double reach = 0.;
+	for (unsigned int n = 0; n < search_areas_.size(); n++) {
+		const dwl::SearchArea& area = search_areas_[n];
+		double corner_x = std::max(fabs(area.min_x), fabs(area.max_x));
+		double corner_y = std::max(fabs(area.min_y), fabs(area.max_y));
+		reach = std::max(reach, sqrt(corner_x * corner_x + corner_y * corner_y));
+	}
+
+	return reach + 2 * space_discretization_.getEnvironmentResolution(true);
+}
+
+
+void ObstacleMapping::reset()
+{
+	columns_.clear();
+	bits_.clear();
+	changed_regions_.clear();
+}
+
+
+void ObstacleMapping::setNumberOfThreads(unsigned int num_threads)
+{
+	pool_.setNumberOfThreads(num_threads);
+}
+
+
+void ObstacleMapping::setStatistics(Statistics* statistics,
+									const std::string& name)
+{
+	statistics_ = statistics;
+	if (!statistics_)
+		return;
+
+	eviction_timer_ = statistics_->addTimer(name + "/eviction");
+	patch_timer_ = statistics_->addTimer(name + "/octree_patch");
+	column_scan_timer_ = statistics_->addTimer(name + "/column_scan");
+	scanned_counter_ = statistics_->addCounter(name + "/scanned_columns");
+	changed_counter_ = statistics_->addCounter(name + "/changed_columns");
+}
+
+
+void ObstacleMapping::setIncrementalUpdate(bool incremental)
+{
+	incremental_update_ = incremental;
+	changed_regions_.clear();
+}
+
+
+void ObstacleMapping::addChangedRegion(double min_x, double max_x,
+									   double min_y, double max_y)
+{
+	changed_regions_.push_back(Eigen::Vector4d(min_x, max_x, min_y, max_y));
+}
+
+
+void ObstacleMapping::setInterestRegion(double radius_x,
+										double radius_y)
+{
+	interest_radius_x_ = radius_x;
+	interest_radius_y_ = radius_y;
+	reset();
+}
+
+
+void ObstacleMapping::addSearchArea(double min_x, double max_x,
+									double min_y, double max_y,
+									double min_z, double max_z,
+									double resolution)
+{
+	dwl::SearchArea search_area;
+	search_area.min_x = min_x;
+	search_area.max_x = max_x;
+	search_area.min_y = min_y;
+	search_area.max_y = max_y;
+	search_area.min_z = min_z;
+	search_area.max_z = max_z;
+	search_area.resolution = resolution;
+
+	if (search_areas_.empty() ||
+			resolution < space_discretization_.getEnvironmentResolution(true)) {
+		space_discretization_.setEnvironmentResolution(resolution, true);
+		space_discretization_.setEnvironmentResolution(resolution, false);
+	}
+
+	search_areas_.push_back(search_area);
+	reset();
+}
+
+
+double ObstacleMapping::getResolution(bool plane) const
+{
+	return space_discretization_.getEnvironmentResolution(plane);
+}
+
+
+void ObstacleMapping::resizeGrid()
+{
+	// Getting the number of voxels per column of the search areas
+	double resolution = space_discretization_.getEnvironmentResolution(false);
+	unsigned int max_voxels = 1;
+	area_voxels_.resize(search_areas_.size());
+	for (unsigned int n = 0; n < search_areas_.size(); n++) {
+		const dwl::SearchArea& area = search_areas_[n];
+		area_voxels_[n] = std::max(1, (int) round((area.max_z - area.min_z) / resolution) + 1);
+		max_voxels = std::max(max_voxels, area_voxels_[n]);
+	}
+	column_words_ = (max_voxels + WORD_BITS - 1) / WORD_BITS;
+
+	// The interest region rotates with the robot, so the grid has to cover
+	// its largest radius in every direction. The grid covers the search areas
+	// too, so the columns around the robot don't share slots. An unbounded
+	// radius keeps the obstacles, but it doesn't size the grid
+	double radius = getOctomapReach();
+	if (interest_radius_x_ < std::numeric_limits<double>::max())
+		radius = std::max(radius, interest_radius_x_);
+	if (interest_radius_y_ < std::numeric_limits<double>::max())
+		radius = std::max(radius, interest_radius_y_);
+
+	double plane_resolution = space_discretization_.getEnvironmentResolution(true);
+	size_x_ = size_y_ = 2 * (unsigned int) ceil(radius / plane_resolution) + 1;
+	columns_.assign(size_x_ * size_y_, Column());
+	bits_.assign(columns_.size() * column_words_, 0);
+	row_key_y_.assign(size_y_, -1);
+	row_first_key_.assign(size_y_, std::numeric_limits<int>::max());
+	row_last_key_.assign(size_y_, std::numeric_limits<int>::min());
+
+	printf(GREEN "Allocated an obstacle grid of %u x %u columns with %u words"
+			" per column\n" COLOR_RESET, size_x_, size_y_, column_words_);
+}
+
+
+unsigned int ObstacleMapping::removeObstacleOutsideInterestRegion(const Eigen::Vector4d& robot_state)
+{
+	InterestRegion region(interest_radius_x_, interest_radius_y_,
+						  robot_state(0), robot_state(1), robot_state(3));
+	if (!region.isBounded())
+		return 0;
+
+	// Cropping every row to its range inside the interest region, only the
+	// columns that leave it are visited
+	int first_grid_key = centre_key_x_ - size_x_ / 2;
+	int last_grid_key = first_grid_key + size_x_ - 1;
+	unsigned int num_removed_columns = 0;
+	for (unsigned int slot_y = 0; slot_y < size_y_; slot_y++) {
+		if (row_first_key_[slot_y] > row_last_key_[slot_y])
+			continue;
+
+		int first_key, last_key;
+		region.getRowKeys(first_key, last_key, space_discretization_,
+						  row_key_y_[slot_y], first_grid_key, last_grid_key);
+		num_removed_columns += cropRow(slot_y, first_key, last_key);
+	}
+
+	return num_removed_columns;
+}
+
+
+unsigned int ObstacleMapping::cropRow(unsigned int slot_y,
+									  int first_key_x,
+									  int last_key_x)
+{
+	int& row_first_key = row_first_key_[slot_y];
+	int& row_last_key = row_last_key_[slot_y];
+	if (row_first_key > row_last_key)
+		return 0;
+
+	// Removing the columns before and after the kept range. Note that a slot
+	// could have a column of other keys, which is discarded by its keys
+	unsigned int num_removed_columns = 0;
+	unsigned short key_y = row_key_y_[slot_y];
+	unsigned int offset = slot_y * size_x_;
+	const int first_keys[2] = {row_first_key,
+							   std::max(std::max(last_key_x + 1, first_key_x), row_first_key)};
+	const int last_keys[2] = {std::min(first_key_x - 1, row_last_key), row_last_key};
+	for (unsigned int i = 0; i < 2; i++) {
+		for (int key_x = first_keys[i]; key_x <= last_keys[i]; key_x++) {
+			unsigned int index = offset + key_x % size_x_;
+			Column& column = columns_[index];
+			if (!column.is_column || column.key_x != key_x || column.key_y != key_y)
+				continue;
+
+			uint64_t* bits = &bits_[index * column_words_];
+			if (!isEmpty(bits, column_words_)) {
+				std::fill(bits, bits + column_words_, 0);
+				num_removed_columns++;
+			}
+			column.is_column = false;
+		}
+	}
+
+	row_first_key = std::max(row_first_key, first_key_x);
+	row_last_key = std::min(row_last_key, last_key_x);
+
+	return num_removed_columns;
+}
+
+
+void ObstacleMapping::markChangedColumns(double voxel_size)
+{
+	// Getting the Cartesian range of the grid, the regions are clipped to it
+	// before the conversion, so the keys don't overflow
+	int first_key_x = centre_key_x_ - size_x_ / 2;
+	int first_key_y = centre_key_y_ - size_y_ / 2;
+	double grid_min_x, grid_max_x, grid_min_y, grid_max_y;
+	space_discretization_.keyToCoord(grid_min_x, first_key_x, true);
+	space_discretization_.keyToCoord(grid_max_x, first_key_x + size_x_ - 1, true);
+	space_discretization_.keyToCoord(grid_min_y, first_key_y, true);
+	space_discretization_.keyToCoord(grid_max_y, first_key_y + size_y_ - 1, true);
+
+	// A column is extracted from the voxels around its centre, so the regions
+	// are grown by the size of these voxels
+	for (unsigned int i = 0; i < changed_regions_.size(); i++) {
+		const Eigen::Vector4d& region = changed_regions_[i];
+		double min_x = std::max(region(0) - voxel_size, grid_min_x);
+		double max_x = std::min(region(1) + voxel_size, grid_max_x);
+		double min_y = std::max(region(2) - voxel_size, grid_min_y);
+		double max_y = std::min(region(3) + voxel_size, grid_max_y);
+		if (min_x > max_x || min_y > max_y)
+			continue;
+
+		unsigned short min_key_x, max_key_x, min_key_y, max_key_y;
+		space_discretization_.coordToKey(min_key_x, min_x, true);
+		space_discretization_.coordToKey(max_key_x, max_x, true);
+		space_discretization_.coordToKey(min_key_y, min_y, true);
+		space_discretization_.coordToKey(max_key_y, max_y, true);
+		for (int key_y = min_key_y; key_y <= max_key_y; key_y++) {
+			unsigned int offset = (key_y % size_y_) * size_x_;
+			for (int key_x = min_key_x; key_x <= max_key_x; key_x++)
+				columns_[offset + key_x % size_x_].is_changed = true;
+		}
+	}
+}
+
+
+void ObstacleMapping::getScanColumns(octomap::OcTreeKey& min_key,
+									 octomap::OcTreeKey& max_key,
+									 octomap::OcTree* octomap,
+									 const Eigen::Vector4d& robot_state,
+									 bool is_full_scan)
+{
+	scan_columns_.clear();
+	for (unsigned int i = 0; i < 3; i++) {
+		min_key[i] = std::numeric_limits<octomap::key_type>::max();
+		max_key[i] = 0;
+	}
+
+	double resolution = space_discretization_.getEnvironmentResolution(true);
+	double cos_yaw = cos(robot_state(3));
+	double sin_yaw = sin(robot_state(3));
+	for (unsigned int n = 0; n < search_areas_.size(); n++) {
+		const dwl::SearchArea& area = search_areas_[n];
+
+		// Getting the vertical window of the area, it's relative to the robot
+		unsigned short key_z;
+		double min_z, max_z;
+		space_discretization_.coordToKey(key_z, area.min_z + robot_state(2), false);
+		space_discretization_.keyToCoord(min_z, key_z, false);
+		space_discretization_.keyToCoord(max_z, key_z + area_voxels_[n] - 1, false);
+		octomap::key_type min_key_z, max_key_z;
+		if (!octomap->coordToKeyChecked(min_z, min_key_z) ||
+				!octomap->coordToKeyChecked(max_z, max_key_z)) {
+			printf(RED "Cell out of bounds\n" COLOR_RESET);
+			continue;
+		}
+
+		// Getting the bounding box of the rotated area relative to the robot
+		double min_dx = std::numeric_limits<double>::max(), max_dx = -min_dx;
+		double min_dy = min_dx, max_dy = -min_dx;
+		for (unsigned int corner = 0; corner < 4; corner++) {
+			double ax = (corner & 1) ? area.max_x : area.min_x;
+			double ay = (corner & 2) ? area.max_y : area.min_y;
+			double dx = ax * cos_yaw - ay * sin_yaw;
+			double dy = ax * sin_yaw + ay * cos_yaw;
+			min_dx = std::min(min_dx, dx);
+			max_dx = std::max(max_dx, dx);
+			min_dy = std::min(min_dy, dy);
+			max_dy = std::max(max_dy, dy);
+		}
+
+		// Getting the columns inside the area, a coarse area takes one column
+		// per its resolution
+		int stride = std::max(1, (int) round(area.resolution / resolution));
+		int first_x = (int) floor(min_dx / resolution) - 1;
+		int last_x = (int) ceil(max_dx / resolution) + 1;
+		int first_y = (int) floor(min_dy / resolution) - 1;
+		int last_y = (int) ceil(max_dy / resolution) + 1;
+		for (int offset_y = first_y; offset_y <= last_y; offset_y++) {
+			if (offset_y % stride != 0)
+				continue;
+
+			unsigned short key_y = centre_key_y_ + offset_y;
+			double y;
+			space_discretization_.keyToCoord(y, key_y, true);
+			double dy = y - robot_state(1);
+			for (int offset_x = first_x; offset_x <= last_x; offset_x++) {
+				if (offset_x % stride != 0)
+					continue;
+
+				unsigned short key_x = centre_key_x_ + offset_x;
+				double x;
+				space_discretization_.keyToCoord(x, key_x, true);
+				double dx = x - robot_state(0);
+
+				// Checking if the column is inside the area (in the body frame)
+				double body_x = dx * cos_yaw + dy * sin_yaw;
+				double body_y = -dx * sin_yaw + dy * cos_yaw;
+				if (body_x < area.min_x || body_x > area.max_x ||
+						body_y < area.min_y || body_y > area.max_y)
+					continue;
+
+				// A column belongs to the first area that contains it
+				unsigned int index = (key_y % size_y_) * size_x_ + key_x % size_x_;
+				Column& column = columns_[index];
+				if (column.scan == scan_)
+					continue;
+
+				octomap::key_type octree_key_x, octree_key_y;
+				if (!octomap->coordToKeyChecked(x, octree_key_x) ||
+						!octomap->coordToKeyChecked(y, octree_key_y))
+					continue;
+
+				column.scan = scan_;
+
+				// Updating the range of keys of the row. A slot of a new row
+				// had a row that left the interest region, or its columns are
+				// discarded by their keys
+				unsigned int slot_y = key_y % size_y_;
+				if (row_key_y_[slot_y] != key_y) {
+					row_key_y_[slot_y] = key_y;
+					row_first_key_[slot_y] = std::numeric_limits<int>::max();
+					row_last_key_[slot_y] = std::numeric_limits<int>::min();
+				}
+				row_first_key_[slot_y] = std::min(row_first_key_[slot_y], (int) key_x);
+				row_last_key_[slot_y] = std::max(row_last_key_[slot_y], (int) key_x);
+
+				// Skipping the columns whose voxels didn't change, unless the
+				// column is new or its vertical window moved. Note that a
+				// column could change while it's outside the search areas
+				if (!is_full_scan && column.is_column && !column.is_changed &&
+						column.key_x == key_x && column.key_y == key_y &&
+						column.key_z == key_z && column.area == n)
+					continue;
+
+				column.is_changed = false;
+				scan_columns_.push_back(ScanColumn(index, key_x, key_y, key_z,
+												   octree_key_x, octree_key_y, n));
+				min_key[0] = std::min(min_key[0], octree_key_x);
+				min_key[1] = std::min(min_key[1], octree_key_y);
+				max_key[0] = std::max(max_key[0], octree_key_x);
+				max_key[1] = std::max(max_key[1], octree_key_y);
+				min_key[2] = std::min(min_key[2], min_key_z);
+				max_key[2] = std::max(max_key[2], max_key_z);
+			}
+		}
+	}
+}
+
+
+bool ObstacleMapping::computeColumn(octomap::OcTree* octomap,
+									const ScanColumn& scan_column,
+									uint64_t* bits,
+									bool is_patch)
+{
+	// Extracting the occupied voxels of the column
+	std::fill(bits, bits + column_words_, 0);
+	octomap::OcTreeKey key;
+	key[0] = scan_column.octree_key_x;
+	key[1] = scan_column.octree_key_y;
+	unsigned int num_voxels = area_voxels_[scan_column.area];
+	for (unsigned int i = 0; i < num_voxels; i++) {
+		double z;
+		space_discretization_.keyToCoord(z, scan_column.key_z + i, false);
+		key[2] = octomap->coordToKey(z);
+
+		bool is_occupied = false;
+		if (!is_patch || !patch_.getOccupancy(is_occupied, key)) {
+			octomap::OcTreeNode* node = octomap->search(key, depth_);
+			is_occupied = node && octomap->isNodeOccupied(node);
+		}
+
+		if (is_occupied)
+			bits[i / WORD_BITS] |= (uint64_t) 1 << (i % WORD_BITS);
+	}
+
+	// Updating the column only if its voxels changed. Note that a column
+	// whose vertical window moved changed if it has obstacles
+	Column& column = columns_[scan_column.index];
+	uint64_t* column_bits = &bits_[scan_column.index * column_words_];
+	bool is_same_column = column.is_column &&
+			column.key_x == scan_column.key_x && column.key_y == scan_column.key_y;
+	bool is_changed;
+	if (is_same_column && column.key_z == scan_column.key_z)
+		is_changed = !std::equal(bits, bits + column_words_, column_bits);
+	else
+		is_changed = !isEmpty(bits, column_words_) ||
+				(is_same_column && !isEmpty(column_bits, column_words_));
+
+	column.key_x = scan_column.key_x;
+	column.key_y = scan_column.key_y;
+	column.key_z = scan_column.key_z;
+	column.area = scan_column.area;
+	column.is_column = true;
+	if (is_changed || !is_same_column)
+		std::copy(bits, bits + column_words_, column_bits);
+
+	return is_changed;
+}
+
+} //@namespace terrain_server
@@ -0,0 +1,126 @@
+#include <terrain_server/OccupancyPatch.h>
+#include <algorithm>
+
+
+namespace terrain_server
+{
+
+/** @brief Number of rows of key per tile */
+static const unsigned int TILE_ROWS = 8;
+
+/** @brief Maximum number of voxels of the patch (8 MB of bits) */
+static const unsigned long MAX_VOXELS = 1 << 26;
+
+/** @brief Number of bits per word */
+static const unsigned int WORD_BITS = 64;
+
+
+OccupancyPatch::OccupancyPatch() : size_y_(0), size_z_(0), row_words_(0),
+		is_patch_(false)
+{
+
+}
+
+
+OccupancyPatch::~OccupancyPatch()
+{
+
+}
+
+
+bool OccupancyPatch::compute(octomap::OcTree* octomap,
+							 const octomap::OcTreeKey& min_key,
+							 const octomap::OcTreeKey& max_key,
+							 int depth,
+							 ThreadPool& pool)
+{
+	unsigned long size_x = max_key[0] - min_key[0] + 1;
+	unsigned long size_y = max_key[1] - min_key[1] + 1;
+	unsigned long size_z = max_key[2] - min_key[2] + 1;
+	if (size_x * size_y * size_z > MAX_VOXELS) {
+		clear();
+		return false;
+	}
+
+	min_key_ = min_key;
+	max_key_ = max_key;
+	size_y_ = size_y;
+	size_z_ = size_z;
+	row_words_ = (size_x + WORD_BITS - 1) / WORD_BITS;
+	bits_.assign(row_words_ * size_y_ * size_z_, 0);
+
+	// Every tile sets the bits of its own rows along the y-axis
+	unsigned int num_tiles = (size_y_ + TILE_ROWS - 1) / TILE_ROWS;
+	pool.run(num_tiles, [&](unsigned int tile, unsigned int thread) {
+		octomap::OcTreeKey tile_min_key = min_key;
+		octomap::OcTreeKey tile_max_key = max_key;
+		tile_min_key[1] = min_key[1] + tile * TILE_ROWS;
+		tile_max_key[1] = std::min((int) tile_min_key[1] + (int) TILE_ROWS - 1,
+								   (int) max_key[1]);
+		computeTile(octomap, tile_min_key, tile_max_key, depth);
+	});
+
+	is_patch_ = true;
+	return true;
+}
+
+
+void OccupancyPatch::computeTile(octomap::OcTree* octomap,
+								 const octomap::OcTreeKey& min_key,
+								 const octomap::OcTreeKey& max_key,
+								 int depth)
+{
+	// Note that the leafs could be bigger than a voxel (i.e. pruned), so we
+	// clip the keys that they cover to the tile
+	unsigned int tree_depth = octomap->getTreeDepth();
+	for (octomap::OcTree::leaf_bbx_iterator it =
+			octomap->begin_leafs_bbx(min_key, max_key, depth),
+			end = octomap->end_leafs_bbx(); it != end; ++it) {
+		if (!octomap->isNodeOccupied(*it))
+			continue;
+
+		const octomap::OcTreeKey& leaf_key = it.getIndexKey();
+		int leaf_size = 1 << (tree_depth - it.getDepth());
+
+		int first_x = std::max((int) leaf_key[0], (int) min_key[0]) - min_key_[0];
+		int last_x = std::min(leaf_key[0] + leaf_size - 1, (int) max_key[0]) - min_key_[0];
+		int first_y = std::max((int) leaf_key[1], (int) min_key[1]);
+		int last_y = std::min(leaf_key[1] + leaf_size - 1, (int) max_key[1]);
+		int first_z = std::max((int) leaf_key[2], (int) min_key[2]);
+		int last_z = std::min(leaf_key[2] + leaf_size - 1, (int) max_key[2]);
+		for (int z = first_z; z <= last_z; z++) {
+			for (int y = first_y; y <= last_y; y++) {
+				uint64_t* row = &bits_[((z - min_key_[2]) * size_y_ +
+										(y - min_key_[1])) * row_words_];
+				for (int x = first_x; x <= last_x; x++)
+					row[x / WORD_BITS] |= (uint64_t) 1 << (x % WORD_BITS);
+			}
+		}
+	}
+}
+
+
+void OccupancyPatch::clear()
+{
+	bits_.clear();
+	is_patch_ = false;
+}
+
+
+bool OccupancyPatch::getOccupancy(bool& is_occupied,
+								  const octomap::OcTreeKey& key) const
+{
+	if (!is_patch_ ||
+			key[0] < min_key_[0] || key[0] > max_key_[0] ||
+			key[1] < min_key_[1] || key[1] > max_key_[1] ||
+			key[2] < min_key_[2] || key[2] > max_key_[2])
+		return false;
+
+	unsigned int x = key[0] - min_key_[0];
+	const uint64_t& word = bits_[((key[2] - min_key_[2]) * size_y_ +
+								  (key[1] - min_key_[1])) * row_words_ + x / WORD_BITS];
+	is_occupied = (word >> (x % WORD_BITS)) & 1;
+	return true;
+}
+
+} //@namespace terrain_server
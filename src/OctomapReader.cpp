@@ -0,0 +1,479 @@
+#include <terrain_server/OctomapReader.h>
+#include <dwl/utils/utils.h>
+#include <istream>
+#include <limits>
+
+
+namespace terrain_server
+{
+
+/** @brief Gets the key of a coordinate, it's clamped to the keys of the octree */
+static octomap::key_type getClampedKey(const octomap::OcTree& octree,
+									   double coordinate)
+{
+	octomap::key_type key;
+	if (octree.coordToKeyChecked(coordinate, key))
+		return key;
+	else if (coordinate < 0.)
+		return 0;
+	else
+		return std::numeric_limits<octomap::key_type>::max();
+}
+
+
+OctomapReader::MessageBuffer::MessageBuffer(const octomap_msgs::Octomap& msg)
+{
+	// The buffer is only read, so the data isn't modified
+	char* data = (char*) msg.data.data();
+	setg(data, data, data + msg.data.size());
+}
+
+
+OctomapReader::CroppedOcTree::CroppedOcTree(double resolution) :
+		octomap::OcTree(resolution), changed_regions_(NULL)
+{
+
+}
+
+
+std::istream& OctomapReader::CroppedOcTree::readCroppedBinaryData(std::istream& stream,
+																  const octomap::OcTreeKey& min_key,
+																  const octomap::OcTreeKey& max_key)
+{
+	min_key_ = min_key;
+	max_key_ = max_key;
+
+	// The root covers all the keys, and it's removed if none of its children
+	// was read. The nodes of the previous tree are reused
+	octomap::OcTreeKey root_key(0, 0, 0);
+	int root_size = 1 << getTreeDepth();
+	bool is_new_root = !root;
+	if (is_new_root) {
+		root = new octomap::OcTreeNode();
+		tree_size = 1;
+	}
+	if (readBinaryNode(stream, root, root_key, root_size, is_new_root)) {
+		if (is_new_root)
+			addChangedRegion(root_key, root_size);
+	} else {
+		if (!is_new_root)
+			addChangedRegion(root_key, root_size);
+		clear();
+	}
+	tree_size = calcNumNodes();
+	size_changed = true;
+
+	return stream;
+}
+
+
+std::istream& OctomapReader::CroppedOcTree::readCroppedData(std::istream& stream,
+															const octomap::OcTreeKey& min_key,
+															const octomap::OcTreeKey& max_key)
+{
+	min_key_ = min_key;
+	max_key_ = max_key;
+
+	octomap::OcTreeKey root_key(0, 0, 0);
+	int root_size = 1 << getTreeDepth();
+	bool is_new_root = !root;
+	if (is_new_root) {
+		root = new octomap::OcTreeNode();
+		tree_size = 1;
+	}
+	if (readNode(stream, root, root_key, root_size, is_new_root)) {
+		if (is_new_root)
+			addChangedRegion(root_key, root_size);
+	} else {
+		if (!is_new_root)
+			addChangedRegion(root_key, root_size);
+		clear();
+	}
+	tree_size = calcNumNodes();
+	size_changed = true;
+
+	return stream;
+}
+
+
+void OctomapReader::CroppedOcTree::setChangedRegions(std::vector<OctreeRegion>* changed_regions)
+{
+	changed_regions_ = changed_regions;
+}
+
+
+bool OctomapReader::CroppedOcTree::readBinaryNode(std::istream& stream,
+												  octomap::OcTreeNode* node,
+												  const octomap::OcTreeKey& node_key,
+												  int node_size,
+												  bool is_changed)
+{
+	char child_bits[2];
+	stream.read(child_bits, 2);
+	if (!stream)
+		return false;
+
+	// Getting the children inside the bounding box, the children of the
+	// previous tree are reused and the ones that aren't read are removed.
+	// Every child has two bits, i.e. free leaf (10), occupied leaf (01) or
+	// inner node (11). A child is changed if it's added or removed, or if its
+	// leaf changed. A new branch is added after reading it, since it's removed
+	// if it doesn't have read children
+	int child_size = node_size / 2;
+	octomap::OcTreeNode* children[8];
+	octomap::OcTreeKey child_keys[8];
+	bool is_inner[8];
+	bool is_new[8];
+	bool is_changed_child[8];
+	bool has_child_array = node && nodeHasChildren(node);
+	for (unsigned int i = 0; i < 8; i++) {
+		unsigned char bits = (unsigned char) child_bits[i / 4] >> (2 * (i % 4));
+		bool is_free = bits & 1;
+		bool is_occupied = bits & 2;
+		is_inner[i] = is_free && is_occupied;
+		is_new[i] = false;
+		is_changed_child[i] = is_changed;
+		children[i] = NULL;
+		if (!node)
+			continue;
+
+		child_keys[i] = getChildKey(node_key, child_size, i);
+		if ((!is_free && !is_occupied) || !isChildInside(child_keys[i], child_size)) {
+			if (nodeChildExists(node, i)) {
+				if (!is_changed)
+					addChangedRegion(child_keys[i], child_size);
+				deleteChild(node, i);
+			}
+			continue;
+		}
+
+		is_new[i] = !nodeChildExists(node, i);
+		if (is_new[i])
+			children[i] = createNodeChild(node, i);
+		else
+			children[i] = getNodeChild(node, i);
+		has_child_array = true;
+
+		if (!is_inner[i]) {
+			float log_odds = is_occupied ? clamping_thres_max : clamping_thres_min;
+			bool is_leaf_changed = is_new[i] || nodeHasChildren(children[i]) ||
+					children[i]->getLogOdds() != log_odds;
+			if (is_leaf_changed && !is_changed)
+				addChangedRegion(child_keys[i], child_size);
+			if (nodeHasChildren(children[i]))
+				pruneChildren(children[i]);
+			children[i]->setLogOdds(log_odds);
+		} else if (is_new[i])
+			is_changed_child[i] = true;
+		else if (!nodeHasChildren(children[i])) {
+			// A leaf that is split, its descendants are in this region
+			if (!is_changed)
+				addChangedRegion(child_keys[i], child_size);
+			is_changed_child[i] = true;
+		}
+	}
+
+	// Reading the inner children in the order of the stream. The skipped ones
+	// are parsed without nodes, and the ones without read children are
+	// removed since their part inside the box is unknown
+	bool has_children = false;
+	for (unsigned int i = 0; i < 8; i++) {
+		if (is_inner[i] && children[i]) {
+			if (readBinaryNode(stream, children[i], child_keys[i], child_size,
+							   is_changed_child[i])) {
+				if (is_new[i] && !is_changed)
+					addChangedRegion(child_keys[i], child_size);
+			} else {
+				if (!is_new[i] && !is_changed)
+					addChangedRegion(child_keys[i], child_size);
+				deleteChild(node, i);
+				children[i] = NULL;
+			}
+		} else if (is_inner[i])
+			readBinaryNode(stream, NULL, child_keys[i], child_size, true);
+
+		if (children[i])
+			has_children = true;
+	}
+
+	if (has_children)
+		node->updateOccupancyChildren();
+	else if (has_child_array) {
+		if (!is_changed)
+			addChangedRegion(node_key, node_size);
+		pruneChildren(node);
+	}
+
+	return has_children;
+}
+
+
+bool OctomapReader::CroppedOcTree::readNode(std::istream& stream,
+											octomap::OcTreeNode* node,
+											const octomap::OcTreeKey& node_key,
+											int node_size,
+											bool is_changed)
+{
+	// Reading the log-odds of the node and the bits of its children
+	float log_odds;
+	char child_bits;
+	stream.read((char*) &log_odds, sizeof(log_odds));
+	stream.read(&child_bits, 1);
+	if (!stream)
+		return false;
+
+	// A leaf, the children of the previous tree are removed
+	if (child_bits == 0) {
+		if (node) {
+			if (!is_changed &&
+					(nodeHasChildren(node) || node->getLogOdds() != log_odds))
+				addChangedRegion(node_key, node_size);
+			if (nodeHasChildren(node))
+				pruneChildren(node);
+			node->setLogOdds(log_odds);
+		}
+		return true;
+	}
+
+	// Reading the children in the order of the stream, the children of the
+	// previous tree are reused and the ones that aren't read are removed. The
+	// inner children without read children are removed too. A removed child is
+	// a changed region, and a new one if it's kept. A leaf that is split is a
+	// changed region with its descendants
+	if (node) {
+		if (!is_changed && !nodeHasChildren(node)) {
+			addChangedRegion(node_key, node_size);
+			is_changed = true;
+		}
+		node->setLogOdds(log_odds);
+	}
+	int child_size = node_size / 2;
+	bool has_children = false;
+	bool has_child_array = node && nodeHasChildren(node);
+	for (unsigned int i = 0; i < 8; i++) {
+		bool is_child = ((unsigned char) child_bits >> i) & 1;
+		octomap::OcTreeNode* child = NULL;
+		octomap::OcTreeKey child_key;
+		bool is_new = false;
+		if (node) {
+			child_key = getChildKey(node_key, child_size, i);
+			if (is_child && isChildInside(child_key, child_size)) {
+				is_new = !nodeChildExists(node, i);
+				if (is_new)
+					child = createNodeChild(node, i);
+				else
+					child = getNodeChild(node, i);
+				has_child_array = true;
+			} else if (nodeChildExists(node, i)) {
+				if (!is_changed)
+					addChangedRegion(child_key, child_size);
+				deleteChild(node, i);
+			}
+		}
+		if (!is_child)
+			continue;
+
+		if (readNode(stream, child, child_key, child_size, is_changed || is_new)) {
+			if (child && is_new && !is_changed)
+				addChangedRegion(child_key, child_size);
+		} else if (child) {
+			if (!is_new && !is_changed)
+				addChangedRegion(child_key, child_size);
+			deleteChild(node, i);
+			child = NULL;
+		}
+
+		if (child)
+			has_children = true;
+	}
+
+	// The occupancy of the node is the maximum of the read children
+	if (has_children)
+		node->updateOccupancyChildren();
+	else if (has_child_array) {
+		if (!is_changed)
+			addChangedRegion(node_key, node_size);
+		pruneChildren(node);
+	}
+
+	return has_children;
+}
+
+
+void OctomapReader::CroppedOcTree::deleteChild(octomap::OcTreeNode* node,
+											   unsigned int child)
+{
+	octomap::OcTreeNode* child_node = getNodeChild(node, child);
+	if (nodeHasChildren(child_node))
+		pruneChildren(child_node);
+	deleteNodeChild(node, child);
+}
+
+
+void OctomapReader::CroppedOcTree::pruneChildren(octomap::OcTreeNode* node)
+{
+	// Completing the children with equal leafs, so the node is collapsible
+	// and its array of children is freed too
+	for (unsigned int i = 0; i < 8; i++) {
+		octomap::OcTreeNode* child;
+		if (nodeChildExists(node, i)) {
+			child = getNodeChild(node, i);
+			if (nodeHasChildren(child))
+				pruneChildren(child);
+		} else
+			child = createNodeChild(node, i);
+		child->setLogOdds(0.);
+	}
+	pruneNode(node);
+}
+
+
+void OctomapReader::CroppedOcTree::addChangedRegion(const octomap::OcTreeKey& key,
+													int size)
+{
+	if (changed_regions_)
+		changed_regions_->push_back(OctreeRegion(key, size));
+}
+
+
+octomap::OcTreeKey OctomapReader::CroppedOcTree::getChildKey(const octomap::OcTreeKey& node_key,
+															 int child_size,
+															 unsigned int child)
+{
+	octomap::OcTreeKey child_key;
+	for (unsigned int i = 0; i < 3; i++)
+		child_key[i] = node_key[i] + ((child & (1 << i)) ? child_size : 0);
+
+	return child_key;
+}
+
+
+bool OctomapReader::CroppedOcTree::isChildInside(const octomap::OcTreeKey& child_key,
+												 int child_size) const
+{
+	for (unsigned int i = 0; i < 3; i++) {
+		if ((int) child_key[i] + child_size - 1 < (int) min_key_[i] ||
+				(int) child_key[i] > (int) max_key_[i])
+			return false;
+	}
+
+	return true;
+}
+
+
+OctomapReader::OctomapReader() : octree_(NULL), is_octree_(false),
+		is_bounding_box_(false), is_change_tracking_(false)
+{
+
+}
+
+
+OctomapReader::~OctomapReader()
+{
+	delete octree_;
+}
+
+
+octomap::OcTree* OctomapReader::read(const octomap_msgs::Octomap& msg)
+{
+	// Only the occupancy octrees can be read into the reused octree
+	if (msg.id != "OcTree") {
+		printf(YELLOW "Could not read an octomap of type %s\n" COLOR_RESET,
+				msg.id.c_str());
+		return NULL;
+	}
+
+	// The nodes of the previous tree are reused, unless the resolution changed
+	bool is_reused = octree_ && is_octree_;
+	if (!octree_)
+		octree_ = new CroppedOcTree(msg.resolution);
+	else if (octree_->getResolution() != msg.resolution) {
+		octree_->clear();
+		octree_->setResolution(msg.resolution);
+		is_reused = false;
+	}
+
+	// The changes are tracked in the reused tree, otherwise the whole tree
+	// changed
+	changed_regions_.clear();
+	if (is_change_tracking_ && !is_reused) {
+		octomap::OcTreeKey root_key(0, 0, 0);
+		changed_regions_.push_back(OctreeRegion(root_key, 1 << octree_->getTreeDepth()));
+	}
+	octree_->setChangedRegions(is_change_tracking_ && is_reused ? &changed_regions_ : NULL);
+
+	// Reading the binary (occupied/free) or full (log-odds) data of the tree,
+	// only inside the bounding box if there is one
+	octomap::OcTreeKey min_key(0, 0, 0);
+	octomap::OcTreeKey max_key(std::numeric_limits<octomap::key_type>::max(),
+							   std::numeric_limits<octomap::key_type>::max(),
+							   std::numeric_limits<octomap::key_type>::max());
+	if (is_bounding_box_) {
+		for (unsigned int i = 0; i < 3; i++) {
+			min_key[i] = getClampedKey(*octree_, bbx_min_(i));
+			max_key[i] = getClampedKey(*octree_, bbx_max_(i));
+		}
+	}
+
+	MessageBuffer buffer(msg);
+	std::istream stream(&buffer);
+	if (msg.binary)
+		octree_->readCroppedBinaryData(stream, min_key, max_key);
+	else
+		octree_->readCroppedData(stream, min_key, max_key);
+
+	is_octree_ = stream.good() || stream.eof();
+	if (!is_octree_) {
+		octree_->clear();
+		return NULL;
+	}
+
+	return octree_;
+}
+
+
+octomap::OcTree* OctomapReader::getOctree() const
+{
+	if (is_octree_)
+		return octree_;
+	else
+		return NULL;
+}
+
+
+void OctomapReader::clear()
+{
+	if (octree_)
+		octree_->clear();
+	is_octree_ = false;
+}
+
+
+void OctomapReader::setBoundingBox(const octomap::point3d& min,
+								   const octomap::point3d& max)
+{
+	bbx_min_ = min;
+	bbx_max_ = max;
+	is_bounding_box_ = true;
+}
+
+
+void OctomapReader::clearBoundingBox()
+{
+	is_bounding_box_ = false;
+}
+
+
+void OctomapReader::setChangeTracking(bool tracking)
+{
+	is_change_tracking_ = tracking;
+	changed_regions_.clear();
+}
+
+
+const std::vector<OctomapReader::OctreeRegion>& OctomapReader::getChangedRegions() const
+{
+	return changed_regions_;
+}
+
+} //@namespace terrain_server
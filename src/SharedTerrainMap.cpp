@@ -0,0 +1,357 @@
+#include <terrain_server/SharedTerrainMap.h>
+#include <dwl/utils/utils.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+
+
+namespace terrain_server
+{
+
+/** @brief Magic number of the segment layout */
+static const uint32_t SEGMENT_MAGIC = 0x54534d31;
+
+/** @brief Number of reads of a slot before giving up, it's only retried if
+ * the writer reused the slot during the read */
+static const unsigned int MAX_READ_TRIES = 4;
+
+
+SharedTerrainMap::SharedTerrainMap() : segment_(NULL), segment_size_(0),
+		is_writer_(false)
+{
+
+}
+
+
+SharedTerrainMap::~SharedTerrainMap()
+{
+	close();
+}
+
+
+bool SharedTerrainMap::create(const std::string& name,
+							  unsigned int capacity)
+{
+	close();
+
+	// Removing a stale segment, a reader that still maps it keeps its memory
+	shm_unlink(name.c_str());
+	int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd < 0) {
+		printf(YELLOW "Could not create the shared memory %s\n" COLOR_RESET,
+				name.c_str());
+		return false;
+	}
+
+	size_t size = getSegmentSize(capacity);
+	if (ftruncate(fd, size) != 0) {
+		::close(fd);
+		shm_unlink(name.c_str());
+		return false;
+	}
+
+	void* address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (address == MAP_FAILED) {
+		shm_unlink(name.c_str());
+		return false;
+	}
+
+	segment_ = static_cast<Segment*>(address);
+	segment_size_ = size;
+	name_ = name;
+	is_writer_ = true;
+
+	// Initializing the header, the slots aren't written yet
+	segment_->capacity = capacity;
+	segment_->active_slot.store(0);
+	segment_->is_retired.store(0);
+	for (unsigned int s = 0; s < 2; s++)
+		segment_->slot[s].sequence.store(0);
+	std::atomic_thread_fence(std::memory_order_release);
+	segment_->magic = SEGMENT_MAGIC;
+
+	return true;
+}
+
+
+bool SharedTerrainMap::open(const std::string& name)
+{
+	close();
+
+	int fd = shm_open(name.c_str(), O_RDONLY, 0);
+	if (fd < 0)
+		return false;
+
+	struct stat status;
+	if (fstat(fd, &status) != 0 || (size_t) status.st_size < sizeof(Segment)) {
+		::close(fd);
+		return false;
+	}
+
+	void* address = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (address == MAP_FAILED)
+		return false;
+
+	// Checking the layout of the segment
+	Segment* segment = static_cast<Segment*>(address);
+	if (segment->magic != SEGMENT_MAGIC ||
+			getSegmentSize(segment->capacity) > (size_t) status.st_size) {
+		munmap(address, status.st_size);
+		return false;
+	}
+
+	segment_ = segment;
+	segment_size_ = status.st_size;
+	name_ = name;
+	is_writer_ = false;
+
+	return true;
+}
+
+
+void SharedTerrainMap::close()
+{
+	if (!segment_)
+		return;
+
+	// The readers are notified that the segment is replaced
+	if (is_writer_) {
+		segment_->is_retired.store(1, std::memory_order_release);
+		shm_unlink(name_.c_str());
+	}
+
+	munmap(segment_, segment_size_);
+	segment_ = NULL;
+	segment_size_ = 0;
+	is_writer_ = false;
+}
+
+
+bool SharedTerrainMap::isOpen() const
+{
+	return segment_ != NULL;
+}
+
+
+bool SharedTerrainMap::isRetired() const
+{
+	return segment_ && segment_->is_retired.load(std::memory_order_acquire);
+}
+
+
+unsigned int SharedTerrainMap::getCapacity() const
+{
+	if (!segment_)
+		return 0;
+
+	return segment_->capacity;
+}
+
+
+bool SharedTerrainMap::write(const TerrainGrid& grid,
+							 double plane_size,
+							 double height_size)
+{
+	unsigned int num_cells = grid.getNumberOfCells();
+	if (!segment_ || !is_writer_ || num_cells > segment_->capacity)
+		return false;
+
+	// Marking the inactive slot as written (odd sequence)
+	unsigned int s = 1 - segment_->active_slot.load(std::memory_order_relaxed);
+	Slot& slot = segment_->slot[s];
+	uint64_t sequence = slot.sequence.load(std::memory_order_relaxed);
+	slot.sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	slot.plane_size = plane_size;
+	slot.height_size = height_size;
+	slot.origin_key_x = grid.getOriginKeyX();
+	slot.origin_key_y = grid.getOriginKeyY();
+	slot.size_x = grid.getSizeX();
+	slot.size_y = grid.getSizeY();
+
+	// Unrolling the circular grid from its origin
+	Cell* cells = getCells(s);
+	unsigned int size_x = grid.getSizeX();
+	unsigned int size_y = grid.getSizeY();
+	unsigned int first_slot_x = size_x > 0 ? grid.getOriginKeyX() % size_x : 0;
+	for (unsigned int y = 0; y < size_y; y++) {
+		unsigned int slot_offset = ((grid.getOriginKeyY() + y) % size_y) * size_x;
+		unsigned int slot_x = first_slot_x;
+		for (unsigned int x = 0; x < size_x; x++) {
+			unsigned int index = slot_offset + slot_x;
+			if (++slot_x == size_x)
+				slot_x = 0;
+
+			Cell& cell = cells[y * size_x + x];
+			cell.is_terrain = grid.isTerrain(index);
+			if (!cell.is_terrain)
+				continue;
+
+			const Eigen::Vector3f& normal = grid.getNormal(index);
+			cell.height = grid.getHeight(index);
+			cell.cost = grid.getCost(index);
+			cell.normal[0] = normal(0);
+			cell.normal[1] = normal(1);
+			cell.normal[2] = normal(2);
+			cell.key_z = grid.getKeyZ(index);
+		}
+	}
+
+	// Publishing the slot
+	slot.sequence.store(sequence + 2, std::memory_order_release);
+	segment_->active_slot.store(s, std::memory_order_release);
+
+	return true;
+}
+
+
+bool SharedTerrainMap::getResolution(double& plane_size,
+									 double& height_size) const
+{
+	if (!segment_)
+		return false;
+
+	for (unsigned int i = 0; i < MAX_READ_TRIES; i++) {
+		const Slot& slot = segment_->slot[segment_->active_slot.load(std::memory_order_acquire)];
+		uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+		if (sequence == 0)
+			return false;
+		else if (sequence & 1)
+			continue;
+
+		plane_size = slot.plane_size;
+		height_size = slot.height_size;
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot.sequence.load(std::memory_order_relaxed) == sequence)
+			return true;
+	}
+
+	return false;
+}
+
+
+bool SharedTerrainMap::getCell(float& height,
+							   float& cost,
+							   Eigen::Vector3f& normal,
+							   unsigned short& key_z,
+							   unsigned short key_x,
+							   unsigned short key_y) const
+{
+	if (!segment_)
+		return false;
+
+	for (unsigned int i = 0; i < MAX_READ_TRIES; i++) {
+		unsigned int s = segment_->active_slot.load(std::memory_order_acquire);
+		const Slot& slot = segment_->slot[s];
+		uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+		if (sequence == 0)
+			return false;
+		else if (sequence & 1)
+			continue;
+
+		// Reading the cell in place
+		int x = (int) key_x - slot.origin_key_x;
+		int y = (int) key_y - slot.origin_key_y;
+		bool is_cell = x >= 0 && x < (int) slot.size_x &&
+				y >= 0 && y < (int) slot.size_y;
+		Cell cell;
+		if (is_cell)
+			memcpy(&cell, &getCells(s)[y * slot.size_x + x], sizeof(Cell));
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot.sequence.load(std::memory_order_relaxed) != sequence)
+			continue;
+
+		if (!is_cell || !cell.is_terrain)
+			return false;
+
+		height = cell.height;
+		cost = cell.cost;
+		normal = Eigen::Vector3f(cell.normal[0], cell.normal[1], cell.normal[2]);
+		key_z = cell.key_z;
+		return true;
+	}
+
+	return false;
+}
+
+
+bool SharedTerrainMap::getGrid(TerrainGrid& grid,
+							   double& plane_size,
+							   double& height_size) const
+{
+	if (!segment_)
+		return false;
+
+	for (unsigned int i = 0; i < MAX_READ_TRIES; i++) {
+		unsigned int s = segment_->active_slot.load(std::memory_order_acquire);
+		const Slot& slot = segment_->slot[s];
+		uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+		if (sequence == 0)
+			return false;
+		else if (sequence & 1)
+			continue;
+
+		plane_size = slot.plane_size;
+		height_size = slot.height_size;
+		unsigned int size_x = slot.size_x;
+		unsigned int size_y = slot.size_y;
+		int origin_key_x = slot.origin_key_x;
+		int origin_key_y = slot.origin_key_y;
+		if (size_x * size_y > segment_->capacity)
+			continue;
+
+		// Copying the cells into the grid, which is placed at the origin
+		if (grid.getSizeX() != size_x || grid.getSizeY() != size_y)
+			grid.resize(size_x, size_y);
+		grid.clear();
+		grid.move(origin_key_x + size_x / 2, origin_key_y + size_y / 2);
+
+		const Cell* cells = getCells(s);
+		for (unsigned int y = 0; y < size_y; y++) {
+			for (unsigned int x = 0; x < size_x; x++) {
+				Cell cell;
+				memcpy(&cell, &cells[y * size_x + x], sizeof(Cell));
+				if (!cell.is_terrain)
+					continue;
+
+				// A torn slot can have keys outside the grid, the sequence
+				// check discards it
+				unsigned int index;
+				if (!grid.getIndex(index, origin_key_x + x, origin_key_y + y))
+					continue;
+
+				grid.setHeight(index, cell.height, cell.key_z);
+				grid.setTerrain(index, cell.cost,
+								Eigen::Vector3f(cell.normal[0], cell.normal[1], cell.normal[2]));
+			}
+		}
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot.sequence.load(std::memory_order_relaxed) == sequence)
+			return true;
+	}
+
+	return false;
+}
+
+
+SharedTerrainMap::Cell* SharedTerrainMap::getCells(unsigned int slot) const
+{
+	Cell* cells = reinterpret_cast<Cell*>(reinterpret_cast<char*>(segment_) + sizeof(Segment));
+	return cells + slot * segment_->capacity;
+}
+
+
+size_t SharedTerrainMap::getSegmentSize(unsigned int capacity)
+{
+	return sizeof(Segment) + 2 * (size_t) capacity * sizeof(Cell);
+}
+
+} //@namespace terrain_server
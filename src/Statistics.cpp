@@ -0,0 +1,165 @@
+#include <terrain_server/Statistics.h>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+
+namespace terrain_server
+{
+
+/** @brief Log-scale bins of the histograms, from 1e-7 to 1e9 (the values
+ * outside this range are clamped). The first bin counts the zero values */
+static const int BINS_PER_DECADE = 8;
+static const int MIN_DECADE = -7;
+static const int MAX_DECADE = 9;
+static const unsigned int NUM_BINS = 1 + (MAX_DECADE - MIN_DECADE) * BINS_PER_DECADE;
+
+
+/** @brief Gets the bin of a value */
+static unsigned int getBin(double value)
+{
+	if (value <= 0.)
+		return 0;
+
+	int bin = 1 + (int) floor((log10(value) - MIN_DECADE) * BINS_PER_DECADE);
+	return (unsigned int) std::min(std::max(bin, 1), (int) NUM_BINS - 1);
+}
+
+
+/**
+ * @brief Gets a value inside a bin, it's interpolated in log-scale
+ * @param unsigned int Bin
+ * @param double Fraction of the bin, from its lower (0) to its upper (1) bound
+ */
+static double getBinValue(unsigned int bin,
+						  double fraction)
+{
+	if (bin == 0)
+		return 0.;
+
+	return pow(10., MIN_DECADE + (bin - 1 + fraction) / BINS_PER_DECADE);
+}
+
+
+Statistics::Statistics() : window_start_(getTime()), is_enabled_(false)
+{
+
+}
+
+
+Statistics::~Statistics()
+{
+
+}
+
+
+void Statistics::setEnabled(bool enable)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (unsigned int i = 0; i < metrics_.size(); i++)
+		clearMetric(metrics_[i]);
+	window_start_ = getTime();
+
+	is_enabled_.store(enable, std::memory_order_relaxed);
+}
+
+
+unsigned int Statistics::addTimer(const std::string& name)
+{
+	return addCounter(name, "s");
+}
+
+
+unsigned int Statistics::addCounter(const std::string& name,
+									const std::string& unit)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	Metric metric;
+	metric.name = name;
+	metric.unit = unit;
+	metric.histogram.resize(NUM_BINS);
+	clearMetric(metric);
+	metrics_.push_back(metric);
+
+	return metrics_.size() - 1;
+}
+
+
+void Statistics::addSample(unsigned int metric,
+						   double value)
+{
+	if (!isEnabled())
+		return;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (metric >= metrics_.size())
+		return;
+
+	Metric& m = metrics_[metric];
+	m.histogram[getBin(value)]++;
+	m.samples++;
+	m.total += value;
+	m.min = std::min(m.min, value);
+	m.max = std::max(m.max, value);
+}
+
+
+double Statistics::rollWindow(std::vector<Summary>& summaries)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	summaries.resize(metrics_.size());
+	for (unsigned int i = 0; i < metrics_.size(); i++) {
+		Metric& metric = metrics_[i];
+		Summary& summary = summaries[i];
+		summary.name = metric.name;
+		summary.unit = metric.unit;
+		summary.samples = metric.samples;
+		summary.total = metric.total;
+		if (metric.samples == 0) {
+			summary.mean = summary.min = summary.max = 0.;
+			summary.p50 = summary.p90 = summary.p99 = 0.;
+			continue;
+		}
+
+		summary.mean = metric.total / metric.samples;
+		summary.min = metric.min;
+		summary.max = metric.max;
+
+		// Getting the percentiles from the histogram, they are bounded by the
+		// exact minimum and maximum values
+		const double percentiles[3] = {0.5, 0.9, 0.99};
+		double* values[3] = {&summary.p50, &summary.p90, &summary.p99};
+		unsigned int p = 0;
+		unsigned long cumulative = 0;
+		for (unsigned int bin = 0; bin < NUM_BINS && p < 3; bin++) {
+			unsigned long count = metric.histogram[bin];
+			while (p < 3 && cumulative + count >= ceil(percentiles[p] * metric.samples)) {
+				double rank = ceil(percentiles[p] * metric.samples) - cumulative;
+				double value = getBinValue(bin, rank / count);
+				*values[p] = std::min(std::max(value, metric.min), metric.max);
+				p++;
+			}
+			cumulative += count;
+		}
+
+		clearMetric(metric);
+	}
+
+	double now = getTime();
+	double window = now - window_start_;
+	window_start_ = now;
+
+	return window;
+}
+
+
+void Statistics::clearMetric(Metric& metric)
+{
+	std::fill(metric.histogram.begin(), metric.histogram.end(), 0);
+	metric.samples = 0;
+	metric.total = 0.;
+	metric.min = std::numeric_limits<double>::max();
+	metric.max = -std::numeric_limits<double>::max();
+}
+
+} //@namespace terrain_server
@@ -0,0 +1,135 @@
+#include <terrain_server/SurfaceExtraction.h>
+#include <algorithm>
+
+
+namespace terrain_server
+{
+
+/** @brief Number of rows of key per tile */
+static const unsigned int TILE_ROWS = 8;
+
+
+SurfaceExtraction::SurfaceExtraction() : size_x_(0), size_y_(0)
+{
+
+}
+
+
+SurfaceExtraction::~SurfaceExtraction()
+{
+
+}
+
+
+void SurfaceExtraction::compute(octomap::OcTree* octomap,
+								const octomap::OcTreeKey& min_key,
+								const octomap::OcTreeKey& max_key,
+								int depth,
+								ThreadPool& pool)
+{
+	min_key_ = min_key;
+	max_key_ = max_key;
+	size_x_ = max_key[0] - min_key[0] + 1;
+	size_y_ = max_key[1] - min_key[1] + 1;
+	surface_key_.assign(size_x_ * size_y_, -1);
+
+	unsigned int num_tiles = (size_y_ + TILE_ROWS - 1) / TILE_ROWS;
+	pool.run(num_tiles, [&](unsigned int tile, unsigned int thread) {
+		octomap::OcTreeKey tile_min_key = min_key;
+		octomap::OcTreeKey tile_max_key = max_key;
+		tile_min_key[1] = min_key[1] + tile * TILE_ROWS;
+		tile_max_key[1] = std::min((int) tile_min_key[1] + (int) TILE_ROWS - 1,
+								   (int) max_key[1]);
+		computeTile(octomap, tile_min_key, tile_max_key, depth);
+	});
+}
+
+
+void SurfaceExtraction::computeTile(octomap::OcTree* octomap,
+									const octomap::OcTreeKey& min_key,
+									const octomap::OcTreeKey& max_key,
+									int depth)
+{
+	octomap::OcTreeNode* root = octomap->getRoot();
+	if (!root)
+		return;
+
+	octomap::OcTreeKey root_key(0, 0, 0);
+	searchNode(octomap, root, root_key, 0, min_key, max_key, depth);
+}
+
+
+void SurfaceExtraction::searchNode(octomap::OcTree* octomap,
+								   octomap::OcTreeNode* node,
+								   const octomap::OcTreeKey& node_key,
+								   int node_depth,
+								   const octomap::OcTreeKey& min_key,
+								   const octomap::OcTreeKey& max_key,
+								   int depth)
+{
+	// Skipping the nodes outside the bounding box
+	int node_size = 1 << (octomap->getTreeDepth() - node_depth);
+	for (unsigned int i = 0; i < 3; i++) {
+		if ((int) node_key[i] + node_size - 1 < (int) min_key[i] ||
+				(int) node_key[i] > (int) max_key[i])
+			return;
+	}
+
+	// The occupancy of an inner node is the maximum of its children, so a
+	// free (or unknown) node doesn't have occupied voxels and its whole span
+	// is skipped
+	if (!octomap->isNodeOccupied(node))
+		return;
+
+	// Searching the children, from the top to the bottom ones. Note that the
+	// nodes of the query depth (or pruned ones) could be bigger than a
+	// voxel, so we clip the keys that they cover to the bounding box
+	if (node_depth < depth && octomap->nodeHasChildren(node)) {
+		int child_size = node_size / 2;
+		for (int child = 7; child >= 0; child--) {
+			if (!octomap->nodeChildExists(node, child))
+				continue;
+
+			octomap::OcTreeKey child_key;
+			child_key[0] = node_key[0] + ((child & 1) ? child_size : 0);
+			child_key[1] = node_key[1] + ((child & 2) ? child_size : 0);
+			child_key[2] = node_key[2] + ((child & 4) ? child_size : 0);
+			searchNode(octomap, octomap->getNodeChild(node, child), child_key,
+					   node_depth + 1, min_key, max_key, depth);
+		}
+		return;
+	}
+
+	int top_key = std::min((int) node_key[2] + node_size - 1, (int) max_key[2]);
+	int first_x = std::max((int) node_key[0], (int) min_key[0]);
+	int last_x = std::min((int) node_key[0] + node_size - 1, (int) max_key[0]);
+	int first_y = std::max((int) node_key[1], (int) min_key[1]);
+	int last_y = std::min((int) node_key[1] + node_size - 1, (int) max_key[1]);
+	for (int y = first_y; y <= last_y; y++) {
+		int* row = &surface_key_[(y - min_key_[1]) * size_x_];
+		for (int x = first_x; x <= last_x; x++) {
+			int& surface_key = row[x - min_key_[0]];
+			if (top_key > surface_key)
+				surface_key = top_key;
+		}
+	}
+}
+
+
+bool SurfaceExtraction::getSurfaceKey(octomap::key_type& key_z,
+									  octomap::key_type key_x,
+									  octomap::key_type key_y) const
+{
+	if (key_x < min_key_[0] || key_x > max_key_[0] ||
+			key_y < min_key_[1] || key_y > max_key_[1])
+		return false;
+
+	int surface_key = surface_key_[(key_y - min_key_[1]) * size_x_ + key_x - min_key_[0]];
+	if (surface_key < 0)
+		return false;
+
+	key_z = surface_key;
+	return true;
+}
+
+} //@namespace terrain_server
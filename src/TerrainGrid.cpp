@@ -0,0 +1,438 @@
+#include <terrain_server/TerrainGrid.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <limits>
+
+
+namespace terrain_server
+{
+
+TerrainGrid::TerrainGrid() : size_x_(0), size_y_(0),
+		origin_key_x_(0), origin_key_y_(0), is_centred_(false),
+		num_height_cells_(0), num_terrain_cells_(0), is_update_tracking_(false),
+		is_cleared_(false)
+{
+
+}
+
+
+TerrainGrid::TerrainGrid(const TerrainGrid& grid) : size_x_(0), size_y_(0),
+		origin_key_x_(0), origin_key_y_(0), is_centred_(false),
+		num_height_cells_(0), num_terrain_cells_(0), is_update_tracking_(false),
+		is_cleared_(false)
+{
+	*this = grid;
+}
+
+
+TerrainGrid::~TerrainGrid()
+{
+
+}
+
+
+TerrainGrid& TerrainGrid::operator=(const TerrainGrid& grid)
+{
+	if (this == &grid)
+		return *this;
+
+	// Copying the layers, the vectors reuse their memory. Note that the
+	// dilation buffers and the updated cells aren't copied because they are
+	// only used by the grid that is computed
+	size_x_ = grid.size_x_;
+	size_y_ = grid.size_y_;
+	origin_key_x_ = grid.origin_key_x_;
+	origin_key_y_ = grid.origin_key_y_;
+	is_centred_ = grid.is_centred_;
+	height_ = grid.height_;
+	cost_ = grid.cost_;
+	normal_ = grid.normal_;
+	key_z_ = grid.key_z_;
+	status_ = grid.status_;
+	row_first_key_ = grid.row_first_key_;
+	row_last_key_ = grid.row_last_key_;
+	num_height_cells_ = grid.num_height_cells_;
+	num_terrain_cells_ = grid.num_terrain_cells_.load();
+
+	return *this;
+}
+
+
+void TerrainGrid::resize(unsigned int size_x,
+						 unsigned int size_y)
+{
+	size_x_ = size_x;
+	size_y_ = size_y;
+
+	unsigned int num_cells = size_x_ * size_y_;
+	height_.assign(num_cells, 0.);
+	cost_.assign(num_cells, 0.);
+	normal_.assign(num_cells, Eigen::Vector3f::UnitZ());
+	key_z_.assign(num_cells, 0);
+	status_.assign(num_cells, EMPTY);
+	row_first_key_.assign(size_y_, std::numeric_limits<int>::max());
+	row_last_key_.assign(size_y_, std::numeric_limits<int>::min());
+
+	num_height_cells_ = 0;
+	num_terrain_cells_ = 0;
+	is_centred_ = false;
+	updated_cells_.clear();
+	is_cleared_ = true;
+}
+
+
+void TerrainGrid::move(unsigned short centre_key_x,
+					   unsigned short centre_key_y)
+{
+	int new_origin_x = (int) centre_key_x - (int) size_x_ / 2;
+	int new_origin_y = (int) centre_key_y - (int) size_y_ / 2;
+
+	if (is_centred_) {
+		// Clearing the columns that leave the grid
+		int shift_x = new_origin_x - origin_key_x_;
+		if (abs(shift_x) >= (int) size_x_)
+			clear();
+		else if (shift_x > 0)
+			clearRange(origin_key_x_, shift_x, true);
+		else if (shift_x < 0)
+			clearRange(origin_key_x_ + (int) size_x_ + shift_x, -shift_x, true);
+
+		// Clearing the rows that leave the grid
+		int shift_y = new_origin_y - origin_key_y_;
+		if (abs(shift_y) >= (int) size_y_)
+			clear();
+		else if (shift_y > 0)
+			clearRange(origin_key_y_, shift_y, false);
+		else if (shift_y < 0)
+			clearRange(origin_key_y_ + (int) size_y_ + shift_y, -shift_y, false);
+	}
+
+	origin_key_x_ = new_origin_x;
+	origin_key_y_ = new_origin_y;
+	is_centred_ = true;
+}
+
+
+void TerrainGrid::clear()
+{
+	status_.assign(status_.size(), EMPTY);
+	row_first_key_.assign(size_y_, std::numeric_limits<int>::max());
+	row_last_key_.assign(size_y_, std::numeric_limits<int>::min());
+	num_height_cells_ = 0;
+	num_terrain_cells_ = 0;
+	updated_cells_.clear();
+	is_cleared_ = true;
+}
+
+
+bool TerrainGrid::getIndex(unsigned int& index,
+						   unsigned short key_x,
+						   unsigned short key_y) const
+{
+	if ((int) key_x < origin_key_x_ || (int) key_x >= origin_key_x_ + (int) size_x_ ||
+			(int) key_y < origin_key_y_ || (int) key_y >= origin_key_y_ + (int) size_y_)
+		return false;
+
+	index = (key_y % size_y_) * size_x_ + key_x % size_x_;
+	return true;
+}
+
+
+void TerrainGrid::getKey(unsigned short& key_x,
+						 unsigned short& key_y,
+						 unsigned int index) const
+{
+	int slot_x = index % size_x_;
+	int slot_y = index / size_x_;
+
+	// Offsets of the slots with respect to the slot of the origin
+	int offset_x = (slot_x - origin_key_x_ % (int) size_x_ + size_x_) % size_x_;
+	int offset_y = (slot_y - origin_key_y_ % (int) size_y_ + size_y_) % size_y_;
+
+	key_x = origin_key_x_ + offset_x;
+	key_y = origin_key_y_ + offset_y;
+}
+
+
+void TerrainGrid::setHeight(unsigned int index,
+							float height,
+							unsigned short key_z)
+{
+	if (!(status_[index] & HEIGHT)) {
+		num_height_cells_++;
+
+		// Extending the range of keys of the row
+		unsigned short key_x, key_y;
+		getKey(key_x, key_y, index);
+		unsigned int slot_y = index / size_x_;
+		row_first_key_[slot_y] = std::min(row_first_key_[slot_y], (int) key_x);
+		row_last_key_[slot_y] = std::max(row_last_key_[slot_y], (int) key_x);
+	} else if (status_[index] & TERRAIN)
+		num_terrain_cells_--;
+
+	height_[index] = height;
+	key_z_[index] = key_z;
+	status_[index] = (status_[index] & (SCANNED | MOMENT_NORMAL | UPDATED)) | HEIGHT;
+	markUpdated(index);
+}
+
+
+void TerrainGrid::setTerrain(unsigned int index,
+							 float cost,
+							 const Eigen::Vector3f& normal)
+{
+	if (!(status_[index] & TERRAIN))
+		num_terrain_cells_.fetch_add(1, std::memory_order_relaxed);
+
+	cost_[index] = cost;
+	normal_[index] = normal;
+	status_[index] |= TERRAIN;
+}
+
+
+void TerrainGrid::setScanned(unsigned int index,
+							 bool scanned)
+{
+	if (scanned)
+		status_[index] |= SCANNED;
+	else
+		status_[index] &= ~SCANNED;
+}
+
+
+void TerrainGrid::setMomentNormal(unsigned int index,
+								  bool moment_normal)
+{
+	if (moment_normal)
+		status_[index] |= MOMENT_NORMAL;
+	else
+		status_[index] &= ~MOMENT_NORMAL;
+}
+
+
+void TerrainGrid::resetScanned()
+{
+	unsigned int num_cells = status_.size();
+	for (unsigned int index = 0; index < num_cells; index++)
+		status_[index] &= ~SCANNED;
+}
+
+
+void TerrainGrid::resetScanned(const std::vector<unsigned int>& indexes)
+{
+	for (unsigned int i = 0; i < indexes.size(); i++)
+		status_[indexes[i]] &= ~SCANNED;
+}
+
+
+void TerrainGrid::invalidateTerrain(std::vector<unsigned int>& dirty_indexes,
+									const std::vector<unsigned int>& indexes,
+									unsigned int radius)
+{
+	dirty_indexes.clear();
+	if (indexes.empty())
+		return;
+
+	// Computing the bounding box (in offsets from the origin) of the cells
+	int min_x = size_x_, max_x = -1, min_y = size_y_, max_y = -1;
+	std::vector<unsigned int>::const_iterator it;
+	for (it = indexes.begin(); it != indexes.end(); it++) {
+		unsigned short key_x, key_y;
+		getKey(key_x, key_y, *it);
+		min_x = std::min(min_x, key_x - origin_key_x_);
+		max_x = std::max(max_x, key_x - origin_key_x_);
+		min_y = std::min(min_y, key_y - origin_key_y_);
+		max_y = std::max(max_y, key_y - origin_key_y_);
+	}
+	min_x = std::max(min_x - (int) radius, 0);
+	max_x = std::min(max_x + (int) radius, (int) size_x_ - 1);
+	min_y = std::max(min_y - (int) radius, 0);
+	max_y = std::min(max_y + (int) radius, (int) size_y_ - 1);
+	int width = max_x - min_x + 1;
+	int height = max_y - min_y + 1;
+
+	// Marking the cells
+	dilation_mask_.assign(width * height, 0);
+	for (it = indexes.begin(); it != indexes.end(); it++) {
+		unsigned short key_x, key_y;
+		getKey(key_x, key_y, *it);
+		dilation_mask_[(key_y - origin_key_y_ - min_y) * width +
+					   key_x - origin_key_x_ - min_x] = 1;
+	}
+
+	// Dilating the rows with a sliding window, and then the columns
+	int r = radius;
+	dilation_count_.assign(width * height, 0);
+	for (int y = 0; y < height; y++) {
+		unsigned char* mask = &dilation_mask_[y * width];
+		unsigned short* count = &dilation_count_[y * width];
+		int window = 0;
+		for (int x = -r; x < width; x++) {
+			if (x + r < width)
+				window += mask[x + r];
+			if (x - r - 1 >= 0)
+				window -= mask[x - r - 1];
+			if (x >= 0)
+				count[x] = window;
+		}
+	}
+	for (int x = 0; x < width; x++) {
+		int window = 0;
+		for (int y = -r; y < height; y++) {
+			if (y + r < height)
+				window += dilation_count_[(y + r) * width + x] > 0;
+			if (y - r - 1 >= 0)
+				window -= dilation_count_[(y - r - 1) * width + x] > 0;
+			if (y >= 0)
+				dilation_mask_[y * width + x] = window > 0;
+		}
+	}
+
+	// Invalidating the terrain data of the dilated cells
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			if (!dilation_mask_[y * width + x])
+				continue;
+
+			unsigned int index;
+			getIndex(index, origin_key_x_ + min_x + x, origin_key_y_ + min_y + y);
+			if (status_[index] & TERRAIN) {
+				status_[index] &= ~TERRAIN;
+				num_terrain_cells_--;
+				markUpdated(index);
+			}
+			if (status_[index] & HEIGHT) {
+				dirty_indexes.push_back(index);
+				markUpdated(index);
+			}
+		}
+	}
+}
+
+
+void TerrainGrid::removeCell(unsigned int index)
+{
+	// Keeping the record of the cell, and recording it if it had a height
+	bool is_height = status_[index] & HEIGHT;
+	unsigned char updated = status_[index] & UPDATED;
+	clearCell(index);
+	status_[index] |= updated;
+	if (is_height)
+		markUpdated(index);
+}
+
+
+unsigned int TerrainGrid::cropRow(unsigned short key_y,
+								 int first_key_x,
+								 int last_key_x)
+{
+	if ((int) key_y < origin_key_y_ || (int) key_y >= origin_key_y_ + (int) size_y_)
+		return 0;
+
+	unsigned int slot_y = key_y % size_y_;
+	int& row_first_key = row_first_key_[slot_y];
+	int& row_last_key = row_last_key_[slot_y];
+	if (row_first_key > row_last_key)
+		return 0;
+
+	// Removing the cells before and after the kept range. Note that the range
+	// of the row could have keys that already left the grid
+	unsigned int num_removed_cells = 0;
+	unsigned int offset = slot_y * size_x_;
+	int grid_first_key = std::max(row_first_key, origin_key_x_);
+	int grid_last_key = std::min(row_last_key, origin_key_x_ + (int) size_x_ - 1);
+	const int first_keys[2] = {grid_first_key,
+							   std::max(std::max(last_key_x + 1, first_key_x), grid_first_key)};
+	const int last_keys[2] = {std::min(first_key_x - 1, grid_last_key), grid_last_key};
+	for (unsigned int i = 0; i < 2; i++) {
+		for (int key_x = first_keys[i]; key_x <= last_keys[i]; key_x++) {
+			unsigned int index = offset + key_x % size_x_;
+			if (status_[index] & HEIGHT) {
+				removeCell(index);
+				num_removed_cells++;
+			}
+		}
+	}
+
+	row_first_key = std::max(row_first_key, first_key_x);
+	row_last_key = std::min(row_last_key, last_key_x);
+
+	return num_removed_cells;
+}
+
+
+void TerrainGrid::setUpdateTracking(bool tracking)
+{
+	is_update_tracking_ = tracking;
+	if (!tracking) {
+		for (unsigned int i = 0; i < updated_cells_.size(); i++)
+			status_[updated_cells_[i]] &= ~UPDATED;
+		updated_cells_.clear();
+	}
+}
+
+
+bool TerrainGrid::takeUpdatedCells(std::vector<unsigned int>& indexes)
+{
+	// Taking the recorded cells that are still marked, i.e. a slot that left
+	// the grid (and maybe was recorded again) isn't marked or it's taken once
+	indexes.clear();
+	for (unsigned int i = 0; i < updated_cells_.size(); i++) {
+		unsigned int index = updated_cells_[i];
+		if (status_[index] & UPDATED) {
+			status_[index] &= ~UPDATED;
+			indexes.push_back(index);
+		}
+	}
+	updated_cells_.clear();
+
+	bool is_cleared = is_cleared_;
+	is_cleared_ = false;
+	return !is_cleared;
+}
+
+
+void TerrainGrid::markUpdated(unsigned int index)
+{
+	if (is_update_tracking_ && !(status_[index] & UPDATED)) {
+		status_[index] |= UPDATED;
+		updated_cells_.push_back(index);
+	}
+}
+
+
+void TerrainGrid::clearCell(unsigned int index)
+{
+	if (status_[index] & HEIGHT) {
+		num_height_cells_--;
+		if (status_[index] & TERRAIN)
+			num_terrain_cells_--;
+	}
+
+	status_[index] = EMPTY;
+}
+
+
+void TerrainGrid::clearRange(int first_key,
+							 int num_keys,
+							 bool along_x)
+{
+	// Clearing the slots without recording them, since the cells leave the
+	// grid
+	for (int key = first_key; key < first_key + num_keys; key++) {
+		if (along_x) {
+			unsigned int slot_x = key % size_x_;
+			for (unsigned int slot_y = 0; slot_y < size_y_; slot_y++)
+				clearCell(slot_y * size_x_ + slot_x);
+		} else {
+			unsigned int slot_y = key % size_y_;
+			unsigned int offset = slot_y * size_x_;
+			for (unsigned int slot_x = 0; slot_x < size_x_; slot_x++)
+				clearCell(offset + slot_x);
+			row_first_key_[slot_y] = std::numeric_limits<int>::max();
+			row_last_key_[slot_y] = std::numeric_limits<int>::min();
+		}
+	}
+}
+
+} //@namespace terrain_server
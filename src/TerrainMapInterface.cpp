@@ -4,15 +4,28 @@
 namespace terrain_server
 {
 
-TerrainMapInterface::TerrainMapInterface() : new_msg_(false),
-		is_terrain_data_(false)
+/** @brief Flag of the triple buffer that indicates a new written buffer */
+static const unsigned int NEW_BUFFER = 4;
+
+/** @brief Mask of the index of the triple buffer */
+static const unsigned int BUFFER_MASK = 3;
+
+
+TerrainMapInterface::TerrainMapInterface() : back_buffer_(0), front_buffer_(1),
+		ready_buffer_(2), shared_map_(-1), format_(FULL_MAP), update_sequence_(0),
+		is_update_synced_(false)
 {
 	ros::NodeHandle node;
 	terrain_clt_ =
 			node.serviceClient<terrain_server::TerrainData>("/terrain_map/data");
+	batch_clt_ =
+			node.serviceClient<terrain_server::TerrainDataBatch>("/terrain_map/data_batch");
+	region_clt_ =
+			node.serviceClient<terrain_server::TerrainRegion>("/terrain_map/region");
 	reset_clt_ =
 			node.serviceClient<std_srvs::Empty>("/terrain_map/reset");
-	terrain_map_.reset(new dwl::environment::TerrainMap());
+	resync_clt_ =
+			node.serviceClient<std_srvs::Empty>("/terrain_map/resync");
 }
 
 
@@ -22,52 +35,30 @@ TerrainMapInterface::~TerrainMapInterface()
 }
 
 
-void TerrainMapInterface::init(ros::NodeHandle node)
+void TerrainMapInterface::init(ros::NodeHandle node,
+							   MapFormat format,
+							   const std::string& shared_memory)
 {
-	sub_ = node.subscribe<terrain_server::TerrainMap> ("/terrain_map", 1,
-			&TerrainMapInterface::callback, this, ros::TransportHints().tcpNoDelay());
+	node_ = node;
+	format_ = format;
+	shared_memory_ = shared_memory;
+	if (format_ == SHARED_MAP) {
+		// The dense terrain map topic is used until the shared memory is
+		// available, and it's checked periodically
+		checkSharedMap(ros::TimerEvent());
+		shared_timer_ = node_.createTimer(ros::Duration(1.),
+										  &TerrainMapInterface::checkSharedMap, this);
+	} else
+		subscribe();
 }
 
 
 void TerrainMapInterface::updateTerrainMap()
 {
-	// Checks if there is a new terrain map message
-	if (new_msg_) {
-		// Setting the terrain map to be updated
-		map_msg_ = *map_buffer_.readFromRT();
-		new_msg_ = false;
-
-		// Getting the number of cells
-		unsigned int num_cells = map_msg_.cell.size();
-		terrain_data_.data.resize(num_cells);
-
-		// Setting up the terrain resolution
-		terrain_data_.plane_size = map_msg_.plane_size;
-		terrain_data_.height_size = map_msg_.height_size;
-
-		// Converting the messages to dwl::TerrainMap format
-		dwl::TerrainCell cell;
-		for (unsigned int i = 0; i < num_cells; i++) {
-			// Filling the terrain values per every cell
-			cell.key.x = map_msg_.cell[i].key_x;
-			cell.key.y = map_msg_.cell[i].key_y;
-			cell.key.z = map_msg_.cell[i].key_z;
-			cell.cost = map_msg_.cell[i].cost;
-			cell.normal =
-					Eigen::Vector3d(map_msg_.cell[i].normal.x,
-									map_msg_.cell[i].normal.y,
-									map_msg_.cell[i].normal.z);
-
-			// Adding the terrain cell to the queue
-			terrain_data_.data[i] = cell;
-		}
-
-		terrain_map_->setTerrainMap(terrain_data_);
-
-		// We have an initial map
-		if (!is_terrain_data_)
-			is_terrain_data_ = true;
-	}
+	// Swapping the read buffer with the latest written one, if it's new
+	if (ready_buffer_.load(std::memory_order_acquire) & NEW_BUFFER)
+		front_buffer_ =
+				ready_buffer_.exchange(front_buffer_, std::memory_order_acq_rel) & BUFFER_MASK;
 }
 
 
@@ -86,11 +77,50 @@ bool TerrainMapInterface::resetTerrainMap()
 bool TerrainMapInterface::getTerrainMap(dwl::TerrainData& map)
 {
 	updateTerrainMap();
-	if (is_terrain_data_) {
-		map = terrain_data_;
-		return true;
-	} else
-		return false;
+
+	// Getting the grid from the shared memory or from the buffers
+	const TerrainGrid* grid;
+	int shared_map = shared_map_.load(std::memory_order_acquire);
+	if (shared_map >= 0) {
+		double plane_size, height_size;
+		if (!shared_maps_[shared_map].getGrid(shared_grid_, plane_size, height_size))
+			return false;
+
+		grid = &shared_grid_;
+		map.plane_size = plane_size;
+		map.height_size = height_size;
+	} else {
+		const MapBuffer& buffer = buffers_[front_buffer_];
+		if (!buffer.is_map)
+			return false;
+
+		grid = &buffer.level[0].grid;
+		map.plane_size = buffer.level[0].discretization.getEnvironmentResolution(true);
+		map.height_size = buffer.level[0].discretization.getEnvironmentResolution(false);
+	}
+
+	// Converting the grid cells to dwl::TerrainMap format
+	map.data.resize(grid->getNumberOfTerrainCells());
+	unsigned int idx = 0;
+	unsigned int grid_size = grid->getNumberOfCells();
+	dwl::TerrainCell cell;
+	for (unsigned int index = 0; index < grid_size; index++) {
+		if (!grid->isTerrain(index))
+			continue;
+
+		unsigned short key_x, key_y;
+		grid->getKey(key_x, key_y, index);
+		cell.key.x = key_x;
+		cell.key.y = key_y;
+		cell.key.z = grid->getKeyZ(index);
+		cell.cost = grid->getCost(index);
+		cell.height = grid->getHeight(index);
+		cell.normal = grid->getNormal(index).cast<double>();
+		map.data[idx] = cell;
+		idx++;
+	}
+
+	return true;
 }
 
 
@@ -136,66 +166,444 @@ const Eigen::Vector3d& TerrainMapInterface::requestTerrainNormal(const Eigen::Ve
 }
 
 
+bool TerrainMapInterface::requestTerrainData(std::vector<dwl::TerrainCell>& cells,
+											 const std::vector<Eigen::Vector2d>& positions)
+{
+	terrain_server::TerrainDataBatch srv;
+	unsigned int num_positions = positions.size();
+	srv.request.position.resize(num_positions);
+	for (unsigned int i = 0; i < num_positions; i++) {
+		srv.request.position[i].x = positions[i](dwl::rbd::X);
+		srv.request.position[i].y = positions[i](dwl::rbd::Y);
+	}
+
+	cells.resize(num_positions);
+	if (!batch_clt_.call(srv) || srv.response.valid.size() != num_positions) {
+		ROS_ERROR("Failed to call service terrain_map/data_batch");
+		for (unsigned int i = 0; i < num_positions; i++) {
+			cells[i].cost = 0.;
+			cells[i].height = 0.;
+			cells[i].normal = Eigen::Vector3d::UnitZ();
+		}
+		return false;
+	}
+
+	for (unsigned int i = 0; i < num_positions; i++) {
+		cells[i].cost = srv.response.cost[i];
+		cells[i].height = srv.response.height[i];
+		cells[i].normal =
+				Eigen::Vector3d(srv.response.normal[i].x,
+								srv.response.normal[i].y,
+								srv.response.normal[i].z);
+	}
+
+	return true;
+}
+
+
+bool TerrainMapInterface::requestTerrainRegion(terrain_server::TerrainRegion::Response& region,
+											   const Eigen::Vector2d& centre,
+											   double size_x,
+											   double size_y,
+											   double yaw)
+{
+	terrain_server::TerrainRegion srv;
+	srv.request.centre.x = centre(dwl::rbd::X);
+	srv.request.centre.y = centre(dwl::rbd::Y);
+	srv.request.size_x = size_x;
+	srv.request.size_y = size_y;
+	srv.request.yaw = yaw;
+
+	if (!region_clt_.call(srv)) {
+		ROS_ERROR("Failed to call service terrain_map/region");
+		return false;
+	}
+
+	region = srv.response;
+	return true;
+}
+
+
 bool TerrainMapInterface::getTerrainData(dwl::TerrainCell& cell,
 										 const Eigen::Vector2d& position) const
 {
-	return terrain_map_->getTerrainData(cell, position);
+	float height, cost;
+	Eigen::Vector3f normal;
+	if (!lookupCell(height, cost, normal, cell.key, position)) {
+		cell.cost = 0.;
+		cell.height = 0.;
+		cell.normal = Eigen::Vector3d::UnitZ();
+		return false;
+	}
+
+	cell.cost = cost;
+	cell.height = height;
+	cell.normal = normal.cast<double>();
+
+	return true;
 }
 
 
 const dwl::TerrainCell& TerrainMapInterface::getTerrainData(const Eigen::Vector2d& position) const
 {
-	return terrain_map_->getTerrainData(position);
+	getTerrainData(lookup_cell_, position);
+	return lookup_cell_;
 }
 
 
 bool TerrainMapInterface::getTerrainCost(double& cost,
 										 const Eigen::Vector2d& position) const
 {
-	return terrain_map_->getTerrainCost(cost, position);
+	dwl::TerrainCell& cell = lookup_cell_;
+	bool is_cell = getTerrainData(cell, position);
+	cost = cell.cost;
+	return is_cell;
 }
 
 
 const double& TerrainMapInterface::getTerrainCost(const Eigen::Vector2d& position) const
 {
-	return terrain_map_->getTerrainCost(position);
+	getTerrainData(lookup_cell_, position);
+	return lookup_cell_.cost;
 }
 
 
 bool TerrainMapInterface::getTerrainHeight(double& height,
 										   const Eigen::Vector2d& position) const
 {
-	return terrain_map_->getTerrainHeight(height, position);
+	dwl::TerrainCell& cell = lookup_cell_;
+	bool is_cell = getTerrainData(cell, position);
+	height = cell.height;
+	return is_cell;
 }
 
 
 double TerrainMapInterface::getTerrainHeight(const Eigen::Vector2d& position) const
 {
-	return terrain_map_->getTerrainHeight(position);
+	getTerrainData(lookup_cell_, position);
+	return lookup_cell_.height;
 }
 
 
 bool TerrainMapInterface::getTerrainNormal(Eigen::Vector3d& normal,
 										   const Eigen::Vector2d& position) const
 {
-	return terrain_map_->getTerrainNormal(normal, position);
+	dwl::TerrainCell& cell = lookup_cell_;
+	bool is_cell = getTerrainData(cell, position);
+	normal = cell.normal;
+	return is_cell;
 }
 
 
 const Eigen::Vector3d& TerrainMapInterface::getTerrainNormal(const Eigen::Vector2d& position) const
 {
-	return terrain_map_->getTerrainNormal(position);
+	getTerrainData(lookup_cell_, position);
+	return lookup_cell_.normal;
+}
+
+
+void TerrainMapInterface::subscribe()
+{
+	if (format_ == DENSE_MAP || format_ == SHARED_MAP)
+		sub_ = node_.subscribe<terrain_server::DenseTerrainMap> ("/terrain_map_dense", 1,
+				&TerrainMapInterface::denseCallback, this, ros::TransportHints().tcpNoDelay());
+	else if (format_ == MAP_UPDATES)
+		sub_ = node_.subscribe<terrain_server::TerrainMapUpdate> ("/terrain_map_update", 10,
+				&TerrainMapInterface::updateCallback, this, ros::TransportHints().tcpNoDelay());
+	else
+		sub_ = node_.subscribe<terrain_server::TerrainMap> ("/terrain_map", 1,
+				&TerrainMapInterface::callback, this, ros::TransportHints().tcpNoDelay());
+}
+
+
+void TerrainMapInterface::checkSharedMap(const ros::TimerEvent& event)
+{
+	int shared_map = shared_map_.load(std::memory_order_acquire);
+	if (shared_map >= 0 && !shared_maps_[shared_map].isRetired())
+		return;
+
+	// Mapping the (new) segment in the unused object. Note that the previous
+	// segment is unmapped in the next remapping, so a real-time lookup never
+	// reads an unmapped segment
+	int next_map = shared_map == 0 ? 1 : 0;
+	if (shared_maps_[next_map].open(shared_memory_)) {
+		shared_map_.store(next_map, std::memory_order_release);
+		if (sub_) {
+			sub_.shutdown();
+			ROS_INFO("Reading the terrain map from the shared memory %s",
+					shared_memory_.c_str());
+		}
+	} else {
+		// Falling back to the ROS topic
+		shared_map_.store(-1, std::memory_order_release);
+		if (!sub_)
+			subscribe();
+	}
 }
 
 
 void TerrainMapInterface::callback(const terrain_server::TerrainMapConstPtr& msg)
 {
-	// the writeFromNonRT can be used in RT, if you have the guarantee that
-	// no non-rt thread is calling the same function (we're not subscribing to ros callbacks)
-	// there is only one single rt thread
-	map_buffer_.writeFromNonRT(*msg);
+	// Converting the finest level and the coarser levels of the far-field
+	// search areas, the map is replaced
+	recorded_updates_.clear();
+	unsigned int num_levels = msg->coarse_level.size() + 1;
+	if (map_.level.size() != num_levels)
+		map_.level.resize(num_levels);
+
+	setLevel(map_.level[0], msg->cell, msg->plane_size, msg->height_size);
+	for (unsigned int n = 0; n < msg->coarse_level.size(); n++) {
+		const terrain_server::TerrainMapLevel& level = msg->coarse_level[n];
+		setLevel(map_.level[n + 1], level.cell, level.plane_size, level.height_size);
+	}
+
+	publishGrid();
+}
+
+
+void TerrainMapInterface::denseCallback(const terrain_server::DenseTerrainMapConstPtr& msg)
+{
+	// Checking the sizes of the layers, a malformed message is dropped before
+	// it changes the map
+	unsigned int grid_size = msg->size_x * msg->size_y;
+	unsigned int num_cells = msg->cost.size();
+	if (msg->valid.size() != (grid_size + 7) / 8 ||
+			msg->height.size() != num_cells || msg->normal.size() != 2 * num_cells) {
+		ROS_WARN("Dropping a malformed dense terrain map (%u x %u cells, %zu valid"
+				" bytes, %u costs, %zu heights, %zu normal components)",
+				msg->size_x, msg->size_y, msg->valid.size(), num_cells,
+				msg->height.size(), msg->normal.size());
+		return;
+	}
+
+	// The dense terrain map has only the finest level, and it replaces the map
+	recorded_updates_.clear();
+	map_.level.resize(1);
+	MapLevel& level = map_.level[0];
+	setGrid(level, msg->plane_size, msg->height_size,
+			msg->origin_key_x, msg->origin_key_y, msg->size_x, msg->size_y);
+
+	// Decoding the valid cells of the grid
+	level.grid.clear();
+	terrain_server::TerrainCell cell;
+	unsigned int idx = 0;
+	for (unsigned int i = 0; i < grid_size && idx < num_cells; i++) {
+		if (!(msg->valid[i / 8] & (1 << (i % 8))))
+			continue;
+
+		Eigen::Vector3d normal;
+		TerrainMapCodec::decodeNormal(normal, msg->normal[2 * idx], msg->normal[2 * idx + 1]);
+		cell.key_x = msg->origin_key_x + i % msg->size_x;
+		cell.key_y = msg->origin_key_y + i / msg->size_x;
+		cell.key_z = msg->base_key_z + msg->height[idx];
+		cell.cost = TerrainMapCodec::decodeCost(msg->cost[idx], msg->max_cost);
+		cell.normal.x = normal(dwl::rbd::X);
+		cell.normal.y = normal(dwl::rbd::Y);
+		cell.normal.z = normal(dwl::rbd::Z);
+		setCell(level, cell);
+
+		idx++;
+	}
+
+	publishGrid();
+}
+
+
+void TerrainMapInterface::updateCallback(const terrain_server::TerrainMapUpdateConstPtr& msg)
+{
+	// The updates have only the finest level
+	map_.level.resize(1);
+	MapLevel& level = map_.level[0];
+	if (msg->keyframe) {
+		// A keyframe replaces the terrain map
+		setGrid(level, msg->plane_size, msg->height_size,
+				msg->origin_key_x, msg->origin_key_y, msg->size_x, msg->size_y);
+		level.grid.clear();
+		for (unsigned int i = 0; i < msg->cell.size(); i++)
+			setCell(level, msg->cell[i]);
+		recorded_updates_.clear();
+		is_update_synced_ = true;
+	} else if (is_update_synced_ && msg->sequence == update_sequence_ + 1) {
+		// Applying the update, and recording it for the buffers that missed it
+		applyUpdate(level, *msg);
+		recorded_updates_.push_back(msg);
+		if (recorded_updates_.size() > MAX_RECORDED_UPDATES)
+			recorded_updates_.pop_front();
+	} else {
+		// Requesting a keyframe when it's missed an update (at most once per
+		// second), the updates are dropped until it arrives
+		is_update_synced_ = false;
+		if ((ros::Time::now() - resync_time_).toSec() > 1.) {
+			resync_time_ = ros::Time::now();
+			std_srvs::Empty srv;
+			if (!resync_clt_.call(srv))
+				ROS_ERROR("Failed to call service /terrain_map/resync");
+		}
+		return;
+	}
+
+	update_sequence_ = msg->sequence;
+
+	publishGrid();
+}
+
+
+void TerrainMapInterface::applyUpdate(MapLevel& level,
+									  const terrain_server::TerrainMapUpdate& update)
+{
+	// Moving the grid as the server does, removing the evicted cells, and
+	// adding the inserted and modified cells
+	setGrid(level, update.plane_size, update.height_size,
+			update.origin_key_x, update.origin_key_y, update.size_x, update.size_y);
+	for (unsigned int i = 0; i < update.evicted.size(); i++) {
+		unsigned int index;
+		if (level.grid.getIndex(index, update.evicted[i].key_x, update.evicted[i].key_y))
+			level.grid.removeCell(index);
+	}
+	for (unsigned int i = 0; i < update.cell.size(); i++)
+		setCell(level, update.cell[i]);
+}
+
+
+void TerrainMapInterface::setLevel(MapLevel& level,
+								   const std::vector<terrain_server::TerrainCell>& cells,
+								   double plane_size,
+								   double height_size)
+{
+	// Getting the bounding box of the cells, the grid is only grown
+	unsigned int num_cells = cells.size();
+	int min_key_x = std::numeric_limits<int>::max();
+	int min_key_y = std::numeric_limits<int>::max();
+	int max_key_x = std::numeric_limits<int>::min();
+	int max_key_y = std::numeric_limits<int>::min();
+	for (unsigned int i = 0; i < num_cells; i++) {
+		min_key_x = std::min(min_key_x, (int) cells[i].key_x);
+		min_key_y = std::min(min_key_y, (int) cells[i].key_y);
+		max_key_x = std::max(max_key_x, (int) cells[i].key_x);
+		max_key_y = std::max(max_key_y, (int) cells[i].key_y);
+	}
+	if (num_cells == 0)
+		min_key_x = min_key_y = max_key_x = max_key_y = 0;
+
+	unsigned int size_x = std::max((int) level.grid.getSizeX(), max_key_x - min_key_x + 1);
+	unsigned int size_y = std::max((int) level.grid.getSizeY(), max_key_y - min_key_y + 1);
+	setGrid(level, plane_size, height_size, min_key_x, min_key_y, size_x, size_y);
+
+	// Converting the cells into the grid
+	level.grid.clear();
+	for (unsigned int i = 0; i < num_cells; i++)
+		setCell(level, cells[i]);
+}
+
+
+void TerrainMapInterface::setGrid(MapLevel& level,
+								  double plane_size,
+								  double height_size,
+								  int origin_key_x,
+								  int origin_key_y,
+								  unsigned int size_x,
+								  unsigned int size_y)
+{
+	level.discretization.setEnvironmentResolution(plane_size, true);
+	level.discretization.setEnvironmentResolution(height_size, false);
+
+	if (level.grid.getSizeX() != size_x || level.grid.getSizeY() != size_y)
+		level.grid.resize(size_x, size_y);
+
+	// Moving the grid to its origin, i.e. the centre is defined from it
+	level.grid.move(origin_key_x + size_x / 2, origin_key_y + size_y / 2);
+}
 
-	new_msg_ = true;
+
+void TerrainMapInterface::setCell(MapLevel& level,
+								  const terrain_server::TerrainCell& cell)
+{
+	unsigned int index;
+	if (!level.grid.getIndex(index, cell.key_x, cell.key_y))
+		return;
+
+	double height;
+	level.discretization.keyToCoord(height, cell.key_z, false);
+	level.grid.setHeight(index, height, cell.key_z);
+	level.grid.setTerrain(index, cell.cost,
+						  Eigen::Vector3f(cell.normal.x, cell.normal.y, cell.normal.z));
+}
+
+
+void TerrainMapInterface::publishGrid()
+{
+	// Bringing the written buffer up to date, and swapping it with the latest
+	// written one. The buffer replays the updates after its sequence if they
+	// are recorded, otherwise the grids are copied (reusing its memory)
+	map_.sequence++;
+	MapBuffer& buffer = buffers_[back_buffer_];
+	uint64_t num_updates = recorded_updates_.size();
+	uint64_t missed_updates = map_.sequence - buffer.sequence;
+	if (buffer.is_map && missed_updates <= num_updates) {
+		for (uint64_t i = num_updates - missed_updates; i < num_updates; i++)
+			applyUpdate(buffer.level[0], *recorded_updates_[i]);
+	} else
+		buffer.level = map_.level;
+	buffer.is_map = true;
+	buffer.sequence = map_.sequence;
+	back_buffer_ =
+			ready_buffer_.exchange(back_buffer_ | NEW_BUFFER,
+								   std::memory_order_acq_rel) & BUFFER_MASK;
+}
+
+
+bool TerrainMapInterface::lookupCell(float& height,
+									 float& cost,
+									 Eigen::Vector3f& normal,
+									 dwl::Key& key,
+									 const Eigen::Vector2d& position) const
+{
+	unsigned short key_x, key_y, key_z;
+
+	// Reading the cell in place from the shared memory
+	int shared_map = shared_map_.load(std::memory_order_acquire);
+	if (shared_map >= 0) {
+		const SharedTerrainMap& map = shared_maps_[shared_map];
+		double plane_size, height_size;
+		if (!map.getResolution(plane_size, height_size))
+			return false;
+		if (plane_size != shared_discretization_.getEnvironmentResolution(true))
+			shared_discretization_.setEnvironmentResolution(plane_size, true);
+
+		shared_discretization_.coordToKey(key_x, position(dwl::rbd::X), true);
+		shared_discretization_.coordToKey(key_y, position(dwl::rbd::Y), true);
+		if (!map.getCell(height, cost, normal, key_z, key_x, key_y))
+			return false;
+	} else {
+		const MapBuffer& buffer = buffers_[front_buffer_];
+		if (!buffer.is_map)
+			return false;
+
+		// Reading the cell from the finest level that has it
+		unsigned int num_levels = buffer.level.size();
+		unsigned int n = 0;
+		unsigned int index = 0;
+		for (; n < num_levels; n++) {
+			const MapLevel& level = buffer.level[n];
+			level.discretization.coordToKey(key_x, position(dwl::rbd::X), true);
+			level.discretization.coordToKey(key_y, position(dwl::rbd::Y), true);
+			if (level.grid.getIndex(index, key_x, key_y) && level.grid.isTerrain(index))
+				break;
+		}
+		if (n == num_levels)
+			return false;
+
+		const TerrainGrid& grid = buffer.level[n].grid;
+		height = grid.getHeight(index);
+		cost = grid.getCost(index);
+		normal = grid.getNormal(index);
+		key_z = grid.getKeyZ(index);
+	}
+
+	key.x = key_x;
+	key.y = key_y;
+	key.z = key_z;
+	return true;
 }
 
 } //@namespace terrain_server
@@ -0,0 +1,31 @@
+#include <terrain_server/TerrainMapNodelet.h>
+#include <pluginlib/class_list_macros.h>
+
+
+namespace terrain_server
+{
+
+TerrainMapNodelet::TerrainMapNodelet()
+{
+
+}
+
+
+TerrainMapNodelet::~TerrainMapNodelet()
+{
+
+}
+
+
+void TerrainMapNodelet::onInit()
+{
+	// The callbacks of the server only post the octomaps to its pipeline, so
+	// the single-threaded queue of the nodelet is enough
+	server_.reset(new TerrainMapServer(getPrivateNodeHandle(), getNodeHandle()));
+	if (!server_->init())
+		NODELET_ERROR("Could not initialize the terrain map server");
+}
+
+} //@namespace terrain_server
+
+PLUGINLIB_EXPORT_CLASS(terrain_server::TerrainMapNodelet, nodelet::Nodelet)
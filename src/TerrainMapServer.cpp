@@ -1,20 +1,34 @@
 #include <terrain_server/TerrainMapServer.h>
+#include <algorithm>
+#include <cmath>
+#include <sstream>
 
 
 namespace terrain_server
 {
 
-TerrainMapServer::TerrainMapServer(ros::NodeHandle node) : private_node_(node),
-		terrain_discretization_(0.04, 0.04, M_PI / 200),
-		octomap_sub_(NULL),	tf_octomap_sub_(NULL), base_frame_("base_link"),
-		world_frame_("world"), initial_map_(false)
+TerrainMapServer::TerrainMapServer(ros::NodeHandle private_node,
+								   ros::NodeHandle node) : node_(node),
+		private_node_(private_node), terrain_discretization_(0.04, 0.04, M_PI / 200),
+		octomap_sub_(NULL),	tf_octomap_sub_(NULL), changes_sub_(NULL),
+		tf_changes_sub_(NULL), cloud_sub_(NULL), tf_cloud_sub_(NULL),
+		base_frame_("base_link"), world_frame_("world"), initial_map_(false),
+		incremental_update_(false), is_point_cloud_(false), persistent_frame_(NULL),
+		is_initial_octree_(false), octomap_reach_(0.), is_stopped_(false),
+		reset_request_(false), is_update_published_(false), update_sequence_(0),
+		keyframe_period_(100), keyframe_request_(false), shared_memory_("/terrain_map"),
+		is_shared_memory_(false), processed_frames_(0), dropped_frames_(0)
 {
-
+	for (unsigned int i = 0; i < NUM_OCTREE_FRAMES; i++)
+		free_frames_.push_back(&octree_frames_[i]);
 }
 
 
 TerrainMapServer::~TerrainMapServer()
 {
+	// The subscribers are deleted once the pipeline doesn't use them
+	stopPipeline();
+
 	if (tf_octomap_sub_) {
 		delete tf_octomap_sub_;
 		tf_octomap_sub_ = NULL;
@@ -24,6 +38,26 @@ TerrainMapServer::~TerrainMapServer()
 		delete octomap_sub_;
 		octomap_sub_ = NULL;
 	}
+
+	if (tf_changes_sub_) {
+		delete tf_changes_sub_;
+		tf_changes_sub_ = NULL;
+	}
+
+	if (changes_sub_) {
+		delete changes_sub_;
+		changes_sub_ = NULL;
+	}
+
+	if (tf_cloud_sub_) {
+		delete tf_cloud_sub_;
+		tf_cloud_sub_ = NULL;
+	}
+
+	if (cloud_sub_) {
+		delete cloud_sub_;
+		cloud_sub_ = NULL;
+	}
 }
 
 
@@ -31,6 +65,7 @@ bool TerrainMapServer::init()
 {
 	// Getting the names of search areas
 	XmlRpc::XmlRpcValue area_names;
+	std::vector<double> level_resolutions;
 	if (!private_node_.getParam("search_areas", area_names)) {
 		ROS_ERROR("No search areas given in the namespace: %s.",
 				private_node_.getNamespace().c_str());
@@ -41,8 +76,34 @@ bool TerrainMapServer::init()
 			return false;
 		}
 
+		// Getting the levels of detail, i.e. the resolutions of the search
+		// areas from the finest to the coarsest
+		for (int i = 0; i < area_names.size(); i++) {
+			double resolution = 0.04;
+			private_node_.getParam((std::string) area_names[i] + "/resolution", resolution);
+			bool is_level = false;
+			for (unsigned int n = 0; n < level_resolutions.size(); n++)
+				is_level |= fabs(level_resolutions[n] - resolution) < 1e-9;
+			if (!is_level)
+				level_resolutions.push_back(resolution);
+		}
+		std::sort(level_resolutions.begin(), level_resolutions.end());
+	}
+
+	// Without search areas there is one level, it uses the default search area
+	unsigned int num_levels = std::max((int) level_resolutions.size(), 1);
+	for (unsigned int n = 0; n < num_levels; n++)
+		terrain_levels_.push_back(std::unique_ptr<TerrainMapping>(new TerrainMapping()));
+	if (num_levels > 1)
+		ROS_INFO("Computing the terrain map with %u levels of detail", num_levels);
+
+	// Adding the search areas to the level of their resolution, and getting
+	// the reach of the levels
+	std::vector<double> level_reach(num_levels, 0.);
+	if (area_names.getType() == XmlRpc::XmlRpcValue::TypeArray) {
 		double min_x, max_x, min_y, max_y, min_z, max_z, resolution;
 		for (int i = 0; i < area_names.size(); i++) {
+			resolution = 0.04;
 			private_node_.getParam((std::string) area_names[i] + "/min_x", min_x);
 			private_node_.getParam((std::string) area_names[i] + "/max_x", max_x);
 			private_node_.getParam((std::string) area_names[i] + "/min_y", min_y);
@@ -51,17 +112,205 @@ bool TerrainMapServer::init()
 			private_node_.getParam((std::string) area_names[i] + "/max_z", max_z);
 			private_node_.getParam((std::string) area_names[i] + "/resolution", resolution);
 
+			// Getting the method for estimating the normals, i.e. the octomap
+			// neighbors (default) or the moment images of the surface
+			std::string normal_estimation = "octree";
+			private_node_.getParam((std::string) area_names[i] + "/normal_estimation",
+								   normal_estimation);
+			TerrainMapping::NormalEstimation estimation_method =
+					TerrainMapping::OCTREE_NEIGHBORS;
+			if (normal_estimation == "moments")
+				estimation_method = TerrainMapping::INTEGRAL_MOMENTS;
+			else if (normal_estimation != "octree")
+				ROS_WARN("Unknown normal estimation %s of the %s search area, using"
+						" the octree neighbors", normal_estimation.c_str(),
+						((std::string) area_names[i]).c_str());
+
 			// Adding the search areas
-			terrain_map_.addSearchArea(min_x, max_x, min_y, max_y, min_z, max_z, resolution);
+			unsigned int level = 0;
+			while (level + 1 < num_levels &&
+					fabs(level_resolutions[level] - resolution) >= 1e-9)
+				level++;
+			terrain_levels_[level]->addSearchArea(min_x, max_x, min_y, max_y, min_z, max_z,
+												  resolution, estimation_method);
+
+			double corner_x = std::max(fabs(min_x), fabs(max_x));
+			double corner_y = std::max(fabs(min_y), fabs(max_y));
+			level_reach[level] = std::max(level_reach[level],
+										  sqrt(corner_x * corner_x + corner_y * corner_y));
 		}
 	}
 
-	// Getting the interest region, i.e. the information outside this region will be deleted
+	// Getting the number of threads used for computing the terrain map
+	int num_threads = 1;
+	private_node_.param("num_threads", num_threads, num_threads);
+
+	// Getting the interest region, i.e. the information outside this region
+	// will be deleted. The finer levels keep only the terrain inside the
+	// reach of their search areas, the coarsest level keeps the interest region
 	double radius_x = 1, radius_y = 1;
 	private_node_.getParam("interest_region/radius_x", radius_x);
 	private_node_.getParam("interest_region/radius_y", radius_y);
-	terrain_map_.setInterestRegion(radius_x, radius_y);
+	for (unsigned int n = 0; n < num_levels; n++) {
+		TerrainMapping& terrain_map = *terrain_levels_[n];
+		terrain_map.setNumberOfThreads(num_threads);
+		if (n + 1 < num_levels)
+			terrain_map.setInterestRegion(std::min(radius_x, level_reach[n]),
+										  std::min(radius_y, level_reach[n]));
+		else
+			terrain_map.setInterestRegion(radius_x, radius_y);
+
+		addFeatures(terrain_map);
+	}
+
+	// Getting the base and world frame
+	private_node_.param("base_frame", base_frame_, base_frame_);
+	private_node_.param("world_frame", world_frame_, world_frame_);
+	map_msg_.header.frame_id = world_frame_;
+	dense_map_msg_.header.frame_id = world_frame_;
+
+	// Getting the input of the terrain map, i.e. the octomap (default) or the
+	// point cloud. The heights of a point cloud are fused directly in the
+	// terrain grid, without octree
+	std::string input = "octomap";
+	private_node_.param("input", input, input);
+	if (input == "point_cloud")
+		is_point_cloud_ = true;
+	else if (input != "octomap")
+		ROS_WARN("Unknown input %s of the terrain map, using the octomap", input.c_str());
+
+	if (is_point_cloud_) {
+		std::string fusion = "max";
+		double decay_time = 0., height_resolution = 0.02;
+		private_node_.param("point_cloud/fusion", fusion, fusion);
+		private_node_.param("point_cloud/decay_time", decay_time, decay_time);
+		private_node_.param("point_cloud/height_resolution",
+							height_resolution, height_resolution);
+		if (fusion != "max" && fusion != "mean")
+			ROS_WARN("Unknown height fusion %s of the point cloud, using the"
+					" maximum height", fusion.c_str());
+		for (unsigned int n = 0; n < terrain_levels_.size(); n++) {
+			if (fusion == "mean")
+				terrain_levels_[n]->setHeightFusion(TerrainMapping::MEAN_HEIGHT);
+			terrain_levels_[n]->setHeightDecay(decay_time);
+			terrain_levels_[n]->setResolution(height_resolution, false);
+		}
+
+		// Declaring the subscriber to point cloud and tf messages
+		cloud_sub_ =
+				new message_filters::Subscriber<sensor_msgs::PointCloud2>(
+						node_, "cloud_in", 5);
+		tf_cloud_sub_ =
+				new tf::MessageFilter<sensor_msgs::PointCloud2>(
+						*cloud_sub_, tf_listener_, world_frame_, 5);
+		tf_cloud_sub_->registerCallback(
+				boost::bind(&TerrainMapServer::cloudCallback, this, _1));
+	} else {
+		// Declaring the subscriber to octomap and tf messages
+		octomap_sub_ =
+				new message_filters::Subscriber<octomap_msgs::Octomap>(
+						node_, "octomap_binary", 5);
+		tf_octomap_sub_ =
+				new tf::MessageFilter<octomap_msgs::Octomap>(
+						*octomap_sub_, tf_listener_, world_frame_, 5);
+		tf_octomap_sub_->registerCallback(
+				boost::bind(&TerrainMapServer::octomapCallback, this, _1));
+	}
+
+	// Declaring the subscriber to the octomap changes, they are published by
+	// the tracking octomap server
+	private_node_.param("incremental_update", incremental_update_, incremental_update_);
+	if (incremental_update_ && is_point_cloud_) {
+		ROS_WARN("The incremental update requires the octomap input, ignoring it");
+		incremental_update_ = false;
+	}
+	for (unsigned int n = 0; n < terrain_levels_.size(); n++)
+		terrain_levels_[n]->setIncrementalUpdate(incremental_update_);
+	if (incremental_update_) {
+		changes_sub_ =
+				new message_filters::Subscriber<sensor_msgs::PointCloud2>(
+						node_, "octomap_changes", 5);
+		tf_changes_sub_ =
+				new tf::MessageFilter<sensor_msgs::PointCloud2>(
+						*changes_sub_, tf_listener_, world_frame_, 5);
+		tf_changes_sub_->registerCallback(
+				boost::bind(&TerrainMapServer::changesCallback, this, _1));
+	}
+
+	// Declaring the publisher of terrain map
+	map_pub_ = node_.advertise<terrain_server::TerrainMap>("terrain_map", 1);
+	dense_map_pub_ =
+			node_.advertise<terrain_server::DenseTerrainMap>("terrain_map_dense", 1);
+
+	// Getting the shared memory for the clients in the same host
+	private_node_.param("shared_memory/enable", is_shared_memory_, is_shared_memory_);
+	private_node_.param("shared_memory/name", shared_memory_, shared_memory_);
+
+	// Declaring the publisher of the terrain map updates, a keyframe is sent
+	// periodically and on request
+	private_node_.param("update_keyframe_period", keyframe_period_, keyframe_period_);
+	if (keyframe_period_ < 1)
+		keyframe_period_ = 1;
+	update_msg_.header.frame_id = world_frame_;
+	update_pub_ =
+			node_.advertise<terrain_server::TerrainMapUpdate>("terrain_map_update", 10);
+
+	reset_srv_ = private_node_.advertiseService("reset", &TerrainMapServer::reset, this);
+	terrain_data_srv_ =
+			private_node_.advertiseService("data", &TerrainMapServer::getTerrainData, this);
+	terrain_batch_srv_ =
+			private_node_.advertiseService("data_batch", &TerrainMapServer::getTerrainDataBatch, this);
+	terrain_region_srv_ =
+			private_node_.advertiseService("region", &TerrainMapServer::getTerrainRegion, this);
+	resync_srv_ = private_node_.advertiseService("resync", &TerrainMapServer::resync, this);
+
+	// Getting the statistics of the hot paths, they are published periodically
+	// if they are enabled
+	bool enable_statistics = false;
+	double statistics_period = 1.;
+	private_node_.param("statistics/enable", enable_statistics, enable_statistics);
+	private_node_.param("statistics/period", statistics_period, statistics_period);
+	deserialize_timer_ = statistics_.addTimer("terrain_server/deserialize");
+	tf_timer_ = statistics_.addTimer("terrain_server/tf_lookup");
+	compute_timer_ = statistics_.addTimer("terrain_server/compute");
+	snapshot_timer_ = statistics_.addTimer("terrain_server/snapshot");
+	publish_map_timer_ = statistics_.addTimer("terrain_server/publish_map");
+	publish_dense_timer_ = statistics_.addTimer("terrain_server/publish_dense_map");
+	publish_update_timer_ = statistics_.addTimer("terrain_server/publish_update");
+	shared_map_timer_ = statistics_.addTimer("terrain_server/write_shared_map");
+	octomap_bytes_counter_ = statistics_.addCounter("terrain_server/octomap_bytes", "bytes");
+	map_bytes_counter_ = statistics_.addCounter("terrain_server/map_bytes", "bytes");
+	dense_bytes_counter_ = statistics_.addCounter("terrain_server/dense_map_bytes", "bytes");
+	update_bytes_counter_ = statistics_.addCounter("terrain_server/update_bytes", "bytes");
+	cloud_points_counter_ = statistics_.addCounter("terrain_server/cloud_points");
+	octree_nodes_counter_ = statistics_.addCounter("terrain_server/octree_nodes");
+	terrain_levels_[0]->setStatistics(&statistics_);
+	terrain_levels_[0]->setUpdateTracking(true);
+	for (unsigned int n = 1; n < terrain_levels_.size(); n++) {
+		std::ostringstream level_name;
+		level_name << "terrain_mapping/level_" << n;
+		terrain_levels_[n]->setStatistics(&statistics_, level_name.str());
+	}
+	if (enable_statistics) {
+		statistics_.setEnabled(true);
+		statistics_pub_ =
+				private_node_.advertise<terrain_server::ServerStatistics>("statistics", 1);
+		statistics_timer_ =
+				private_node_.createTimer(ros::Duration(statistics_period),
+										  &TerrainMapServer::publishStatistics, this);
+	}
+
+	// Starting the stages of the pipeline
+	deserialize_thread_ = std::thread(&TerrainMapServer::deserializeLoop, this);
+	compute_thread_ = std::thread(&TerrainMapServer::computeLoop, this);
+	publish_thread_ = std::thread(&TerrainMapServer::publishLoop, this);
+
+	return true;
+}
 
+
+void TerrainMapServer::addFeatures(TerrainMapping& terrain_map)
+{
 	// Getting the feature information
 	bool enable_slope, enable_height_dev, enable_curvature;
 	double weight;
@@ -78,7 +327,7 @@ bool TerrainMapServer::init()
 		slope_ptr->setWeight(weight);
 
 		// Adding the feature
-		terrain_map_.addFeature(slope_ptr);
+		terrain_map.addFeature(slope_ptr);
 	}
 
 	// Adding the height deviation feature if it's enable
@@ -93,11 +342,12 @@ bool TerrainMapServer::init()
 							 max_height_deviation, 0.3);
 		private_node_.param("features/height_deviation/min_allowed_height",
 							 min_allowed_height, -std::numeric_limits<double>::max());
-		dwl::environment::Feature* height_dev_ptr =
+		terrain_server::feature::HeightDeviationFeature* height_dev_ptr =
 				new terrain_server::feature::HeightDeviationFeature(flat_height_deviation,
 																	max_height_deviation,
 																	min_allowed_height);
 		height_dev_ptr->setWeight(weight);
+		height_dev_ptr->setIntegralHeightMap(&terrain_map.getIntegralHeightMap());
 
 		// Setting the neighboring area
 		double size, resolution;
@@ -107,8 +357,12 @@ bool TerrainMapServer::init()
 							resolution, 0.04);
 		height_dev_ptr->setNeighboringArea(-size, size, -size, size, resolution);
 
+		// The estimated height of a missing neighbor uses another neighboring
+		// area, so a change of the surface affects the cells inside two sizes
+		terrain_map.setFeatureRadius(2 * size);
+
 		// Adding the feature
-		terrain_map_.addFeature(height_dev_ptr);
+		terrain_map.addFeature(height_dev_ptr);
 	}
 
 	// Adding the curvature feature if it's enable
@@ -119,71 +373,648 @@ bool TerrainMapServer::init()
 		curvature_ptr->setWeight(weight);
 
 		// Adding the feature
-		terrain_map_.addFeature(curvature_ptr);
+		terrain_map.addFeature(curvature_ptr);
 	}
+}
 
-	// Getting the base and world frame
-	private_node_.param("base_frame", base_frame_, base_frame_);
-	private_node_.param("world_frame", world_frame_, world_frame_);
-	map_msg_.header.frame_id = world_frame_;
 
-	// Declaring the subscriber to octomap and tf messages
-	octomap_sub_ =
-			new message_filters::Subscriber<octomap_msgs::Octomap>(
-					node_, "octomap_binary", 5);
-	tf_octomap_sub_ =
-			new tf::MessageFilter<octomap_msgs::Octomap>(
-					*octomap_sub_, tf_listener_, world_frame_, 5);
-	tf_octomap_sub_->registerCallback(
-			boost::bind(&TerrainMapServer::octomapCallback, this, _1));
+void TerrainMapServer::octomapCallback(const octomap_msgs::Octomap::ConstPtr& msg)
+{
+	// In the incremental mode, the octomaps after the initial one aren't
+	// needed. The subscriber is shut down from the callback thread, which also
+	// subscribes it in the reset, so a stale octomap can't undo a reset
+	if (incremental_update_) {
+		std::lock_guard<std::mutex> lock(reset_mutex_);
+		if (is_initial_octree_) {
+			octomap_sub_->unsubscribe();
+			return;
+		}
+	}
 
-	// Declaring the publisher of terrain map
-	map_pub_ = node_.advertise<terrain_server::TerrainMap>("terrain_map", 1);
+	// Posting the message to the deserialization stage, a message that wasn't
+	// read yet is stale, so it's dropped
+	octomap_msgs::Octomap::ConstPtr* stale_msg =
+			octomap_mailbox_.post(new octomap_msgs::Octomap::ConstPtr(msg));
+	if (stale_msg) {
+		delete stale_msg;
+		dropped_frames_++;
+	}
+	notifyStage(deserialize_mutex_, deserialize_cond_);
+}
 
-	reset_srv_ = private_node_.advertiseService("reset", &TerrainMapServer::reset, this);
-	terrain_data_srv_ =
-			private_node_.advertiseService("data", &TerrainMapServer::getTerrainData, this);
 
+void TerrainMapServer::changesCallback(const sensor_msgs::PointCloud2::ConstPtr& msg)
+{
+	// The changes aren't stale, so they are accumulated until the compute stage
+	// applies them
+	{
+		std::lock_guard<std::mutex> lock(compute_mutex_);
+		pending_changes_.push_back(msg);
+	}
+	compute_cond_.notify_one();
+}
+
+
+void TerrainMapServer::cloudCallback(const sensor_msgs::PointCloud2::ConstPtr& msg)
+{
+	// Posting the message to the compute stage, a point cloud that wasn't
+	// computed yet is stale, so it's dropped
+	sensor_msgs::PointCloud2::ConstPtr* stale_msg =
+			cloud_mailbox_.post(new sensor_msgs::PointCloud2::ConstPtr(msg));
+	if (stale_msg) {
+		delete stale_msg;
+		dropped_frames_++;
+	}
+	notifyStage(compute_mutex_, compute_cond_);
+}
+
+
+bool TerrainMapServer::reset(std_srvs::Empty::Request& req,
+							std_srvs::Empty::Response& resp)
+{
+	// The octomaps older than the reset are dropped, and the incremental mode
+	// waits for a new initial octomap
+	{
+		std::lock_guard<std::mutex> lock(reset_mutex_);
+		reset_stamp_ = ros::Time::now();
+		if (incremental_update_) {
+			is_initial_octree_ = false;
+			octomap_sub_->subscribe();
+		}
+	}
+
+	// The terrain map is reset by the compute stage
+	initial_map_ = false;
+	reset_request_ = true;
+	notifyStage(compute_mutex_, compute_cond_);
+
+	// There isn't an octomap server without the octomap input
+	if (is_point_cloud_) {
+		ROS_INFO("Reset terrain map");
+		return true;
+	}
+
+	ros::ServiceClient client = 
+		private_node_.serviceClient<std_srvs::Empty>("/octomap_server/reset");
+
+	if (!client.call(req, resp)) {
+		ROS_ERROR("Failed to call service /octomap_server/reset");
+		return false;
+	}
 
+	ROS_INFO("Reset terrain map");	
 	return true;
 }
 
 
-void TerrainMapServer::octomapCallback(const octomap_msgs::Octomap::ConstPtr& msg)
+bool TerrainMapServer::getTerrainData(terrain_server::TerrainData::Request& req,
+									  terrain_server::TerrainData::Response& res)
+{
+	TerrainSnapshotPtr snapshot = getLatestSnapshot();
+	if (snapshot) {
+		const TerrainGrid* grid;
+		unsigned int index;
+		if (getCellIndex(index, grid, *snapshot, req.position.x, req.position.y)) {
+			const Eigen::Vector3f& normal = grid->getNormal(index);
+			res.cost = grid->getCost(index);
+			res.height = grid->getHeight(index);
+			res.normal.x = normal(dwl::rbd::X);
+			res.normal.y = normal(dwl::rbd::Y);
+			res.normal.z = normal(dwl::rbd::Z);
+		} else {
+			res.cost = 0.;
+			res.height = 0.;
+			res.normal.x = 0.;
+			res.normal.y = 0.;
+			res.normal.z = 1.;
+		}
+
+		return true;
+	}
+	
+	return false;
+}
+
+
+bool TerrainMapServer::getTerrainDataBatch(terrain_server::TerrainDataBatch::Request& req,
+										   terrain_server::TerrainDataBatch::Response& res)
+{
+	TerrainSnapshotPtr snapshot = getLatestSnapshot();
+	if (!snapshot)
+		return false;
+
+	unsigned int num_positions = req.position.size();
+	res.height.resize(num_positions);
+	res.cost.resize(num_positions);
+	res.normal.resize(num_positions);
+	res.valid.resize(num_positions);
+
+	// Answering all the positions from the same snapshot
+	for (unsigned int i = 0; i < num_positions; i++) {
+		const TerrainGrid* grid;
+		unsigned int index;
+		if (getCellIndex(index, grid, *snapshot, req.position[i].x, req.position[i].y)) {
+			const Eigen::Vector3f& normal = grid->getNormal(index);
+			res.height[i] = grid->getHeight(index);
+			res.cost[i] = grid->getCost(index);
+			res.normal[i].x = normal(dwl::rbd::X);
+			res.normal[i].y = normal(dwl::rbd::Y);
+			res.normal[i].z = normal(dwl::rbd::Z);
+			res.valid[i] = 1;
+		} else {
+			res.height[i] = 0.;
+			res.cost[i] = 0.;
+			res.normal[i].x = 0.;
+			res.normal[i].y = 0.;
+			res.normal[i].z = 1.;
+			res.valid[i] = 0;
+		}
+	}
+
+	return true;
+}
+
+
+bool TerrainMapServer::getTerrainRegion(terrain_server::TerrainRegion::Request& req,
+										terrain_server::TerrainRegion::Response& res)
+{
+	TerrainSnapshotPtr snapshot = getLatestSnapshot();
+	if (!snapshot || !std::isfinite(req.centre.x) || !std::isfinite(req.centre.y) ||
+			!std::isfinite(req.size_x) || !std::isfinite(req.size_y) ||
+			!std::isfinite(req.yaw) || req.size_x < 0. || req.size_y < 0.)
+		return false;
+
+	// Clamping the size to the reach of the grids, i.e. the distance from the
+	// centre to the farthest corner of the levels. The samples beyond it are
+	// outside every level, so a huge size doesn't overflow the number of
+	// samples or allocate them
+	double reach = 0.;
+	for (unsigned int n = 0; n < snapshot->level.size(); n++) {
+		const SnapshotLevel& level = snapshot->level[n];
+		if (level.grid.getNumberOfCells() == 0)
+			continue;
+
+		double min_x, min_y, max_x, max_y;
+		double half_cell = 0.5 * level.plane_resolution;
+		level.discretization.keyToCoord(min_x, level.grid.getOriginKeyX(), true);
+		level.discretization.keyToCoord(min_y, level.grid.getOriginKeyY(), true);
+		max_x = min_x + level.grid.getSizeX() * level.plane_resolution - half_cell;
+		max_y = min_y + level.grid.getSizeY() * level.plane_resolution - half_cell;
+		min_x -= half_cell;
+		min_y -= half_cell;
+		double dx = std::max(fabs(min_x - req.centre.x), fabs(max_x - req.centre.x));
+		double dy = std::max(fabs(min_y - req.centre.y), fabs(max_y - req.centre.y));
+		reach = std::max(reach, sqrt(dx * dx + dy * dy));
+	}
+	double size_x = std::min(req.size_x, 2. * reach);
+	double size_y = std::min(req.size_y, 2. * reach);
+
+	// Sampling the rectangle at the plane resolution (of the finest level)
+	// along its axes, for an axis-aligned region the samples are the cells of
+	// the grid
+	double resolution = snapshot->level[0].plane_resolution;
+	double cos_yaw = cos(req.yaw);
+	double sin_yaw = sin(req.yaw);
+	res.resolution = resolution;
+	res.size_x = std::max(1, (int) ceil(size_x / resolution));
+	res.size_y = std::max(1, (int) ceil(size_y / resolution));
+	double half_x = 0.5 * (res.size_x - 1) * resolution;
+	double half_y = 0.5 * (res.size_y - 1) * resolution;
+	res.corner.x = req.centre.x - cos_yaw * half_x + sin_yaw * half_y;
+	res.corner.y = req.centre.y - sin_yaw * half_x - cos_yaw * half_y;
+
+	unsigned int num_samples = res.size_x * res.size_y;
+	res.valid.assign(num_samples, 0);
+	res.height.assign(num_samples, 0.);
+	res.cost.assign(num_samples, 0.);
+	res.normal.resize(num_samples);
+
+	for (unsigned int j = 0; j < res.size_y; j++) {
+		for (unsigned int i = 0; i < res.size_x; i++) {
+			unsigned int sample = j * res.size_x + i;
+			double x = res.corner.x + (cos_yaw * i - sin_yaw * j) * resolution;
+			double y = res.corner.y + (sin_yaw * i + cos_yaw * j) * resolution;
+
+			const TerrainGrid* grid;
+			unsigned int index;
+			if (getCellIndex(index, grid, *snapshot, x, y)) {
+				const Eigen::Vector3f& normal = grid->getNormal(index);
+				res.valid[sample] = 1;
+				res.height[sample] = grid->getHeight(index);
+				res.cost[sample] = grid->getCost(index);
+				res.normal[sample].x = normal(dwl::rbd::X);
+				res.normal[sample].y = normal(dwl::rbd::Y);
+				res.normal[sample].z = normal(dwl::rbd::Z);
+			} else
+				res.normal[sample].z = 1.;
+		}
+	}
+
+	return true;
+}
+
+
+bool TerrainMapServer::resync(std_srvs::Empty::Request& req,
+							  std_srvs::Empty::Response& resp)
+{
+	// The keyframe is sent by the publish stage
+	keyframe_request_ = true;
+	notifyStage(publish_mutex_, publish_cond_);
+
+	return true;
+}
+
+
+unsigned long TerrainMapServer::getNumberOfProcessedFrames() const
 {
-	// Creating a octree
-	octomap::OcTree* octomap = NULL;
-	octomap::AbstractOcTree* tree = octomap_msgs::msgToMap(*msg);
+	return processed_frames_;
+}
+
 
-	if (tree) {
-		octomap = dynamic_cast<octomap::OcTree*>(tree);
+unsigned long TerrainMapServer::getNumberOfDroppedFrames() const
+{
+	return dropped_frames_;
+}
+
+
+TerrainMapServer::TerrainSnapshotPtr TerrainMapServer::getLatestSnapshot() const
+{
+	// Reading the latest snapshot, so the services don't wait for the
+	// computation of the terrain map
+	if (!initial_map_)
+		return TerrainSnapshotPtr();
+
+	return std::atomic_load(&latest_snapshot_);
+}
+
+
+bool TerrainMapServer::getCellIndex(unsigned int& index,
+									const TerrainGrid*& grid,
+									const TerrainSnapshot& snapshot,
+									double x, double y) const
+{
+	for (unsigned int n = 0; n < snapshot.level.size(); n++) {
+		const SnapshotLevel& level = snapshot.level[n];
+		unsigned short key_x, key_y;
+		level.discretization.coordToKey(key_x, x, true);
+		level.discretization.coordToKey(key_y, y, true);
+		if (level.grid.getIndex(index, key_x, key_y) && level.grid.isTerrain(index)) {
+			grid = &level.grid;
+			return true;
+		}
 	}
 
-	if (!octomap) {
-		ROS_WARN("Failed to create octree structure");
+	return false;
+}
+
+
+void TerrainMapServer::deserializeLoop()
+{
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(deserialize_mutex_);
+			deserialize_cond_.wait(lock, [this] {
+				return is_stopped_ || octomap_mailbox_.isFull();
+			});
+		}
+		if (is_stopped_)
+			return;
+
+		octomap_msgs::Octomap::ConstPtr* msg = octomap_mailbox_.take();
+		if (!msg)
+			continue;
+		if (isBeforeReset((*msg)->header.stamp)) {
+			delete msg;
+			dropped_frames_++;
+			continue;
+		}
+
+		// Getting a free octree, there is always one since the pipeline
+		// holds at most the computed and the waiting octrees
+		OctreeFrame* frame = NULL;
+		{
+			std::lock_guard<std::mutex> lock(frames_mutex_);
+			if (!free_frames_.empty()) {
+				frame = free_frames_.back();
+				free_frames_.pop_back();
+			}
+		}
+		if (!frame) {
+			delete msg;
+			dropped_frames_++;
+			continue;
+		}
+
+		// Restricting the octomap to the reach of the terrain map around the
+		// robot. In the incremental mode the octree is persistent, so it's
+		// read whole
+		frame->reader.clearBoundingBox();
+		double reach = octomap_reach_.load();
+		if (!incremental_update_ && reach > 0.) {
+			try {
+				tf::StampedTransform tf_transform;
+				tf_listener_.lookupTransform(world_frame_,
+											 base_frame_,
+											 (*msg)->header.stamp,
+											 tf_transform);
+				const tf::Vector3& position = tf_transform.getOrigin();
+				frame->reader.setBoundingBox(
+						octomap::point3d(position.x() - reach, position.y() - reach, -1e6),
+						octomap::point3d(position.x() + reach, position.y() + reach, 1e6));
+			} catch (tf::TransformException& ex) {
+				// The octomap is read whole, and the computation of the
+				// terrain map reports the transform error
+			}
+		}
+
+		// Reading the octomap into the recycled octree
+		{
+			ScopedTimer timer(&statistics_, deserialize_timer_);
+			frame->octree = frame->reader.read(**msg);
+		}
+		statistics_.addSample(octomap_bytes_counter_, (*msg)->data.size());
+		if (frame->octree)
+			statistics_.addSample(octree_nodes_counter_, frame->octree->size());
+		frame->stamp = (*msg)->header.stamp;
+		delete msg;
+		if (!frame->octree) {
+			ROS_WARN("Failed to create octree structure");
+			releaseFrame(frame);
+			continue;
+		}
+
+		// In the incremental mode, the first octomap that is read after the
+		// reset is kept and then it's updated with the changes, the next
+		// octomap callback unsubscribes. An octomap read during a reset is
+		// dropped
+		if (incremental_update_) {
+			bool is_initial;
+			{
+				std::lock_guard<std::mutex> lock(reset_mutex_);
+				is_initial = !is_initial_octree_ && frame->stamp >= reset_stamp_;
+				if (is_initial)
+					is_initial_octree_ = true;
+			}
+			if (!is_initial) {
+				releaseFrame(frame);
+				dropped_frames_++;
+				continue;
+			}
+			ROS_INFO("Received the initial octomap, listening its changes");
+		}
+
+		// Posting the octree to the compute stage, an octree that wasn't
+		// computed yet is stale, so it's dropped
+		OctreeFrame* stale_frame = octree_mailbox_.post(frame);
+		if (stale_frame) {
+			releaseFrame(stale_frame);
+			dropped_frames_++;
+		}
+		notifyStage(compute_mutex_, compute_cond_);
+	}
+}
+
+
+bool TerrainMapServer::isBeforeReset(const ros::Time& stamp)
+{
+	std::lock_guard<std::mutex> lock(reset_mutex_);
+	return stamp < reset_stamp_;
+}
+
+
+void TerrainMapServer::computeLoop()
+{
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(compute_mutex_);
+			compute_cond_.wait(lock, [this] {
+				return is_stopped_ || reset_request_ || octree_mailbox_.isFull() ||
+						cloud_mailbox_.isFull() ||
+						(persistent_frame_ && !pending_changes_.empty());
+			});
+		}
+		if (is_stopped_)
+			return;
+
+		// Resetting the terrain map, and the octree in the incremental mode
+		if (reset_request_.exchange(false)) {
+			for (unsigned int n = 0; n < terrain_levels_.size(); n++)
+				terrain_levels_[n]->reset();
+			std::atomic_store(&latest_snapshot_, TerrainSnapshotPtr());
+			if (persistent_frame_) {
+				releaseFrame(persistent_frame_);
+				persistent_frame_ = NULL;
+			}
+
+			std::lock_guard<std::mutex> lock(compute_mutex_);
+			pending_changes_.clear();
+		}
+
+		// Computing the terrain map of a new octree, an octree posted before
+		// the reset is dropped
+		OctreeFrame* frame = octree_mailbox_.take();
+		if (frame && isBeforeReset(frame->stamp)) {
+			releaseFrame(frame);
+			dropped_frames_++;
+			frame = NULL;
+		}
+		if (frame) {
+			double resolution = frame->octree->getResolution();
+			double reach = 0.;
+			for (unsigned int n = 0; n < terrain_levels_.size(); n++) {
+				terrain_levels_[n]->setResolution(resolution, false);
+				reach = std::max(reach, terrain_levels_[n]->getOctomapReach(resolution));
+			}
+			octomap_reach_ = reach;
+			computeTerrainMap(frame->octree, frame->stamp);
+
+			// In the incremental mode, the octree is kept for applying the
+			// changes after its time
+			if (incremental_update_) {
+				if (persistent_frame_)
+					releaseFrame(persistent_frame_);
+				persistent_frame_ = frame;
+			} else
+				releaseFrame(frame);
+		}
+
+		// Computing the terrain map of the changes of the octree
+		if (persistent_frame_) {
+			ros::Time stamp = applyChanges(persistent_frame_->octree);
+			if (!stamp.isZero())
+				computeTerrainMap(persistent_frame_->octree, stamp);
+		}
+
+		// Computing the terrain map of a new point cloud
+		sensor_msgs::PointCloud2::ConstPtr* msg = cloud_mailbox_.take();
+		if (msg) {
+			computeTerrainMap(**msg);
+			delete msg;
+		}
+	}
+}
+
+
+void TerrainMapServer::publishLoop()
+{
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(publish_mutex_);
+			publish_cond_.wait(lock, [this] {
+				return is_stopped_ || snapshot_mailbox_.isFull() || keyframe_request_;
+			});
+		}
+		if (is_stopped_)
+			return;
+
+		// Publishing a new snapshot, the keyframe request is answered with
+		// it. Otherwise, the keyframe is the latest updated terrain map
+		TerrainSnapshotPtr* snapshot = snapshot_mailbox_.take();
+		if (snapshot) {
+			{
+				ScopedTimer timer(&statistics_, publish_map_timer_);
+				publishTerrainMap(**snapshot);
+			}
+			{
+				ScopedTimer timer(&statistics_, publish_dense_timer_);
+				publishDenseTerrainMap(**snapshot);
+			}
+			{
+				ScopedTimer timer(&statistics_, publish_update_timer_);
+				publishTerrainMapUpdate(**snapshot);
+			}
+			{
+				ScopedTimer timer(&statistics_, shared_map_timer_);
+				writeSharedTerrainMap(**snapshot);
+			}
+			delete snapshot;
+		} else if (keyframe_request_)
+			publishKeyframe();
+	}
+}
+
+
+void TerrainMapServer::stopPipeline()
+{
+	is_stopped_ = true;
+	notifyStage(deserialize_mutex_, deserialize_cond_);
+	notifyStage(compute_mutex_, compute_cond_);
+	notifyStage(publish_mutex_, publish_cond_);
+
+	if (deserialize_thread_.joinable())
+		deserialize_thread_.join();
+	if (compute_thread_.joinable())
+		compute_thread_.join();
+	if (publish_thread_.joinable())
+		publish_thread_.join();
+
+	// The octrees are owned by the server, not by the mailbox
+	octree_mailbox_.take();
+	delete cloud_mailbox_.take();
+}
+
+
+void TerrainMapServer::computeTerrainMap(octomap::OcTree* octomap,
+										 const ros::Time& stamp)
+{
+	Eigen::Vector4d robot_state;
+	if (!getRobotState(robot_state, stamp))
+		return;
+
+	// Computing the terrain map
+	timespec start_rt, end_rt;
+	clock_gettime(CLOCK_REALTIME, &start_rt);
+	{
+		ScopedTimer timer(&statistics_, compute_timer_);
+		for (unsigned int n = 0; n < terrain_levels_.size(); n++)
+			terrain_levels_[n]->compute(octomap, robot_state);
+	}
+	postSnapshot(stamp);
+
+	clock_gettime(CLOCK_REALTIME, &end_rt);
+	double duration =
+			(end_rt.tv_sec - start_rt.tv_sec) + 1e-9*(end_rt.tv_nsec - start_rt.tv_nsec);
+	ROS_INFO("The duration of computation of terrain map is %f seg (%lu processed and"
+			" %lu dropped frames).", duration, (unsigned long) processed_frames_,
+			(unsigned long) dropped_frames_);
+}
+
+
+void TerrainMapServer::computeTerrainMap(const sensor_msgs::PointCloud2& msg)
+{
+	Eigen::Vector4d robot_state;
+	if (!getRobotState(robot_state, msg.header.stamp))
+		return;
+
+	// Getting the transformation between the world to sensor frame
+	tf::StampedTransform tf_transform;
+	try {
+		ScopedTimer timer(&statistics_, tf_timer_);
+		tf_listener_.lookupTransform(world_frame_,
+									 msg.header.frame_id,
+									 msg.header.stamp,
+									 tf_transform);
+	} catch (tf::TransformException& ex) {
+		ROS_ERROR_STREAM("Transform error of sensor data: " << ex.what() << ", quitting callback");
 		return;
 	}
 
-	// Setting the resolution of the gridmap
-	terrain_map_.setResolution(octomap->getResolution(), false);
+	// Computing the terrain map from the points in the world frame, the
+	// invalid points are skipped
+	timespec start_rt, end_rt;
+	clock_gettime(CLOCK_REALTIME, &start_rt);
+	{
+		ScopedTimer timer(&statistics_, compute_timer_);
+		pcl::fromROSMsg(msg, cloud_);
+		points_.clear();
+		points_.reserve(cloud_.points.size());
+		for (unsigned int i = 0; i < cloud_.points.size(); i++) {
+			const pcl::PointXYZ& point = cloud_.points[i];
+			if (!std::isfinite(point.x) || !std::isfinite(point.y) ||
+					!std::isfinite(point.z))
+				continue;
 
+			tf::Vector3 world_point = tf_transform * tf::Vector3(point.x, point.y, point.z);
+			points_.push_back(Eigen::Vector3f(world_point.x(),
+											  world_point.y(),
+											  world_point.z()));
+		}
+		for (unsigned int n = 0; n < terrain_levels_.size(); n++)
+			terrain_levels_[n]->compute(points_, robot_state, msg.header.stamp.toSec());
+	}
+	statistics_.addSample(cloud_points_counter_, points_.size());
+	postSnapshot(msg.header.stamp);
+
+	clock_gettime(CLOCK_REALTIME, &end_rt);
+	double duration =
+			(end_rt.tv_sec - start_rt.tv_sec) + 1e-9*(end_rt.tv_nsec - start_rt.tv_nsec);
+	ROS_INFO("The duration of computation of terrain map is %f seg (%lu processed and"
+			" %lu dropped frames).", duration, (unsigned long) processed_frames_,
+			(unsigned long) dropped_frames_);
+}
+
+
+bool TerrainMapServer::getRobotState(Eigen::Vector4d& robot_state,
+									 const ros::Time& stamp)
+{
 	// Getting the transformation between the world to robot frame
 	tf::StampedTransform tf_transform;
 	try {
+		ScopedTimer timer(&statistics_, tf_timer_);
 		tf_listener_.lookupTransform(world_frame_,
 									 base_frame_,
-									 msg->header.stamp,
+									 stamp,
 									 tf_transform);
 	} catch (tf::TransformException& ex) {
 		ROS_ERROR_STREAM("Transform error of sensor data: " << ex.what() << ", quitting callback");
-		return;
+		return false;
 	}
 
 	// Getting the robot state (3D position and yaw angle)
-	Eigen::Vector4d robot_position = Eigen::Vector4d::Zero();
-	robot_position(0) = tf_transform.getOrigin()[0];
-	robot_position(1) = tf_transform.getOrigin()[1];
-	robot_position(2) = tf_transform.getOrigin()[2];
+	robot_state = Eigen::Vector4d::Zero();
+	robot_state(0) = tf_transform.getOrigin()[0];
+	robot_state(1) = tf_transform.getOrigin()[1];
+	robot_state(2) = tf_transform.getOrigin()[2];
 
 	// Computing the yaw angle
 	tf::Quaternion q = tf_transform.getRotation();
@@ -192,117 +1023,419 @@ void TerrainMapServer::octomapCallback(const octomap_msgs::Octomap::ConstPtr& ms
 																   q.getX(),
 																   q.getY(),
 																   q.getZ())));
-	robot_position(3) = yaw;
+	robot_state(3) = yaw;
 
-	// Computing the terrain map
-	timespec start_rt, end_rt;
-	clock_gettime(CLOCK_REALTIME, &start_rt);
-	terrain_map_.compute(octomap, robot_position);
-	initial_map_ = true;
-	publishTerrainMap();
-	clock_gettime(CLOCK_REALTIME, &end_rt);
-	double duration =
-			(end_rt.tv_sec - start_rt.tv_sec) + 1e-9*(end_rt.tv_nsec - start_rt.tv_nsec);
-	ROS_INFO("The duration of computation of terrain map is %f seg.", duration);
+	return true;
 }
 
 
-bool TerrainMapServer::reset(std_srvs::Empty::Request& req,
-							std_srvs::Empty::Response& resp)
+void TerrainMapServer::postSnapshot(const ros::Time& stamp)
 {
-	initial_map_ = false;
-	terrain_map_.reset();
+	// Taking a snapshot of the terrain map. The previous snapshot is recycled
+	// once the publisher and the services don't use it
+	TerrainSnapshotPtr snapshot;
+	{
+		ScopedTimer timer(&statistics_, snapshot_timer_);
+		if (spare_snapshot_ && spare_snapshot_.use_count() == 1)
+			snapshot.swap(spare_snapshot_);
+		else
+			snapshot = std::make_shared<TerrainSnapshot>();
+		snapshot->level.resize(terrain_levels_.size());
+		for (unsigned int n = 0; n < terrain_levels_.size(); n++) {
+			SnapshotLevel& level = snapshot->level[n];
+			level.grid = terrain_levels_[n]->getTerrainGrid();
+			level.plane_resolution = terrain_levels_[n]->getResolution(true);
+			level.height_resolution = terrain_levels_[n]->getResolution(false);
+			level.discretization.setEnvironmentResolution(level.plane_resolution, true);
+			level.discretization.setEnvironmentResolution(level.height_resolution, false);
+		}
+		snapshot->stamp = stamp;
 
-	ros::ServiceClient client = 
-		private_node_.serviceClient<std_srvs::Empty>("/octomap_server/reset");
+		// Getting the updated cells of the finest level, the updates of a
+		// snapshot that wasn't published yet are kept in the new one
+		const TerrainGrid& grid = terrain_levels_[0]->getTerrainGrid();
+		snapshot->is_full_update = !terrain_levels_[0]->takeUpdatedCells(updated_indexes_);
+		snapshot->updated_cells.resize(updated_indexes_.size());
+		for (unsigned int i = 0; i < updated_indexes_.size(); i++)
+			grid.getKey(snapshot->updated_cells[i].first,
+						snapshot->updated_cells[i].second,
+						updated_indexes_[i]);
 
-	if (!client.call(req, resp)) {
-		ROS_ERROR("Failed to call service /octomap_server/reset");
-		return false;
+		TerrainSnapshotPtr* stale_snapshot = snapshot_mailbox_.take();
+		if (stale_snapshot) {
+			const TerrainSnapshot& stale = **stale_snapshot;
+			snapshot->is_full_update |= stale.is_full_update;
+			snapshot->updated_cells.insert(snapshot->updated_cells.end(),
+										   stale.updated_cells.begin(),
+										   stale.updated_cells.end());
+			std::sort(snapshot->updated_cells.begin(), snapshot->updated_cells.end());
+			snapshot->updated_cells.erase(std::unique(snapshot->updated_cells.begin(),
+													  snapshot->updated_cells.end()),
+										  snapshot->updated_cells.end());
+			delete stale_snapshot;
+		}
+
+		spare_snapshot_ = std::atomic_exchange(&latest_snapshot_, snapshot);
 	}
+	initial_map_ = true;
+	processed_frames_++;
 
-	ROS_INFO("Reset terrain map");	
-	return true;
+	// Posting the snapshot to the publish stage
+	delete snapshot_mailbox_.post(new TerrainSnapshotPtr(snapshot));
+	notifyStage(publish_mutex_, publish_cond_);
 }
 
 
-bool TerrainMapServer::getTerrainData(terrain_server::TerrainData::Request& req,
-									  terrain_server::TerrainData::Response& res)
+ros::Time TerrainMapServer::applyChanges(octomap::OcTree* octree)
 {
-	if (initial_map_) {
-		Eigen::Vector2d position(req.position.x, req.position.y);
-		dwl::TerrainCell cell = terrain_map_.getTerrainData(position);
+	std::vector<sensor_msgs::PointCloud2::ConstPtr> changes;
+	{
+		std::lock_guard<std::mutex> lock(compute_mutex_);
+		changes.swap(pending_changes_);
+	}
 
-		res.cost = cell.cost;
-		res.height = cell.height;
-		res.normal.x = cell.normal(dwl::rbd::X);
-		res.normal.y = cell.normal(dwl::rbd::Y);
-		res.normal.z = cell.normal(dwl::rbd::Z);
+	// Applying the changes to the octree, as the tracking octomap server
+	// does, i.e. the intensity is the log-odds update of each changed voxel.
+	// Note that the changes before the octree time are already in the octree
+	ros::Time stamp;
+	pcl::PointCloud<pcl::PointXYZI> changed_cells;
+	for (unsigned int n = 0; n < changes.size(); n++) {
+		if (changes[n]->header.stamp <= persistent_frame_->stamp)
+			continue;
 
-		return true;
+		pcl::fromROSMsg(*changes[n], changed_cells);
+		for (unsigned int i = 0; i < changed_cells.points.size(); i++) {
+			const pcl::PointXYZI& point = changed_cells.points[i];
+			octomap::OcTreeKey key =
+					octree->coordToKey(octomap::point3d(point.x, point.y, point.z));
+			octree->updateNode(key, point.intensity, true);
+			for (unsigned int l = 0; l < terrain_levels_.size(); l++)
+				terrain_levels_[l]->addChangedColumn(point.x, point.y);
+		}
+		stamp = changes[n]->header.stamp;
 	}
-	
-	return false;
+
+	if (!stamp.isZero())
+		octree->updateInnerOccupancy();
+
+	return stamp;
 }
 
 
-void TerrainMapServer::publishTerrainMap()
+void TerrainMapServer::publishTerrainMap(const TerrainSnapshot& snapshot)
 {
 	// Publishing the terrain map if there is at least one subscriber
 	if (map_pub_.getNumSubscribers() > 0) {
 		map_msg_.header.stamp = ros::Time::now();
 
-		dwl::TerrainDataMap terrain_gridmap = terrain_map_.getTerrainDataMap();
+		// Getting the cells of the finest level, and then the ones of the
+		// coarse levels
+		map_msg_.coarse_level.resize(snapshot.level.size() - 1);
+		for (unsigned int n = 0; n < snapshot.level.size(); n++) {
+			const SnapshotLevel& level = snapshot.level[n];
+			const TerrainGrid& grid = level.grid;
 
-		// Getting the terrain map resolutions
-		map_msg_.plane_size = terrain_map_.getResolution(true);
-		map_msg_.height_size = terrain_map_.getResolution(false);
+			// Getting the terrain map resolutions
+			std::vector<terrain_server::TerrainCell>* cells;
+			if (n == 0) {
+				map_msg_.plane_size = level.plane_resolution;
+				map_msg_.height_size = level.height_resolution;
+				cells = &map_msg_.cell;
+			} else {
+				map_msg_.coarse_level[n - 1].plane_size = level.plane_resolution;
+				map_msg_.coarse_level[n - 1].height_size = level.height_resolution;
+				cells = &map_msg_.coarse_level[n - 1].cell;
+			}
 
-		// Getting the number of cells
-		unsigned int num_cells = terrain_gridmap.size();
-		map_msg_.cell.resize(num_cells);
+			// Getting the number of cells
+			unsigned int num_cells = grid.getNumberOfTerrainCells();
+			cells->resize(num_cells);
 
-		// Converting the vertexes into a cell message
-		terrain_server::TerrainCell cell;
-		unsigned int idx = 0;
-		for (dwl::TerrainDataMap::iterator vertex_iter = terrain_gridmap.begin();
-				vertex_iter != terrain_gridmap.end();
-				vertex_iter++)
-		{
-			dwl::TerrainCell terrain_cell = vertex_iter->second;
+			// Converting the grid cells into a cell message
+			unsigned int idx = 0;
+			unsigned int grid_size = grid.getNumberOfCells();
+			for (unsigned int index = 0; index < grid_size; index++) {
+				if (!grid.isTerrain(index))
+					continue;
 
-			cell.key_x = terrain_cell.key.x;
-			cell.key_y = terrain_cell.key.y;
-			cell.key_z = terrain_cell.key.z;
-			cell.cost = terrain_cell.cost;
-			cell.normal.x = terrain_cell.normal(dwl::rbd::X);
-			cell.normal.y = terrain_cell.normal(dwl::rbd::Y);
-			cell.normal.z = terrain_cell.normal(dwl::rbd::Z);
-			map_msg_.cell[idx] = cell;
-
-			idx++;
+				convertTerrainCell((*cells)[idx], grid, index);
+				idx++;
+			}
 		}
 
 		map_pub_.publish(map_msg_);
+		if (statistics_.isEnabled())
+			statistics_.addSample(map_bytes_counter_,
+								  ros::serialization::serializationLength(map_msg_));
 
 		// Deleting old information
 		map_msg_.cell.clear();
+		map_msg_.coarse_level.clear();
 	}
 }
 
-} //@namespace terrain_server
 
+void TerrainMapServer::publishDenseTerrainMap(const TerrainSnapshot& snapshot)
+{
+	// Publishing the dense terrain map if there is at least one subscriber
+	if (dense_map_pub_.getNumSubscribers() > 0) {
+		dense_map_msg_.header.stamp = ros::Time::now();
+
+		// Getting the terrain map resolutions and the grid of the finest level
+		const SnapshotLevel& level = snapshot.level[0];
+		const TerrainGrid& grid = level.grid;
+		dense_map_msg_.plane_size = level.plane_resolution;
+		dense_map_msg_.height_size = level.height_resolution;
+		dense_map_msg_.origin_key_x = grid.getOriginKeyX();
+		dense_map_msg_.origin_key_y = grid.getOriginKeyY();
+		dense_map_msg_.size_x = grid.getSizeX();
+		dense_map_msg_.size_y = grid.getSizeY();
+
+		// Getting the maximum cost and the base height key of the terrain
+		// cells, which are the references of the quantized layers
+		float max_cost = 0.;
+		unsigned short base_key_z = std::numeric_limits<unsigned short>::max();
+		unsigned int grid_size = grid.getNumberOfCells();
+		for (unsigned int index = 0; index < grid_size; index++) {
+			if (!grid.isTerrain(index))
+				continue;
+
+			max_cost = std::max(max_cost, grid.getCost(index));
+			base_key_z = std::min(base_key_z, grid.getKeyZ(index));
+		}
+		dense_map_msg_.max_cost = max_cost;
+		dense_map_msg_.base_key_z = base_key_z;
+
+		// Unrolling the circular grid from its origin into the layers
+		unsigned int num_cells = grid.getNumberOfTerrainCells();
+		dense_map_msg_.valid.assign((grid_size + 7) / 8, 0);
+		dense_map_msg_.cost.resize(num_cells);
+		dense_map_msg_.height.resize(num_cells);
+		dense_map_msg_.normal.resize(2 * num_cells);
+
+		unsigned int idx = 0;
+		unsigned int size_x = grid.getSizeX();
+		unsigned int size_y = grid.getSizeY();
+		unsigned int first_slot_x = grid.getOriginKeyX() % size_x;
+		for (unsigned int y = 0; y < size_y; y++) {
+			unsigned int slot_offset = ((grid.getOriginKeyY() + y) % size_y) * size_x;
+			unsigned int slot_x = first_slot_x;
+			for (unsigned int x = 0; x < size_x; x++) {
+				unsigned int index = slot_offset + slot_x;
+				if (++slot_x == size_x)
+					slot_x = 0;
+
+				if (!grid.isTerrain(index))
+					continue;
+
+				unsigned int cell = y * size_x + x;
+				dense_map_msg_.valid[cell / 8] |= 1 << (cell % 8);
+				dense_map_msg_.cost[idx] =
+						TerrainMapCodec::encodeCost(grid.getCost(index), max_cost);
+				dense_map_msg_.height[idx] = grid.getKeyZ(index) - base_key_z;
+				signed char u, v;
+				TerrainMapCodec::encodeNormal(u, v, grid.getNormal(index));
+				dense_map_msg_.normal[2 * idx] = u;
+				dense_map_msg_.normal[2 * idx + 1] = v;
+
+				idx++;
+			}
+		}
+
+		dense_map_pub_.publish(dense_map_msg_);
+		if (statistics_.isEnabled())
+			statistics_.addSample(dense_bytes_counter_,
+								  ros::serialization::serializationLength(dense_map_msg_));
+	}
+}
 
 
-int main(int argc, char **argv)
+void TerrainMapServer::publishTerrainMapUpdate(const TerrainSnapshot& snapshot)
 {
-	ros::init(argc, argv, "terrain_map_server");
+	// Without subscribers, the next update is a keyframe
+	if (update_pub_.getNumSubscribers() == 0) {
+		is_update_published_ = false;
+		return;
+	}
 
-	terrain_server::TerrainMapServer terrain_server;
-	if (!terrain_server.init())
-		return -1;
+	// A keyframe is sent if it's requested, periodically, or if every cell
+	// could have changed (e.g. the grid was reset or resized). Note that the
+	// updates have the finest level
+	const SnapshotLevel& level = snapshot.level[0];
+	bool is_keyframe = !is_update_published_ ||
+			keyframe_request_.exchange(false) ||
+			(update_sequence_ + 1) % keyframe_period_ == 0 ||
+			snapshot.is_full_update;
 
-	ros::spin();
+	update_msg_.header.stamp = ros::Time::now();
+	update_msg_.sequence = ++update_sequence_;
+	update_msg_.keyframe = is_keyframe;
+	update_msg_.plane_size = level.plane_resolution;
+	update_msg_.height_size = level.height_resolution;
+	update_msg_.origin_key_x = level.grid.getOriginKeyX();
+	update_msg_.origin_key_y = level.grid.getOriginKeyY();
+	update_msg_.size_x = level.grid.getSizeX();
+	update_msg_.size_y = level.grid.getSizeY();
+	update_msg_.cell.clear();
+	update_msg_.evicted.clear();
 
-	return 0;
+	const TerrainGrid& grid = level.grid;
+	terrain_server::TerrainCell cell;
+	if (is_keyframe) {
+		unsigned int grid_size = grid.getNumberOfCells();
+		for (unsigned int index = 0; index < grid_size; index++) {
+			if (!grid.isTerrain(index))
+				continue;
+
+			convertTerrainCell(cell, grid, index);
+			update_msg_.cell.push_back(cell);
+		}
+	} else {
+		// Getting the cells that were updated by the compute stage, they are
+		// either modified or evicted. The cells that left the grid aren't
+		// sent because the clients move their grid
+		terrain_server::Cell evicted_cell;
+		for (unsigned int i = 0; i < snapshot.updated_cells.size(); i++) {
+			unsigned int index;
+			evicted_cell.key_x = snapshot.updated_cells[i].first;
+			evicted_cell.key_y = snapshot.updated_cells[i].second;
+			if (!grid.getIndex(index, evicted_cell.key_x, evicted_cell.key_y))
+				continue;
+
+			if (grid.isTerrain(index)) {
+				convertTerrainCell(cell, grid, index);
+				update_msg_.cell.push_back(cell);
+			} else {
+				evicted_cell.key_z = grid.getKeyZ(index);
+				update_msg_.evicted.push_back(evicted_cell);
+			}
+		}
+	}
+
+	update_pub_.publish(update_msg_);
+	if (statistics_.isEnabled())
+		statistics_.addSample(update_bytes_counter_,
+							  ros::serialization::serializationLength(update_msg_));
+
+	is_update_published_ = true;
+}
+
+
+void TerrainMapServer::writeSharedTerrainMap(const TerrainSnapshot& snapshot)
+{
+	if (!is_shared_memory_)
+		return;
+
+	// Creating a new segment if the grid of the finest level doesn't fit, the
+	// readers remap it
+	const SnapshotLevel& level = snapshot.level[0];
+	unsigned int num_cells = level.grid.getNumberOfCells();
+	if (shared_map_.getCapacity() < num_cells &&
+			!shared_map_.create(shared_memory_, num_cells)) {
+		ROS_ERROR("Failed to create the shared memory %s, it's disabled",
+				shared_memory_.c_str());
+		is_shared_memory_ = false;
+		return;
+	}
+
+	shared_map_.write(level.grid, level.plane_resolution, level.height_resolution);
+}
+
+
+void TerrainMapServer::publishKeyframe()
+{
+	keyframe_request_ = false;
+	TerrainSnapshotPtr snapshot = getLatestSnapshot();
+	if (!snapshot)
+		return;
+
+	// The keyframe has the cells of the latest snapshot. Note that it could be
+	// newer than the latest update, however the update of this snapshot
+	// doesn't change the keyframe since it has the same cells
+	const SnapshotLevel& level = snapshot->level[0];
+	update_msg_.header.stamp = ros::Time::now();
+	update_msg_.sequence = ++update_sequence_;
+	update_msg_.keyframe = true;
+	update_msg_.plane_size = level.plane_resolution;
+	update_msg_.height_size = level.height_resolution;
+	update_msg_.origin_key_x = level.grid.getOriginKeyX();
+	update_msg_.origin_key_y = level.grid.getOriginKeyY();
+	update_msg_.size_x = level.grid.getSizeX();
+	update_msg_.size_y = level.grid.getSizeY();
+	update_msg_.cell.clear();
+	update_msg_.evicted.clear();
+
+	const TerrainGrid& grid = level.grid;
+	terrain_server::TerrainCell cell;
+	unsigned int grid_size = grid.getNumberOfCells();
+	for (unsigned int index = 0; index < grid_size; index++) {
+		if (!grid.isTerrain(index))
+			continue;
+
+		convertTerrainCell(cell, grid, index);
+		update_msg_.cell.push_back(cell);
+	}
+
+	update_pub_.publish(update_msg_);
 }
+
+
+void TerrainMapServer::publishStatistics(const ros::TimerEvent& event)
+{
+	std::vector<Statistics::Summary> summaries;
+	statistics_msg_.window = statistics_.rollWindow(summaries);
+	statistics_msg_.header.stamp = ros::Time::now();
+	statistics_msg_.metric.resize(summaries.size());
+	for (unsigned int i = 0; i < summaries.size(); i++) {
+		const Statistics::Summary& summary = summaries[i];
+		terrain_server::MetricSummary& metric = statistics_msg_.metric[i];
+		metric.name = summary.name;
+		metric.unit = summary.unit;
+		metric.samples = summary.samples;
+		metric.total = summary.total;
+		metric.mean = summary.mean;
+		metric.min = summary.min;
+		metric.max = summary.max;
+		metric.p50 = summary.p50;
+		metric.p90 = summary.p90;
+		metric.p99 = summary.p99;
+	}
+
+	statistics_pub_.publish(statistics_msg_);
+}
+
+
+void TerrainMapServer::convertTerrainCell(terrain_server::TerrainCell& cell,
+										  const TerrainGrid& grid,
+										  unsigned int index) const
+{
+	grid.getKey(cell.key_x, cell.key_y, index);
+	cell.key_z = grid.getKeyZ(index);
+	cell.cost = grid.getCost(index);
+	const Eigen::Vector3f& normal = grid.getNormal(index);
+	cell.normal.x = normal(dwl::rbd::X);
+	cell.normal.y = normal(dwl::rbd::Y);
+	cell.normal.z = normal(dwl::rbd::Z);
+}
+
+
+void TerrainMapServer::releaseFrame(OctreeFrame* frame)
+{
+	std::lock_guard<std::mutex> lock(frames_mutex_);
+	free_frames_.push_back(frame);
+}
+
+
+void TerrainMapServer::notifyStage(std::mutex& mutex,
+								   std::condition_variable& condition)
+{
+	// Locking the mutex avoids a lost wake-up between the check of the waiting
+	// stage and its wait
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+	}
+	condition.notify_one();
+}
+
+} //@namespace terrain_server
+
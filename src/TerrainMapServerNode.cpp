@@ -0,0 +1,15 @@
+#include <terrain_server/TerrainMapServer.h>
+
+
+int main(int argc, char **argv)
+{
+	ros::init(argc, argv, "terrain_map_server");
+
+	terrain_server::TerrainMapServer terrain_server;
+	if (!terrain_server.init())
+		return -1;
+
+	ros::spin();
+
+	return 0;
+}
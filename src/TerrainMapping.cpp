@@ -1,14 +1,62 @@
 #include <terrain_server/TerrainMapping.h>
+#include <algorithm>
 
 
 namespace terrain_server
 {
 
-TerrainMapping::TerrainMapping() :
+/** @brief Number of cells of the terrain grid per tile */
+static const unsigned int TILE_CELLS = 256;
+
+/**
+ * @brief Maximum number of points of the running mean height, the older points
+ * fade out so the mean follows the changes of the terrain
+ */
+static const unsigned int MAX_FUSED_POINTS = 256;
+
+
+/**
+ * @brief Clips a range of values to a linear constraint
+ * @param double& Minimum of the range
+ * @param double& Maximum of the range
+ * @param double Coefficient of the value in the constraint
+ * @param double Offset of the constraint
+ * @param double Lower bound of the constraint
+ * @param double Upper bound of the constraint
+ * @return Returns false if the clipped range is empty
+ */
+static bool clipRange(double& min_value,
+					  double& max_value,
+					  double coefficient,
+					  double offset,
+					  double lower_bound,
+					  double upper_bound)
+{
+	// Constraint: lower_bound <= coefficient * value + offset <= upper_bound
+	if (fabs(coefficient) < 1e-9)
+		return offset >= lower_bound && offset <= upper_bound &&
+				min_value <= max_value;
+
+	double first = (lower_bound - offset) / coefficient;
+	double last = (upper_bound - offset) / coefficient;
+	if (coefficient < 0.)
+		std::swap(first, last);
+	min_value = std::max(min_value, first);
+	max_value = std::min(max_value, last);
+
+	return min_value <= max_value;
+}
+
+
+TerrainMapping::TerrainMapping() : is_resized_grid_(false),
+		is_height_map_stale_(true), moment_radius_(1),
 		is_added_feature_(false), is_added_search_area_(false),
 		interest_radius_x_(std::numeric_limits<double>::max()),
 		interest_radius_y_(std::numeric_limits<double>::max()),
-		using_cloud_mean_(false), depth_(16)
+		using_cloud_mean_(false), depth_(16), key_step_(1), incremental_update_(false),
+		scan_height_(0.), feature_radius_(0.), is_rasterized_(false), raster_yaw_(0.),
+		raster_resolution_(0.), raster_reach_(0.), height_fusion_(MAX_HEIGHT),
+		decay_time_(0.), statistics_(NULL), octree_searches_(0)
 {
 	// Default neighboring area
 	setNeighboringArea(-2, 2, -2, 2, -2, 2);
@@ -33,6 +81,7 @@ void TerrainMapping::addFeature(dwl::environment::Feature* feature)
 	printf(GREEN "Adding the %s feature with a weight of %f\n" COLOR_RESET,
 			feature->getName().c_str(), weight);
 	features_.push_back(feature);
+	batch_features_.push_back(dynamic_cast<feature::BatchFeature*>(feature));
 	is_added_feature_ = true;
 }
 
@@ -45,6 +94,7 @@ void TerrainMapping::removeFeature(std::string feature_name)
 			printf(GREEN "Removing the %s feature\n" COLOR_RESET,
 					features_[i]->getName().c_str());
 			features_.erase(features_.begin() + i);
+			batch_features_.erase(batch_features_.begin() + i);
 
 			return;
 		}
@@ -58,6 +108,369 @@ void TerrainMapping::removeFeature(std::string feature_name)
 
 void TerrainMapping::compute(octomap::OcTree* octomap,
 							 const Eigen::Vector4d& robot_state)
+{
+	prepareGrid(robot_state);
+
+	// Getting the depth of the octree queries, the voxels of this depth are
+	// (at most) as big as the cells of the grid
+	int tree_depth = octomap->getTreeDepth();
+	double size_ratio =
+			space_discretization_.getEnvironmentResolution(true) / octomap->getResolution();
+	int coarse_levels = std::max(0, (int) floor(log2(size_ratio) + 1e-6));
+	depth_ = std::max(1, tree_depth - coarse_levels);
+	key_step_ = 1 << (tree_depth - depth_);
+
+	// Invalidating the columns that changed in the octomap. Note that in the
+	// incremental mode the surface is searched only on columns that weren't
+	// scanned, so we scan them again if the vertical search window moved.
+	// Otherwise the cells of the last computation are scanned again
+	changed_cells_.clear();
+	if (incremental_update_) {
+		if (fabs(robot_state(2) - scan_height_) >= octomap->getResolution()) {
+			grid_.resetScanned();
+			scan_height_ = robot_state(2);
+		}
+
+		for (unsigned int i = 0; i < changed_columns_.size(); i++) {
+			unsigned int index;
+			if (grid_.getIndex(index,
+							   changed_columns_[i].first,
+							   changed_columns_[i].second)) {
+				grid_.setScanned(index, false);
+				changed_cells_.push_back(index);
+			}
+		}
+	} else {
+		grid_.resetScanned(scanned_cells_);
+		scanned_cells_.clear();
+	}
+	changed_columns_.clear();
+
+	// Rasterizing the search areas for the current yaw, or reusing the cells
+	// of a previous raster. The raster is relative to the cell of the robot,
+	// so it moves with the robot in integer keys
+	unsigned short centre_key_x, centre_key_y;
+	space_discretization_.coordToKey(centre_key_x, robot_state(0), true);
+	space_discretization_.coordToKey(centre_key_y, robot_state(1), true);
+	rasterizeSearchAreas(robot_state(3));
+
+	// Computing terrain map for several search areas
+	unsigned int area_size = search_areas_.size();
+	unsigned int num_scanned_cells = 0;
+	bool is_timed = statistics_ && statistics_->isEnabled();
+	double scan_start_time = is_timed ? Statistics::getTime() : 0.;
+	for (unsigned int n = 0; n < area_size; n++) {
+		const std::vector<RasterCell>& raster = raster_cells_[n];
+		if (raster.empty())
+			continue;
+
+		// Checking if the bounding box of the area belongs to dimensions of
+		// the octomap, then the keys of its columns are inside the octomap.
+		// The columns are marked as scanned only after these checks, so the
+		// columns of a skipped area are scanned in the next computation
+		double min_x, min_y, max_x, max_y;
+		const RasterBox& box = raster_boxes_[n];
+		space_discretization_.keyToCoord(min_x, centre_key_x + box.min_x, true);
+		space_discretization_.keyToCoord(min_y, centre_key_y + box.min_y, true);
+		space_discretization_.keyToCoord(max_x, centre_key_x + box.max_x, true);
+		space_discretization_.keyToCoord(max_y, centre_key_y + box.max_y, true);
+		octomap::key_type check_key;
+		if (!octomap->coordToKeyChecked(min_x, check_key) ||
+				!octomap->coordToKeyChecked(min_y, check_key) ||
+				!octomap->coordToKeyChecked(max_x, check_key) ||
+				!octomap->coordToKeyChecked(max_y, check_key)) {
+			printf(RED "Cell out of bounds\n" COLOR_RESET);
+			continue;
+		}
+
+		// Getting the vertical limits of the search area
+		octomap::OcTreeKey min_key, max_key;
+		if (!octomap->coordToKeyChecked(search_areas_[n].min_z + robot_state(2),
+										min_key[2]) ||
+				!octomap->coordToKeyChecked(search_areas_[n].max_z + robot_state(2),
+											max_key[2])) {
+			printf(RED "Cell out of bounds\n" COLOR_RESET);
+			continue;
+		}
+
+		// Getting the columns of the search area that weren't scanned, and
+		// their bounding box. A column is the one of the centre of its cell
+		scan_columns_.clear();
+		min_key[0] = min_key[1] = std::numeric_limits<octomap::key_type>::max();
+		max_key[0] = max_key[1] = 0;
+		for (unsigned int i = 0; i < raster.size(); i++) {
+			unsigned short key_x = centre_key_x + raster[i].offset_x;
+			unsigned short key_y = centre_key_y + raster[i].offset_y;
+			unsigned int index;
+			if (!grid_.getIndex(index, key_x, key_y) || grid_.isScanned(index))
+				continue;
+
+			double x, y;
+			space_discretization_.keyToCoord(x, key_x, true);
+			space_discretization_.keyToCoord(y, key_y, true);
+			octomap::OcTreeKey column_key;
+			column_key[0] = octomap->coordToKey(x);
+			column_key[1] = octomap->coordToKey(y);
+
+			grid_.setScanned(index, true);
+			grid_.setMomentNormal(index, normal_estimation_[n] == INTEGRAL_MOMENTS);
+			if (!incremental_update_)
+				scanned_cells_.push_back(index);
+			scan_columns_.push_back(ScanColumn(column_key[0], column_key[1], index));
+			min_key[0] = std::min(min_key[0], column_key[0]);
+			min_key[1] = std::min(min_key[1], column_key[1]);
+			max_key[0] = std::max(max_key[0], column_key[0]);
+			max_key[1] = std::max(max_key[1], column_key[1]);
+		}
+
+		num_scanned_cells += scan_columns_.size();
+		if (scan_columns_.empty())
+			continue;
+
+		// Finding the surface of every column that has to be scanned
+		surface_.compute(octomap, min_key, max_key, depth_, pool_);
+
+		for (unsigned int i = 0; i < scan_columns_.size(); i++) {
+			const ScanColumn& column = scan_columns_[i];
+			octomap::OcTreeKey heightmap_key;
+			heightmap_key[0] = column.key_x;
+			heightmap_key[1] = column.key_y;
+			if (!surface_.getSurfaceKey(heightmap_key[2],
+										heightmap_key[0],
+										heightmap_key[1]))
+				continue;
+
+			// Getting position of the occupied cell
+			octomap::point3d height_point =
+					octomap->keyToCoord(heightmap_key, depth_);
+			dwl::Key cell_key;
+			Eigen::Vector3d cell_position;
+			cell_position(0) = height_point(0);
+			cell_position(1) = height_point(1);
+			cell_position(2) = height_point(2);
+			space_discretization_.coordToKeyChecked(cell_key, cell_position);
+
+			// Updating the cell of the grid if it changed status (height). In
+			// the full-octomap mode the changes of the occupancy below or
+			// around the surface aren't known, so every scanned cell changes
+			bool is_changed = !grid_.isHeight(column.index) ||
+					grid_.getKeyZ(column.index) != cell_key.z;
+			if (is_changed) {
+				grid_.setHeight(column.index, cell_position(2), cell_key.z);
+				if (cell_position(2) < min_height_)
+					min_height_ = cell_position(2);
+			}
+			if (is_changed || !incremental_update_)
+				changed_cells_.push_back(column.index);
+		}
+	}
+
+	if (is_timed) {
+		statistics_->addSample(column_scan_timer_, Statistics::getTime() - scan_start_time);
+		statistics_->addSample(scanned_counter_, num_scanned_cells);
+	}
+
+	computeTerrain(octomap, octomap->getResolution() * key_step_);
+}
+
+
+void TerrainMapping::compute(const PointCloud& cloud,
+							 const Eigen::Vector4d& robot_state,
+							 double time)
+{
+	prepareGrid(robot_state);
+
+	// Fusing the points of the search areas into the columns of the grid
+	changed_cells_.clear();
+	fuseCloud(cloud, robot_state, time);
+
+	computeTerrain(NULL, space_discretization_.getEnvironmentResolution(false));
+}
+
+
+void TerrainMapping::fuseCloud(const PointCloud& cloud,
+							   const Eigen::Vector4d& robot_state,
+							   double time)
+{
+	ScopedTimer timer(statistics_, height_fusion_timer_);
+	unsigned int num_cells = grid_.getNumberOfCells();
+	if (column_count_.size() != num_cells) {
+		column_height_.assign(num_cells, 0.);
+		column_count_.assign(num_cells, 0);
+		cell_height_.assign(num_cells, 0.);
+		cell_count_.assign(num_cells, 0);
+		cell_height_time_.assign(num_cells, time);
+		cell_time_.assign(num_cells, time);
+	}
+
+	double yaw = robot_state(3);
+	double cos_yaw = cos(yaw);
+	double sin_yaw = sin(yaw);
+	unsigned int area_size = search_areas_.size();
+	unsigned int num_fused_points = 0;
+	fused_cells_.clear();
+	for (unsigned int i = 0; i < cloud.size(); i++) {
+		const Eigen::Vector3f& point = cloud[i];
+
+		// Getting the point in the frame of the robot (yaw rotation)
+		double dx = point(0) - robot_state(0);
+		double dy = point(1) - robot_state(1);
+		double xb = dx * cos_yaw + dy * sin_yaw;
+		double yb = -dx * sin_yaw + dy * cos_yaw;
+		double zb = point(2) - robot_state(2);
+		bool is_inside = false;
+		for (unsigned int n = 0; n < area_size && !is_inside; n++) {
+			const dwl::SearchArea& area = search_areas_[n];
+			is_inside = xb >= area.min_x && xb <= area.max_x &&
+					yb >= area.min_y && yb <= area.max_y &&
+					zb >= area.min_z && zb <= area.max_z;
+		}
+		if (!is_inside)
+			continue;
+
+		unsigned short key_x, key_y;
+		unsigned int index;
+		space_discretization_.coordToKey(key_x, point(0), true);
+		space_discretization_.coordToKey(key_y, point(1), true);
+		if (!grid_.getIndex(index, key_x, key_y))
+			continue;
+
+		if (column_count_[index] == 0) {
+			fused_cells_.push_back(index);
+			column_height_[index] = point(2);
+		} else if (height_fusion_ == MAX_HEIGHT)
+			column_height_[index] = std::max(column_height_[index], point(2));
+		else
+			column_height_[index] += point(2);
+		column_count_[index]++;
+		num_fused_points++;
+	}
+
+	// Fusing the points of the frame with the previous frames. A cell that was
+	// removed (decayed or evicted) starts again. The mean is weighted by the
+	// number of points, and the maximum is kept while it's observed within
+	// the decay time. The normals are estimated from the moment images since
+	// there isn't an octree
+	for (unsigned int i = 0; i < fused_cells_.size(); i++) {
+		unsigned int index = fused_cells_[i];
+		bool is_new_cell = !grid_.isHeight(index);
+		float& height = cell_height_[index];
+		if (height_fusion_ == MEAN_HEIGHT) {
+			unsigned int count = is_new_cell ? 0 : cell_count_[index];
+			height = ((double) height * count + column_height_[index]) /
+					(count + column_count_[index]);
+			cell_count_[index] = std::min(count + column_count_[index], MAX_FUSED_POINTS);
+		} else if (is_new_cell || column_height_[index] >= height ||
+				(decay_time_ > 0. && time - cell_height_time_[index] > decay_time_)) {
+			height = column_height_[index];
+			cell_height_time_[index] = time;
+		}
+		column_count_[index] = 0;
+		cell_time_[index] = time;
+
+		unsigned short key_z;
+		space_discretization_.coordToKey(key_z, height, false);
+		grid_.setMomentNormal(index, true);
+		if (!grid_.isHeight(index) || grid_.getKeyZ(index) != key_z) {
+			grid_.setHeight(index, height, key_z);
+			changed_cells_.push_back(index);
+			if (height < min_height_)
+				min_height_ = height;
+		}
+	}
+
+	// Removing the cells that weren't observed recently, their neighbors need
+	// new terrain data
+	if (decay_time_ > 0.) {
+		for (unsigned int index = 0; index < num_cells; index++) {
+			if (grid_.isHeight(index) && time - cell_time_[index] > decay_time_) {
+				grid_.removeCell(index);
+				changed_cells_.push_back(index);
+			}
+		}
+	}
+
+	if (statistics_)
+		statistics_->addSample(fused_counter_, num_fused_points);
+}
+
+
+void TerrainMapping::rasterizeSearchAreas(double yaw)
+{
+	// Reusing the raster if its farthest cell moved less than half a cell
+	double resolution = space_discretization_.getEnvironmentResolution(true);
+	if (is_rasterized_ && raster_resolution_ == resolution &&
+			fabs(remainder(yaw - raster_yaw_, 2 * M_PI)) * raster_reach_ < 0.5 * resolution)
+		return;
+
+	raster_yaw_ = yaw;
+	raster_resolution_ = resolution;
+	double cos_yaw = cos(yaw);
+	double sin_yaw = sin(yaw);
+
+	// Getting the reach of the search areas, it bounds the rotated areas
+	unsigned int area_size = search_areas_.size();
+	raster_reach_ = 0.;
+	for (unsigned int n = 0; n < area_size; n++) {
+		const dwl::SearchArea& area = search_areas_[n];
+		double corner_x = std::max(fabs(area.min_x), fabs(area.max_x));
+		double corner_y = std::max(fabs(area.min_y), fabs(area.max_y));
+		raster_reach_ = std::max(raster_reach_,
+								 sqrt(corner_x * corner_x + corner_y * corner_y));
+	}
+	int half_size = (int) ceil(raster_reach_ / resolution);
+	int size = 2 * half_size + 1;
+	raster_mask_.assign(size * size, 0);
+
+	// Rasterizing the rotated areas row by row, every row of an area is a
+	// range of cells. A cell belongs to the first area that contains it, and
+	// a coarse area takes one cell per its resolution
+	raster_cells_.resize(area_size);
+	raster_boxes_.resize(area_size);
+	for (unsigned int n = 0; n < area_size; n++) {
+		const dwl::SearchArea& area = search_areas_[n];
+		std::vector<RasterCell>& cells = raster_cells_[n];
+		RasterBox& box = raster_boxes_[n];
+		cells.clear();
+		box.min_x = box.min_y = size;
+		box.max_x = box.max_y = -size;
+
+		int stride = std::max(1, (int) round(area.resolution / resolution));
+		for (int j = -half_size; j <= half_size; j++) {
+			if (j % stride != 0)
+				continue;
+
+			// The cell is inside the area if its coordinates in the frame
+			// of the area are inside the boundaries
+			double dy = j * resolution;
+			double min_dx = -half_size * resolution;
+			double max_dx = half_size * resolution;
+			if (!clipRange(min_dx, max_dx, cos_yaw, dy * sin_yaw, area.min_x, area.max_x) ||
+					!clipRange(min_dx, max_dx, -sin_yaw, dy * cos_yaw, area.min_y, area.max_y))
+				continue;
+
+			int first_i = (int) ceil(min_dx / resolution - 1e-9);
+			int last_i = (int) floor(max_dx / resolution + 1e-9);
+			for (int i = first_i; i <= last_i; i++) {
+				unsigned char& mark = raster_mask_[(j + half_size) * size + i + half_size];
+				if (i % stride != 0 || mark)
+					continue;
+
+				mark = 1;
+				cells.push_back(RasterCell(i, j));
+				box.min_x = std::min(box.min_x, i);
+				box.min_y = std::min(box.min_y, j);
+				box.max_x = std::max(box.max_x, i);
+				box.max_y = std::max(box.max_y, j);
+			}
+		}
+	}
+
+	is_rasterized_ = true;
+}
+
+
+void TerrainMapping::prepareGrid(const Eigen::Vector4d& robot_state)
 {
 	if (!is_added_search_area_) {
 		printf(YELLOW "Warning: adding a default search area \n" COLOR_RESET);
@@ -67,161 +480,234 @@ void TerrainMapping::compute(octomap::OcTree* octomap,
 		is_added_search_area_ = true;
 	}
 
+	if (!is_resized_grid_)
+		resizeGrid();
+
+	// Moving the terrain grid with the robot
+	unsigned short centre_key_x, centre_key_y;
+	space_discretization_.coordToKey(centre_key_x, robot_state(0), true);
+	space_discretization_.coordToKey(centre_key_y, robot_state(1), true);
+	grid_.move(centre_key_x, centre_key_y);
+
 	if (terrain_information_) {
 		// Removing the points that doesn't belong to the interest area
 		Eigen::Vector3d robot_2dpose; // (x,y,yaw)
 		robot_2dpose(0) = robot_state(0);
 		robot_2dpose(1) = robot_state(1);
 		robot_2dpose(2) = robot_state(3);
+		ScopedTimer timer(statistics_, eviction_timer_);
 		removeTerrainOutsideInterestRegion(robot_2dpose);
 	}
+}
 
 
-	// Computing terrain map for several search areas
-	double yaw = robot_state(3);
-	unsigned int area_size = search_areas_.size();
-	for (unsigned int n = 0; n < area_size; n++) {
-		// Computing the boundary of the gridmap
-		Eigen::Vector2d boundary_min, boundary_max;
-
-		boundary_min(0) = search_areas_[n].min_x + robot_state(0);
-		boundary_min(1) = search_areas_[n].min_y + robot_state(1);
-		boundary_max(0) = search_areas_[n].max_x + robot_state(0);
-		boundary_max(1) = search_areas_[n].max_y + robot_state(1);
-
-		double resolution = search_areas_[n].resolution;
-		for (double y = boundary_min(1); y <= boundary_max(1); y += resolution) {
-			for (double x = boundary_min(0); x <= boundary_max(0); x += resolution) {
-				// Computing the rotated coordinate of the point inside the search area
-				double xr = (x - robot_state(0)) * cos(yaw) -
-							(y - robot_state(1)) * sin(yaw) + robot_state(0);
-				double yr = (x - robot_state(0)) * sin(yaw) +
-							(y - robot_state(1)) * cos(yaw) + robot_state(1);
-
-				// Checking if the cell belongs to dimensions of the map,
-				// and also getting the key of this cell
-				double z = search_areas_[n].max_z + robot_state(2);
-				octomap::OcTreeKey init_key;
-				if (!octomap->coordToKeyChecked(xr, yr, z, depth_, init_key)) {
-					printf(RED "Cell out of bounds\n" COLOR_RESET);
-
-					return;
-				}
+void TerrainMapping::computeTerrain(octomap::OcTree* octomap,
+									double voxel_size)
+{
+	bool is_timed = statistics_ && statistics_->isEnabled();
 
-				// Finding the cell of the surface
-				int r = 0;
-				octomap::OcTreeNode* heightmap_node =
-						octomap->search(init_key, depth_);
-				while (z >= search_areas_[n].min_z + robot_state(2)) {
-					octomap::OcTreeKey heightmap_key;
-					heightmap_key[0] = init_key[0];
-					heightmap_key[1] = init_key[1];
-					heightmap_key[2] = init_key[2] - r;
-
-					heightmap_node = octomap->search(heightmap_key, depth_);
-					octomap::point3d height_point =
-							octomap->keyToCoord(heightmap_key, depth_);
-					z = height_point(2);
-					if (heightmap_node) {
-						// Computation of the heightmap
-						if (octomap->isNodeOccupied(heightmap_node)) {
-							// Getting position of the occupied cell
-							dwl::Key cell_key;
-							Eigen::Vector3d cell_position;
-							cell_position(0) = height_point(0);
-							cell_position(1) = height_point(1);
-							cell_position(2) = height_point(2);
-							space_discretization_.coordToKeyChecked(cell_key,
-																	cell_position);
-
-							dwl::Vertex vertex_id;
-							space_discretization_.keyToVertex(vertex_id, cell_key, true);
-							if (!terrain_information_)
-								addCellToTerrainHeightMap(vertex_id,
-														  (double) cell_position(2));
-							else {
-								bool new_status = true;
-								std::map<dwl::Vertex,double>::iterator height_it =
-										terrain_heightmap_.find(vertex_id);
-								if (height_it != terrain_heightmap_.end()) {
-									// Evaluating if it changed status (height)
-									unsigned short int old_key_z;
-									space_discretization_.coordToKey(old_key_z,
-																	 height_it->second,
-																	 false);
-									if (old_key_z != cell_key.z) {
-										removeCellToTerrainMap(vertex_id);
-										removeCellToTerrainHeightMap(vertex_id);
-									} else
-										new_status = false;
-								}
-
-								if (new_status)
-									addCellToTerrainHeightMap(vertex_id,
-															  (double) cell_position(2));
-							}
-							break;
-						}
-					}
-					r++;
-				}
-			}
-		}
+	// Invalidating the terrain data around the cells that changed
+	double plane_resolution = space_discretization_.getEnvironmentResolution(true);
+	int neighbor_size = std::max(std::max(-neighboring_area_.min_x, neighboring_area_.max_x),
+								 std::max(-neighboring_area_.min_y, neighboring_area_.max_y));
+	double update_radius = std::max(neighbor_size * voxel_size, feature_radius_);
+	grid_.invalidateTerrain(dirty_cells_, changed_cells_,
+							(unsigned int) ceil(update_radius / plane_resolution));
+
+	// Updating the integral height map used by the features. Note that only
+	// the cells that changed (and their neighbors) need new terrain data, and
+	// the tables are recomputed from the first changed row and column (fully
+	// if the grid moved or cells were removed)
+	if (changed_cells_.empty()) {
+		terrain_information_ = true;
+		return;
+	}
+	{
+		ScopedTimer timer(statistics_, height_map_timer_);
+		if (is_height_map_stale_)
+			height_map_.compute(grid_);
+		else
+			height_map_.update(grid_, changed_cells_);
+		is_height_map_stale_ = false;
+	}
+
+	// Computing the moment images if a search area uses them, or if there
+	// isn't an octree. The moments are taken over the same reach as the
+	// neighbors in the octomap
+	if (!octomap || std::find(normal_estimation_.begin(), normal_estimation_.end(),
+			INTEGRAL_MOMENTS) != normal_estimation_.end()) {
+		moment_map_.compute(height_map_, plane_resolution);
+		moment_radius_ = std::max(1, (int) round(neighbor_size * voxel_size /
+												 plane_resolution));
 	}
 
 	// Setting the terrain information
-	*terrain_info_.height_map = terrain_heightmap_;
 	terrain_info_.resolution = space_discretization_.getEnvironmentResolution(true);
 	terrain_info_.min_height = min_height_;
 
-	// Computing the terrain map
-	for (std::map<dwl::Vertex, double>::iterator terrain_iter = terrain_heightmap_.begin();
-			terrain_iter != terrain_heightmap_.end();
-			terrain_iter++)
-	{
-		octomap::OcTreeKey heightmap_key;
-		dwl::Vertex vertex_id = terrain_iter->first;
-		Eigen::Vector2d xy_coord;
-		space_discretization_.vertexToCoord(xy_coord, vertex_id);
+	if (!is_added_feature_) {
+		printf(YELLOW "Could not computed the cost of the features because it"
+				" is necessary to add at least one\n" COLOR_RESET);
+		return;
+	}
+
+	// Copying the heights of the grid to the height map of the features that
+	// compute the cost per cell, the batch features read the grid directly
+	if (std::find(batch_features_.begin(), batch_features_.end(),
+			(feature::BatchFeature*) NULL) != batch_features_.end()) {
+		std::map<dwl::Vertex,double>& height_map = *terrain_info_.height_map;
+		height_map.clear();
+		unsigned int num_cells = grid_.getNumberOfCells();
+		for (unsigned int index = 0; index < num_cells; index++) {
+			if (!grid_.isHeight(index))
+				continue;
+
+			dwl::Key key;
+			grid_.getKey(key.x, key.y, index);
+			key.z = grid_.getKeyZ(index);
+			dwl::Vertex vertex_id;
+			space_discretization_.keyToVertex(vertex_id, key, true);
+			height_map[vertex_id] = grid_.getHeight(index);
+		}
+	}
+
+	// Getting the invalidated cells, and the bounding box of the octree
+	// neighbors of these cells
+	terrain_cells_.clear();
+	octomap::OcTreeKey min_key, max_key;
+	for (unsigned int i = 0; i < 3; i++) {
+		min_key[i] = std::numeric_limits<octomap::key_type>::max();
+		max_key[i] = 0;
+	}
+	for (unsigned int i = 0; i < dirty_cells_.size(); i++) {
+		unsigned int index = dirty_cells_[i];
+		unsigned short key_x, key_y;
+		grid_.getKey(key_x, key_y, index);
 
-		double height = terrain_iter->second;
 		octomap::point3d terrain_point;
-		terrain_point(0) = xy_coord(0);
-		terrain_point(1) = xy_coord(1);
-		terrain_point(2) = height;
-		heightmap_key = octomap->coordToKey(terrain_point, depth_);
-
-		if (!terrain_information_)
-			computeTerrainData(octomap, heightmap_key);
-		else {
-			bool new_status = true;
-			std::map<dwl::Vertex,dwl::TerrainCell>::iterator terrain_it =
-					terrain_map_.find(vertex_id);
-			if (terrain_it != terrain_map_.end()) {
-				// Evaluating if it's changed status (height)
-				dwl::TerrainCell terrain_cell = terrain_it->second;
-
-				if (terrain_cell.key.z != heightmap_key[2]) {
-					removeCellToTerrainMap(vertex_id);
-					removeCellToTerrainHeightMap(vertex_id);
-				} else
-					new_status = true;//false;
+		double coord;
+		space_discretization_.keyToCoord(coord, key_x, true);
+		terrain_point(0) = coord;
+		space_discretization_.keyToCoord(coord, key_y, true);
+		terrain_point(1) = coord;
+		terrain_point(2) = grid_.getHeight(index);
+		if (!octomap) {
+			terrain_cells_.push_back(DirtyCell(index, octomap::OcTreeKey(), terrain_point));
+			continue;
+		}
+
+		octomap::OcTreeKey heightmap_key =
+				octomap->coordToKey(terrain_point, depth_);
+		terrain_cells_.push_back(DirtyCell(index, heightmap_key,
+										   octomap->keyToCoord(heightmap_key, depth_)));
+
+		if (!grid_.isMomentNormal(index)) {
+			for (unsigned int i = 0; i < 3; i++) {
+				min_key[i] = std::min(min_key[i], heightmap_key[i]);
+				max_key[i] = std::max(max_key[i], heightmap_key[i]);
 			}
+		}
+	}
+
+	// Extracting the occupancy of the octree neighbors in one pass. If the
+	// patch is too large, the neighbors are searched in the octree
+	patch_.clear();
+	if (min_key[0] <= max_key[0]) {
+		const int margin_min[3] = {neighboring_area_.min_x, neighboring_area_.min_y,
+								   neighboring_area_.min_z};
+		const int margin_max[3] = {neighboring_area_.max_x, neighboring_area_.max_y,
+								   neighboring_area_.max_z};
+		int max_key_value = std::numeric_limits<octomap::key_type>::max();
+		for (unsigned int i = 0; i < 3; i++) {
+			min_key[i] = std::max((int) min_key[i] + std::min(margin_min[i], 0) * key_step_, 0);
+			max_key[i] = std::min((int) max_key[i] + std::max(margin_max[i], 0) * key_step_,
+								  max_key_value);
+		}
+		ScopedTimer timer(statistics_, patch_timer_);
+		patch_.compute(octomap, min_key, max_key, depth_, pool_);
+	}
+
+	// Computing the terrain map. The cells are split in tiles, and every tile
+	// writes only its own cells. The cost of the features is computed once per
+	// tile from a batch of its cells
+	unsigned int num_threads = pool_.getNumberOfThreads();
+	std::vector<dwl::Terrain> thread_terrain_info(num_threads, terrain_info_);
+	thread_batch_.resize(num_threads);
+	if (is_timed) {
+		thread_data_time_.assign(num_threads, 0.);
+		thread_feature_time_.assign(num_threads, 0.);
+	}
+	unsigned int num_terrain_cells = terrain_cells_.size();
+	unsigned int num_tiles = (num_terrain_cells + TILE_CELLS - 1) / TILE_CELLS;
+	pool_.run(num_tiles, [&](unsigned int tile, unsigned int thread) {
+		dwl::Terrain& terrain_info = thread_terrain_info[thread];
+		feature::TerrainBatch& batch = thread_batch_[thread];
+		batch.clear();
+		batch.resolution = terrain_info_.resolution;
+		batch.min_height = terrain_info_.min_height;
+		double start_time = is_timed ? Statistics::getTime() : 0.;
+
+		unsigned int first_cell = tile * TILE_CELLS;
+		unsigned int last_cell = std::min(first_cell + TILE_CELLS, num_terrain_cells);
+		for (unsigned int i = first_cell; i < last_cell; i++) {
+			unsigned int index = terrain_cells_[i].index;
+			const octomap::OcTreeKey& heightmap_key = terrain_cells_[i].heightmap_key;
+
+			bool is_fitted;
+			if (!octomap || grid_.isMomentNormal(index)) {
+				const octomap::point3d& heightmap_point = terrain_cells_[i].position;
+				Eigen::Vector3d heightmap_position(heightmap_point(0),
+												   heightmap_point(1),
+												   heightmap_point(2));
+				is_fitted = computeTerrainDataFromMoments(heightmap_position,
+														  terrain_info);
+			} else
+				is_fitted = computeTerrainData(octomap, heightmap_key, terrain_info);
+
+			if (is_fitted)
+				batch.addCell(index, terrain_info);
+		}
+
+		double data_time = is_timed ? Statistics::getTime() : 0.;
+		computeTerrainCost(batch);
+		if (is_timed) {
+			double feature_time = Statistics::getTime();
+			thread_data_time_[thread] += data_time - start_time;
+			thread_feature_time_[thread] += feature_time - data_time;
+		}
 
-			if (new_status)
-				computeTerrainData(octomap, heightmap_key);
+		unsigned int num_batch_cells = batch.size();
+		for (unsigned int i = 0; i < num_batch_cells; i++) {
+			grid_.setTerrain(batch.index[i],
+							 batch.cost[i],
+							 Eigen::Vector3f(batch.normal_x[i],
+											 batch.normal_y[i],
+											 batch.normal_z[i]));
 		}
+	});
+
+	// Recording the time of the tiles (summed over the threads) and the cells
+	if (is_timed) {
+		double data_time = 0., feature_time = 0.;
+		for (unsigned int i = 0; i < num_threads; i++) {
+			data_time += thread_data_time_[i];
+			feature_time += thread_feature_time_[i];
+		}
+		statistics_->addSample(terrain_data_timer_, data_time);
+		statistics_->addSample(features_timer_, feature_time);
+		statistics_->addSample(recomputed_counter_, num_terrain_cells);
+		statistics_->addSample(search_counter_, octree_searches_.exchange(0));
 	}
 
 	terrain_information_ = true;
 }
 
 
-void TerrainMapping::computeTerrainData(octomap::OcTree* octomap,
-										const octomap::OcTreeKey& heightmap_key)
+bool TerrainMapping::computeTerrainData(octomap::OcTree* octomap,
+										const octomap::OcTreeKey& heightmap_key,
+										dwl::Terrain& terrain_info)
 {
 	std::vector<Eigen::Vector3f> neighbors_position;
-	octomap::OcTreeNode* heightmap_node = octomap->search(heightmap_key, depth_);
 
 	// Adding to the cloud the point of interest
 	Eigen::Vector3f heightmap_position;
@@ -230,107 +716,251 @@ void TerrainMapping::computeTerrainData(octomap::OcTree* octomap,
 	heightmap_position(1) = heightmap_point(1);
 	heightmap_position(2) = heightmap_point(2);
 	neighbors_position.push_back(heightmap_position);
+	terrain_info.position = heightmap_position.cast<double>();
+	terrain_info.surface_normal = Eigen::Vector3d::UnitZ();
+	terrain_info.curvature = 0.;
 
-	// Iterates over the 8 neighboring sets
+	// Iterates over the 8 neighboring sets. The occupancy is read from the
+	// patch, or searched in the octree if the neighbor is outside it
 	octomap::OcTreeKey neighbor_key;
-	octomap::OcTreeNode* neighbor_node = heightmap_node;
 	bool is_there_neighboring = false;
+	unsigned int num_searches = 0;
 	for (int i = neighboring_area_.min_z; i < neighboring_area_.max_z + 1; i++) {
 		for (int j = neighboring_area_.min_y; j < neighboring_area_.max_y + 1; j++) {
 			for (int k = neighboring_area_.min_x; k < neighboring_area_.max_x + 1; k++) {
-				neighbor_key[0] = heightmap_key[0] + k;
-				neighbor_key[1] = heightmap_key[1] + j;
-				neighbor_key[2] = heightmap_key[2] + i;
-				neighbor_node = octomap->search(neighbor_key, depth_);
+				neighbor_key[0] = heightmap_key[0] + k * key_step_;
+				neighbor_key[1] = heightmap_key[1] + j * key_step_;
+				neighbor_key[2] = heightmap_key[2] + i * key_step_;
+				bool is_occupied;
+				if (!patch_.getOccupancy(is_occupied, neighbor_key)) {
+					octomap::OcTreeNode* neighbor_node =
+							octomap->search(neighbor_key, depth_);
+					num_searches++;
+					is_occupied = neighbor_node && octomap->isNodeOccupied(neighbor_node);
+				}
 
-				if (neighbor_node) {
+				if (is_occupied) {
 					Eigen::Vector3f neighbor_position;
-					octomap::point3d neighbor_point;
-					if (octomap->isNodeOccupied(neighbor_node)) {
-						neighbor_point = octomap->keyToCoord(neighbor_key, depth_);
-						neighbor_position(0) = neighbor_point(0);
-						neighbor_position(1) = neighbor_point(1);
-						neighbor_position(2) = neighbor_point(2);
-						neighbors_position.push_back(neighbor_position);
-
-						is_there_neighboring = true;
-					}
+					octomap::point3d neighbor_point =
+							octomap->keyToCoord(neighbor_key, depth_);
+					neighbor_position(0) = neighbor_point(0);
+					neighbor_position(1) = neighbor_point(1);
+					neighbor_position(2) = neighbor_point(2);
+					neighbors_position.push_back(neighbor_position);
+
+					is_there_neighboring = true;
 				}
 			}
 		}
 	}
 
+	if (num_searches > 0 && statistics_)
+		octree_searches_.fetch_add(num_searches, std::memory_order_relaxed);
+
 	if (is_there_neighboring) {
 		// Computing terrain info
 		EIGEN_ALIGN16 Eigen::Matrix3d covariance_matrix;
 		if (neighbors_position.size() < 3 ||
-				dwl::math::computeMeanAndCovarianceMatrix(terrain_info_.position,
+				dwl::math::computeMeanAndCovarianceMatrix(terrain_info.position,
 														  covariance_matrix,
 														  neighbors_position) == 0)
-			return;
+			return false;
 
 		if (!using_cloud_mean_) {
-			terrain_info_.position(0) = neighbors_position[0](0);
-			terrain_info_.position(1) = neighbors_position[0](1);
-			terrain_info_.position(2) = neighbors_position[0](2);
+			terrain_info.position(0) = neighbors_position[0](0);
+			terrain_info.position(1) = neighbors_position[0](1);
+			terrain_info.position(2) = neighbors_position[0](2);
 		}
 
-		dwl::math::solvePlaneParameters(terrain_info_.surface_normal,
-									    terrain_info_.curvature,
+		dwl::math::solvePlaneParameters(terrain_info.surface_normal,
+									    terrain_info.curvature,
 								   covariance_matrix);
 	}
 
-	// Computing the cost
-	if (is_added_feature_) {
-		double cost_value, weight, total_cost = 0;
-		unsigned int num_feature = features_.size();
-		for (unsigned int i = 0; i < num_feature; i++) {
-			features_[i]->computeCost(cost_value, terrain_info_);
-			features_[i]->getWeight(weight);
-			total_cost += weight * cost_value;
+	return true;
+}
+
+
+bool TerrainMapping::computeTerrainDataFromMoments(const Eigen::Vector3d& heightmap_position,
+												   dwl::Terrain& terrain_info)
+{
+	terrain_info.position = heightmap_position;
+	terrain_info.surface_normal = Eigen::Vector3d::UnitZ();
+	terrain_info.curvature = 0.;
+
+	// Getting the cell of the moment images
+	unsigned short key_x, key_y;
+	space_discretization_.coordToKey(key_x, heightmap_position(0), true);
+	space_discretization_.coordToKey(key_y, heightmap_position(1), true);
+	int cell_x, cell_y;
+	height_map_.getCoordinates(cell_x, cell_y, key_x, key_y);
+
+	// Fitting the plane. As the octree neighbors method, a cell without
+	// neighbors is flat, and a cell with one neighbor can't be fitted
+	Eigen::Vector3d mean, normal;
+	double curvature;
+	unsigned int num_points = moment_map_.computePlane(mean, normal, curvature,
+													   cell_x, cell_y, moment_radius_);
+	if (num_points <= 1)
+		return true;
+	else if (num_points < 3)
+		return false;
+
+	terrain_info.surface_normal = normal;
+	terrain_info.curvature = curvature;
+	if (using_cloud_mean_) {
+		// The mean is expressed with respect to the origin cell
+		double origin_x, origin_y;
+		space_discretization_.keyToCoord(origin_x, height_map_.getOriginKeyX(), true);
+		space_discretization_.keyToCoord(origin_y, height_map_.getOriginKeyY(), true);
+		terrain_info.position << origin_x + mean(0), origin_y + mean(1), mean(2);
+	}
+
+	return true;
+}
+
+
+void TerrainMapping::computeTerrainCost(feature::TerrainBatch& batch)
+{
+	unsigned int num_cells = batch.size();
+	unsigned int num_feature = features_.size();
+	for (unsigned int i = 0; i < num_feature; i++) {
+		if (batch_features_[i] != NULL) {
+			batch_features_[i]->addWeightedCost(batch);
+			continue;
 		}
 
-		dwl::TerrainCell cell;
-		setTerrainCell(cell,
-					   total_cost,
-					   (double) heightmap_position(dwl::rbd::Z),
-					   terrain_info_);
-		addCellToTerrainMap(cell);
-	} else {
-		printf(YELLOW "Could not computed the cost of the features because it"
-				" is necessary to add at least one\n" COLOR_RESET);
+		// The features without a batch interface compute the cost per cell,
+		// and only one tile calls them at a time
+		std::lock_guard<std::mutex> lock(cell_feature_mutex_);
+		double cost_value, weight;
+		features_[i]->getWeight(weight);
+		dwl::Terrain terrain_info = terrain_info_;
+		for (unsigned int j = 0; j < num_cells; j++) {
+			terrain_info.position << batch.position_x[j], batch.position_y[j],
+					batch.position_z[j];
+			terrain_info.surface_normal << batch.normal_x[j], batch.normal_y[j],
+					batch.normal_z[j];
+			terrain_info.curvature = batch.curvature[j];
+
+			features_[i]->computeCost(cost_value, terrain_info);
+			batch.cost[j] += weight * cost_value;
+		}
 	}
 }
 
 
 void TerrainMapping::removeTerrainOutsideInterestRegion(const Eigen::Vector3d& robot_state)
 {
-	// Getting the orientation of the body
-	double yaw = robot_state(2);
+	InterestRegion region(interest_radius_x_, interest_radius_y_,
+						  robot_state(0), robot_state(1), robot_state(2));
+	if (!region.isBounded())
+		return;
 
-	for (std::map<dwl::Vertex,dwl::TerrainCell>::iterator vertex_iter = terrain_map_.begin();
-			vertex_iter != terrain_map_.end();
-			vertex_iter++)
-	{
-		dwl::Vertex v = vertex_iter->first;
-		Eigen::Vector2d point;
-		space_discretization_.vertexToCoord(point, v);
-
-		double xc = point(0) - robot_state(0);
-		double yc = point(1) - robot_state(1);
-		if (xc * cos(yaw) + yc * sin(yaw) >= 0.0) {
-			if (pow(xc * cos(yaw) + yc * sin(yaw), 2) / pow(interest_radius_y_, 2) +
-					pow(xc * sin(yaw) - yc * cos(yaw), 2) / pow(interest_radius_x_, 2) > 1) {
-				terrain_map_.erase(v);
-				terrain_heightmap_.erase(v);
-			}
-		} else {
-			if (pow(xc, 2) + pow(yc, 2) > pow(interest_radius_x_, 2)) {
-				terrain_map_.erase(v);
-				terrain_heightmap_.erase(v);
-			}
-		}
+	// Cropping every row to its range inside the interest region, the grid
+	// visits only the cells that leave it
+	int first_grid_key = grid_.getOriginKeyX();
+	int last_grid_key = first_grid_key + grid_.getSizeX() - 1;
+	unsigned int num_evicted_cells = 0;
+	unsigned int size_y = grid_.getSizeY();
+	for (unsigned int j = 0; j < size_y; j++) {
+		unsigned short key_y = grid_.getOriginKeyY() + j;
+		int first_key, last_key;
+		region.getRowKeys(first_key, last_key, space_discretization_, key_y,
+						  first_grid_key, last_grid_key);
+		num_evicted_cells += grid_.cropRow(key_y, first_key, last_key);
+	}
+	if (num_evicted_cells > 0)
+		is_height_map_stale_ = true;
+
+	if (statistics_)
+		statistics_->addSample(evicted_counter_, num_evicted_cells);
+}
+
+
+double TerrainMapping::getOctomapReach(double octomap_resolution)
+{
+	// Getting the reach of the search areas
+	double reach = 0.;
+	for (unsigned int n = 0; n < search_areas_.size(); n++) {
+		const dwl::SearchArea& area = search_areas_[n];
+		double corner_x = std::max(fabs(area.min_x), fabs(area.max_x));
+		double corner_y = std::max(fabs(area.min_y), fabs(area.max_y));
+		reach = std::max(reach, sqrt(corner_x * corner_x + corner_y * corner_y));
 	}
+
+	// The terrain data is recomputed around the changed cells, and it reads
+	// the octree neighbors of these cells. Note that the queried voxels are
+	// at most as big as the cells (or the leafs)
+	double plane_resolution = space_discretization_.getEnvironmentResolution(true);
+	double voxel_size = std::max(plane_resolution, octomap_resolution);
+	int neighbor_size = std::max(std::max(-neighboring_area_.min_x, neighboring_area_.max_x),
+								 std::max(-neighboring_area_.min_y, neighboring_area_.max_y));
+	double update_radius = std::max(neighbor_size * voxel_size, feature_radius_);
+
+	return reach + update_radius + neighbor_size * voxel_size + 2 * plane_resolution;
+}
+
+
+void TerrainMapping::setIncrementalUpdate(bool incremental)
+{
+	incremental_update_ = incremental;
+}
+
+
+void TerrainMapping::addChangedColumn(double x,
+									  double y)
+{
+	unsigned short key_x, key_y;
+	space_discretization_.coordToKey(key_x, x, true);
+	space_discretization_.coordToKey(key_y, y, true);
+	changed_columns_.push_back(std::make_pair(key_x, key_y));
+}
+
+
+void TerrainMapping::setFeatureRadius(double radius)
+{
+	feature_radius_ = radius;
+}
+
+
+void TerrainMapping::setHeightFusion(HeightFusion fusion)
+{
+	height_fusion_ = fusion;
+}
+
+
+void TerrainMapping::setHeightDecay(double decay_time)
+{
+	decay_time_ = decay_time;
+}
+
+
+void TerrainMapping::setNumberOfThreads(unsigned int num_threads)
+{
+	pool_.setNumberOfThreads(num_threads);
+}
+
+
+void TerrainMapping::setStatistics(Statistics* statistics,
+								   const std::string& name)
+{
+	statistics_ = statistics;
+	if (!statistics_)
+		return;
+
+	eviction_timer_ = statistics_->addTimer(name + "/eviction");
+	column_scan_timer_ = statistics_->addTimer(name + "/column_scan");
+	height_map_timer_ = statistics_->addTimer(name + "/height_map");
+	patch_timer_ = statistics_->addTimer(name + "/octree_patch");
+	terrain_data_timer_ = statistics_->addTimer(name + "/terrain_data");
+	features_timer_ = statistics_->addTimer(name + "/features");
+	scanned_counter_ = statistics_->addCounter(name + "/scanned_cells");
+	search_counter_ = statistics_->addCounter(name + "/octree_searches");
+	recomputed_counter_ = statistics_->addCounter(name + "/recomputed_cells");
+	evicted_counter_ = statistics_->addCounter(name + "/evicted_cells");
+	height_fusion_timer_ = statistics_->addTimer(name + "/height_fusion");
+	fused_counter_ = statistics_->addCounter(name + "/fused_points");
 }
 
 
@@ -339,13 +969,15 @@ void TerrainMapping::setInterestRegion(double radius_x,
 {
 	interest_radius_x_ = radius_x;
 	interest_radius_y_ = radius_y;
+	is_resized_grid_ = false;
 }
 
 
 void TerrainMapping::addSearchArea(double min_x, double max_x,
 								   double min_y, double max_y,
 								   double min_z, double max_z,
-								   double grid_resolution)
+								   double grid_resolution,
+								   NormalEstimation normal_estimation)
 {
 	dwl::SearchArea search_area;
 	search_area.min_x = min_x;
@@ -357,6 +989,8 @@ void TerrainMapping::addSearchArea(double min_x, double max_x,
 	search_area.resolution = grid_resolution;
 
 	search_areas_.push_back(search_area);
+	normal_estimation_.push_back(normal_estimation);
+	is_rasterized_ = false;
 
 	if (!is_added_search_area_ ||
 			grid_resolution < space_discretization_.getEnvironmentResolution(true)) {
@@ -365,6 +999,7 @@ void TerrainMapping::addSearchArea(double min_x, double max_x,
 	}
 
 	is_added_search_area_ = true;
+	is_resized_grid_ = false;
 }
 
 
@@ -380,4 +1015,93 @@ void TerrainMapping::setNeighboringArea(int back_neighbors, int front_neighbors,
 	neighboring_area_.max_z = top_neighbors;
 }
 
+void TerrainMapping::reset()
+{
+	dwl::environment::TerrainMap::reset();
+	grid_.clear();
+	changed_columns_.clear();
+	scanned_cells_.clear();
+	is_height_map_stale_ = true;
+}
+
+
+bool TerrainMapping::getTerrainData(dwl::TerrainCell& cell,
+									const Eigen::Vector2d& position) const
+{
+	unsigned short key_x, key_y;
+	space_discretization_.coordToKey(key_x, position(0), true);
+	space_discretization_.coordToKey(key_y, position(1), true);
+
+	unsigned int index;
+	if (!grid_.getIndex(index, key_x, key_y) || !grid_.isTerrain(index))
+		return false;
+
+	cell.key.x = key_x;
+	cell.key.y = key_y;
+	cell.key.z = grid_.getKeyZ(index);
+	cell.cost = grid_.getCost(index);
+	cell.height = grid_.getHeight(index);
+	cell.normal = grid_.getNormal(index).cast<double>();
+
+	return true;
+}
+
+
+const TerrainGrid& TerrainMapping::getTerrainGrid() const
+{
+	return grid_;
+}
+
+
+void TerrainMapping::setUpdateTracking(bool tracking)
+{
+	grid_.setUpdateTracking(tracking);
+}
+
+
+bool TerrainMapping::takeUpdatedCells(std::vector<unsigned int>& indexes)
+{
+	return grid_.takeUpdatedCells(indexes);
+}
+
+
+const IntegralHeightMap& TerrainMapping::getIntegralHeightMap() const
+{
+	return height_map_;
+}
+
+
+unsigned int TerrainMapping::getNumberOfComputedCells() const
+{
+	return terrain_cells_.size();
+}
+
+
+void TerrainMapping::resizeGrid()
+{
+	// Computing the reach of the search areas
+	double reach = 0.;
+	unsigned int area_size = search_areas_.size();
+	for (unsigned int n = 0; n < area_size; n++) {
+		double corner_x = std::max(fabs(search_areas_[n].min_x),
+								   fabs(search_areas_[n].max_x));
+		double corner_y = std::max(fabs(search_areas_[n].min_y),
+								   fabs(search_areas_[n].max_y));
+		reach = std::max(reach, sqrt(corner_x * corner_x + corner_y * corner_y));
+	}
+
+	// The interest region rotates with the robot, so the grid has to cover
+	// its largest radius in every direction
+	double radius = std::max(interest_radius_x_, interest_radius_y_);
+	if (radius == std::numeric_limits<double>::max())
+		radius = reach;
+
+	double resolution = space_discretization_.getEnvironmentResolution(true);
+	unsigned int size = 2 * (unsigned int) ceil(radius / resolution) + 1;
+	grid_.resize(size, size);
+	scanned_cells_.clear();
+	is_height_map_stale_ = true;
+	is_resized_grid_ = true;
+}
+
 } //@namepace terrain_server
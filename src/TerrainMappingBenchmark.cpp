@@ -0,0 +1,381 @@
+#include <terrain_server/TerrainMappingBenchmark.h>
+#include <terrain_server/feature/HeightDeviationFeature.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <regex>
+#include <map>
+
+
+namespace terrain_server
+{
+
+TerrainMappingBenchmark::TerrainMappingBenchmark() : octree_(NULL)
+{
+
+}
+
+
+TerrainMappingBenchmark::~TerrainMappingBenchmark()
+{
+	delete octree_;
+}
+
+
+bool TerrainMappingBenchmark::loadScene(const std::string& filename,
+										double resolution)
+{
+	delete octree_;
+	octree_ = NULL;
+
+	// Reading the binary octomap
+	std::string extension = ".bt";
+	if (filename.size() > extension.size() &&
+			filename.compare(filename.size() - extension.size(),
+							 extension.size(), extension) == 0) {
+		octree_ = new octomap::OcTree(resolution);
+		if (!octree_->readBinary(filename)) {
+			printf(RED "Could not read the octomap %s\n" COLOR_RESET, filename.c_str());
+			delete octree_;
+			octree_ = NULL;
+			return false;
+		}
+
+		return true;
+	}
+
+	return generateScene(filename, resolution);
+}
+
+
+bool TerrainMappingBenchmark::loadTrajectory(const std::string& filename)
+{
+	std::ifstream file(filename.c_str());
+	if (!file.is_open()) {
+		printf(RED "Could not open the trajectory %s\n" COLOR_RESET, filename.c_str());
+		return false;
+	}
+
+	trajectory_.clear();
+	std::string line;
+	while (std::getline(file, line)) {
+		if (line.empty() || line[0] == '#')
+			continue;
+
+		Eigen::Vector4d pose;
+		std::istringstream stream(line);
+		if (!(stream >> pose(0) >> pose(1) >> pose(2) >> pose(3))) {
+			printf(YELLOW "Skipping the invalid pose: %s\n" COLOR_RESET, line.c_str());
+			continue;
+		}
+		trajectory_.push_back(pose);
+	}
+
+	return !trajectory_.empty();
+}
+
+
+void TerrainMappingBenchmark::generateTrajectory(double step,
+												 double nominal_height)
+{
+	trajectory_.clear();
+	if (!octree_ || step <= 0.)
+		return;
+
+	// Walking along the x-axis through the middle of the scene
+	double min_x, min_y, min_z, max_x, max_y, max_z;
+	octree_->getMetricMin(min_x, min_y, min_z);
+	octree_->getMetricMax(max_x, max_y, max_z);
+	double y = (min_y + max_y) / 2;
+	double surface_height = min_z;
+	for (double x = min_x; x <= max_x; x += step) {
+		// The robot keeps the last height above the gaps
+		getSurfaceHeight(surface_height, x, y);
+		trajectory_.push_back(Eigen::Vector4d(x, y, surface_height + nominal_height, 0.));
+	}
+}
+
+
+bool TerrainMappingBenchmark::run(TerrainMapping& terrain_mapping,
+								  unsigned int warmup,
+								  Statistics& statistics)
+{
+	if (!octree_ || trajectory_.empty()) {
+		printf(RED "There isn't a scene or a trajectory to replay\n" COLOR_RESET);
+		return false;
+	}
+
+	terrain_mapping.setResolution(octree_->getResolution(), false);
+
+	// Computing the terrain map along the trajectory
+	std::vector<double> latency;
+	unsigned long num_cells = 0;
+	for (unsigned int i = 0; i < trajectory_.size(); i++) {
+		// The stages are recorded after warming up
+		if (i == warmup)
+			statistics.setEnabled(true);
+
+		timespec start_time, end_time;
+		clock_gettime(CLOCK_MONOTONIC, &start_time);
+		terrain_mapping.compute(octree_, trajectory_[i]);
+		clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+		if (i < warmup)
+			continue;
+
+		latency.push_back((end_time.tv_sec - start_time.tv_sec) +
+						  (end_time.tv_nsec - start_time.tv_nsec) * 1e-9);
+		num_cells += terrain_mapping.getNumberOfComputedCells();
+	}
+
+	if (latency.empty()) {
+		printf(YELLOW "All the %u poses are used for warming up\n" COLOR_RESET,
+				(unsigned int) trajectory_.size());
+		return false;
+	}
+
+	// Getting the latency percentiles (nearest rank)
+	double total_time = 0.;
+	for (unsigned int i = 0; i < latency.size(); i++)
+		total_time += latency[i];
+	std::sort(latency.begin(), latency.end());
+	const double percentiles[3] = {0.5, 0.9, 0.99};
+	double latency_percentile[3];
+	for (unsigned int p = 0; p < 3; p++) {
+		unsigned int rank = (unsigned int) ceil(percentiles[p] * latency.size());
+		latency_percentile[p] = latency[std::max(rank, 1u) - 1];
+	}
+
+	// Counting the terrain cells of the last map
+	const TerrainGrid& grid = terrain_mapping.getTerrainGrid();
+	unsigned int num_terrain_cells = 0;
+	for (unsigned int index = 0; index < grid.getNumberOfCells(); index++) {
+		if (grid.isTerrain(index))
+			num_terrain_cells++;
+	}
+
+	// Getting the peak memory (in kilobytes on Linux)
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	printf(GREEN "Terrain mapping benchmark\n" COLOR_RESET);
+	printf("  frames:        %u (%u for warming up)\n",
+			(unsigned int) latency.size(), std::min(warmup, (unsigned int) trajectory_.size()));
+	printf("  latency [ms]:  mean %.3f  p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+			1e3 * total_time / latency.size(), 1e3 * latency_percentile[0],
+			1e3 * latency_percentile[1], 1e3 * latency_percentile[2],
+			1e3 * latency.back());
+	printf("  cells:         %.1f computed per frame, %.0f per second\n",
+			(double) num_cells / latency.size(),
+			total_time > 0. ? num_cells / total_time : 0.);
+	printf("  terrain map:   %u terrain cells\n", num_terrain_cells);
+	printf("  peak memory:   %.1f MB\n", usage.ru_maxrss / 1024.);
+
+	// Printing the stages per frame
+	std::vector<Statistics::Summary> summaries;
+	statistics.rollWindow(summaries);
+	printf("  stages:\n");
+	for (unsigned int i = 0; i < summaries.size(); i++) {
+		const Statistics::Summary& summary = summaries[i];
+		double scale = summary.unit == "s" ? 1e3 : 1.;
+		printf("    %-34s %-6s mean %10.3f  p50 %10.3f  p99 %10.3f  max %10.3f\n",
+				summary.name.c_str(), summary.unit == "s" ? "[ms]" : "",
+				scale * summary.mean, scale * summary.p50, scale * summary.p99,
+				scale * summary.max);
+	}
+
+	return true;
+}
+
+
+bool TerrainMappingBenchmark::generateScene(const std::string& filename,
+											double resolution)
+{
+	std::ifstream file(filename.c_str());
+	if (!file.is_open()) {
+		printf(RED "Could not open the scene %s\n" COLOR_RESET, filename.c_str());
+		return false;
+	}
+
+	// Reading the parameters of the default_flat_terrain node
+	std::stringstream buffer;
+	buffer << file.rdbuf();
+	std::string launch = buffer.str();
+	std::map<std::string, double> params;
+	std::regex param_regex("<param\\s+name=\"([^\"]+)\"[^>]*value=\"([^\"]+)\"");
+	for (std::sregex_iterator i(launch.begin(), launch.end(), param_regex);
+			i != std::sregex_iterator(); i++) {
+		char* end;
+		double value = strtod((*i)[2].str().c_str(), &end);
+		if (*end == '\0')
+			params[(*i)[1].str()] = value;
+	}
+
+	// Getting the rectangles, the ones without an area are skipped as the
+	// flat terrain node doesn't add points for them
+	double position[3] = {params["position/x"], params["position/y"], params["position/z"]};
+	int num_rectangles = params.count("rectangles") ? (int) params["rectangles"] : 1;
+	std::vector<Rectangle> rectangles;
+	for (int k = 0; k < num_rectangles; k++) {
+		std::string ns_name = "rectangle_" + std::to_string(k + 1);
+
+		Rectangle rectangle;
+		rectangle.center_x = params[ns_name + "/center_x"];
+		rectangle.center_y = params[ns_name + "/center_y"];
+		rectangle.width = params[ns_name + "/width"];
+		rectangle.length = params[ns_name + "/length"];
+		rectangle.yaw = params[ns_name + "/yaw"];
+		rectangle.resolution = params[ns_name + "/resolution"];
+		rectangle.height = params[ns_name + "/height"];
+		if (rectangle.width <= 0. || rectangle.length <= 0. || rectangle.resolution <= 0.)
+			continue;
+
+		rectangles.push_back(rectangle);
+	}
+
+	if (rectangles.empty()) {
+		printf(RED "There aren't rectangles in the scene %s\n" COLOR_RESET,
+				filename.c_str());
+		return false;
+	}
+
+	// Inserting the points of the flat terrain (as default_flat_terrain), they
+	// are at least as dense as the voxels so the surfaces don't have holes
+	octree_ = new octomap::OcTree(resolution);
+	for (unsigned int k = 0; k < rectangles.size(); k++) {
+		const Rectangle& rectangle = rectangles[k];
+		double step = std::min(rectangle.resolution, resolution / 2);
+		double cos_yaw = cos(rectangle.yaw);
+		double sin_yaw = sin(rectangle.yaw);
+		for (double xi = 0; xi < rectangle.length / 2; xi += step) {
+			for (int sx = -1; sx <= 1; sx += 2) {
+				for (double yi = 0; yi < rectangle.width / 2; yi += step) {
+					for (int sy = -1; sy <= 1; sy += 2) {
+						double x = sx * xi * cos_yaw - sy * yi * sin_yaw +
+								rectangle.center_x + position[0];
+						double y = sx * xi * sin_yaw + sy * yi * cos_yaw +
+								rectangle.center_y + position[1];
+						double z = rectangle.height + position[2];
+						octree_->updateNode(octomap::point3d(x, y, z), true, true);
+					}
+				}
+			}
+		}
+	}
+	octree_->updateInnerOccupancy();
+
+	printf(GREEN "Generated the scene %s with %u rectangles and %u leafs\n" COLOR_RESET,
+			filename.c_str(), (unsigned int) rectangles.size(),
+			(unsigned int) octree_->getNumLeafNodes());
+
+	return true;
+}
+
+
+bool TerrainMappingBenchmark::getSurfaceHeight(double& height,
+											   double x,
+											   double y) const
+{
+	double min_x, min_y, min_z, max_x, max_y, max_z;
+	octree_->getMetricMin(min_x, min_y, min_z);
+	octree_->getMetricMax(max_x, max_y, max_z);
+
+	octomap::OcTreeKey min_key, max_key;
+	if (!octree_->coordToKeyChecked(x, y, min_z, min_key) ||
+			!octree_->coordToKeyChecked(x, y, max_z, max_key))
+		return false;
+
+	// Searching the topmost occupied voxel of the column
+	octomap::OcTreeKey key = max_key;
+	for (int key_z = max_key[2]; key_z >= min_key[2]; key_z--) {
+		key[2] = key_z;
+		octomap::OcTreeNode* node = octree_->search(key);
+		if (node && octree_->isNodeOccupied(node)) {
+			height = octree_->keyToCoord(key[2]);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+} //@namespace terrain_server
+
+
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		printf("Usage: terrain_mapping_benchmark <scene> [options]\n"
+				"  scene: launch file of a flat terrain (e.g. launch/stair/stair_s2_h14_l20.launch)\n"
+				"         or binary octomap (.bt)\n"
+				"  -t <file>     trajectory, one pose (x y z yaw) per line\n"
+				"  -r <value>    resolution of the generated octree (default 0.02)\n"
+				"  -s <value>    step of the generated trajectory (default 0.02)\n"
+				"  -z <value>    nominal height of the robot (default 0.55)\n"
+				"  -n <value>    number of threads (default 4)\n"
+				"  -w <value>    number of poses for warming up (default 5)\n");
+		return -1;
+	}
+
+	std::string scene = argv[1];
+	std::string trajectory;
+	double resolution = 0.02, step = 0.02, nominal_height = 0.55;
+	int num_threads = 4, warmup = 5;
+	for (int i = 2; i + 1 < argc; i += 2) {
+		std::string option = argv[i];
+		if (option == "-t")
+			trajectory = argv[i + 1];
+		else if (option == "-r")
+			resolution = atof(argv[i + 1]);
+		else if (option == "-s")
+			step = atof(argv[i + 1]);
+		else if (option == "-z")
+			nominal_height = atof(argv[i + 1]);
+		else if (option == "-n")
+			num_threads = atoi(argv[i + 1]);
+		else if (option == "-w")
+			warmup = atoi(argv[i + 1]);
+		else
+			printf(YELLOW "Unknown option %s\n" COLOR_RESET, option.c_str());
+	}
+
+	terrain_server::TerrainMappingBenchmark benchmark;
+	if (!benchmark.loadScene(scene, resolution))
+		return -1;
+
+	if (!trajectory.empty()) {
+		if (!benchmark.loadTrajectory(trajectory))
+			return -1;
+	} else
+		benchmark.generateTrajectory(step, nominal_height);
+
+	// Setting up the terrain mapping as the default configuration of the
+	// terrain map server (config/terrain_map.yaml)
+	terrain_server::TerrainMapping terrain_mapping;
+	terrain_mapping.addSearchArea(0., 1.6, -0.5, 0.5, -1.2, 0., 0.02);
+	terrain_mapping.setNumberOfThreads(std::max(num_threads, 1));
+	terrain_mapping.setInterestRegion(1.5, 5.5);
+
+	double size = 0.12;
+	terrain_server::feature::HeightDeviationFeature* height_dev_ptr =
+			new terrain_server::feature::HeightDeviationFeature(0.01, 0.06, -0.10);
+	height_dev_ptr->setWeight(1.);
+	height_dev_ptr->setIntegralHeightMap(&terrain_mapping.getIntegralHeightMap());
+	height_dev_ptr->setNeighboringArea(-size, size, -size, size, 0.02);
+	terrain_mapping.setFeatureRadius(2 * size);
+	terrain_mapping.addFeature(height_dev_ptr);
+
+	// Recording the stages of the terrain mapping
+	terrain_server::Statistics statistics;
+	terrain_mapping.setStatistics(&statistics);
+
+	if (!benchmark.run(terrain_mapping, std::max(warmup, 0), statistics))
+		return -1;
+
+	return 0;
+}
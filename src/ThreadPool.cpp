@@ -0,0 +1,164 @@
+#include <terrain_server/ThreadPool.h>
+
+
+namespace terrain_server
+{
+
+ThreadPool::ThreadPool() : pending_tasks_(0), generation_(0), is_stopped_(false)
+{
+	queues_.push_back(std::unique_ptr<TaskQueue>(new TaskQueue()));
+}
+
+
+ThreadPool::~ThreadPool()
+{
+	stop();
+}
+
+
+void ThreadPool::setNumberOfThreads(unsigned int num_threads)
+{
+	if (num_threads == 0)
+		num_threads = 1;
+
+	if (num_threads == getNumberOfThreads())
+		return;
+
+	stop();
+
+	queues_.clear();
+	for (unsigned int i = 0; i < num_threads; i++)
+		queues_.push_back(std::unique_ptr<TaskQueue>(new TaskQueue()));
+
+	// The calling thread works as the thread 0
+	is_stopped_ = false;
+	for (unsigned int i = 1; i < num_threads; i++)
+		threads_.push_back(std::thread(&ThreadPool::work, this, i));
+}
+
+
+unsigned int ThreadPool::getNumberOfThreads() const
+{
+	return queues_.size();
+}
+
+
+void ThreadPool::run(unsigned int num_tasks,
+					 const Task& task)
+{
+	if (num_tasks == 0)
+		return;
+
+	// Running the tasks in the calling thread if there aren't workers
+	if (threads_.empty()) {
+		for (unsigned int i = 0; i < num_tasks; i++)
+			task(i, 0);
+
+		return;
+	}
+
+	// Distributing contiguous blocks of tasks among the queues
+	task_ = task;
+	pending_tasks_ = num_tasks;
+	unsigned int num_threads = getNumberOfThreads();
+	for (unsigned int t = 0; t < num_threads; t++) {
+		std::lock_guard<std::mutex> lock(queues_[t]->mutex);
+		for (unsigned int i = t * num_tasks / num_threads;
+				i < (t + 1) * num_tasks / num_threads; i++)
+			queues_[t]->tasks.push_back(i);
+	}
+
+	// Waking up the workers
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		generation_++;
+	}
+	start_cond_.notify_all();
+
+	runTasks(0);
+
+	// Waiting until the tasks stolen by other threads are finished
+	std::unique_lock<std::mutex> lock(mutex_);
+	done_cond_.wait(lock, [this] { return pending_tasks_ == 0; });
+}
+
+
+void ThreadPool::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		is_stopped_ = true;
+	}
+	start_cond_.notify_all();
+
+	for (unsigned int i = 0; i < threads_.size(); i++)
+		threads_[i].join();
+	threads_.clear();
+}
+
+
+void ThreadPool::work(unsigned int thread)
+{
+	unsigned long generation = 0;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			start_cond_.wait(lock, [this, generation] {
+				return is_stopped_ || generation_ != generation;
+			});
+
+			if (is_stopped_)
+				return;
+
+			generation = generation_;
+		}
+
+		runTasks(thread);
+	}
+}
+
+
+void ThreadPool::runTasks(unsigned int thread)
+{
+	unsigned int task;
+	while (popTask(task, thread)) {
+		task_(task, thread);
+
+		if (--pending_tasks_ == 0) {
+			std::lock_guard<std::mutex> lock(mutex_);
+			done_cond_.notify_all();
+		}
+	}
+}
+
+
+bool ThreadPool::popTask(unsigned int& task,
+						 unsigned int thread)
+{
+	// Popping from the front of the own queue
+	{
+		TaskQueue& queue = *queues_[thread];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (!queue.tasks.empty()) {
+			task = queue.tasks.front();
+			queue.tasks.pop_front();
+			return true;
+		}
+	}
+
+	// Stealing from the back of the other queues
+	unsigned int num_threads = getNumberOfThreads();
+	for (unsigned int i = 1; i < num_threads; i++) {
+		TaskQueue& queue = *queues_[(thread + i) % num_threads];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (!queue.tasks.empty()) {
+			task = queue.tasks.back();
+			queue.tasks.pop_back();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+} //@namespace terrain_server
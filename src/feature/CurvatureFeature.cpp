@@ -41,5 +41,30 @@ void CurvatureFeature::computeCost(double& cost_value,
 								/ (positive_threshold_ - negative_threshold_));
 }
 
+
+void CurvatureFeature::addWeightedCost(TerrainBatch& batch)
+{
+	unsigned int num_cells = batch.size();
+	if (num_cells == 0)
+		return;
+
+	// The cost curve is evaluated with array expressions, so Eigen uses the
+	// SIMD packets of the target flags (SSE2 in the baseline build) and scalar
+	// code otherwise. The logarithm of the lanes out of the thresholds isn't selected
+	Eigen::Map<const Eigen::ArrayXf> curvature(&batch.curvature[0], num_cells);
+	Eigen::Map<Eigen::ArrayXf> cost(&batch.cost[0], num_cells);
+
+	// The cost expression is added without a temporary array
+	float max_cost = max_cost_;
+	double weight;
+	getWeight(weight);
+	cost += (float) weight *
+			(curvature * 10000.f > 9.f).select(max_cost,
+			(curvature > (float) positive_threshold_).select(0.f,
+			(curvature < (float) negative_threshold_).select(max_cost,
+			max_cost - ((curvature - (float) negative_threshold_) /
+					(float) (positive_threshold_ - negative_threshold_)).log())));
+}
+
 } //@namespace feature
 } //@namespace terrain
@@ -12,7 +12,8 @@ HeightDeviationFeature::HeightDeviationFeature(double flat_height_deviation,
 											   double min_allowed_height) :
 													   flat_height_deviation_(flat_height_deviation),
 													   max_height_deviation_(max_height_deviation),
-													   min_allowed_height_(min_allowed_height)
+													   min_allowed_height_(min_allowed_height),
+													   height_map_(NULL)
 {
 	name_ = "Height Deviation";
 }
@@ -24,119 +25,187 @@ HeightDeviationFeature::~HeightDeviationFeature()
 }
 
 
+void HeightDeviationFeature::setIntegralHeightMap(const IntegralHeightMap* height_map)
+{
+	height_map_ = height_map;
+}
+
+
 void HeightDeviationFeature::computeCost(double& cost_value,
 										 const dwl::Terrain& terrain_info)
 {
-	// Setting the grid resolution of the gridmap
-	space_discretization_.setEnvironmentResolution(terrain_info.resolution, true);
-	space_discretization_.setStateResolution(terrain_info.resolution);
+	if (height_map_ == NULL) {
+		cost_value = 0.;
+		return;
+	}
 
-	// Getting the cell position
-	Eigen::Vector2d cell_position = terrain_info.position.head(2);
-	dwl::Vertex cell_vertex;
-	space_discretization_.stateToVertex(cell_vertex, cell_position);
-	space_discretization_.vertexToState(cell_position, cell_vertex);
+	// Getting the cell of the height map. Note that we use a local
+	// discretization because the cost is computed concurrently
+	dwl::environment::SpaceDiscretization space_discretization(terrain_info.resolution,
+															   terrain_info.resolution,
+															   M_PI / 200);
+	unsigned short key_x, key_y;
+	space_discretization.coordToKey(key_x, terrain_info.position(0), true);
+	space_discretization.coordToKey(key_y, terrain_info.position(1), true);
+	int cell_x, cell_y;
+	height_map_->getCoordinates(cell_x, cell_y, key_x, key_y);
+
+	std::vector<int> offset_x, offset_y;
+	computeSampleOffsets(offset_x, offset_y, terrain_info.resolution);
+	cost_value = computeCellCost(cell_x, cell_y, terrain_info.min_height,
+								 offset_x, offset_y);
+}
 
-	// Putting minimum cost to voxel with low height
-	if (terrain_info.height_map->find(cell_vertex)->second < min_allowed_height_) {
-		if (terrain_info.height_map->count(cell_vertex) > 0) {
-			cost_value = max_cost_;
-			return;
-		}
+
+void HeightDeviationFeature::addWeightedCost(TerrainBatch& batch)
+{
+	unsigned int num_cells = batch.size();
+	if (height_map_ == NULL || num_cells == 0)
+		return;
+
+	// The discretization and the sample offsets are shared by the batch
+	dwl::environment::SpaceDiscretization space_discretization(batch.resolution,
+															   batch.resolution,
+															   M_PI / 200);
+	std::vector<int> offset_x, offset_y;
+	computeSampleOffsets(offset_x, offset_y, batch.resolution);
+
+	double weight;
+	getWeight(weight);
+	for (unsigned int i = 0; i < num_cells; i++) {
+		unsigned short key_x, key_y;
+		space_discretization.coordToKey(key_x, batch.position_x[i], true);
+		space_discretization.coordToKey(key_y, batch.position_y[i], true);
+		int cell_x, cell_y;
+		height_map_->getCoordinates(cell_x, cell_y, key_x, key_y);
+
+		batch.cost[i] += weight * computeCellCost(cell_x, cell_y, batch.min_height,
+												  offset_x, offset_y);
 	}
+}
+
+
+void HeightDeviationFeature::computeSampleOffsets(std::vector<int>& offset_x,
+												  std::vector<int>& offset_y,
+												  double terrain_resolution) const
+{
+	// A sample is the cell that contains the point (cell centre + sample offset)
+	double resolution = neightboring_area_.resolution;
+	double ratio = resolution / terrain_resolution;
+	int min_sample_x = round(neightboring_area_.min_x / resolution);
+	int max_sample_x = round(neightboring_area_.max_x / resolution);
+	int min_sample_y = round(neightboring_area_.min_y / resolution);
+	int max_sample_y = round(neightboring_area_.max_y / resolution);
+	for (int i = min_sample_x; i <= max_sample_x; i++)
+		offset_x.push_back(round(i * ratio));
+	for (int i = min_sample_y; i <= max_sample_y; i++)
+		offset_y.push_back(round(i * ratio));
+}
+
+
+double HeightDeviationFeature::computeCellCost(int cell_x, int cell_y,
+											   double min_height,
+											   const std::vector<int>& offset_x,
+											   const std::vector<int>& offset_y) const
+{
+	// Putting minimum cost to voxel with low height
+	double height;
+	if (height_map_->getHeight(height, cell_x, cell_y) && height < min_allowed_height_)
+		return max_cost_;
+
+	if (offset_x.empty() || offset_y.empty())
+		return 0.;
+
+	// When the samples are contiguous cells, the box sums come from the
+	// summed-area tables
+	bool is_dense = offset_x.back() - offset_x.front() + 1 == (int) offset_x.size() &&
+			offset_y.back() - offset_y.front() + 1 == (int) offset_y.size();
 
 	// Computing the average height of the neighboring area
-	double height_average = 0, height_deviation = 0, estimated_height_deviation = 0;
-	int counter = 0, estimated_counter = 0;
-
-	Eigen::Vector2d boundary_min, boundary_max;
-	boundary_min(0) = neightboring_area_.min_x + cell_position(0);
-	boundary_min(1) = neightboring_area_.min_y + cell_position(1);
-	boundary_max(0) = neightboring_area_.max_x + cell_position(0);
-	boundary_max(1) = neightboring_area_.max_y + cell_position(1);
-	for (double y = boundary_min(1); y <= boundary_max(1); y += neightboring_area_.resolution) {
-		for (double x = boundary_min(0); x <= boundary_max(0); x += neightboring_area_.resolution) {
-			Eigen::Vector2d coord;
-			coord(0) = x;
-			coord(1) = y;
-			dwl::Vertex vertex_2d;
-			space_discretization_.coordToVertex(vertex_2d, coord);
-
-			if (terrain_info.height_map->count(vertex_2d) > 0) {
-				double height = terrain_info.height_map->find(vertex_2d)->second;
-				height_average += height;
-				counter++;
+	double height_average = 0;
+	unsigned int counter = 0;
+	if (is_dense) {
+		height_map_->getBoxSum(height_average, counter,
+							   cell_x + offset_x.front(), cell_y + offset_y.front(),
+							   cell_x + offset_x.back(), cell_y + offset_y.back());
+	} else {
+		for (unsigned int j = 0; j < offset_y.size(); j++) {
+			for (unsigned int i = 0; i < offset_x.size(); i++) {
+				if (height_map_->getHeight(height, cell_x + offset_x[i], cell_y + offset_y[j])) {
+					height_average += height;
+					counter++;
+				}
 			}
 		}
 	}
-	if (counter != 0) {
-		height_average /= counter;
-
-		// Computing the standard deviation of the height
-		for (double y = boundary_min(1); y <= boundary_max(1); y += neightboring_area_.resolution) {
-			for (double x = boundary_min(0); x <= boundary_max(0); x += neightboring_area_.resolution) {
-				Eigen::Vector2d coord;
-				coord(0) = x;
-				coord(1) = y;
-				dwl::Vertex vertex_2d;
-				space_discretization_.coordToVertex(vertex_2d, coord);
-
-				if (terrain_info.height_map->count(vertex_2d) > 0) {
-					height_deviation += fabs(terrain_info.height_map->find(vertex_2d)->second - height_average);
-				} else {
-					// Computing the estimated ground
-					Eigen::Vector2d height_boundary_min, height_boundary_max;
-					height_boundary_min(0) = neightboring_area_.min_x + coord(0);
-					height_boundary_min(1) = neightboring_area_.min_y + coord(1);
-					height_boundary_max(0) = neightboring_area_.max_x + coord(0);
-					height_boundary_max(1) = neightboring_area_.max_y + coord(1);
-					double estimated_height = 0;
-					int height_counter = 0;
-					double resolution = neightboring_area_.resolution;
-					for (double y_e = height_boundary_min(1); y_e < height_boundary_max(1); y_e += resolution) {
-						for (double x_e = height_boundary_min(0); x_e < height_boundary_max(0); x_e += resolution) {
-							Eigen::Vector2d height_coord;
-							height_coord(0) = x_e;
-							height_coord(1) = y_e;
-							dwl::Vertex height_vertex_2d;
-							space_discretization_.coordToVertex(height_vertex_2d, height_coord);
-
-							if (terrain_info.height_map->count(height_vertex_2d) > 0)
-								estimated_height += terrain_info.height_map->find(height_vertex_2d)->second;
-							else
-								estimated_height += terrain_info.min_height;
+	if (counter == 0)
+		return 0.;
+	height_average /= counter;
+
+	// Computing the mean absolute deviation of the height. The height of a
+	// missing sample is estimated from its own neighboring area (without the
+	// last row and column), where the missing cells take the minimum height
+	double height_deviation = 0, estimated_height_deviation = 0;
+	int estimated_counter = 0;
+	unsigned int num_estimation_cells = (offset_x.size() - 1) * (offset_y.size() - 1);
+	for (unsigned int j = 0; j < offset_y.size(); j++) {
+		int y = cell_y + offset_y[j];
+		for (unsigned int i = 0; i < offset_x.size(); i++) {
+			int x = cell_x + offset_x[i];
+			if (height_map_->getHeight(height, x, y)) {
+				height_deviation += fabs(height - height_average);
+				continue;
+			}
 
+			// Computing the estimated ground
+			if (num_estimation_cells == 0)
+				continue;
+
+			double estimated_height = 0;
+			unsigned int height_counter = 0;
+			if (is_dense) {
+				height_map_->getBoxSum(estimated_height, height_counter,
+									   x + offset_x.front(), y + offset_y.front(),
+									   x + offset_x[offset_x.size() - 2],
+									   y + offset_y[offset_y.size() - 2]);
+			} else {
+				for (unsigned int l = 0; l < offset_y.size() - 1; l++) {
+					for (unsigned int m = 0; m < offset_x.size() - 1; m++) {
+						double estimation_height;
+						if (height_map_->getHeight(estimation_height,
+												   x + offset_x[m], y + offset_y[l])) {
+							estimated_height += estimation_height;
 							height_counter++;
 						}
 					}
-
-					if (height_counter != 0) {
-						estimated_height /= height_counter;
-						estimated_height_deviation += fabs(estimated_height - height_average);
-						estimated_counter++;
-					}
 				}
 			}
+			estimated_height += (num_estimation_cells - height_counter) * min_height;
+			estimated_height /= num_estimation_cells;
+			estimated_height_deviation += fabs(estimated_height - height_average);
+			estimated_counter++;
 		}
+	}
 
-		height_deviation /= counter;
+	height_deviation /= counter;
 
-		if (estimated_counter != 0)
-			estimated_height_deviation /= estimated_counter;
+	if (estimated_counter != 0)
+		estimated_height_deviation /= estimated_counter;
 
-		double total_heigh_deviation = height_deviation + estimated_height_deviation;
+	double total_heigh_deviation = height_deviation + estimated_height_deviation;
 
-		if (total_heigh_deviation <= flat_height_deviation_)
-			cost_value = 0.;
-		else if (total_heigh_deviation < max_height_deviation_) {
-			cost_value = -log(1 - (total_heigh_deviation - flat_height_deviation_) /
-					(max_height_deviation_ - flat_height_deviation_));
-			if (max_cost_ < cost_value)
-				cost_value = max_cost_;
-		} else
+	double cost_value;
+	if (total_heigh_deviation <= flat_height_deviation_)
+		cost_value = 0.;
+	else if (total_heigh_deviation < max_height_deviation_) {
+		cost_value = -log(1 - (total_heigh_deviation - flat_height_deviation_) /
+				(max_height_deviation_ - flat_height_deviation_));
+		if (max_cost_ < cost_value)
 			cost_value = max_cost_;
 	} else
-		cost_value = 0.;
+		cost_value = max_cost_;
+
+	return cost_value;
 }
 
 } //@namespace feature
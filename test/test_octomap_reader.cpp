@@ -0,0 +1,311 @@
+#include <terrain_server/OctomapReader.h>
+#include <octomap_msgs/conversions.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+
+/** @brief Number of allocations of the process, it counts the octree nodes */
+static std::atomic<unsigned long> num_allocations(0);
+
+void* operator new(std::size_t size)
+{
+	num_allocations++;
+	void* address = malloc(size);
+	if (!address)
+		throw std::bad_alloc();
+	return address;
+}
+
+void operator delete(void* address) noexcept
+{
+	free(address);
+}
+
+
+using namespace terrain_server;
+
+/** @brief Number of reads of the soak test */
+static const unsigned int NUM_SOAK_READS = 400;
+
+
+/**
+ * @brief Creates an octree of a terrain with steps, the free space above the
+ * surface is observed
+ * @param octomap::OcTree& Octree
+ * @param bool Indicates if there is a box on the terrain
+ */
+static void createTerrain(octomap::OcTree& octree,
+						  bool is_box)
+{
+	double resolution = octree.getResolution();
+	for (double x = -2.; x < 2.; x += resolution) {
+		for (double y = -2.; y < 2.; y += resolution) {
+			double z = floor(x / 0.4) * 0.1;
+			if (is_box && fabs(x - 0.5) < 0.2 && fabs(y) < 0.2)
+				z += 0.3;
+
+			octree.updateNode(octomap::point3d(x, y, z), true);
+			for (double h = z + resolution; h < z + 0.3; h += resolution)
+				octree.updateNode(octomap::point3d(x, y, h), false);
+		}
+	}
+	octree.updateInnerOccupancy();
+	octree.prune();
+}
+
+
+/**
+ * @brief Gets the octomap messages of the test. A recorded octomap (.bt file)
+ * is used if the TERRAIN_SERVER_TEST_OCTOMAP variable has its path, otherwise
+ * a synthetic terrain without and with a box are used
+ * @param octomap_msgs::Octomap& First message
+ * @param octomap_msgs::Octomap& Second message
+ * @param bool Indicates if the messages have the binary or the full data
+ */
+static void getMessages(octomap_msgs::Octomap& first_msg,
+						octomap_msgs::Octomap& second_msg,
+						bool binary)
+{
+	octomap::OcTree first_octree(0.05), second_octree(0.05);
+	const char* recorded_octomap = getenv("TERRAIN_SERVER_TEST_OCTOMAP");
+	if (recorded_octomap) {
+		ASSERT_TRUE(first_octree.readBinary(recorded_octomap));
+		second_octree.setResolution(first_octree.getResolution());
+		second_octree.readBinary(recorded_octomap);
+		second_octree.updateNode(octomap::point3d(0., 0., 0.), true);
+	} else {
+		createTerrain(first_octree, false);
+		createTerrain(second_octree, true);
+	}
+
+	if (binary) {
+		ASSERT_TRUE(octomap_msgs::binaryMapToMsg(first_octree, first_msg));
+		ASSERT_TRUE(octomap_msgs::binaryMapToMsg(second_octree, second_msg));
+	} else {
+		ASSERT_TRUE(octomap_msgs::fullMapToMsg(first_octree, first_msg));
+		ASSERT_TRUE(octomap_msgs::fullMapToMsg(second_octree, second_msg));
+	}
+}
+
+
+/** @brief Gets the number of leafs of an octree that aren't in another one */
+static unsigned int getNumberOfMismatches(const octomap::OcTree& octree,
+										  const octomap::OcTree& reference)
+{
+	unsigned int num_mismatches = 0;
+	for (octomap::OcTree::leaf_iterator it = octree.begin_leafs(), end = octree.end_leafs();
+			it != end; ++it) {
+		octomap::OcTreeNode* node = reference.search(it.getKey(), it.getDepth());
+		if (!node || reference.nodeHasChildren(node) ||
+				reference.isNodeOccupied(node) != octree.isNodeOccupied(*it))
+			num_mismatches++;
+	}
+
+	return num_mismatches;
+}
+
+
+/**
+ * @brief Gets the number of leafs of an octree that changed with respect to a
+ * previous octree, and that aren't inside a changed region
+ */
+static unsigned int getNumberOfUntrackedChanges(const octomap::OcTree& octree,
+												const octomap::OcTree& previous,
+												const std::vector<OctomapReader::OctreeRegion>& regions)
+{
+	unsigned int num_untracked = 0;
+	for (octomap::OcTree::leaf_iterator it = octree.begin_leafs(), end = octree.end_leafs();
+			it != end; ++it) {
+		octomap::OcTreeNode* node = previous.search(it.getKey(), it.getDepth());
+		if (node && !previous.nodeHasChildren(node) &&
+				previous.isNodeOccupied(node) == octree.isNodeOccupied(*it))
+			continue;
+
+		// Getting the minimum key (corner) of the leaf
+		int size = 1 << (octree.getTreeDepth() - it.getDepth());
+		octomap::OcTreeKey key = it.getKey();
+		bool is_tracked = false;
+		for (unsigned int n = 0; n < regions.size() && !is_tracked; n++) {
+			is_tracked = true;
+			for (unsigned int i = 0; i < 3; i++) {
+				int min_key = key[i] & ~(size - 1);
+				if (min_key < regions[n].key[i] ||
+						min_key + size > regions[n].key[i] + regions[n].size)
+					is_tracked = false;
+			}
+		}
+		if (!is_tracked)
+			num_untracked++;
+	}
+
+	return num_untracked;
+}
+
+
+/** @brief Gets the resident memory of the process in bytes */
+static unsigned long getResidentMemory()
+{
+	unsigned long size = 0, resident = 0;
+	FILE* file = fopen("/proc/self/statm", "r");
+	if (file) {
+		if (fscanf(file, "%lu %lu", &size, &resident) != 2)
+			resident = 0;
+		fclose(file);
+	}
+
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+
+/** @brief Reads a message into a new octree with a new reader */
+static void readReference(OctomapReader& reader,
+						  const octomap_msgs::Octomap& msg,
+						  bool is_bounding_box)
+{
+	if (is_bounding_box) {
+		reader.setBoundingBox(octomap::point3d(-0.5, -0.7, -1.),
+							  octomap::point3d(0.9, 0.6, 1.));
+	}
+	ASSERT_TRUE(reader.read(msg) != NULL);
+}
+
+
+class OctomapReaderTest : public testing::TestWithParam<bool>
+{
+
+};
+
+
+TEST_P(OctomapReaderTest, ReusedTreeMatchesNewTree)
+{
+	octomap_msgs::Octomap first_msg, second_msg;
+	getMessages(first_msg, second_msg, GetParam());
+
+	// The whole tree is the one of octomap
+	OctomapReader reader;
+	octomap::OcTree* octree = reader.read(first_msg);
+	ASSERT_TRUE(octree != NULL);
+	octomap::AbstractOcTree* tree = octomap_msgs::msgToMap(first_msg);
+	octomap::OcTree* reference = dynamic_cast<octomap::OcTree*>(tree);
+	ASSERT_TRUE(reference != NULL);
+	EXPECT_EQ(reference->getNumLeafNodes(), octree->getNumLeafNodes());
+	EXPECT_EQ(0u, getNumberOfMismatches(*octree, *reference));
+	EXPECT_EQ(0u, getNumberOfMismatches(*reference, *octree));
+	delete tree;
+
+	// Reading other messages and bounding boxes into the reused tree, it has
+	// to match the tree of a new reader
+	for (unsigned int i = 0; i < 8; i++) {
+		const octomap_msgs::Octomap& msg = i % 2 == 0 ? second_msg : first_msg;
+		bool is_bounding_box = i % 4 < 2;
+		if (is_bounding_box) {
+			reader.setBoundingBox(octomap::point3d(-0.5, -0.7, -1.),
+								  octomap::point3d(0.9, 0.6, 1.));
+		} else
+			reader.clearBoundingBox();
+
+		octree = reader.read(msg);
+		ASSERT_TRUE(octree != NULL);
+		OctomapReader new_reader;
+		readReference(new_reader, msg, is_bounding_box);
+		const octomap::OcTree& new_octree = *new_reader.getOctree();
+		EXPECT_EQ(new_octree.size(), octree->size());
+		EXPECT_EQ(new_octree.size(), octree->calcNumNodes());
+		EXPECT_EQ(0u, getNumberOfMismatches(*octree, new_octree));
+		EXPECT_EQ(0u, getNumberOfMismatches(new_octree, *octree));
+	}
+}
+
+
+TEST_P(OctomapReaderTest, SoakHasBoundedMemory)
+{
+	octomap_msgs::Octomap first_msg, second_msg;
+	getMessages(first_msg, second_msg, GetParam());
+
+	// Rereading the same message reuses all the nodes
+	OctomapReader reader;
+	ASSERT_TRUE(reader.read(first_msg) != NULL);
+	size_t num_nodes = reader.getOctree()->size();
+	unsigned long first_allocations = num_allocations.load();
+	for (unsigned int i = 0; i < 10; i++)
+		ASSERT_TRUE(reader.read(first_msg) != NULL);
+	unsigned long reread_allocations = num_allocations.load() - first_allocations;
+	EXPECT_LT(reread_allocations, 10 * 16u) << "nodes: " << num_nodes;
+
+	// Alternating the messages, the allocations are the changed branches
+	for (unsigned int i = 0; i < 20; i++)
+		ASSERT_TRUE(reader.read(i % 2 == 0 ? second_msg : first_msg) != NULL);
+	unsigned long warm_memory = getResidentMemory();
+	first_allocations = num_allocations.load();
+	for (unsigned int i = 0; i < NUM_SOAK_READS; i++)
+		ASSERT_TRUE(reader.read(i % 2 == 0 ? second_msg : first_msg) != NULL);
+	unsigned long soak_allocations = num_allocations.load() - first_allocations;
+
+	// Reading a new tree every time would allocate all its nodes
+	EXPECT_LT(soak_allocations, NUM_SOAK_READS * num_nodes / 4);
+
+	// Alternating the bounding boxes too, the resident memory doesn't grow
+	for (unsigned int i = 0; i < NUM_SOAK_READS; i++) {
+		if (i % 3 == 0)
+			reader.setBoundingBox(octomap::point3d(-1., -1., -1.),
+								  octomap::point3d(1., 1., 1.));
+		else
+			reader.clearBoundingBox();
+		ASSERT_TRUE(reader.read(i % 2 == 0 ? second_msg : first_msg) != NULL);
+	}
+	EXPECT_LT(getResidentMemory(), warm_memory + 4 * 1024 * 1024);
+}
+
+
+TEST_P(OctomapReaderTest, ChangedRegionsCoverChanges)
+{
+	octomap_msgs::Octomap first_msg, second_msg;
+	getMessages(first_msg, second_msg, GetParam());
+	octomap::AbstractOcTree* first_tree = octomap_msgs::msgToMap(first_msg);
+	octomap::AbstractOcTree* second_tree = octomap_msgs::msgToMap(second_msg);
+	octomap::OcTree* first_octree = dynamic_cast<octomap::OcTree*>(first_tree);
+	octomap::OcTree* second_octree = dynamic_cast<octomap::OcTree*>(second_tree);
+	ASSERT_TRUE(first_octree != NULL && second_octree != NULL);
+
+	// The first read changes the whole tree, and a reread doesn't change it
+	OctomapReader reader;
+	reader.setChangeTracking(true);
+	ASSERT_TRUE(reader.read(first_msg) != NULL);
+	ASSERT_EQ(1u, reader.getChangedRegions().size());
+	EXPECT_EQ(1 << reader.getOctree()->getTreeDepth(), reader.getChangedRegions()[0].size);
+	ASSERT_TRUE(reader.read(first_msg) != NULL);
+	EXPECT_TRUE(reader.getChangedRegions().empty());
+
+	// The regions contain the added, removed and changed leafs, and none of
+	// them is the whole tree
+	for (unsigned int i = 0; i < 4; i++) {
+		bool is_second = i % 2 == 0;
+		ASSERT_TRUE(reader.read(is_second ? second_msg : first_msg) != NULL);
+		const octomap::OcTree& octree = is_second ? *second_octree : *first_octree;
+		const octomap::OcTree& previous = is_second ? *first_octree : *second_octree;
+		const std::vector<OctomapReader::OctreeRegion>& regions = reader.getChangedRegions();
+		EXPECT_FALSE(regions.empty());
+		EXPECT_EQ(0u, getNumberOfUntrackedChanges(octree, previous, regions));
+		EXPECT_EQ(0u, getNumberOfUntrackedChanges(previous, octree, regions));
+		for (unsigned int n = 0; n < regions.size(); n++)
+			EXPECT_LT(regions[n].size, 1 << octree.getTreeDepth());
+	}
+
+	delete first_tree;
+	delete second_tree;
+}
+
+
+INSTANTIATE_TEST_CASE_P(BinaryAndFullData, OctomapReaderTest, testing::Bool());
+
+
+int main(int argc, char** argv)
+{
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
@@ -0,0 +1,259 @@
+#include <terrain_server/SharedTerrainMap.h>
+#include <gtest/gtest.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <sstream>
+
+
+using namespace terrain_server;
+
+/** @brief Number of generations written by the writer process */
+static const unsigned int NUM_GENERATIONS = 20000;
+
+/** @brief Maximum number of cells of the grids */
+static const unsigned int CAPACITY = 32 * 32;
+
+
+/**
+ * @brief Fills a grid with the cells of a generation. The geometry of the grid
+ * changes with the generation, and every value of a cell encodes it, so a
+ * snapshot that mixes generations is detected
+ * @param TerrainGrid& Terrain grid
+ * @param unsigned int Generation
+ */
+static void fillGrid(TerrainGrid& grid,
+					 unsigned int generation)
+{
+	unsigned int size_x = 16 + generation % 17;
+	unsigned int size_y = 32 - generation % 13;
+	if (grid.getSizeX() != size_x || grid.getSizeY() != size_y)
+		grid.resize(size_x, size_y);
+	grid.clear();
+	grid.move(1000 + generation % 7, 2000 + generation % 5);
+
+	float value = generation;
+	for (unsigned int index = 0; index < grid.getNumberOfCells(); index++) {
+		grid.setHeight(index, value, generation % 60000);
+		grid.setTerrain(index, value, Eigen::Vector3f(value, -value, 1.));
+	}
+}
+
+
+/** @brief Gets a segment name that doesn't collide with other test runs */
+static std::string getSegmentName()
+{
+	std::ostringstream name;
+	name << "/terrain_server_test_" << getpid();
+	return name.str();
+}
+
+
+/** @brief Checks if a cell has the values of a generation */
+static bool isGenerationCell(float height, float cost, const Eigen::Vector3f& normal,
+							 unsigned short key_z, float generation)
+{
+	return height == generation && cost == generation &&
+			normal(0) == generation && normal(1) == -generation && normal(2) == 1. &&
+			key_z == (unsigned int) generation % 60000;
+}
+
+
+TEST(SharedTerrainMap, OpenRequiresSegment)
+{
+	SharedTerrainMap reader;
+	EXPECT_FALSE(reader.open("/terrain_server_test_missing"));
+	EXPECT_FALSE(reader.isOpen());
+
+	double plane_size, height_size;
+	EXPECT_FALSE(reader.getResolution(plane_size, height_size));
+}
+
+
+TEST(SharedTerrainMap, WriteAndRead)
+{
+	std::string name = getSegmentName();
+	SharedTerrainMap writer, reader;
+	ASSERT_TRUE(writer.create(name, CAPACITY));
+	ASSERT_TRUE(reader.open(name));
+
+	// The reader doesn't have a terrain map until the first write
+	TerrainGrid grid;
+	double plane_size, height_size;
+	EXPECT_FALSE(reader.getGrid(grid, plane_size, height_size));
+
+	TerrainGrid written_grid;
+	fillGrid(written_grid, 7);
+	ASSERT_TRUE(writer.write(written_grid, 0.04, 0.02));
+	ASSERT_TRUE(reader.getGrid(grid, plane_size, height_size));
+	EXPECT_EQ(0.04, plane_size);
+	EXPECT_EQ(0.02, height_size);
+	EXPECT_EQ(written_grid.getOriginKeyX(), grid.getOriginKeyX());
+	EXPECT_EQ(written_grid.getOriginKeyY(), grid.getOriginKeyY());
+	EXPECT_EQ(written_grid.getNumberOfTerrainCells(), grid.getNumberOfTerrainCells());
+
+	float height, cost;
+	Eigen::Vector3f normal;
+	unsigned short key_z;
+	ASSERT_TRUE(reader.getCell(height, cost, normal, key_z,
+							   written_grid.getOriginKeyX(),
+							   written_grid.getOriginKeyY()));
+	EXPECT_TRUE(isGenerationCell(height, cost, normal, key_z, 7));
+	EXPECT_FALSE(reader.getCell(height, cost, normal, key_z, 0, 0));
+
+	// A grid bigger than the segment isn't written
+	TerrainGrid big_grid;
+	big_grid.resize(64, 64);
+	EXPECT_FALSE(writer.write(big_grid, 0.04, 0.02));
+
+	reader.close();
+	writer.close();
+}
+
+
+TEST(SharedTerrainMap, ReaderNeverSeesTornSnapshot)
+{
+	// The writer is a child process that creates the segment, and the reader
+	// opens it by name in this process. The child waits for the reader before
+	// writing, and it replaces the segment halfway, so the reader remaps it
+	std::string name = getSegmentName();
+	int ready_pipe[2];
+	ASSERT_EQ(0, pipe(ready_pipe));
+	pid_t writer_pid = fork();
+	ASSERT_GE(writer_pid, 0);
+	if (writer_pid == 0) {
+		::close(ready_pipe[1]);
+		SharedTerrainMap writer;
+		char ready;
+		if (!writer.create(name, CAPACITY) || read(ready_pipe[0], &ready, 1) != 1)
+			_exit(1);
+
+		TerrainGrid grid;
+		for (unsigned int generation = 1; generation <= NUM_GENERATIONS; generation++) {
+			if (generation == NUM_GENERATIONS / 2 && !writer.create(name, 4 * CAPACITY))
+				_exit(1);
+			fillGrid(grid, generation);
+			writer.write(grid, generation, generation);
+		}
+
+		// Exiting without closing the writer, so the segment is kept for the
+		// last read of the reader
+		_exit(0);
+	}
+	::close(ready_pipe[0]);
+
+	SharedTerrainMap reader;
+	while (!reader.open(name)) {
+		if (waitpid(writer_pid, NULL, WNOHANG) != 0) {
+			::close(ready_pipe[1]);
+			FAIL() << "The writer exited before creating the segment";
+		}
+		usleep(1000);
+	}
+	ASSERT_EQ(1, write(ready_pipe[1], "r", 1));
+	::close(ready_pipe[1]);
+
+	// Copying the grid and looking up cells while the generations are written.
+	// Every successful read has to be a single generation, and the generations
+	// never go backwards, also across the remapping
+	unsigned int num_grids = 0, num_torn_grids = 0;
+	unsigned int num_cells = 0, num_torn_cells = 0;
+	unsigned int num_backward_reads = 0, num_remaps = 0;
+	double last_generation = 0.;
+	TerrainGrid grid;
+	int status = 0;
+	pid_t exited_pid;
+	while ((exited_pid = waitpid(writer_pid, &status, WNOHANG)) == 0) {
+		// A failed open closes the reader, it's retried until the writer
+		// created the new segment
+		if (reader.isRetired() || !reader.isOpen()) {
+			if (reader.open(name))
+				num_remaps++;
+			continue;
+		}
+
+		double plane_size, height_size;
+		if (reader.getGrid(grid, plane_size, height_size)) {
+			num_grids++;
+			float generation = plane_size;
+			bool is_torn = height_size != plane_size ||
+					grid.getNumberOfTerrainCells() != grid.getNumberOfCells();
+			for (unsigned int index = 0; index < grid.getNumberOfCells() && !is_torn; index++) {
+				if (!isGenerationCell(grid.getHeight(index), grid.getCost(index),
+									  grid.getNormal(index), grid.getKeyZ(index),
+									  generation))
+					is_torn = true;
+			}
+			TerrainGrid expected_grid;
+			fillGrid(expected_grid, generation);
+			if (grid.getSizeX() != expected_grid.getSizeX() ||
+					grid.getSizeY() != expected_grid.getSizeY() ||
+					grid.getOriginKeyX() != expected_grid.getOriginKeyX() ||
+					grid.getOriginKeyY() != expected_grid.getOriginKeyY())
+				is_torn = true;
+
+			if (is_torn)
+				num_torn_grids++;
+			if (plane_size < last_generation)
+				num_backward_reads++;
+			last_generation = plane_size;
+		}
+
+		float height, cost;
+		Eigen::Vector3f normal;
+		unsigned short key_z;
+		if (reader.getCell(height, cost, normal, key_z, 1002, 2002)) {
+			num_cells++;
+			if (!isGenerationCell(height, cost, normal, key_z, height))
+				num_torn_cells++;
+		}
+	}
+	ASSERT_EQ(writer_pid, exited_pid);
+	EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	EXPECT_GT(num_grids, 0u);
+	EXPECT_GT(num_cells, 0u);
+	EXPECT_EQ(0u, num_torn_grids);
+	EXPECT_EQ(0u, num_torn_cells);
+	EXPECT_EQ(0u, num_backward_reads);
+
+	// The last generation is read from the replaced segment after the writer
+	// finished
+	if ((reader.isRetired() || !reader.isOpen()) && reader.open(name))
+		num_remaps++;
+	EXPECT_EQ(1u, num_remaps);
+	EXPECT_EQ(4 * CAPACITY, reader.getCapacity());
+	double plane_size, height_size;
+	ASSERT_TRUE(reader.getGrid(grid, plane_size, height_size));
+	EXPECT_EQ(NUM_GENERATIONS, plane_size);
+
+	reader.close();
+	shm_unlink(name.c_str());
+}
+
+
+TEST(SharedTerrainMap, ReaderDetectsRetiredSegment)
+{
+	std::string name = getSegmentName();
+	SharedTerrainMap writer, reader;
+	ASSERT_TRUE(writer.create(name, CAPACITY));
+	ASSERT_TRUE(reader.open(name));
+	EXPECT_FALSE(reader.isRetired());
+
+	// Creating a bigger segment retires the mapped one
+	ASSERT_TRUE(writer.create(name, 4 * CAPACITY));
+	EXPECT_TRUE(reader.isRetired());
+	EXPECT_TRUE(reader.open(name));
+	EXPECT_FALSE(reader.isRetired());
+	EXPECT_EQ(4 * CAPACITY, reader.getCapacity());
+
+	reader.close();
+	writer.close();
+}
+
+
+int main(int argc, char** argv)
+{
+	testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}